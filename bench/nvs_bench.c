@@ -0,0 +1,114 @@
+/*
+ * nvs_bench.c -- host micro-benchmark for the NVS key index
+ *
+ * Runs emu_nvs.c in memory mode (no files) and times set, overwrite,
+ * get and miss over one namespace holding N keys (default 10000).
+ *
+ *   cmake --build build --target nvs-bench && ./build/nvs-bench [keys] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nvs.h"
+#include "esp_log.h"
+
+/* Normally defined by emu_main.c */
+char emu_log_ring[EMU_LOG_LINES][EMU_LOG_COLS];
+int emu_log_head;
+
+extern void emu_nvs_set_memory(int enable);
+extern void emu_nvs_shutdown(void);
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, long ops)
+{
+    double s = now_s() - start;
+    printf("%-22s %8.0f ns/op  (%ld ops, %.3f s)\n", name, s / (double)ops * 1e9, ops, s);
+}
+
+/* NVS keys are at most 15 characters */
+static void key_name(char *buf, int i)
+{
+    snprintf(buf, 16, "key%d", i);
+}
+
+int main(int argc, char **argv)
+{
+    int keys = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    if (keys <= 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [keys] [rounds]\n", argv[0]);
+        return 2;
+    }
+
+    emu_nvs_set_memory(1);
+
+    nvs_handle_t h;
+    if (nvs_open("bench", NVS_READWRITE, &h) != ESP_OK) {
+        fprintf(stderr, "nvs_open failed\n");
+        return 1;
+    }
+
+    char key[16];
+    int32_t v;
+    long bad = 0;
+    double t;
+
+    printf("NVS benchmark: %d keys, %d rounds\n", keys, rounds);
+
+    t = now_s();
+    for (int i = 0; i < keys; i++) {
+        key_name(key, i);
+        bad += nvs_set_i32(h, key, i) != ESP_OK;
+    }
+    report("set (insert)", t, keys);
+
+    t = now_s();
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < keys; i++) {
+            key_name(key, i);
+            bad += nvs_set_i32(h, key, i + r) != ESP_OK;
+        }
+    report("set (overwrite)", t, (long)keys * rounds);
+
+    t = now_s();
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < keys; i++) {
+            key_name(key, i);
+            bad += nvs_get_i32(h, key, &v) != ESP_OK;
+        }
+    report("get (hit)", t, (long)keys * rounds);
+
+    t = now_s();
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < keys; i++) {
+            snprintf(key, sizeof(key), "miss%d", i);
+            bad += nvs_get_i32(h, key, &v) != ESP_ERR_NVS_NOT_FOUND;
+        }
+    report("get (miss)", t, (long)keys * rounds);
+
+    t = now_s();
+    for (int i = 0; i < keys; i++) {
+        key_name(key, i);
+        bad += nvs_erase_key(h, key) != ESP_OK;
+    }
+    report("erase", t, keys);
+
+    nvs_close(h);
+    emu_nvs_shutdown();
+
+    if (bad) {
+        fprintf(stderr, "%ld operations returned an unexpected status\n", bad);
+        return 1;
+    }
+    return 0;
+}
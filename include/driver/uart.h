@@ -0,0 +1,119 @@
+/*
+ * driver/uart.h -- UART driver shim
+ *
+ * RX is emulated by emu_uart.c: bytes passed to emu_uart_inject() arrive
+ * through a 128-byte RX FIFO at the configured baud rate on the FreeRTOS
+ * shim clock, for code that installs this driver.  Firmware run by flexe
+ * has no RX hook, so nothing in the emulator injects input yet.
+ * TX goes to stdout.
+ */
+#ifndef DRIVER_UART_H
+#define DRIVER_UART_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_log.h"  /* esp_err_t, ESP_OK */
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+typedef int uart_port_t;
+
+#define UART_NUM_0      0
+#define UART_NUM_1      1
+#define UART_NUM_2      2
+#define UART_NUM_MAX    3
+
+#define UART_FIFO_LEN   128
+#define UART_PIN_NO_CHANGE  (-1)
+
+typedef enum {
+    UART_DATA_5_BITS = 0,
+    UART_DATA_6_BITS = 1,
+    UART_DATA_7_BITS = 2,
+    UART_DATA_8_BITS = 3,
+} uart_word_length_t;
+
+typedef enum {
+    UART_PARITY_DISABLE = 0,
+    UART_PARITY_EVEN    = 2,
+    UART_PARITY_ODD     = 3,
+} uart_parity_t;
+
+typedef enum {
+    UART_STOP_BITS_1   = 1,
+    UART_STOP_BITS_1_5 = 2,
+    UART_STOP_BITS_2   = 3,
+} uart_stop_bits_t;
+
+typedef enum {
+    UART_HW_FLOWCTRL_DISABLE = 0,
+    UART_HW_FLOWCTRL_RTS     = 1,
+    UART_HW_FLOWCTRL_CTS     = 2,
+    UART_HW_FLOWCTRL_CTS_RTS = 3,
+} uart_hw_flowcontrol_t;
+
+typedef enum {
+    UART_SCLK_APB     = 0,
+    UART_SCLK_REF_TICK = 1,
+    UART_SCLK_DEFAULT = UART_SCLK_APB,
+} uart_sclk_t;
+
+typedef struct {
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uint8_t rx_flow_ctrl_thresh;
+    uart_sclk_t source_clk;
+} uart_config_t;
+
+typedef enum {
+    UART_DATA,
+    UART_BREAK,
+    UART_BUFFER_FULL,
+    UART_FIFO_OVF,
+    UART_FRAME_ERR,
+    UART_PARITY_ERR,
+    UART_DATA_BREAK,
+    UART_PATTERN_DET,
+    UART_EVENT_MAX,
+} uart_event_type_t;
+
+typedef struct {
+    uart_event_type_t type;
+    size_t size;            /* UART_DATA: bytes moved into the RX buffer */
+    int timeout_flag;       /* UART_DATA: delivered by the RX timeout */
+} uart_event_t;
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size,
+                              int queue_size, QueueHandle_t *uart_queue,
+                              int intr_alloc_flags);
+esp_err_t uart_driver_delete(uart_port_t port);
+int uart_is_driver_installed(uart_port_t port);
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *cfg);
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baudrate);
+esp_err_t uart_get_baudrate(uart_port_t port, uint32_t *baudrate);
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts);
+esp_err_t uart_set_rx_full_threshold(uart_port_t port, int threshold);
+esp_err_t uart_set_rx_timeout(uart_port_t port, uint8_t tout_thresh);
+
+/* Blocks up to ticks_to_wait for length bytes; returns the count read
+ * (possibly short) or -1 if the driver is not installed */
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks_to_wait);
+int uart_write_bytes(uart_port_t port, const void *src, size_t size);
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size);
+esp_err_t uart_flush_input(uart_port_t port);
+esp_err_t uart_flush(uart_port_t port);
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks_to_wait);
+
+/* Emulator side: queue bytes for a port's RX line */
+int emu_uart_inject(uart_port_t port, const void *data, size_t len);
+void emu_uart_shutdown(void);   /* app stopped: delete installed drivers */
+
+/* Emulator side: UART0 TX mirror to a host pty (--uart-pty) */
+int emu_uart_pty_start(void);
+void emu_uart_pty_stop(void);
+void emu_uart_pty_write(const void *data, size_t len);
+
+#endif /* DRIVER_UART_H */
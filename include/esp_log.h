@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 typedef int esp_err_t;
 #define ESP_OK 0
@@ -21,31 +22,56 @@ typedef int esp_err_t;
 extern char emu_log_ring[EMU_LOG_LINES][EMU_LOG_COLS];
 extern int  emu_log_head;  /* next write position */
 
-static inline void emu_log_append(char level, const char *tag, const char *msg)
-{
-    /* Write to ring buffer */
-    snprintf(emu_log_ring[emu_log_head], EMU_LOG_COLS, "[%c] %.43s", level, msg);
-    emu_log_head = (emu_log_head + 1) % EMU_LOG_LINES;
-}
+/* Append a line under the panel ring's lock (emu_log.c) */
+void emu_log_panel_add(const char *line);
 
-#define ESP_LOGE(tag, fmt, ...) do { \
-    char _msg[256]; snprintf(_msg, sizeof(_msg), fmt, ##__VA_ARGS__); \
-    printf("[E][%s] %s\n", tag, _msg); \
-    emu_log_append('E', tag, _msg); \
-} while(0)
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
 
-#define ESP_LOGW(tag, fmt, ...) do { \
-    char _msg[256]; snprintf(_msg, sizeof(_msg), fmt, ##__VA_ARGS__); \
-    printf("[W][%s] %s\n", tag, _msg); \
-    emu_log_append('W', tag, _msg); \
-} while(0)
+/* Per-tag runtime level; tag "*" sets the default (ESP_LOG_INFO) */
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+esp_log_level_t esp_log_level_get(const char *tag);
+
+/*
+ * Backend (emu_log.c).  Messages are formatted and printed on a logger
+ * thread between emu_log_start() and emu_log_stop(), directly by the
+ * caller otherwise.  tag and fmt must stay valid (string literals).
+ */
+extern volatile int emu_log_max_level;  /* highest level of any tag */
+int  emu_log_enabled(const char *tag, esp_log_level_t level);
+/* "[tag=]level,..." with none/error/warn/info/debug/verbose, their
+ * first letter, or 0-5; -1 if any entry is bad */
+int  emu_log_set_levels(const char *spec);
+void emu_log_start(void);
+void emu_log_stop(void);
+#ifdef __GNUC__
+__attribute__((format(printf, 3, 4)))
+#endif
+void emu_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...);
 
-#define ESP_LOGI(tag, fmt, ...) do { \
-    char _msg[256]; snprintf(_msg, sizeof(_msg), fmt, ##__VA_ARGS__); \
-    printf("[I][%s] %s\n", tag, _msg); \
-    emu_log_append('I', tag, _msg); \
+/* History of log and UART lines with emulated cycle and host time
+ * (emu_log.c); emu_log_search() returns a malloc'd "LOG ..." listing */
+void emu_log_set_cycle_source(uint64_t (*fn)(void));
+void emu_log_uart_line(uint64_t cycle, const char *line);
+char *emu_log_search(uint64_t since, const char *regex, int tail, int *nlines, int *more);
+
+#define ESP_LOG_LEVEL(level, tag, fmt, ...) do { \
+    if ((int)(level) <= emu_log_max_level && emu_log_enabled(tag, level)) \
+        emu_log_write(level, tag, fmt, ##__VA_ARGS__); \
 } while(0)
 
+#define ESP_LOGE(tag, fmt, ...) ESP_LOG_LEVEL(ESP_LOG_ERROR,   tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) ESP_LOG_LEVEL(ESP_LOG_WARN,    tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ESP_LOG_LEVEL(ESP_LOG_INFO,    tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG,   tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) ESP_LOG_LEVEL(ESP_LOG_VERBOSE, tag, fmt, ##__VA_ARGS__)
+
 #define ESP_ERROR_CHECK(x) do { (void)(x); } while(0)
 
 static inline const char *esp_err_to_name(esp_err_t err) {
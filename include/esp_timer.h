@@ -7,6 +7,7 @@
 #ifndef ESP_TIMER_H
 #define ESP_TIMER_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "esp_log.h"  /* for esp_err_t */
@@ -37,6 +38,9 @@ esp_err_t esp_timer_stop(esp_timer_handle_t timer);
 esp_err_t esp_timer_delete(esp_timer_handle_t timer);
 bool esp_timer_is_active(esp_timer_handle_t timer);
 
+/* Print per-timer stats and the dispatch-lateness histogram */
+esp_err_t esp_timer_dump(FILE *stream);
+
 /* Returns microseconds since boot */
 int64_t esp_timer_get_time(void);
 
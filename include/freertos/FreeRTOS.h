@@ -51,8 +51,14 @@ void emu_exit_critical(void);
 #define portENTER_CRITICAL_ISR(mux)   emu_enter_critical()
 #define portEXIT_CRITICAL_ISR(mux)    emu_exit_critical()
 
+/* ---- ISR exit ---- */
+/* Delivers the task wakeups deferred by *FromISR calls on this thread */
+void emu_yield_from_isr(BaseType_t xHigherPriorityTaskWoken);
+
+#define portYIELD_FROM_ISR(x)      emu_yield_from_isr(x)
+#define portEND_SWITCHING_ISR(x)   emu_yield_from_isr(x)
+
 /* ---- Misc ---- */
-#define portYIELD_FROM_ISR(x)  do { (void)(x); } while(0)
 #define configASSERT(x)        do { (void)(x); } while(0)
 
 #endif /* FREERTOS_H */
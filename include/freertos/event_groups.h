@@ -1,7 +1,8 @@
 /*
  * event_groups.h — FreeRTOS event group API emulation
  *
- * Bitmask with mutex + condvar for waiting on bit patterns.
+ * Bitmask with mutex; each blocked waiter gets its own wait record
+ * and condvar so set-bits wakes only the waiters it satisfies.
  */
 #ifndef FREERTOS_EVENT_GROUPS_H
 #define FREERTOS_EVENT_GROUPS_H
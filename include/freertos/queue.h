@@ -30,10 +30,19 @@ UBaseType_t uxQueueSpacesAvailable(QueueHandle_t xQueue);
 BaseType_t xQueueReset(QueueHandle_t xQueue);
 void vQueueDelete(QueueHandle_t xQueue);
 
-/* ISR variants (no real ISR context — just non-blocking wrappers) */
+/* ISR variants — never block; task wakeups are deferred until
+ * portYIELD_FROM_ISR() and *pxHigherPriorityTaskWoken is set to pdTRUE
+ * when a blocked task was made ready */
 BaseType_t xQueueSendFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
                               BaseType_t *pxHigherPriorityTaskWoken);
+BaseType_t xQueueSendToBackFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                    BaseType_t *pxHigherPriorityTaskWoken);
+BaseType_t xQueueSendToFrontFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                     BaseType_t *pxHigherPriorityTaskWoken);
+BaseType_t xQueueOverwriteFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                   BaseType_t *pxHigherPriorityTaskWoken);
 BaseType_t xQueueReceiveFromISR(QueueHandle_t xQueue, void *pvBuffer,
                                  BaseType_t *pxHigherPriorityTaskWoken);
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t xQueue);
 
 #endif /* FREERTOS_QUEUE_H */
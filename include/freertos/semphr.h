@@ -25,6 +25,8 @@ BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t xSemaphore);
 
 BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t xSemaphore,
                                   BaseType_t *pxHigherPriorityTaskWoken);
+BaseType_t xSemaphoreTakeFromISR(SemaphoreHandle_t xSemaphore,
+                                  BaseType_t *pxHigherPriorityTaskWoken);
 
 void vSemaphoreDelete(SemaphoreHandle_t xSemaphore);
 
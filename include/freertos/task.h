@@ -34,4 +34,83 @@ TaskHandle_t xTaskGetCurrentTaskHandle(void);
 /* Shutdown helper — called by emulator on exit to join child tasks */
 void emu_freertos_shutdown(void);
 
+/* Run ticks, delays and timeouts on a virtual clock that jumps ahead
+ * whenever every task is blocked.  Call before creating any task. */
+void emu_freertos_set_virtual_time(int enable);
+
+/* Shim clock in ns since boot, and a sleep on it that lets virtual
+ * time advance (the caller counts as blocked while it waits) */
+uint64_t emu_freertos_now_ns(void);
+void emu_freertos_sleep_until_ns(uint64_t deadline_ns);
+
+/* Live kernel-object counts, for leak checks */
+typedef struct {
+    int tasks;
+    int semaphores;
+    int queues;
+    int event_groups;
+    int timers;
+} emu_freertos_counts_t;
+
+void emu_freertos_get_counts(emu_freertos_counts_t *out);
+
+/* Object registry — every live task, semaphore, queue, event group,
+ * software timer and esp_timer, keyed by where it was created: the
+ * firmware call site when created from the flexe CPU thread, else a
+ * short host backtrace */
+enum {
+    EMU_OBJ_TASK,
+    EMU_OBJ_SEMAPHORE,
+    EMU_OBJ_QUEUE,
+    EMU_OBJ_EVENT_GROUP,
+    EMU_OBJ_TIMER,
+    EMU_OBJ_ESP_TIMER,
+    EMU_OBJ_TYPES
+};
+
+#define EMU_OBJ_FRAMES 4
+
+typedef struct {
+    uint32_t guest_pc;                   /* firmware caller, 0 on the host */
+    const void *frames[EMU_OBJ_FRAMES];  /* host callers, innermost first */
+} emu_obj_where_t;
+
+struct emu_obj_node {
+    struct emu_obj_node *prev, *next;   /* NULL while unregistered */
+    emu_obj_where_t where;
+    int type;
+};
+
+typedef struct {
+    int type;
+    emu_obj_where_t where;
+    int count;
+} emu_obj_site_t;
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define EMU_CALLER() _ReturnAddress()
+#else
+#define EMU_CALLER() __builtin_return_address(0)
+#endif
+
+/* <site> is the create API's return address; the backtrace starts there */
+void emu_obj_register(struct emu_obj_node *node, int type, const void *site);
+void emu_obj_unregister(struct emu_obj_node *node);
+
+/* Live objects grouped by (type, site), largest group first.
+ * Fills up to max entries and returns the number of groups filled. */
+int emu_obj_census(emu_obj_site_t *out, int max);
+const char *emu_obj_type_name(int type);
+void emu_obj_site_name(const emu_obj_where_t *where, char *buf, size_t len);
+
+/* Guest call-site hooks, installed by the flexe bridge: <pc> returns the
+ * firmware caller when run on the CPU thread (0 elsewhere), <name>
+ * symbolizes a firmware address into buf (returns 0 if unknown) */
+void emu_obj_set_guest_hooks(uint32_t (*pc)(void),
+                             int (*name)(uint32_t pc, char *buf, size_t len));
+
+/* Log every object still registered (called when the app stops) */
+void emu_obj_report(void);
+
 #endif /* FREERTOS_TASK_H */
@@ -1,8 +1,9 @@
 /*
  * nvs.h -- Non-Volatile Storage API shim
  *
- * File-backed key-value store in ~/.cyd-emulator/nvs/.
- * Each namespace is a separate binary file.
+ * File-backed key-value store in ~/.cyd-emulator/nvs/ (or --nvs-dir),
+ * or memory-only with --nvs-memory.  Each namespace is a separate
+ * binary file.
  */
 #ifndef NVS_H
 #define NVS_H
@@ -21,6 +22,20 @@ typedef enum {
 
 typedef nvs_open_mode_t nvs_open_mode;  /* legacy alias */
 
+typedef enum {
+    NVS_TYPE_U8   = 0x01,
+    NVS_TYPE_I8   = 0x11,
+    NVS_TYPE_U16  = 0x02,
+    NVS_TYPE_I16  = 0x12,
+    NVS_TYPE_U32  = 0x04,
+    NVS_TYPE_I32  = 0x14,
+    NVS_TYPE_U64  = 0x08,
+    NVS_TYPE_I64  = 0x18,
+    NVS_TYPE_STR  = 0x21,
+    NVS_TYPE_BLOB = 0x42,
+    NVS_TYPE_ANY  = 0xff,
+} nvs_type_t;
+
 #define ESP_ERR_NVS_NOT_FOUND        0x1102
 #define ESP_ERR_NVS_INVALID_HANDLE   0x1103
 #define ESP_ERR_NVS_INVALID_NAME     0x1104
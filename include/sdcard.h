@@ -8,11 +8,105 @@
 
 #include <stdint.h>
 
-int sdcard_init(void);
+/* emu_sdcard_sync_ms values; N > 0 syncs at most every N ms */
+#define SDCARD_SYNC_NONE    (-1)   /* never fsync (default) */
+#define SDCARD_SYNC_DEINIT  0      /* fsync when the card is closed */
+
+/* Each slot has its own image, transfer queue, cache and statistics;
+ * the speed class is shared.  Slot 0 is the card (--sdcard); slot 1 is
+ * not opened yet, as the firmware has no path to a second card. */
+#define SDCARD_MAX_SLOTS    2
+
+int sdcard_init(void);              /* opens slot 0 */
+
+/* Image path to give flexe for the firmware's card, NULL if slot 0 is
+ * not a plain image (overlay, --sdcard-dir, packed) */
+const char *sdcard_guest_image_path(void);
 void sdcard_deinit(void);
-uint64_t sdcard_size(void);
 uint32_t sdcard_sector_size(void);
+
+/* 0 / -1 on an empty or out-of-range slot */
+uint64_t sdcard_slot_size(int slot);
+int sdcard_slot_write(int slot, uint32_t lba, uint32_t count, const void *data);
+int sdcard_slot_read(int slot, uint32_t lba, uint32_t count, void *data);
+
+/* Slot 0 */
+uint64_t sdcard_size(void);
 int sdcard_write(uint32_t lba, uint32_t count, const void *data);
 int sdcard_read(uint32_t lba, uint32_t count, void *data);
 
+/* Copy the slot 0 card into a new image at path on a worker thread (reflink
+ * or sparse-aware copy; base + delta in overlay mode).  Keep the app
+ * from writing until sdcard_snapshot_poll() stops returning 1. */
+int sdcard_snapshot_start(const char *path);
+/* 1 while running (progress in *percent if non-NULL); then 0 on
+ * success or -1 on failure */
+int sdcard_snapshot_poll(int *percent);
+
+/* Write back the sector caches of all slots (no fsync) */
+void sdcard_flush(void);
+
+/* Sector cache statistics, per region of the card's FAT filesystem.
+ * Reset when a card is attached. */
+enum {
+    SDCARD_REGION_BOOT,    /* MBR, boot and reserved sectors */
+    SDCARD_REGION_FAT,
+    SDCARD_REGION_DIR,
+    SDCARD_REGION_DATA,    /* also everything on an unrecognized card */
+    SDCARD_REGION_COUNT
+};
+
+typedef struct {
+    uint64_t hits[SDCARD_REGION_COUNT];     /* sectors read from the cache */
+    uint64_t misses[SDCARD_REGION_COUNT];   /* sectors read from the image */
+    uint64_t readahead;                     /* sectors prefetched */
+    uint64_t writeback_runs;                /* coalesced image writes */
+    uint64_t writeback_sectors;
+} sdcard_cache_stats_t;
+
+/* -1 for an out-of-range slot */
+int sdcard_get_cache_stats(int slot, sdcard_cache_stats_t *out);
+const char *sdcard_region_name(int region);
+
+/* I/O trace: a ring per slot of the last <entries> requests (rounded
+ * up to a power of two); 0 turns tracing off.  Re-enabling clears the
+ * rings. */
+int sdcard_trace_enable(uint32_t entries);
+int sdcard_trace_export_csv(int slot, const char *path);
+
+#define SDCARD_TRACE_HOT 8
+
+/* Summary of the requests currently in the trace ring */
+typedef struct {
+    uint64_t ops, reads, writes, errors;
+    uint64_t read_sectors, write_sectors;
+    uint64_t sequential;        /* requests continuing one of the 4 before */
+    uint64_t span_ns;           /* shim time from first start to last end */
+    uint64_t latency_ns_sum, latency_ns_max;
+    uint64_t dropped;           /* older requests overwritten in the ring */
+    int nhot;
+    struct {
+        uint32_t lba;
+        uint32_t hits;
+        int region;
+    } hot[SDCARD_TRACE_HOT];    /* most requested start LBAs */
+} sdcard_trace_stats_t;
+
+/* -1 if tracing is off */
+int sdcard_trace_stats(int slot, sdcard_trace_stats_t *out);
+
+/* Write a packed (chunked, deflated) copy of raw image src to dst;
+ * sdcard_init() recognizes packed images and opens them in place */
+int sdcard_pack_image(const char *src, const char *dst);
+
+/* Transfer timing model: spi (default), class2, class4, class10.
+ * Returns -1 for an unknown name. */
+int sdcard_set_speed_class(const char *name);
+
+/* Slot 0 in overlay mode (--sdcard-overlay or --sdcard-dir) only;
+ * -1 otherwise */
+int sdcard_overlay_commit(void);    /* merge the delta into the base image */
+int sdcard_overlay_discard(void);   /* drop all writes since the last commit */
+int sdcard_overlay_apply(const char *path);  /* merge the delta into a copy */
+
 #endif /* SDCARD_H */
@@ -11,6 +11,16 @@
  *   screenshot <path>   Save display as 24-bit BMP
  *   status              Emulator info
  *   log                 Recent UART output lines
+ *   log [since <cycle>] [tail <n>] [grep <regex>]
+ *                       Search the UART/log history (grep takes the rest
+ *                       of the line)
+ *   loglevel <[tag=]lvl,...>  Set emulator ESP_LOG levels (tag * = default)
+ *   objects             Live FreeRTOS/esp_timer objects by creation site
+ *   sd_commit           Merge the SD overlay delta into the base image
+ *   sd_discard          Drop all SD overlay writes
+ *   sdtrace on [n]|off  Record the last n SD requests (default 65536)
+ *   sdtrace csv [slot] <path>  Export an SD slot's trace as CSV
+ *   sdstats [slot]      SD access pattern and cache statistics
  *   quit                Clean shutdown
  */
 
@@ -22,6 +32,8 @@
 #include "display.h"
 #include "emu_flexe.h"
 #include "emu_board.h"
+#include "sdcard.h"
+#include "freertos/task.h"
 
 #include "xtensa.h"
 #include "memory.h"
@@ -29,6 +41,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
@@ -54,6 +67,9 @@ extern const struct board_profile *emu_active_board;
 #define EMU_LOG_LINES 64
 extern char emu_log_ring[][48];
 extern int  emu_log_head;
+extern int  emu_log_set_levels(const char *spec);
+extern char *emu_log_search(uint64_t since, const char *regex, int tail,
+                            int *nlines, int *more);
 
 #ifdef _MSC_VER
 /* Windows stubs - control socket not supported on Windows */
@@ -275,6 +291,145 @@ static void handle_log(int fd)
     send_str(fd, "OK\n");
 }
 
+static void handle_log_search(int fd, const char *args)
+{
+    uint64_t since = 0;
+    int tail = 0;
+    const char *regex = NULL;
+    while (*args) {
+        while (*args == ' ') args++;
+        if (strncmp(args, "since ", 6) == 0) {
+            since = strtoull(args + 6, (char **)&args, 0);
+        } else if (strncmp(args, "tail ", 5) == 0) {
+            tail = (int)strtol(args + 5, (char **)&args, 0);
+        } else if (strncmp(args, "grep ", 5) == 0 && args[5]) {
+            regex = args + 5;
+            break;
+        } else if (*args) {
+            send_str(fd, "ERR usage: log [since <cycle>] [tail <n>] [grep <regex>]\n");
+            return;
+        }
+    }
+
+    int n, more;
+    char *out = emu_log_search(since, regex, tail, &n, &more);
+    if (!out) {
+        send_str(fd, "ERR bad regex or out of memory\n");
+        return;
+    }
+    send_str(fd, out);
+    free(out);
+    char resp[64];
+    snprintf(resp, sizeof(resp), more ? "OK %d lines (older ones omitted)\n" : "OK %d lines\n", n);
+    send_str(fd, resp);
+}
+
+static void handle_objects(int fd)
+{
+    emu_obj_site_t sites[64];
+    int n = emu_obj_census(sites, 64);
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        char where[256], line[320];
+        emu_obj_site_name(&sites[i].where, where, sizeof(where));
+        snprintf(line, sizeof(line), "OBJ %s %d %s\n",
+                 emu_obj_type_name(sites[i].type), sites[i].count, where);
+        send_str(fd, line);
+        total += sites[i].count;
+    }
+    char resp[64];
+    snprintf(resp, sizeof(resp), "OK %d live\n", total);
+    send_str(fd, resp);
+}
+
+static void handle_sd_overlay(int fd, int commit)
+{
+    int ret = commit ? sdcard_overlay_commit() : sdcard_overlay_discard();
+    send_str(fd, ret == 0 ? "OK\n" : "ERR no SD overlay or I/O error\n");
+}
+
+static void handle_sdtrace(int fd, const char *args)
+{
+    char resp[600];
+    if (strncmp(args, "on", 2) == 0 && (args[2] == '\0' || args[2] == ' ')) {
+        long n = args[2] ? strtol(args + 3, NULL, 0) : 65536;
+        if (n <= 0 || sdcard_trace_enable((uint32_t)n) != 0) {
+            send_str(fd, "ERR bad entry count or out of memory\n");
+            return;
+        }
+        send_str(fd, "OK\n");
+    } else if (strcmp(args, "off") == 0) {
+        sdcard_trace_enable(0);
+        send_str(fd, "OK\n");
+    } else if (strncmp(args, "csv ", 4) == 0 && args[4]) {
+        const char *path = args + 4;
+        int slot = 0;
+        if (isdigit((unsigned char)path[0]) && path[1] == ' ' && path[2]) {
+            slot = path[0] - '0';
+            path += 2;
+        }
+        if (sdcard_trace_export_csv(slot, path) == 0)
+            snprintf(resp, sizeof(resp), "OK %s\n", path);
+        else
+            snprintf(resp, sizeof(resp), "ERR trace off or cannot write %s\n", path);
+        send_str(fd, resp);
+    } else {
+        send_str(fd, "ERR usage: sdtrace on [entries] | off | csv [slot] <path>\n");
+    }
+}
+
+static void handle_sdstats(int fd, int slot)
+{
+    char line[256];
+    sdcard_trace_stats_t st;
+    sdcard_cache_stats_t cs;
+    if (sdcard_get_cache_stats(slot, &cs) != 0) {
+        send_str(fd, "ERR no such SD slot\n");
+        return;
+    }
+    if (sdcard_trace_stats(slot, &st) == 0 && st.ops > 0) {
+        double secs = st.span_ns / 1e9;
+        uint64_t sectors = st.read_sectors + st.write_sectors;
+        snprintf(line, sizeof(line),
+                 "SD ops=%llu reads=%llu writes=%llu errors=%llu span=%.3fs dropped=%llu\n",
+                 (unsigned long long)st.ops, (unsigned long long)st.reads,
+                 (unsigned long long)st.writes, (unsigned long long)st.errors,
+                 secs, (unsigned long long)st.dropped);
+        send_str(fd, line);
+        if (secs > 0)
+            snprintf(line, sizeof(line), "SD iops=%.1f read=%.2fMB/s write=%.2fMB/s\n",
+                     st.ops / secs, st.read_sectors * 512 / secs / 1e6,
+                     st.write_sectors * 512 / secs / 1e6);
+        else
+            snprintf(line, sizeof(line), "SD iops=- read=- write=- (no time elapsed)\n");
+        send_str(fd, line);
+        snprintf(line, sizeof(line),
+                 "SD avg_req=%.1fKB sequential=%.1f%% lat_avg=%.3fms lat_max=%.3fms\n",
+                 sectors * 512.0 / st.ops / 1024, 100.0 * st.sequential / st.ops,
+                 st.latency_ns_sum / 1e6 / st.ops, st.latency_ns_max / 1e6);
+        send_str(fd, line);
+        for (int i = 0; i < st.nhot; i++) {
+            snprintf(line, sizeof(line), "HOT %u %s %u\n", st.hot[i].lba,
+                     sdcard_region_name(st.hot[i].region), st.hot[i].hits);
+            send_str(fd, line);
+        }
+    }
+
+    for (int r = 0; r < SDCARD_REGION_COUNT; r++) {
+        uint64_t n = cs.hits[r] + cs.misses[r];
+        if (!n) continue;
+        snprintf(line, sizeof(line), "CACHE %s hits=%llu misses=%llu rate=%.1f%%\n",
+                 sdcard_region_name(r), (unsigned long long)cs.hits[r],
+                 (unsigned long long)cs.misses[r], 100.0 * cs.hits[r] / n);
+        send_str(fd, line);
+    }
+    snprintf(line, sizeof(line), "CACHE readahead=%llu writeback=%llu/%llu runs\n",
+             (unsigned long long)cs.readahead, (unsigned long long)cs.writeback_sectors,
+             (unsigned long long)cs.writeback_runs);
+    send_str(fd, line);
+    send_str(fd, st.ops > 0 ? "OK\n" : "OK trace off or empty (sdtrace on)\n");
+}
+
 static void handle_quit(int fd)
 {
     send_str(fd, "OK\n");
@@ -582,6 +737,23 @@ void emu_control_poll(void)
         handle_status(client);
     } else if (strcmp(buf, "log") == 0) {
         handle_log(client);
+    } else if (strncmp(buf, "log ", 4) == 0) {
+        handle_log_search(client, buf + 4);
+    } else if (strcmp(buf, "objects") == 0) {
+        handle_objects(client);
+    } else if (strncmp(buf, "loglevel ", 9) == 0) {
+        send_str(client, emu_log_set_levels(buf + 9) == 0 ? "OK\n"
+                 : "ERR usage: loglevel [tag=]none|error|warn|info|debug|verbose,...\n");
+    } else if (strcmp(buf, "sd_commit") == 0) {
+        handle_sd_overlay(client, 1);
+    } else if (strcmp(buf, "sd_discard") == 0) {
+        handle_sd_overlay(client, 0);
+    } else if (strncmp(buf, "sdtrace ", 8) == 0) {
+        handle_sdtrace(client, buf + 8);
+    } else if (strcmp(buf, "sdstats") == 0) {
+        handle_sdstats(client, 0);
+    } else if (strncmp(buf, "sdstats ", 8) == 0) {
+        handle_sdstats(client, atoi(buf + 8));
     } else if (strcmp(buf, "quit") == 0) {
         handle_quit(client);
     } else if (strncmp(buf, "peek ", 5) == 0) {
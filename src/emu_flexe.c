@@ -2,7 +2,7 @@
  * emu_flexe.c — Bridge between cyd-emulator and flexe Xtensa interpreter
  *
  * Uses flexe_session for all init/run/cleanup — no duplicated stub
- * management.  Only GUI-specific code lives here: UART log ring,
+ * management.  Only GUI-specific code lives here: UART output sink,
  * SDL touch bridge, debug pause/continue.
  */
 
@@ -11,14 +11,17 @@
 #endif
 
 #include "emu_flexe.h"
+#include "sdcard.h"
 #include "flexe_session.h"
 #include "display_stubs.h"
 #include "xtensa.h"
 #include "memory.h"
 #include "freertos_stubs.h"
+#include "elf_symbols.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
@@ -37,10 +40,17 @@ extern pthread_mutex_t emu_framebuf_mutex;
 extern const char *emu_sdcard_path;
 extern uint64_t emu_sdcard_size_bytes;
 
-/* From emu_main.c (log ring buffer) */
-extern char emu_log_ring[][48];
-extern int  emu_log_head;
-#define EMU_LOG_LINES 64
+/* From emu_log.c (panel log ring, history) */
+extern void emu_log_panel_add(const char *line);
+extern void emu_log_uart_line(uint64_t cycle, const char *line);
+extern void emu_log_set_cycle_source(uint64_t (*fn)(void));
+
+/* From emu_freertos.c (object registry creation sites) */
+extern void emu_obj_set_guest_hooks(uint32_t (*pc)(void),
+                                    int (*name)(uint32_t pc, char *buf, size_t len));
+
+/* From emu_uart.c (--uart-pty bridge) */
+extern void emu_uart_pty_write(const void *data, size_t len);
 
 /* Debug pause state (cross-thread) */
 static pthread_mutex_t debug_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -49,40 +59,232 @@ static volatile int    debug_paused = 0;
 static volatile int    debug_pause_requested = 0;
 static volatile int    cpu_thread_alive = 0; /* 1 while emu_flexe_run() is active */
 
+#define FLEXE_CPU_MHZ 160      /* ESP32 default CPU clock */
+
 /* Module state */
 static int flexe_active = 0;
 static flexe_session_t *session;
+static xtensa_cpu_t *run_cpu;           /* CPU thread, inside emu_flexe_run() */
+static pthread_t run_thread;            /* valid while run_cpu is set */
+static atomic_ullong flexe_cycles;      /* cycle count after the last batch */
+
+/* ---- UART output ----
+ *
+ * The CPU thread only copies UART TX bytes into a single-producer /
+ * single-consumer ring.  A writer thread, running alongside
+ * emu_flexe_run(), drains it in batches to stdout, the --uart-log
+ * capture file, the --uart-pty bridge, the log history and the panel
+ * log ring.  When the ring is full the CPU thread sleeps on a condvar
+ * until the writer has drained part of it, like firmware blocking on a
+ * full TX FIFO.  Line terminators carry the cycle count they were sent
+ * at in uart_stamp[], at the same ring offset.
+ */
 
-/* UART line accumulator */
+#define UART_RING_SIZE  (64 * 1024)   /* power of two */
+
+/* Capture file for UART output (--uart-log); NULL = none */
+const char *emu_uart_log_path = NULL;
+
+static uint8_t     uart_ring[UART_RING_SIZE];
+static uint64_t    uart_stamp[UART_RING_SIZE];
+static atomic_uint uart_ring_head;     /* advanced by the CPU thread */
+static atomic_uint uart_ring_tail;     /* advanced by the writer */
+static atomic_int  uart_writer_idle;   /* writer waiting for data */
+static atomic_int  uart_writer_quit;
+static int         uart_writer_valid;
+static pthread_t   uart_writer;
+static atomic_int  uart_cpu_waiting;   /* CPU thread waiting for ring space */
+static pthread_mutex_t uart_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  uart_wake_cond;   /* writer: data or quit */
+static pthread_cond_t  uart_space_cond;  /* CPU thread: ring drained */
+static int             uart_conds_ready;
+static unsigned long long uart_dropped;  /* bytes sent with no writer */
+static FILE *uart_log_file;
+
+/* UART line accumulator (writer thread) */
 static char  uart_line[256];
 static int   uart_pos = 0;
 
-static void uart_flush_line(void)
+static void uart_flush_line(uint64_t cycle)
 {
     if (uart_pos == 0) return;
     uart_line[uart_pos] = '\0';
 
-    /* Copy into log ring (truncate to fit) */
-    strncpy(emu_log_ring[emu_log_head], uart_line, 47);
-    emu_log_ring[emu_log_head][47] = '\0';
-    emu_log_head = (emu_log_head + 1) % EMU_LOG_LINES;
+    emu_log_uart_line(cycle, uart_line);
+    /* Copy into log ring (truncated to fit) */
+    emu_log_panel_add(uart_line);
 
     uart_pos = 0;
 }
 
+/* Clock used for condvar timeouts (MSVC pthreads only support REALTIME) */
+#ifdef _MSC_VER
+#define UART_COND_CLOCK CLOCK_REALTIME
+#else
+#define UART_COND_CLOCK CLOCK_MONOTONIC
+#endif
+
+static void uart_cond_init(pthread_cond_t *cond)
+{
+#ifdef _MSC_VER
+    pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, UART_COND_CLOCK);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+static void uart_wake_writer(void)
+{
+    pthread_mutex_lock(&uart_wake_mutex);
+    pthread_cond_signal(&uart_wake_cond);
+    pthread_mutex_unlock(&uart_wake_mutex);
+}
+
+/* CPU thread: queue a span of TX bytes sent at <cycle> (a memcpy
+ * unless the ring is full) */
+static void uart_ring_push(const uint8_t *p, size_t n, uint64_t cycle)
+{
+    if (n == 0) return;
+    unsigned head = atomic_load_explicit(&uart_ring_head, memory_order_relaxed);
+    while (n > 0) {
+        unsigned tail = atomic_load_explicit(&uart_ring_tail, memory_order_acquire);
+        size_t space = UART_RING_SIZE - (head - tail);
+        if (space == 0) {
+            if (!uart_writer_valid) {
+                uart_dropped += n;
+                return;
+            }
+            /* Sleep until the writer has drained some of the ring */
+            pthread_mutex_lock(&uart_wake_mutex);
+            atomic_store(&uart_cpu_waiting, 1);
+            pthread_cond_signal(&uart_wake_cond);
+            while (atomic_load(&uart_ring_tail) == tail && uart_writer_valid)
+                pthread_cond_wait(&uart_space_cond, &uart_wake_mutex);
+            atomic_store(&uart_cpu_waiting, 0);
+            pthread_mutex_unlock(&uart_wake_mutex);
+            continue;
+        }
+        size_t off = head & (UART_RING_SIZE - 1);
+        size_t len = n < space ? n : space;
+        if (len > UART_RING_SIZE - off) len = UART_RING_SIZE - off;
+        memcpy(uart_ring + off, p, len);
+        for (size_t i = 0; i < len; i++)
+            if (p[i] == '\n' || p[i] == '\r') uart_stamp[off + i] = cycle;
+        head += (unsigned)len;
+        atomic_store_explicit(&uart_ring_head, head, memory_order_release);
+        p += len;
+        n -= len;
+    }
+    /* An idle writer also polls, so only end-of-line needs a prompt wakeup */
+    if (p[-1] == '\n' && atomic_load_explicit(&uart_writer_idle, memory_order_relaxed))
+        uart_wake_writer();
+}
+
 static void uart_log_cb(void *ctx, uint8_t byte)
 {
     (void)ctx;
+    uint64_t cycle = run_cpu ? run_cpu->cycle_count
+                             : atomic_load_explicit(&flexe_cycles, memory_order_relaxed);
+    uart_ring_push(&byte, 1, cycle);
+}
+
+/* Writer thread: hand one batch (with its terminators' stamps) to every sink */
+static void uart_sink_write(const uint8_t *p, const uint64_t *stamp, size_t n)
+{
+    fwrite(p, 1, n, stdout);
+    if (uart_log_file) fwrite(p, 1, n, uart_log_file);
+    emu_uart_pty_write(p, n);
+
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '\n' || p[i] == '\r')
+            uart_flush_line(stamp[i]);
+        else if (uart_pos < (int)sizeof(uart_line) - 1)
+            uart_line[uart_pos++] = (char)p[i];
+    }
+}
+
+static void *uart_writer_func(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        unsigned tail = atomic_load_explicit(&uart_ring_tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&uart_ring_head, memory_order_acquire);
+        if (head == tail) {
+            fflush(stdout);
+            if (uart_log_file) fflush(uart_log_file);
+            if (atomic_load(&uart_writer_quit)) break;
+
+            struct timespec ts;
+            clock_gettime(UART_COND_CLOCK, &ts);
+            ts.tv_nsec += 20 * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&uart_wake_mutex);
+            atomic_store(&uart_writer_idle, 1);
+            if (atomic_load(&uart_ring_head) == tail && !atomic_load(&uart_writer_quit))
+                pthread_cond_timedwait(&uart_wake_cond, &uart_wake_mutex, &ts);
+            atomic_store(&uart_writer_idle, 0);
+            pthread_mutex_unlock(&uart_wake_mutex);
+            continue;
+        }
+
+        /* Up to the end of the ring; the wrapped part is the next batch */
+        size_t off = tail & (UART_RING_SIZE - 1);
+        size_t len = head - tail;
+        if (len > UART_RING_SIZE - off) len = UART_RING_SIZE - off;
+        uart_sink_write(uart_ring + off, uart_stamp + off, len);
+        atomic_store_explicit(&uart_ring_tail, tail + (unsigned)len,
+                              memory_order_release);
+        if (atomic_load(&uart_cpu_waiting)) {
+            pthread_mutex_lock(&uart_wake_mutex);
+            pthread_cond_signal(&uart_space_cond);
+            pthread_mutex_unlock(&uart_wake_mutex);
+        }
+    }
+
+    /* Flush any partial UART line */
+    uart_flush_line(emu_flexe_cycles());
+    return NULL;
+}
 
-    /* Also write to stdout for terminal visibility */
-    putchar(byte);
+static void uart_writer_start(void)
+{
+    if (uart_writer_valid) return;
+    if (!uart_conds_ready) {
+        uart_cond_init(&uart_wake_cond);
+        uart_cond_init(&uart_space_cond);
+        uart_conds_ready = 1;
+    }
+    if (emu_uart_log_path && !uart_log_file) {
+        uart_log_file = fopen(emu_uart_log_path, "w");
+        if (!uart_log_file)
+            fprintf(stderr, "Cannot open UART log %s\n", emu_uart_log_path);
+    }
+    atomic_store(&uart_writer_quit, 0);
+    if (pthread_create(&uart_writer, NULL, uart_writer_func, NULL) == 0)
+        uart_writer_valid = 1;
+    else
+        fprintf(stderr, "Failed to create UART writer thread\n");
+}
 
-    if (byte == '\n' || byte == '\r') {
-        uart_flush_line();
-        return;
+/* Drain everything queued so far, then stop the writer */
+static void uart_writer_stop(void)
+{
+    if (!uart_writer_valid) return;
+    atomic_store(&uart_writer_quit, 1);
+    uart_wake_writer();
+    pthread_join(uart_writer, NULL);
+    uart_writer_valid = 0;
+    if (uart_dropped) {
+        fprintf(stderr, "UART: %llu bytes dropped with no writer\n", uart_dropped);
+        uart_dropped = 0;
     }
-    if (uart_pos < (int)sizeof(uart_line) - 1)
-        uart_line[uart_pos++] = (char)byte;
 }
 
 /* Bridge callback: read touch state from emu_touch.c */
@@ -92,12 +294,42 @@ static int flexe_touch_read(int *x, int *y, void *ctx)
     return touch_read(x, y) ? 1 : 0;
 }
 
+/* Object registry hook: the firmware code that called into a host shim.
+ * A host shim runs on the CPU thread with the guest stopped at the
+ * called function, so a0 holds the windowed return address. */
+static uint32_t flexe_caller_pc(void)
+{
+    xtensa_cpu_t *cpu = run_cpu;
+    if (!cpu || !pthread_equal(pthread_self(), run_thread)) return 0;
+    uint32_t a0 = ar_read(cpu, 0);
+    if (!a0) return cpu->pc;
+    return (a0 & 0x3FFFFFFFu) | (cpu->pc & 0xC0000000u);
+}
+
+static int flexe_pc_name(uint32_t pc, char *buf, size_t len)
+{
+    const elf_symbols_t *syms = flexe_session_syms(session);
+    elf_sym_info_t sym;
+    if (!syms || !elf_symbols_lookup(syms, pc, &sym)) return 0;
+    snprintf(buf, len, "%s+0x%x", sym.name, sym.offset);
+    return 1;
+}
+
 int emu_flexe_init(const char *bin_path, const char *elf_path)
 {
+    /* flexe's SD stubs take an image path and size (the session config
+     * has no block-device callback) and read the file themselves, not
+     * through sdcard.h.  Card modes without a plain image would hand
+     * them the wrong file, so the firmware gets no card there. */
+    const char *sd_image = sdcard_guest_image_path();
+    if (!sd_image && emu_sdcard_path)
+        fprintf(stderr, "Warning: firmware sees no SD card with --sdcard-overlay, "
+                "--sdcard-dir or a packed image (flexe opens plain images only)\n");
+
     flexe_session_config_t cfg = {
         .bin_path      = bin_path,
         .elf_path      = elf_path,
-        .sdcard_path   = emu_sdcard_path,
+        .sdcard_path   = sd_image,
         .sdcard_size   = emu_sdcard_size_bytes,
         .initial_sp    = 0x3FFF8000u,
         .uart_cb       = uart_log_cb,
@@ -114,6 +346,8 @@ int emu_flexe_init(const char *bin_path, const char *elf_path)
         return -1;
     }
 
+    emu_log_set_cycle_source(emu_flexe_cycles);
+    emu_obj_set_guest_hooks(flexe_caller_pc, flexe_pc_name);
     flexe_active = 1;
     return 0;
 }
@@ -123,6 +357,9 @@ void emu_flexe_run(void)
     xtensa_cpu_t *cpu = flexe_session_cpu(session, 0);
     freertos_stubs_t *frt = flexe_session_frt(session);
 
+    uart_writer_start();
+    run_thread = pthread_self();
+    run_cpu = cpu;
     cpu_thread_alive = 1;
     while (emu_app_running && cpu->running) {
         /* Check if pause requested or breakpoint hit */
@@ -159,6 +396,7 @@ void emu_flexe_run(void)
 
         uint32_t pc_before = cpu->pc;
         int ran = xtensa_run(cpu, 10000);
+        atomic_store_explicit(&flexe_cycles, cpu->cycle_count, memory_order_relaxed);
         if (ran < 10000 && !cpu->breakpoint_hit && !debug_pause_requested
             && !cpu->halted)
             break;
@@ -186,9 +424,8 @@ void emu_flexe_run(void)
     pthread_cond_broadcast(&debug_cond);
     pthread_mutex_unlock(&debug_mutex);
 
-    /* Flush any partial UART line */
-    uart_flush_line();
-    fflush(stdout);
+    run_cpu = NULL;
+    uart_writer_stop();
 }
 
 void emu_flexe_shutdown(void)
@@ -204,6 +441,32 @@ int emu_flexe_active(void)
     return flexe_active;
 }
 
+uint64_t emu_flexe_cycles(void)
+{
+    return atomic_load_explicit(&flexe_cycles, memory_order_relaxed);
+}
+
+/* Guest time in ns from the cycle count, for device models timing a
+ * request made by the CPU thread.  Returns 0 on any other thread. */
+int emu_flexe_guest_ns(uint64_t *ns)
+{
+    xtensa_cpu_t *cpu = run_cpu;
+    if (!cpu || !pthread_equal(pthread_self(), run_thread)) return 0;
+    *ns = cpu->cycle_count * 1000 / FLEXE_CPU_MHZ;
+    return 1;
+}
+
+/* Host-side device models (SD transfers) charge their busy time here:
+ * the guest's cycle count moves on by <ns> at the CPU clock instead of
+ * the host thread sleeping.  Returns 0 if not called on the CPU thread. */
+int emu_flexe_charge_ns(uint64_t ns)
+{
+    xtensa_cpu_t *cpu = run_cpu;
+    if (!cpu || !pthread_equal(pthread_self(), run_thread)) return 0;
+    cpu->cycle_count += ns * FLEXE_CPU_MHZ / 1000;
+    return 1;
+}
+
 int emu_flexe_display_width(void)
 {
     if (!flexe_active) return 320;
@@ -19,6 +19,9 @@ int  emu_flexe_init(const char *bin_path, const char *elf_path);
 void emu_flexe_run(void);       /* blocks until emu_app_running==0 or cpu stops */
 void emu_flexe_shutdown(void);
 int  emu_flexe_active(void);    /* 1 if firmware mode */
+uint64_t emu_flexe_cycles(void); /* CPU cycles as of the last run batch (any thread) */
+int  emu_flexe_guest_ns(uint64_t *ns); /* guest time from cycles (CPU thread only) */
+int  emu_flexe_charge_ns(uint64_t ns); /* add device time as CPU cycles (CPU thread only) */
 uint32_t emu_flexe_mem_read32(uint32_t addr);
 uint8_t  emu_flexe_mem_read8(uint32_t addr);
 uint16_t emu_flexe_mem_read16(uint32_t addr);
@@ -9,6 +9,9 @@
  * - Stack depth is ignored (pthreads manage their own stacks)
  * - Blocking waits check emu_app_running every 100ms for clean shutdown
  * - Timer callbacks run in a dedicated timer thread (like FreeRTOS daemon)
+ * - Ticks, delays and timeouts come from the shim clock: monotonic real
+ *   time by default, or virtual time (see emu_freertos_set_virtual_time)
+ * - Semaphores, queues, event groups and timers come from per-type slab pools
  */
 
 #ifdef _MSC_VER
@@ -24,6 +27,10 @@
 #endif
 #include <time.h>
 #include <errno.h>
+#ifndef _MSC_VER
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -37,27 +44,399 @@ static const char *TAG = "freertos";
 
 extern volatile int emu_app_running;
 
+/* Clock used for condvar timeouts (MSVC pthreads only support REALTIME) */
+#ifdef _MSC_VER
+#define EMU_COND_CLOCK CLOCK_REALTIME
+#else
+#define EMU_COND_CLOCK CLOCK_MONOTONIC
+#endif
+
+static void emu_cond_init(pthread_cond_t *cond)
+{
+#ifdef _MSC_VER
+    pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, EMU_COND_CLOCK);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+/* Absolute condvar timeout <ms> from now */
+static void cond_timeout_in(struct timespec *ts, long ms)
+{
+    clock_gettime(EMU_COND_CLOCK, ts);
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
 /* ================================================================
- * Tick counter — milliseconds since first call (1 tick = 1 ms)
+ * Shim clock — monotonic real time or virtual time
+ *
+ * In real mode the clock is CLOCK_MONOTONIC, so wall-clock jumps can't
+ * distort tick counts or timeouts.
+ *
+ * In virtual mode time only moves when every shim thread is blocked.
+ * Blocked threads park a vc_sleeper record (deadline + the condvar they
+ * sleep on) on a global list; the last thread to block advances the
+ * clock straight to the earliest deadline and wakes its owner.  Wakeups
+ * given through emu_cond_signal/broadcast mark sleepers runnable at
+ * signal time, so the clock never jumps while a woken task has yet to run.
  * ================================================================ */
 
-static uint64_t boot_time_ms;
+#define VC_POLL_MS 10   /* re-check interval for sleepers on object condvars */
+
+struct vc_sleeper {
+    struct vc_sleeper *next;
+    uint64_t deadline_ns;   /* UINT64_MAX if none */
+    pthread_cond_t *cond;   /* condvar the owner sleeps on */
+    int woken;              /* handed a wakeup by emu_cond_signal */
+    int expired;            /* deadline reached by a clock advance */
+};
+
+static int clock_virtual = 0;
+static uint64_t boot_time_ns;
 static int boot_time_init = 0;
 
-static uint64_t now_ms(void)
+static pthread_mutex_t vc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  vc_cond;        /* vTaskDelay sleepers in virtual mode */
+static uint64_t vc_now_ns = 0;
+static int vc_threads = 0;             /* shim threads taking part */
+static int vc_blocked = 0;             /* ...of which currently blocked */
+static struct vc_sleeper *vc_sleepers;
+static pthread_key_t vc_key;
+
+static uint64_t mono_ns(void)
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-TickType_t xTaskGetTickCount(void)
+static uint64_t clock_now_ns(void)
 {
+    if (clock_virtual) {
+        pthread_mutex_lock(&vc_mutex);
+        uint64_t now = vc_now_ns;
+        pthread_mutex_unlock(&vc_mutex);
+        return now;
+    }
     if (!boot_time_init) {
-        boot_time_ms = now_ms();
+        boot_time_ns = mono_ns();
         boot_time_init = 1;
     }
-    return (TickType_t)(now_ms() - boot_time_ms);
+    return mono_ns() - boot_time_ns;
+}
+
+static uint64_t now_ms(void)
+{
+    return clock_now_ns() / 1000000ULL;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)now_ms();
+}
+
+/* Jump to the earliest deadline once every participating thread is blocked */
+static void vc_maybe_advance_locked(void)
+{
+    if (vc_threads <= 0 || vc_blocked < vc_threads) return;
+
+    uint64_t earliest = UINT64_MAX;
+    for (struct vc_sleeper *s = vc_sleepers; s; s = s->next) {
+        if (!s->woken && !s->expired && s->deadline_ns < earliest)
+            earliest = s->deadline_ns;
+    }
+    if (earliest == UINT64_MAX) return;  /* everyone waits forever */
+    if (earliest > vc_now_ns) vc_now_ns = earliest;
+
+    for (struct vc_sleeper *s = vc_sleepers; s; s = s->next) {
+        if (s->woken || s->expired || s->deadline_ns > vc_now_ns) continue;
+        s->expired = 1;
+        vc_blocked--;
+        pthread_cond_broadcast(s->cond);
+    }
+}
+
+static void vc_thread_exit(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&vc_mutex);
+    vc_threads--;
+    vc_maybe_advance_locked();
+    pthread_mutex_unlock(&vc_mutex);
+}
+
+/* Count a thread about to be created (before it can run) */
+static void vc_thread_starting(void)
+{
+    if (!clock_virtual) return;
+    pthread_mutex_lock(&vc_mutex);
+    vc_threads++;
+    pthread_mutex_unlock(&vc_mutex);
+}
+
+/* First call in a thread counted by vc_thread_starting() */
+static void vc_adopt_self(void)
+{
+    if (clock_virtual)
+        pthread_setspecific(vc_key, (void *)1);
+}
+
+/* Threads the shim didn't create join when they first create a task
+ * or timer, or on their first blocking call */
+static void vc_register_self_locked(void)
+{
+    if (pthread_getspecific(vc_key)) return;
+    pthread_setspecific(vc_key, (void *)1);
+    vc_threads++;
+}
+
+static void vc_register_self(void)
+{
+    if (!clock_virtual) return;
+    pthread_mutex_lock(&vc_mutex);
+    vc_register_self_locked();
+    pthread_mutex_unlock(&vc_mutex);
+}
+
+static void vc_block_locked(struct vc_sleeper *s, pthread_cond_t *cond,
+                            uint64_t deadline_ns)
+{
+    vc_register_self_locked();
+    memset(s, 0, sizeof(*s));
+    s->deadline_ns = deadline_ns;
+    s->cond = cond;
+    s->next = vc_sleepers;
+    vc_sleepers = s;
+    if (deadline_ns <= vc_now_ns) {
+        s->expired = 1;
+        return;
+    }
+    vc_blocked++;
+    vc_maybe_advance_locked();
+}
+
+static void vc_unblock_locked(struct vc_sleeper *s)
+{
+    for (struct vc_sleeper **pp = &vc_sleepers; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    if (!s->woken && !s->expired) vc_blocked--;
+}
+
+static void vc_unblock_cleanup(void *arg)
+{
+    pthread_mutex_lock(&vc_mutex);
+    vc_unblock_locked((struct vc_sleeper *)arg);
+    pthread_mutex_unlock(&vc_mutex);
+}
+
+/* Cancelled inside the vc_cond wait: vc_mutex is held again here */
+static void vc_sleep_cleanup(void *arg)
+{
+    vc_unblock_locked((struct vc_sleeper *)arg);
+    pthread_mutex_unlock(&vc_mutex);
+}
+
+/* Mark sleepers on <cond> runnable before the actual wakeup */
+static void vc_mark_woken(pthread_cond_t *cond, int all)
+{
+    pthread_mutex_lock(&vc_mutex);
+    for (struct vc_sleeper *s = vc_sleepers; s; s = s->next) {
+        if (s->cond != cond || s->woken || s->expired) continue;
+        s->woken = 1;
+        vc_blocked--;
+        if (!all) break;
+    }
+    pthread_mutex_unlock(&vc_mutex);
+}
+
+static void emu_cond_signal(pthread_cond_t *cond)
+{
+    if (clock_virtual) vc_mark_woken(cond, 0);
+    pthread_cond_signal(cond);
+}
+
+static void emu_cond_broadcast(pthread_cond_t *cond)
+{
+    if (clock_virtual) vc_mark_woken(cond, 1);
+    pthread_cond_broadcast(cond);
+}
+
+/* Must be called before any task or timer is created */
+void emu_freertos_set_virtual_time(int enable)
+{
+    static int key_created = 0;
+    if (!key_created) {
+        pthread_key_create(&vc_key, vc_thread_exit);
+        emu_cond_init(&vc_cond);
+        key_created = 1;
+    }
+    clock_virtual = enable ? 1 : 0;
+    if (clock_virtual)
+        ESP_LOGI(TAG, "Virtual time enabled");
+}
+
+/* Sleep until <deadline_ns> on the shim clock */
+static void clock_sleep_until(uint64_t deadline_ns)
+{
+    if (!clock_virtual) {
+        uint64_t now;
+        while (emu_app_running && (now = clock_now_ns()) < deadline_ns) {
+            uint64_t us = (deadline_ns - now + 999) / 1000;
+            if (us > 100000) us = 100000;
+            usleep((useconds_t)us);
+        }
+        return;
+    }
+
+    struct vc_sleeper s;
+    pthread_mutex_lock(&vc_mutex);
+    vc_block_locked(&s, &vc_cond, deadline_ns);
+    pthread_cleanup_push(vc_sleep_cleanup, &s);
+    while (!s.expired && !s.woken && emu_app_running) {
+        struct timespec ts;
+        cond_timeout_in(&ts, 100);
+        pthread_cond_timedwait(&vc_cond, &vc_mutex, &ts);
+    }
+    pthread_cleanup_pop(1);
+}
+
+/* Shim clock for other emulator modules (e.g. SD transfer timing) */
+uint64_t emu_freertos_now_ns(void)
+{
+    return clock_now_ns();
+}
+
+void emu_freertos_sleep_until_ns(uint64_t deadline_ns)
+{
+    clock_sleep_until(deadline_ns);
+}
+
+/* ================================================================
+ * ISR context — deferred wakeups for the *FromISR APIs
+ *
+ * A FromISR call never waits: it updates the object under its mutex
+ * and, if a task is blocked on it, records the condvar to wake in a
+ * pending list instead of signalling right away.  The list is flushed
+ * by portYIELD_FROM_ISR — the point where a real port would switch to
+ * the woken task — so a burst of posts from one ISR costs one wakeup
+ * per object.  It is also flushed when a task blocks, delays or exits,
+ * when a timer callback returns, and by blocked waiters once an entry
+ * has been pending for a tick, so a post whose ISR never yields is
+ * late by at most a tick or two rather than lost.
+ * ================================================================ */
+
+#define ISR_PENDING_MAX 16
+#define ISR_STALE_NS    ((uint64_t)portTICK_PERIOD_MS * 1000000ULL)
+
+struct isr_wake {
+    pthread_cond_t *cond;
+    int posts;            /* >1 means several waiters may be satisfied */
+    uint64_t posted_ns;   /* host time of the first post */
+};
+
+static pthread_mutex_t isr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct isr_wake isr_pending[ISR_PENDING_MAX];
+static volatile int isr_pending_count;
+
+/* Caller holds isr_mutex.  Wakes entries posted before <before_ns>;
+ * returns how many were woken. */
+static int isr_flush_locked(uint64_t before_ns)
+{
+    int keep = 0, woken = 0;
+    for (int i = 0; i < isr_pending_count; i++) {
+        struct isr_wake *w = &isr_pending[i];
+        if (w->posted_ns >= before_ns) {
+            isr_pending[keep++] = *w;
+            continue;
+        }
+        if (w->posts > 1)
+            emu_cond_broadcast(w->cond);
+        else
+            emu_cond_signal(w->cond);
+        woken++;
+    }
+    isr_pending_count = keep;
+    return woken;
+}
+
+static void isr_flush(void)
+{
+    if (!isr_pending_count) return;
+    pthread_mutex_lock(&isr_mutex);
+    isr_flush_locked(UINT64_MAX);
+    pthread_mutex_unlock(&isr_mutex);
+}
+
+/* Called by blocked waiters on each poll */
+static int isr_flush_stale(void)
+{
+    if (!isr_pending_count) return 0;
+    pthread_mutex_lock(&isr_mutex);
+    int woken = isr_flush_locked(mono_ns() - ISR_STALE_NS);
+    pthread_mutex_unlock(&isr_mutex);
+    return woken;
+}
+
+/* Waiter poll interval: one tick while wakeups are pending */
+static long isr_poll_ms(long ms)
+{
+    return isr_pending_count && ms > portTICK_PERIOD_MS ? portTICK_PERIOD_MS : ms;
+}
+
+/* Drop entries for a condvar about to be destroyed */
+static void isr_forget(pthread_cond_t *cond)
+{
+    pthread_mutex_lock(&isr_mutex);
+    int keep = 0;
+    for (int i = 0; i < isr_pending_count; i++) {
+        if (isr_pending[i].cond != cond)
+            isr_pending[keep++] = isr_pending[i];
+    }
+    isr_pending_count = keep;
+    pthread_mutex_unlock(&isr_mutex);
+}
+
+/* Caller holds the object mutex.  Returns pdTRUE if a task was waiting,
+ * i.e. the value FromISR APIs report through pxHigherPriorityTaskWoken. */
+static BaseType_t isr_defer_wake(pthread_cond_t *cond, int waiters)
+{
+    if (waiters <= 0) return pdFALSE;   /* nobody to wake */
+
+    pthread_mutex_lock(&isr_mutex);
+    for (int i = 0; i < isr_pending_count; i++) {
+        if (isr_pending[i].cond == cond) {
+            isr_pending[i].posts++;
+            pthread_mutex_unlock(&isr_mutex);
+            return pdTRUE;
+        }
+    }
+    if (isr_pending_count == ISR_PENDING_MAX)
+        isr_flush_locked(UINT64_MAX);
+    isr_pending[isr_pending_count].cond = cond;
+    isr_pending[isr_pending_count].posts = 1;
+    isr_pending[isr_pending_count].posted_ns = mono_ns();
+    isr_pending_count++;
+    pthread_mutex_unlock(&isr_mutex);
+    return pdTRUE;
+}
+
+void emu_yield_from_isr(BaseType_t xHigherPriorityTaskWoken)
+{
+    (void)xHigherPriorityTaskWoken;   /* flush regardless: never lose a wake */
+    isr_flush();
 }
 
 /* ================================================================
@@ -65,14 +444,21 @@ TickType_t xTaskGetTickCount(void)
  *
  * Computes the absolute deadline once, then loops with 100ms chunks
  * checking emu_app_running between sleeps. This avoids resetting
- * the timeout on spurious wakeups.
+ * the timeout on spurious wakeups.  In virtual mode the deadline is
+ * delivered by the clock advance instead of a condvar timeout.
  *
- * Returns 0 if signaled, ETIMEDOUT if deadline passed.
+ * Returns 0 if signaled, ETIMEDOUT if deadline passed.  Delivering
+ * stale ISR wakeups also returns 0 (the target may be this waiter),
+ * so callers re-check their predicate in a loop.
+ *
+ * On shutdown the thread exits with <mutex> still held, the same state
+ * a cancelled pthread_cond_timedwait() leaves it in (vTaskDelete), so
+ * callers release it from one cleanup handler for both paths.
  * ================================================================ */
 
 struct emu_deadline {
-    int infinite;        /* true if portMAX_DELAY */
-    struct timespec ts;  /* absolute CLOCK_REALTIME deadline */
+    int infinite;         /* true if portMAX_DELAY */
+    uint64_t ns;          /* absolute deadline on the shim clock */
 };
 
 static void deadline_init(struct emu_deadline *dl, TickType_t ticks)
@@ -81,50 +467,391 @@ static void deadline_init(struct emu_deadline *dl, TickType_t ticks)
         dl->infinite = 1;
     } else {
         dl->infinite = 0;
-        clock_gettime(CLOCK_REALTIME, &dl->ts);
-        dl->ts.tv_sec  += ticks / 1000;
-        dl->ts.tv_nsec += (long)(ticks % 1000) * 1000000L;
-        if (dl->ts.tv_nsec >= 1000000000L) {
-            dl->ts.tv_sec++;
-            dl->ts.tv_nsec -= 1000000000L;
-        }
+        dl->ns = clock_now_ns() + (uint64_t)ticks * 1000000ULL;
+    }
+}
+
+static int cond_wait_virtual(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                             struct emu_deadline *dl)
+{
+    struct vc_sleeper s;
+    volatile int ret = 0;   /* set inside the cleanup (setjmp) region */
+
+    pthread_mutex_lock(&vc_mutex);
+    vc_block_locked(&s, cond, dl->infinite ? UINT64_MAX : dl->ns);
+    pthread_mutex_unlock(&vc_mutex);
+
+    pthread_cleanup_push(vc_unblock_cleanup, &s);
+    for (;;) {
+        if (!emu_app_running)
+            pthread_exit(NULL);
+
+        pthread_mutex_lock(&vc_mutex);
+        int expired = s.expired, woken = s.woken;
+        pthread_mutex_unlock(&vc_mutex);
+        if (expired) { ret = ETIMEDOUT; break; }
+        if (woken) break;
+
+        /* Short poll covers a clock advance racing with our wait entry */
+        struct timespec ts;
+        cond_timeout_in(&ts, isr_poll_ms(VC_POLL_MS));
+        if (pthread_cond_timedwait(cond, mutex, &ts) == 0 || isr_flush_stale()) break;
     }
+    pthread_cleanup_pop(1);
+    return ret;
 }
 
 static int cond_wait_deadline(pthread_cond_t *cond, pthread_mutex_t *mutex,
                               struct emu_deadline *dl)
 {
+    isr_flush();
+    if (clock_virtual)
+        return cond_wait_virtual(cond, mutex, dl);
+
     for (;;) {
-        if (!emu_app_running) {
-            pthread_mutex_unlock(mutex);
+        if (!emu_app_running)
             pthread_exit(NULL);
-        }
 
         /* Compute wait point: min(now + 100ms, deadline) */
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-
+        uint64_t wait_ms = 100;
         if (!dl->infinite) {
+            uint64_t now = clock_now_ns();
             /* Check if deadline already passed */
-            if (ts.tv_sec > dl->ts.tv_sec ||
-                (ts.tv_sec == dl->ts.tv_sec && ts.tv_nsec >= dl->ts.tv_nsec))
+            if (now >= dl->ns)
                 return ETIMEDOUT;
+            uint64_t left_ms = (dl->ns - now + 999999) / 1000000;
+            if (left_ms < wait_ms) wait_ms = left_ms;
         }
 
-        ts.tv_nsec += 100000000L;  /* +100ms */
-        if (ts.tv_nsec >= 1000000000L) {
-            ts.tv_sec++;
-            ts.tv_nsec -= 1000000000L;
+        struct timespec ts;
+        cond_timeout_in(&ts, isr_poll_ms((long)wait_ms));
+        int ret = pthread_cond_timedwait(cond, mutex, &ts);
+        if (ret == 0 || isr_flush_stale()) return 0;
+    }
+}
+
+static void mutex_unlock_cleanup(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void waiter_count_cleanup(void *arg)
+{
+    (*(int *)arg)--;
+}
+
+/* cond_wait_deadline() that keeps *waiters (the number of tasks blocked
+ * on the object) accurate, for the FromISR woken-task flag */
+static int cond_wait_counted(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                             struct emu_deadline *dl, int *waiters)
+{
+    int ret;
+    (*waiters)++;
+    pthread_cleanup_push(mutex_unlock_cleanup, mutex);
+    pthread_cleanup_push(waiter_count_cleanup, waiters);
+    ret = cond_wait_deadline(cond, mutex, dl);
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(0);
+    return ret;
+}
+
+/* ---- Service threads for other emulator modules (esp_timer) ---- */
+
+struct svc_start {
+    void *(*fn)(void *);
+    void *arg;
+};
+
+static void *svc_thread_entry(void *p)
+{
+    struct svc_start st = *(struct svc_start *)p;
+    free(p);
+    vc_adopt_self();
+    return st.fn(st.arg);
+}
+
+/* pthread_create() for a thread that counts towards virtual time, so
+ * the clock never jumps past a deadline it is waiting for */
+int emu_freertos_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    struct svc_start *st = malloc(sizeof(*st));
+    if (!st) return -1;
+    st->fn = fn;
+    st->arg = arg;
+    vc_thread_starting();
+    if (pthread_create(thread, NULL, svc_thread_entry, st) != 0) {
+        if (clock_virtual) vc_thread_exit(NULL);
+        free(st);
+        return -1;
+    }
+    return 0;
+}
+
+void emu_freertos_cond_init(pthread_cond_t *cond)
+{
+    emu_cond_init(cond);
+}
+
+void emu_freertos_cond_signal(pthread_cond_t *cond)
+{
+    emu_cond_signal(cond);
+}
+
+/* Wait on <cond> until signalled or <deadline_ns> on the shim clock
+ * (UINT64_MAX: no deadline).  Exits the thread with <mutex> held once
+ * the app stops, like every shim wait. */
+int emu_freertos_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                                 uint64_t deadline_ns)
+{
+    struct emu_deadline dl = { deadline_ns == UINT64_MAX, deadline_ns };
+    return cond_wait_deadline(cond, mutex, &dl);
+}
+
+/* ================================================================
+ * Object pools — slab free lists per kernel-object type
+ *
+ * Semaphores, queues, event groups, software timers and task start
+ * records come from per-type pools instead of individual calloc()/free()
+ * calls.  A pool grows a slab of POOL_SLAB_OBJS objects at a time and
+ * never returns memory to the host; freed objects go back on the pool's
+ * free list.
+ * Queues carry their ring storage inline, so they are drawn from
+ * power-of-two size classes; anything above the largest class falls
+ * back to malloc.  Each pool keeps a live count for leak checks.
+ * ================================================================ */
+
+#define POOL_SLAB_OBJS   32
+
+struct pool_free {
+    struct pool_free *next;
+};
+
+struct emu_pool {
+    pthread_mutex_t mutex;
+    size_t obj_size;
+    struct pool_free *free_list;
+    int live;
+    int slabs;
+};
+
+#define POOL_INIT(size) { PTHREAD_MUTEX_INITIALIZER, (size), NULL, 0, 0 }
+
+/* Round up so every object in a slab stays pointer-aligned */
+static size_t pool_obj_size(size_t size)
+{
+    size_t align = sizeof(void *) * 2;
+    if (size < sizeof(struct pool_free))
+        size = sizeof(struct pool_free);
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* Returns a zeroed object, or NULL if the host is out of memory */
+static void *pool_alloc(struct emu_pool *p)
+{
+    size_t size = pool_obj_size(p->obj_size);
+
+    pthread_mutex_lock(&p->mutex);
+    if (!p->free_list) {
+        uint8_t *slab = malloc(size * POOL_SLAB_OBJS);
+        if (!slab) {
+            pthread_mutex_unlock(&p->mutex);
+            return NULL;
+        }
+        for (int i = POOL_SLAB_OBJS - 1; i >= 0; i--) {
+            struct pool_free *f = (struct pool_free *)(slab + (size_t)i * size);
+            f->next = p->free_list;
+            p->free_list = f;
         }
+        p->slabs++;
+    }
+    struct pool_free *f = p->free_list;
+    p->free_list = f->next;
+    p->live++;
+    pthread_mutex_unlock(&p->mutex);
 
-        if (!dl->infinite) {
-            if (ts.tv_sec > dl->ts.tv_sec ||
-                (ts.tv_sec == dl->ts.tv_sec && ts.tv_nsec > dl->ts.tv_nsec))
-                ts = dl->ts;
+    memset(f, 0, size);
+    return f;
+}
+
+static void pool_free(struct emu_pool *p, void *obj)
+{
+    struct pool_free *f = (struct pool_free *)obj;
+    pthread_mutex_lock(&p->mutex);
+    f->next = p->free_list;
+    p->free_list = f;
+    p->live--;
+    pthread_mutex_unlock(&p->mutex);
+}
+
+static int pool_live(struct emu_pool *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    int n = p->live;
+    pthread_mutex_unlock(&p->mutex);
+    return n;
+}
+
+/* ================================================================
+ * Object registry — live objects by creation site
+ *
+ * Every kernel object embeds an emu_obj_node that is linked into one
+ * global list while the object is alive.  The node records where the
+ * create call came from: the firmware caller when it is made from the
+ * flexe CPU thread, otherwise the first EMU_OBJ_FRAMES host frames
+ * starting at the create call's return address.  Symbol names are
+ * resolved only when reporting.
+ * ================================================================ */
+
+#define OBJ_REPORT_SITES 64
+#define OBJ_BT_MAX       (EMU_OBJ_FRAMES + 8)   /* room for shim frames */
+
+static const char *const obj_type_names[EMU_OBJ_TYPES] = {
+    "task", "semaphore", "queue", "event_group", "timer", "esp_timer",
+};
+
+static pthread_mutex_t obj_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct emu_obj_node obj_list = { &obj_list, &obj_list, { 0, { NULL } }, 0 };
+
+static uint32_t (*obj_guest_pc)(void);
+static int (*obj_guest_name)(uint32_t pc, char *buf, size_t len);
+
+void emu_obj_set_guest_hooks(uint32_t (*pc)(void),
+                             int (*name)(uint32_t pc, char *buf, size_t len))
+{
+    obj_guest_pc = pc;
+    obj_guest_name = name;
+}
+
+static void obj_where_capture(emu_obj_where_t *w, const void *site)
+{
+    memset(w, 0, sizeof(*w));
+    if (obj_guest_pc && (w->guest_pc = obj_guest_pc()) != 0)
+        return;
+
+    w->frames[0] = site;
+#ifndef _MSC_VER
+    /* Skip the shim's own frames: start at the create call's caller */
+    void *bt[OBJ_BT_MAX];
+    int n = backtrace(bt, OBJ_BT_MAX);
+    for (int i = 0; i < n; i++) {
+        if (bt[i] != site) continue;
+        for (int k = 0; k < EMU_OBJ_FRAMES && i + k < n; k++)
+            w->frames[k] = bt[i + k];
+        break;
+    }
+#endif
+}
+
+void emu_obj_register(struct emu_obj_node *node, int type, const void *site)
+{
+    node->type = type;
+    obj_where_capture(&node->where, site);
+    pthread_mutex_lock(&obj_mutex);
+    node->prev = obj_list.prev;
+    node->next = &obj_list;
+    obj_list.prev->next = node;
+    obj_list.prev = node;
+    pthread_mutex_unlock(&obj_mutex);
+}
+
+void emu_obj_unregister(struct emu_obj_node *node)
+{
+    pthread_mutex_lock(&obj_mutex);
+    if (node->next) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = NULL;
+    }
+    pthread_mutex_unlock(&obj_mutex);
+}
+
+int emu_obj_census(emu_obj_site_t *out, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&obj_mutex);
+    for (struct emu_obj_node *o = obj_list.next; o != &obj_list; o = o->next) {
+        int i;
+        for (i = 0; i < n; i++) {
+            if (out[i].type == o->type &&
+                memcmp(&out[i].where, &o->where, sizeof(o->where)) == 0) break;
+        }
+        if (i < n) {
+            out[i].count++;
+        } else if (n < max) {
+            out[n].type = o->type;
+            out[n].where = o->where;
+            out[n].count = 1;
+            n++;
         }
+    }
+    pthread_mutex_unlock(&obj_mutex);
+
+    /* Largest groups first (insertion sort — n is small) */
+    for (int i = 1; i < n; i++) {
+        emu_obj_site_t tmp = out[i];
+        int j = i;
+        while (j > 0 && out[j - 1].count < tmp.count) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = tmp;
+    }
+    return n;
+}
 
-        int ret = pthread_cond_timedwait(cond, mutex, &ts);
-        if (ret == 0) return 0;
+const char *emu_obj_type_name(int type)
+{
+    if (type < 0 || type >= EMU_OBJ_TYPES) return "?";
+    return obj_type_names[type];
+}
+
+static void obj_frame_name(const void *site, char *buf, size_t len)
+{
+#ifndef _MSC_VER
+    Dl_info info;
+    if (site && dladdr(site, &info) && info.dli_sname) {
+        snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+                 (unsigned long)((uintptr_t)site - (uintptr_t)info.dli_saddr));
+        return;
+    }
+#endif
+    snprintf(buf, len, "%p", site);
+}
+
+/* "fw:func+0x1c", or host frames innermost first: "a+0x10 < b+0x4 < ..." */
+void emu_obj_site_name(const emu_obj_where_t *where, char *buf, size_t len)
+{
+    if (where->guest_pc) {
+        char sym[96];
+        if (obj_guest_name && obj_guest_name(where->guest_pc, sym, sizeof(sym)))
+            snprintf(buf, len, "fw:%s", sym);
+        else
+            snprintf(buf, len, "fw:0x%08x", (unsigned)where->guest_pc);
+        return;
+    }
+
+    size_t pos = 0;
+    buf[0] = '\0';
+    for (int k = 0; k < EMU_OBJ_FRAMES && where->frames[k] && pos < len; k++) {
+        char frame[96];
+        obj_frame_name(where->frames[k], frame, sizeof(frame));
+        int w = snprintf(buf + pos, len - pos, "%s%s", k ? " < " : "", frame);
+        if (w < 0) break;
+        pos += (size_t)w;
+    }
+    if (!buf[0]) snprintf(buf, len, "?");
+}
+
+void emu_obj_report(void)
+{
+    emu_obj_site_t sites[OBJ_REPORT_SITES];
+    int n = emu_obj_census(sites, OBJ_REPORT_SITES);
+    for (int i = 0; i < n; i++) {
+        char where[256];
+        emu_obj_site_name(&sites[i].where, where, sizeof(where));
+        ESP_LOGW(TAG, "still alive: %d %s created at %s",
+                 sites[i].count, emu_obj_type_name(sites[i].type), where);
     }
 }
 
@@ -137,40 +864,52 @@ static int cond_wait_deadline(pthread_cond_t *cond, pthread_mutex_t *mutex,
 struct emu_task {
     pthread_t thread;
     int valid;
+    struct emu_obj_node obj;
 };
 
 static struct emu_task task_list[MAX_TASKS];
 static pthread_mutex_t task_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Caller holds task_list_mutex */
+static void task_slot_release(int idx)
+{
+    task_list[idx].valid = 0;
+    emu_obj_unregister(&task_list[idx].obj);
+}
+
 struct task_arg {
     TaskFunction_t func;
     void *param;
     int index;
 };
 
+static struct emu_pool task_arg_pool = POOL_INIT(sizeof(struct task_arg));
+
 static void *task_wrapper(void *arg)
 {
     struct task_arg *ta = (struct task_arg *)arg;
     TaskFunction_t func = ta->func;
     void *param = ta->param;
     int index = ta->index;
-    free(ta);
+    pool_free(&task_arg_pool, ta);
 
+    vc_adopt_self();
     func(param);
+    isr_flush();
 
     /* Task returned normally — mark as done */
     pthread_mutex_lock(&task_list_mutex);
-    task_list[index].valid = 0;
+    task_slot_release(index);
     pthread_mutex_unlock(&task_list_mutex);
     return NULL;
 }
 
-BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
-                       configSTACK_DEPTH_TYPE usStackDepth, void *pvParameters,
-                       UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask)
+static BaseType_t task_create(TaskFunction_t pvTaskCode, const char *pcName,
+                              void *pvParameters, TaskHandle_t *pxCreatedTask,
+                              const void *site)
 {
-    (void)usStackDepth;
-    (void)uxPriority;
+
+    vc_register_self();
 
     pthread_mutex_lock(&task_list_mutex);
     int idx = -1;
@@ -183,7 +922,7 @@ BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
         return pdFAIL;
     }
 
-    struct task_arg *ta = malloc(sizeof(*ta));
+    struct task_arg *ta = pool_alloc(&task_arg_pool);
     if (!ta) {
         pthread_mutex_unlock(&task_list_mutex);
         return pdFAIL;
@@ -192,13 +931,16 @@ BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
     ta->param = pvParameters;
     ta->index = idx;
 
+    vc_thread_starting();
     if (pthread_create(&task_list[idx].thread, NULL, task_wrapper, ta) != 0) {
-        free(ta);
+        if (clock_virtual) vc_thread_exit(NULL);
+        pool_free(&task_arg_pool, ta);
         pthread_mutex_unlock(&task_list_mutex);
         ESP_LOGE(TAG, "xTaskCreate: pthread_create failed");
         return pdFAIL;
     }
     task_list[idx].valid = 1;
+    emu_obj_register(&task_list[idx].obj, EMU_OBJ_TASK, site);
 
     if (pxCreatedTask)
         *pxCreatedTask = (TaskHandle_t)(uintptr_t)(idx + 1);  /* 1-based */
@@ -208,14 +950,26 @@ BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
     return pdPASS;
 }
 
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
+                       configSTACK_DEPTH_TYPE usStackDepth, void *pvParameters,
+                       UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask)
+{
+    (void)usStackDepth;
+    (void)uxPriority;
+    return task_create(pvTaskCode, pcName, pvParameters, pxCreatedTask,
+                       EMU_CALLER());
+}
+
 BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName,
                                     configSTACK_DEPTH_TYPE usStackDepth,
                                     void *pvParameters, UBaseType_t uxPriority,
                                     TaskHandle_t *pxCreatedTask, BaseType_t xCoreID)
 {
+    (void)usStackDepth;
+    (void)uxPriority;
     (void)xCoreID;
-    return xTaskCreate(pvTaskCode, pcName, usStackDepth, pvParameters,
-                       uxPriority, pxCreatedTask);
+    return task_create(pvTaskCode, pcName, pvParameters, pxCreatedTask,
+                       EMU_CALLER());
 }
 
 void vTaskDelete(TaskHandle_t xTask)
@@ -226,7 +980,7 @@ void vTaskDelete(TaskHandle_t xTask)
         pthread_mutex_lock(&task_list_mutex);
         for (int i = 0; i < MAX_TASKS; i++) {
             if (task_list[i].valid && pthread_equal(task_list[i].thread, self)) {
-                task_list[i].valid = 0;
+                task_slot_release(i);
                 pthread_detach(self);
                 pthread_mutex_unlock(&task_list_mutex);
                 pthread_exit(NULL);
@@ -244,15 +998,16 @@ void vTaskDelete(TaskHandle_t xTask)
     if (task_list[idx].valid) {
         pthread_cancel(task_list[idx].thread);
         pthread_join(task_list[idx].thread, NULL);
-        task_list[idx].valid = 0;
+        task_slot_release(idx);
     }
     pthread_mutex_unlock(&task_list_mutex);
 }
 
 void vTaskDelay(TickType_t xTicksToDelay)
 {
+    isr_flush();
     if (xTicksToDelay > 0)
-        usleep((useconds_t)xTicksToDelay * 1000);
+        clock_sleep_until(clock_now_ns() + (uint64_t)xTicksToDelay * 1000000ULL);
     if (!emu_app_running)
         pthread_exit(NULL);
 }
@@ -308,17 +1063,23 @@ struct emu_semaphore {
     int count;
     int max_count;
     int type;
+    int waiters;          /* tasks blocked in take */
     /* Recursive mutex tracking */
     pthread_t owner;
     int recurse_count;
+    struct emu_obj_node obj;
 };
 
-static SemaphoreHandle_t sem_create(int type, int initial, int max_count)
+static struct emu_pool sem_pool = POOL_INIT(sizeof(struct emu_semaphore));
+
+static SemaphoreHandle_t sem_create(int type, int initial, int max_count,
+                                    const void *site)
 {
-    struct emu_semaphore *s = calloc(1, sizeof(*s));
+    struct emu_semaphore *s = pool_alloc(&sem_pool);
     if (!s) return NULL;
+    emu_obj_register(&s->obj, EMU_OBJ_SEMAPHORE, site);
     pthread_mutex_init(&s->mutex, NULL);
-    pthread_cond_init(&s->cond, NULL);
+    emu_cond_init(&s->cond);
     s->count = initial;
     s->max_count = max_count;
     s->type = type;
@@ -327,23 +1088,24 @@ static SemaphoreHandle_t sem_create(int type, int initial, int max_count)
 
 SemaphoreHandle_t xSemaphoreCreateMutex(void)
 {
-    return sem_create(SEM_MUTEX, 1, 1);
+    return sem_create(SEM_MUTEX, 1, 1, EMU_CALLER());
 }
 
 SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
 {
-    return sem_create(SEM_RECURSIVE, 1, 1);
+    return sem_create(SEM_RECURSIVE, 1, 1, EMU_CALLER());
 }
 
 SemaphoreHandle_t xSemaphoreCreateBinary(void)
 {
-    return sem_create(SEM_BINARY, 0, 1);
+    return sem_create(SEM_BINARY, 0, 1, EMU_CALLER());
 }
 
 SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount,
                                             UBaseType_t uxInitialCount)
 {
-    return sem_create(SEM_COUNTING, (int)uxInitialCount, (int)uxMaxCount);
+    return sem_create(SEM_COUNTING, (int)uxInitialCount, (int)uxMaxCount,
+                      EMU_CALLER());
 }
 
 BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xTicksToWait)
@@ -370,8 +1132,10 @@ BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xTicksToWait)
     struct emu_deadline dl;
     deadline_init(&dl, xTicksToWait);
 
+    /* Re-check on timeout: a give racing the deadline still counts */
     while (s->count <= 0) {
-        if (cond_wait_deadline(&s->cond, &s->mutex, &dl) == ETIMEDOUT) {
+        if (cond_wait_counted(&s->cond, &s->mutex, &dl, &s->waiters) == ETIMEDOUT &&
+            s->count <= 0) {
             pthread_mutex_unlock(&s->mutex);
             return pdFALSE;
         }
@@ -392,7 +1156,7 @@ BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
         return pdFAIL;
     }
     s->count++;
-    pthread_cond_signal(&s->cond);
+    emu_cond_signal(&s->cond);
     pthread_mutex_unlock(&s->mutex);
     return pdTRUE;
 }
@@ -431,7 +1195,8 @@ BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t xSemaphore,
     deadline_init(&dl, xTicksToWait);
 
     while (s->count <= 0) {
-        if (cond_wait_deadline(&s->cond, &s->mutex, &dl) == ETIMEDOUT) {
+        if (cond_wait_counted(&s->cond, &s->mutex, &dl, &s->waiters) == ETIMEDOUT &&
+            s->count <= 0) {
             pthread_mutex_unlock(&s->mutex);
             return pdFALSE;
         }
@@ -453,7 +1218,7 @@ BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t xSemaphore)
         s->recurse_count--;
         if (s->recurse_count == 0) {
             s->count++;
-            pthread_cond_signal(&s->cond);
+            emu_cond_signal(&s->cond);
         }
     }
     pthread_mutex_unlock(&s->mutex);
@@ -463,17 +1228,38 @@ BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t xSemaphore)
 BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t xSemaphore,
                                   BaseType_t *pxHigherPriorityTaskWoken)
 {
-    if (pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdFALSE;
-    return xSemaphoreGive(xSemaphore);
+    struct emu_semaphore *s = (struct emu_semaphore *)xSemaphore;
+    if (!s) return pdFAIL;
+
+    pthread_mutex_lock(&s->mutex);
+    if (s->count >= s->max_count) {
+        pthread_mutex_unlock(&s->mutex);
+        return pdFAIL;
+    }
+    s->count++;
+    BaseType_t woken = isr_defer_wake(&s->cond, s->waiters);
+    pthread_mutex_unlock(&s->mutex);
+
+    if (woken && pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdTRUE;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeFromISR(SemaphoreHandle_t xSemaphore,
+                                  BaseType_t *pxHigherPriorityTaskWoken)
+{
+    (void)pxHigherPriorityTaskWoken;   /* nothing blocks on a give */
+    return xSemaphoreTake(xSemaphore, 0);
 }
 
 void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
 {
     struct emu_semaphore *s = (struct emu_semaphore *)xSemaphore;
     if (!s) return;
+    emu_obj_unregister(&s->obj);
+    isr_forget(&s->cond);
     pthread_mutex_destroy(&s->mutex);
     pthread_cond_destroy(&s->cond);
-    free(s);
+    pool_free(&sem_pool, s);
 }
 
 /* ================================================================
@@ -490,18 +1276,60 @@ struct emu_queue {
     size_t head;          /* next write position */
     size_t tail;          /* next read position */
     size_t count;         /* items currently in queue */
+    int recv_waiters;     /* tasks blocked in receive/peek */
+    int send_waiters;     /* tasks blocked in send */
+    int size_class;       /* queue_pools index, or -1 if malloc'd */
+    struct emu_obj_node obj;
+    uint8_t storage[];    /* ring storage, allocated inline */
 };
 
+/* Size classes start at the first power of two above the queue header
+ * (256 B on 64-bit Linux); anything smaller could never be used */
+#define QUEUE_HDR_SIZE   sizeof(struct emu_queue)
+#define QUEUE_POOL_MIN   (QUEUE_HDR_SIZE < 128 ? 128 : QUEUE_HDR_SIZE < 256 ? 256 : \
+                          QUEUE_HDR_SIZE < 512 ? 512 : 1024)
+#define QUEUE_POOL_CLASSES 8     /* QUEUE_POOL_MIN .. QUEUE_POOL_MIN << 7 */
+
+static struct emu_pool queue_pools[QUEUE_POOL_CLASSES] = {
+    POOL_INIT(QUEUE_POOL_MIN << 0), POOL_INIT(QUEUE_POOL_MIN << 1),
+    POOL_INIT(QUEUE_POOL_MIN << 2), POOL_INIT(QUEUE_POOL_MIN << 3),
+    POOL_INIT(QUEUE_POOL_MIN << 4), POOL_INIT(QUEUE_POOL_MIN << 5),
+    POOL_INIT(QUEUE_POOL_MIN << 6), POOL_INIT(QUEUE_POOL_MIN << 7),
+};
+static int queue_heap_live = 0;   /* oversized queues, malloc fallback */
+static pthread_mutex_t queue_heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize)
 {
-    struct emu_queue *q = calloc(1, sizeof(*q));
+    size_t item = uxItemSize > 0 ? uxItemSize : 1;
+    if (uxQueueLength > 0 && item > (SIZE_MAX - sizeof(struct emu_queue)) / uxQueueLength)
+        return NULL;
+    size_t total = sizeof(struct emu_queue) + item * uxQueueLength;
+
+    struct emu_queue *q = NULL;
+    int cls = -1;
+    for (int i = 0; i < QUEUE_POOL_CLASSES; i++) {
+        if (total <= queue_pools[i].obj_size) { cls = i; break; }
+    }
+    if (cls >= 0) {
+        q = pool_alloc(&queue_pools[cls]);
+    } else {
+        q = calloc(1, total);
+        if (q) {
+            pthread_mutex_lock(&queue_heap_mutex);
+            queue_heap_live++;
+            pthread_mutex_unlock(&queue_heap_mutex);
+        }
+    }
     if (!q) return NULL;
+    emu_obj_register(&q->obj, EMU_OBJ_QUEUE, EMU_CALLER());
     pthread_mutex_init(&q->mutex, NULL);
-    pthread_cond_init(&q->cond_recv, NULL);
-    pthread_cond_init(&q->cond_send, NULL);
+    emu_cond_init(&q->cond_recv);
+    emu_cond_init(&q->cond_send);
     q->item_size = uxItemSize;
     q->capacity = uxQueueLength;
-    q->buffer = calloc(uxQueueLength, uxItemSize > 0 ? uxItemSize : 1);
+    q->size_class = cls;
+    q->buffer = q->storage;
     return (QueueHandle_t)q;
 }
 
@@ -521,7 +1349,9 @@ BaseType_t xQueueSendToBack(QueueHandle_t xQueue, const void *pvItemToQueue,
         struct emu_deadline dl;
         deadline_init(&dl, xTicksToWait);
         while (q->count >= q->capacity) {
-            if (cond_wait_deadline(&q->cond_send, &q->mutex, &dl) == ETIMEDOUT) {
+            if (cond_wait_counted(&q->cond_send, &q->mutex, &dl,
+                                  &q->send_waiters) == ETIMEDOUT &&
+                q->count >= q->capacity) {
                 pthread_mutex_unlock(&q->mutex);
                 return pdFALSE;
             }
@@ -532,7 +1362,7 @@ BaseType_t xQueueSendToBack(QueueHandle_t xQueue, const void *pvItemToQueue,
         memcpy(q->buffer + q->head * q->item_size, pvItemToQueue, q->item_size);
     q->head = (q->head + 1) % q->capacity;
     q->count++;
-    pthread_cond_signal(&q->cond_recv);
+    emu_cond_signal(&q->cond_recv);
     pthread_mutex_unlock(&q->mutex);
     return pdTRUE;
 }
@@ -559,7 +1389,9 @@ BaseType_t xQueueSendToFront(QueueHandle_t xQueue, const void *pvItemToQueue,
         struct emu_deadline dl;
         deadline_init(&dl, xTicksToWait);
         while (q->count >= q->capacity) {
-            if (cond_wait_deadline(&q->cond_send, &q->mutex, &dl) == ETIMEDOUT) {
+            if (cond_wait_counted(&q->cond_send, &q->mutex, &dl,
+                                  &q->send_waiters) == ETIMEDOUT &&
+                q->count >= q->capacity) {
                 pthread_mutex_unlock(&q->mutex);
                 return pdFALSE;
             }
@@ -570,7 +1402,7 @@ BaseType_t xQueueSendToFront(QueueHandle_t xQueue, const void *pvItemToQueue,
     if (q->item_size > 0 && pvItemToQueue)
         memcpy(q->buffer + q->tail * q->item_size, pvItemToQueue, q->item_size);
     q->count++;
-    pthread_cond_signal(&q->cond_recv);
+    emu_cond_signal(&q->cond_recv);
     pthread_mutex_unlock(&q->mutex);
     return pdTRUE;
 }
@@ -590,7 +1422,7 @@ BaseType_t xQueueOverwrite(QueueHandle_t xQueue, const void *pvItemToQueue)
         memcpy(q->buffer + q->head * q->item_size, pvItemToQueue, q->item_size);
     q->head = (q->head + 1) % q->capacity;
     q->count++;
-    pthread_cond_signal(&q->cond_recv);
+    emu_cond_signal(&q->cond_recv);
     pthread_mutex_unlock(&q->mutex);
     return pdTRUE;
 }
@@ -611,7 +1443,9 @@ BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer,
         struct emu_deadline dl;
         deadline_init(&dl, xTicksToWait);
         while (q->count == 0) {
-            if (cond_wait_deadline(&q->cond_recv, &q->mutex, &dl) == ETIMEDOUT) {
+            if (cond_wait_counted(&q->cond_recv, &q->mutex, &dl,
+                                  &q->recv_waiters) == ETIMEDOUT &&
+                q->count == 0) {
                 pthread_mutex_unlock(&q->mutex);
                 return pdFALSE;
             }
@@ -622,7 +1456,7 @@ BaseType_t xQueueReceive(QueueHandle_t xQueue, void *pvBuffer,
         memcpy(pvBuffer, q->buffer + q->tail * q->item_size, q->item_size);
     q->tail = (q->tail + 1) % q->capacity;
     q->count--;
-    pthread_cond_signal(&q->cond_send);
+    emu_cond_signal(&q->cond_send);
     pthread_mutex_unlock(&q->mutex);
     return pdTRUE;
 }
@@ -643,7 +1477,9 @@ BaseType_t xQueuePeek(QueueHandle_t xQueue, void *pvBuffer,
         struct emu_deadline dl;
         deadline_init(&dl, xTicksToWait);
         while (q->count == 0) {
-            if (cond_wait_deadline(&q->cond_recv, &q->mutex, &dl) == ETIMEDOUT) {
+            if (cond_wait_counted(&q->cond_recv, &q->mutex, &dl,
+                                  &q->recv_waiters) == ETIMEDOUT &&
+                q->count == 0) {
                 pthread_mutex_unlock(&q->mutex);
                 return pdFALSE;
             }
@@ -685,7 +1521,7 @@ BaseType_t xQueueReset(QueueHandle_t xQueue)
     q->head = 0;
     q->tail = 0;
     q->count = 0;
-    pthread_cond_broadcast(&q->cond_send);
+    emu_cond_broadcast(&q->cond_send);
     pthread_mutex_unlock(&q->mutex);
     return pdPASS;
 }
@@ -694,43 +1530,175 @@ void vQueueDelete(QueueHandle_t xQueue)
 {
     struct emu_queue *q = (struct emu_queue *)xQueue;
     if (!q) return;
+    emu_obj_unregister(&q->obj);
+    isr_forget(&q->cond_recv);
+    isr_forget(&q->cond_send);
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->cond_recv);
     pthread_cond_destroy(&q->cond_send);
-    free(q->buffer);
-    free(q);
+    if (q->size_class >= 0) {
+        pool_free(&queue_pools[q->size_class], q);
+    } else {
+        pthread_mutex_lock(&queue_heap_mutex);
+        queue_heap_live--;
+        pthread_mutex_unlock(&queue_heap_mutex);
+        free(q);
+    }
+}
+
+/* Shared by the FromISR send variants: never waits for space */
+static BaseType_t queue_send_isr(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                 BaseType_t *pxHigherPriorityTaskWoken,
+                                 int front, int overwrite)
+{
+    struct emu_queue *q = (struct emu_queue *)xQueue;
+    if (!q) return pdFAIL;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->count >= q->capacity) {
+        if (!overwrite) {
+            pthread_mutex_unlock(&q->mutex);
+            return pdFALSE;   /* errQUEUE_FULL */
+        }
+        /* Discard oldest item */
+        q->tail = (q->tail + 1) % q->capacity;
+        q->count--;
+    }
+    if (front) {
+        q->tail = (q->tail == 0) ? q->capacity - 1 : q->tail - 1;
+        if (q->item_size > 0 && pvItemToQueue)
+            memcpy(q->buffer + q->tail * q->item_size, pvItemToQueue, q->item_size);
+    } else {
+        if (q->item_size > 0 && pvItemToQueue)
+            memcpy(q->buffer + q->head * q->item_size, pvItemToQueue, q->item_size);
+        q->head = (q->head + 1) % q->capacity;
+    }
+    q->count++;
+    BaseType_t woken = isr_defer_wake(&q->cond_recv, q->recv_waiters);
+    pthread_mutex_unlock(&q->mutex);
+
+    if (woken && pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdTRUE;
+    return pdTRUE;
 }
 
 BaseType_t xQueueSendFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
                               BaseType_t *pxHigherPriorityTaskWoken)
 {
-    if (pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdFALSE;
-    return xQueueSendToBack(xQueue, pvItemToQueue, 0);
+    return queue_send_isr(xQueue, pvItemToQueue, pxHigherPriorityTaskWoken, 0, 0);
+}
+
+BaseType_t xQueueSendToBackFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                    BaseType_t *pxHigherPriorityTaskWoken)
+{
+    return queue_send_isr(xQueue, pvItemToQueue, pxHigherPriorityTaskWoken, 0, 0);
+}
+
+BaseType_t xQueueSendToFrontFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                     BaseType_t *pxHigherPriorityTaskWoken)
+{
+    return queue_send_isr(xQueue, pvItemToQueue, pxHigherPriorityTaskWoken, 1, 0);
+}
+
+BaseType_t xQueueOverwriteFromISR(QueueHandle_t xQueue, const void *pvItemToQueue,
+                                   BaseType_t *pxHigherPriorityTaskWoken)
+{
+    return queue_send_isr(xQueue, pvItemToQueue, pxHigherPriorityTaskWoken, 0, 1);
 }
 
 BaseType_t xQueueReceiveFromISR(QueueHandle_t xQueue, void *pvBuffer,
                                  BaseType_t *pxHigherPriorityTaskWoken)
 {
-    if (pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdFALSE;
-    return xQueueReceive(xQueue, pvBuffer, 0);
+    struct emu_queue *q = (struct emu_queue *)xQueue;
+    if (!q) return pdFAIL;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->mutex);
+        return pdFALSE;
+    }
+    if (q->item_size > 0 && pvBuffer)
+        memcpy(pvBuffer, q->buffer + q->tail * q->item_size, q->item_size);
+    q->tail = (q->tail + 1) % q->capacity;
+    q->count--;
+    BaseType_t woken = isr_defer_wake(&q->cond_send, q->send_waiters);
+    pthread_mutex_unlock(&q->mutex);
+
+    if (woken && pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdTRUE;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t xQueue)
+{
+    return uxQueueMessagesWaiting(xQueue);
 }
 
 /* ================================================================
- * Event Groups — bitmask with condvar
+ * Event Groups — bitmask with per-waiter wait records
+ *
+ * Each blocked xEventGroupWaitBits() links a wait record (mask,
+ * wait-all, clear-on-exit, private condvar) into the group.  Set-bits
+ * walks the list and wakes only the waiters whose condition is met,
+ * clearing their bits on their behalf — as FreeRTOS does — instead of
+ * broadcasting to every waiter on the group.
  * ================================================================ */
 
+struct eg_waiter {
+    struct eg_waiter *next;
+    pthread_cond_t cond;
+    EventBits_t mask;
+    int wait_all;
+    int clear_on_exit;
+    int done;             /* set by xEventGroupSetBits when satisfied */
+    EventBits_t result;   /* group bits at the moment of satisfaction */
+};
+
 struct emu_event_group {
     pthread_mutex_t mutex;
-    pthread_cond_t  cond;
     EventBits_t bits;
+    struct eg_waiter *waiters;
+    struct emu_obj_node obj;
+};
+
+static struct emu_pool eg_pool = POOL_INIT(sizeof(struct emu_event_group));
+
+static int eg_bits_match(EventBits_t bits, EventBits_t mask, int wait_all)
+{
+    EventBits_t match = bits & mask;
+    return wait_all ? (match == mask) : (match != 0);
+}
+
+static void eg_unlink_waiter(struct emu_event_group *eg, struct eg_waiter *w)
+{
+    for (struct eg_waiter **pp = &eg->waiters; *pp; pp = &(*pp)->next) {
+        if (*pp == w) {
+            *pp = w->next;
+            return;
+        }
+    }
+}
+
+struct eg_wait_ctx {
+    struct emu_event_group *eg;
+    struct eg_waiter *w;
 };
 
+/* Runs with eg->mutex held if the waiter exits on shutdown or is
+ * cancelled by vTaskDelete inside cond_wait_deadline */
+static void eg_wait_cleanup(void *arg)
+{
+    struct eg_wait_ctx *ctx = (struct eg_wait_ctx *)arg;
+    if (!ctx->w->done)
+        eg_unlink_waiter(ctx->eg, ctx->w);
+    pthread_mutex_unlock(&ctx->eg->mutex);
+    pthread_cond_destroy(&ctx->w->cond);
+}
+
 EventGroupHandle_t xEventGroupCreate(void)
 {
-    struct emu_event_group *eg = calloc(1, sizeof(*eg));
+    struct emu_event_group *eg = pool_alloc(&eg_pool);
     if (!eg) return NULL;
+    emu_obj_register(&eg->obj, EMU_OBJ_EVENT_GROUP, EMU_CALLER());
     pthread_mutex_init(&eg->mutex, NULL);
-    pthread_cond_init(&eg->cond, NULL);
     return (EventGroupHandle_t)eg;
 }
 
@@ -741,8 +1709,26 @@ EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup,
     if (!eg) return 0;
     pthread_mutex_lock(&eg->mutex);
     eg->bits |= uxBitsToSet;
+
+    /* All waiters are tested against the same value; clears are
+     * accumulated and applied once at the end. */
+    EventBits_t to_clear = 0;
+    struct eg_waiter **pp = &eg->waiters;
+    while (*pp) {
+        struct eg_waiter *w = *pp;
+        if (!eg_bits_match(eg->bits, w->mask, w->wait_all)) {
+            pp = &w->next;
+            continue;
+        }
+        *pp = w->next;
+        w->result = eg->bits;
+        w->done = 1;
+        if (w->clear_on_exit) to_clear |= w->mask;
+        emu_cond_signal(&w->cond);
+    }
+    eg->bits &= ~to_clear;
+
     EventBits_t result = eg->bits;
-    pthread_cond_broadcast(&eg->cond);
     pthread_mutex_unlock(&eg->mutex);
     return result;
 }
@@ -781,10 +1767,7 @@ EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup,
     pthread_mutex_lock(&eg->mutex);
 
     /* Check immediately */
-    EventBits_t match = eg->bits & uxBitsToWaitFor;
-    int satisfied = xWaitForAllBits ? (match == uxBitsToWaitFor) : (match != 0);
-
-    if (satisfied) {
+    if (eg_bits_match(eg->bits, uxBitsToWaitFor, xWaitForAllBits)) {
         EventBits_t result = eg->bits;
         if (xClearOnExit) eg->bits &= ~uxBitsToWaitFor;
         pthread_mutex_unlock(&eg->mutex);
@@ -797,119 +1780,121 @@ EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup,
         return result;
     }
 
+    /* Link a wait record; xEventGroupSetBits completes it for us */
+    struct eg_waiter w;
+    memset(&w, 0, sizeof(w));
+    emu_cond_init(&w.cond);
+    w.mask = uxBitsToWaitFor;
+    w.wait_all = xWaitForAllBits ? 1 : 0;
+    w.clear_on_exit = xClearOnExit ? 1 : 0;
+    w.next = eg->waiters;
+    eg->waiters = &w;
+
     struct emu_deadline dl;
     deadline_init(&dl, xTicksToWait);
 
-    for (;;) {
-        if (cond_wait_deadline(&eg->cond, &eg->mutex, &dl) == ETIMEDOUT) {
-            EventBits_t result = eg->bits;
-            pthread_mutex_unlock(&eg->mutex);
-            return result;
-        }
-
-        match = eg->bits & uxBitsToWaitFor;
-        satisfied = xWaitForAllBits ? (match == uxBitsToWaitFor) : (match != 0);
-        if (satisfied) {
-            EventBits_t result = eg->bits;
-            if (xClearOnExit) eg->bits &= ~uxBitsToWaitFor;
-            pthread_mutex_unlock(&eg->mutex);
-            return result;
+    struct eg_wait_ctx ctx = { eg, &w };
+    EventBits_t result;
+    pthread_cleanup_push(eg_wait_cleanup, &ctx);
+    while (!w.done) {
+        if (cond_wait_deadline(&w.cond, &eg->mutex, &dl) == ETIMEDOUT) {
+            if (w.done) break;  /* satisfied right at the deadline */
+            eg_unlink_waiter(eg, &w);
+            break;
         }
     }
+    result = w.done ? w.result : eg->bits;
+    pthread_mutex_unlock(&eg->mutex);
+    pthread_cleanup_pop(0);
+
+    pthread_cond_destroy(&w.cond);
+    return result;
 }
 
 void vEventGroupDelete(EventGroupHandle_t xEventGroup)
 {
     struct emu_event_group *eg = (struct emu_event_group *)xEventGroup;
     if (!eg) return;
+    emu_obj_unregister(&eg->obj);
     pthread_mutex_destroy(&eg->mutex);
-    pthread_cond_destroy(&eg->cond);
-    free(eg);
+    pool_free(&eg_pool, eg);
 }
 
 /* ================================================================
  * Software Timers — dedicated timer thread
  * ================================================================ */
 
-#define MAX_TIMERS 16
-
 struct emu_timer {
+    struct emu_timer *next;   /* timer_list link */
     char name[16];
     TickType_t period;
     int auto_reload;
     void *timer_id;
     TimerCallbackFunction_t callback;
     int active;
+    int in_use;           /* cleared by xTimerDelete; stale handles fail */
     uint64_t next_fire_ms;
+    struct emu_obj_node obj;
 };
 
-static struct emu_timer timers[MAX_TIMERS];
-static int timer_count = 0;
+static struct emu_pool timer_pool = POOL_INIT(sizeof(struct emu_timer));
+static struct emu_timer *timer_list;  /* live timers, under timer_mutex */
 static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t timer_cond;  /* initialized with the timer thread */
 static pthread_t timer_thread_id;
 static int timer_thread_started = 0;
 
+/* Caller holds timer_mutex */
+static struct emu_timer *timer_get(TimerHandle_t xTimer)
+{
+    struct emu_timer *t = (struct emu_timer *)xTimer;
+    return (t && t->in_use) ? t : NULL;
+}
+
 static void *timer_thread_func(void *arg)
 {
     (void)arg;
+    vc_adopt_self();
     pthread_mutex_lock(&timer_mutex);
 
     while (emu_app_running) {
         /* Find earliest active timer */
         uint64_t earliest = UINT64_MAX;
-        for (int i = 0; i < timer_count; i++) {
-            if (timers[i].active && timers[i].next_fire_ms < earliest)
-                earliest = timers[i].next_fire_ms;
+        for (struct emu_timer *t = timer_list; t; t = t->next) {
+            if (t->active && t->next_fire_ms < earliest)
+                earliest = t->next_fire_ms;
         }
 
-        if (earliest == UINT64_MAX) {
-            /* No active timers — sleep in 100ms chunks */
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += 100000000L;
-            if (ts.tv_nsec >= 1000000000L) {
-                ts.tv_sec++;
-                ts.tv_nsec -= 1000000000L;
-            }
-            pthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
+        /* Sleep until the earliest fire time, or until a timer changes */
+        if (earliest == UINT64_MAX || now_ms() < earliest) {
+            struct emu_deadline dl;
+            dl.infinite = (earliest == UINT64_MAX);
+            dl.ns = dl.infinite ? 0 : earliest * 1000000ULL;
+            pthread_cleanup_push(mutex_unlock_cleanup, &timer_mutex);
+            cond_wait_deadline(&timer_cond, &timer_mutex, &dl);
+            pthread_cleanup_pop(0);
             continue;
         }
 
-        uint64_t now = now_ms();
-        if (now < earliest) {
-            uint64_t wait_ms = earliest - now;
-            if (wait_ms > 100) wait_ms = 100;
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec  += wait_ms / 1000;
-            ts.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
-            if (ts.tv_nsec >= 1000000000L) {
-                ts.tv_sec++;
-                ts.tv_nsec -= 1000000000L;
-            }
-            pthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
-            continue;
-        }
+        /* Fire one expired timer; the callback may create or delete
+         * timers, so the list is scanned again afterwards */
+        for (struct emu_timer *t = timer_list; t; t = t->next) {
+            if (!t->active || !t->callback) continue;
+            if (now_ms() < t->next_fire_ms) continue;
 
-        /* Fire expired timers */
-        for (int i = 0; i < timer_count; i++) {
-            if (!timers[i].active || !timers[i].callback) continue;
-            if (now_ms() < timers[i].next_fire_ms) continue;
-
-            TimerCallbackFunction_t cb = timers[i].callback;
-            TimerHandle_t handle = (TimerHandle_t)(uintptr_t)(i + 1);
-
-            if (timers[i].auto_reload) {
-                timers[i].next_fire_ms = now_ms() + timers[i].period;
+            TimerCallbackFunction_t cb = t->callback;
+            if (t->auto_reload) {
+                t->next_fire_ms = now_ms() + t->period;
             } else {
-                timers[i].active = 0;
+                t->active = 0;
             }
 
             /* Unlock while calling callback to avoid deadlock */
             pthread_mutex_unlock(&timer_mutex);
-            cb(handle);
+            cb((TimerHandle_t)t);
+            isr_flush();
             pthread_mutex_lock(&timer_mutex);
+            break;
         }
     }
 
@@ -921,6 +1906,8 @@ static void ensure_timer_thread(void)
 {
     if (!timer_thread_started) {
         timer_thread_started = 1;
+        emu_cond_init(&timer_cond);
+        vc_thread_starting();
         pthread_create(&timer_thread_id, NULL, timer_thread_func, NULL);
     }
 }
@@ -929,37 +1916,41 @@ TimerHandle_t xTimerCreate(const char *pcTimerName, TickType_t xTimerPeriod,
                             UBaseType_t uxAutoReload, void *pvTimerID,
                             TimerCallbackFunction_t pxCallbackFunction)
 {
-    pthread_mutex_lock(&timer_mutex);
-    if (timer_count >= MAX_TIMERS) {
-        pthread_mutex_unlock(&timer_mutex);
-        ESP_LOGE(TAG, "xTimerCreate: too many timers (max %d)", MAX_TIMERS);
+    vc_register_self();
+    struct emu_timer *t = pool_alloc(&timer_pool);
+    if (!t) {
+        ESP_LOGE(TAG, "xTimerCreate: out of memory");
         return NULL;
     }
-
-    int idx = timer_count++;
-    memset(&timers[idx], 0, sizeof(timers[idx]));
     if (pcTimerName)
-        strncpy(timers[idx].name, pcTimerName, sizeof(timers[idx].name) - 1);
-    timers[idx].period = xTimerPeriod;
-    timers[idx].auto_reload = (int)uxAutoReload;
-    timers[idx].timer_id = pvTimerID;
-    timers[idx].callback = pxCallbackFunction;
+        strncpy(t->name, pcTimerName, sizeof(t->name) - 1);
+    t->period = xTimerPeriod;
+    t->auto_reload = (int)uxAutoReload;
+    t->timer_id = pvTimerID;
+    t->callback = pxCallbackFunction;
+    t->in_use = 1;
+    emu_obj_register(&t->obj, EMU_OBJ_TIMER, EMU_CALLER());
 
+    pthread_mutex_lock(&timer_mutex);
+    t->next = timer_list;
+    timer_list = t;
     ensure_timer_thread();
     pthread_mutex_unlock(&timer_mutex);
-    return (TimerHandle_t)(uintptr_t)(idx + 1);
+    return (TimerHandle_t)t;
 }
 
 BaseType_t xTimerStart(TimerHandle_t xTimer, TickType_t xTicksToWait)
 {
     (void)xTicksToWait;
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return pdFAIL;
-
     pthread_mutex_lock(&timer_mutex);
-    timers[idx].active = 1;
-    timers[idx].next_fire_ms = now_ms() + timers[idx].period;
-    pthread_cond_signal(&timer_cond);
+    struct emu_timer *t = timer_get(xTimer);
+    if (!t) {
+        pthread_mutex_unlock(&timer_mutex);
+        return pdFAIL;
+    }
+    t->active = 1;
+    t->next_fire_ms = now_ms() + t->period;
+    emu_cond_signal(&timer_cond);
     pthread_mutex_unlock(&timer_mutex);
     return pdPASS;
 }
@@ -967,13 +1958,11 @@ BaseType_t xTimerStart(TimerHandle_t xTimer, TickType_t xTicksToWait)
 BaseType_t xTimerStop(TimerHandle_t xTimer, TickType_t xTicksToWait)
 {
     (void)xTicksToWait;
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return pdFAIL;
-
     pthread_mutex_lock(&timer_mutex);
-    timers[idx].active = 0;
+    struct emu_timer *t = timer_get(xTimer);
+    if (t) t->active = 0;
     pthread_mutex_unlock(&timer_mutex);
-    return pdPASS;
+    return t ? pdPASS : pdFAIL;
 }
 
 BaseType_t xTimerReset(TimerHandle_t xTimer, TickType_t xTicksToWait)
@@ -985,14 +1974,16 @@ BaseType_t xTimerChangePeriod(TimerHandle_t xTimer, TickType_t xNewPeriod,
                                TickType_t xTicksToWait)
 {
     (void)xTicksToWait;
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return pdFAIL;
-
     pthread_mutex_lock(&timer_mutex);
-    timers[idx].period = xNewPeriod;
-    if (timers[idx].active)
-        timers[idx].next_fire_ms = now_ms() + xNewPeriod;
-    pthread_cond_signal(&timer_cond);
+    struct emu_timer *t = timer_get(xTimer);
+    if (!t) {
+        pthread_mutex_unlock(&timer_mutex);
+        return pdFAIL;
+    }
+    t->period = xNewPeriod;
+    if (t->active)
+        t->next_fire_ms = now_ms() + xNewPeriod;
+    emu_cond_signal(&timer_cond);
     pthread_mutex_unlock(&timer_mutex);
     return pdPASS;
 }
@@ -1000,35 +1991,75 @@ BaseType_t xTimerChangePeriod(TimerHandle_t xTimer, TickType_t xNewPeriod,
 BaseType_t xTimerDelete(TimerHandle_t xTimer, TickType_t xTicksToWait)
 {
     (void)xTicksToWait;
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return pdFAIL;
-
     pthread_mutex_lock(&timer_mutex);
-    timers[idx].active = 0;
-    timers[idx].callback = NULL;
+    struct emu_timer *t = timer_get(xTimer);
+    if (!t) {
+        pthread_mutex_unlock(&timer_mutex);
+        return pdFAIL;
+    }
+    for (struct emu_timer **pp = &timer_list; *pp; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+    t->active = 0;
+    t->in_use = 0;
+    emu_obj_unregister(&t->obj);
     pthread_mutex_unlock(&timer_mutex);
+    pool_free(&timer_pool, t);
     return pdPASS;
 }
 
 BaseType_t xTimerIsTimerActive(TimerHandle_t xTimer)
 {
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return pdFALSE;
-    return timers[idx].active ? pdTRUE : pdFALSE;
+    pthread_mutex_lock(&timer_mutex);
+    struct emu_timer *t = timer_get(xTimer);
+    int active = t && t->active;
+    pthread_mutex_unlock(&timer_mutex);
+    return active ? pdTRUE : pdFALSE;
 }
 
 void *pvTimerGetTimerID(TimerHandle_t xTimer)
 {
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return NULL;
-    return timers[idx].timer_id;
+    pthread_mutex_lock(&timer_mutex);
+    struct emu_timer *t = timer_get(xTimer);
+    void *id = t ? t->timer_id : NULL;
+    pthread_mutex_unlock(&timer_mutex);
+    return id;
 }
 
 void vTimerSetTimerID(TimerHandle_t xTimer, void *pvNewID)
 {
-    int idx = (int)(uintptr_t)xTimer - 1;
-    if (idx < 0 || idx >= timer_count) return;
-    timers[idx].timer_id = pvNewID;
+    pthread_mutex_lock(&timer_mutex);
+    struct emu_timer *t = timer_get(xTimer);
+    if (t) t->timer_id = pvNewID;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+/* ================================================================
+ * Object counts — live objects per type, for leak checks
+ * ================================================================ */
+
+void emu_freertos_get_counts(emu_freertos_counts_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&task_list_mutex);
+    for (int i = 0; i < MAX_TASKS; i++)
+        if (task_list[i].valid) out->tasks++;
+    pthread_mutex_unlock(&task_list_mutex);
+
+    out->semaphores = pool_live(&sem_pool);
+    out->event_groups = pool_live(&eg_pool);
+
+    for (int i = 0; i < QUEUE_POOL_CLASSES; i++)
+        out->queues += pool_live(&queue_pools[i]);
+    pthread_mutex_lock(&queue_heap_mutex);
+    out->queues += queue_heap_live;
+    pthread_mutex_unlock(&queue_heap_mutex);
+
+    out->timers = pool_live(&timer_pool);
 }
 
 /* ================================================================
@@ -1040,18 +2071,25 @@ void emu_freertos_shutdown(void)
     /* Stop timer thread */
     if (timer_thread_started) {
         pthread_mutex_lock(&timer_mutex);
-        pthread_cond_signal(&timer_cond);
+        emu_cond_signal(&timer_cond);
         pthread_mutex_unlock(&timer_mutex);
         pthread_join(timer_thread_id, NULL);
         timer_thread_started = 0;
     }
 
+    /* Release virtual-time sleepers so they see the shutdown */
+    if (clock_virtual) {
+        pthread_mutex_lock(&vc_mutex);
+        pthread_cond_broadcast(&vc_cond);
+        pthread_mutex_unlock(&vc_mutex);
+    }
+
     /* Join all tracked task threads */
     for (int i = 0; i < MAX_TASKS; i++) {
         pthread_mutex_lock(&task_list_mutex);
         if (task_list[i].valid) {
             pthread_t t = task_list[i].thread;
-            task_list[i].valid = 0;
+            task_slot_release(i);
             pthread_mutex_unlock(&task_list_mutex);
             pthread_join(t, NULL);
         } else {
@@ -1,5 +1,6 @@
 /*
- * emu_json.c — Save/load emulator state (JSON config + SD card image)
+ * emu_json.c — Save/load emulator state (JSON config; the SD card image
+ * is snapshotted by sdcard_snapshot_start in emu_sdcard.c)
  *
  * Writer: fprintf-based, straightforward.
  * Reader: Minimal token-based parser for our known schema.
@@ -18,8 +19,7 @@ static const char *TAG = "emu_json";
 
 /* ---- Writer ---- */
 
-int emu_json_save_state(const char *base_path, const struct emu_state *state,
-                        const char *sdcard_img_path)
+int emu_json_save_state(const char *base_path, const struct emu_state *state)
 {
     /* Write JSON config */
     char json_path[512];
@@ -66,23 +66,6 @@ int emu_json_save_state(const char *base_path, const struct emu_state *state,
     fclose(f);
 
     ESP_LOGI(TAG, "Saved config: %s", json_path);
-
-    /* Copy SD card image (sparse-preserving) */
-    char img_path[512];
-    snprintf(img_path, sizeof(img_path), "%s.img", base_path);
-
-    char cmd[1200];
-    snprintf(cmd, sizeof(cmd), "cp --sparse=always '%s' '%s'",
-             sdcard_img_path, img_path);
-
-    ESP_LOGI(TAG, "Copying SD image...");
-    int ret = system(cmd);
-    if (ret != 0) {
-        ESP_LOGE(TAG, "SD image copy failed (exit %d)", ret);
-        return -1;
-    }
-    ESP_LOGI(TAG, "Saved SD image: %s", img_path);
-
     return 0;
 }
 
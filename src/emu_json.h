@@ -18,11 +18,11 @@ struct emu_state {
 };
 
 /*
- * Save state: writes <base>.json with config, copies SD image to <base>.img.
+ * Save state: writes <base>.json with config.  The caller snapshots the
+ * SD image to <base>.img (sdcard_snapshot_start).
  * Returns 0 on success, -1 on error.
  */
-int emu_json_save_state(const char *base_path, const struct emu_state *state,
-                        const char *sdcard_img_path);
+int emu_json_save_state(const char *base_path, const struct emu_state *state);
 
 /*
  * Load state: reads <base>.json, fills out state struct.
@@ -0,0 +1,941 @@
+/*
+ * emu_log.c -- ESP_LOG backend
+ *
+ * ESP_LOGx first checks the message level against the tag's runtime
+ * level (esp_log_level_set); with no tag raised above the default that
+ * is a single compare in the macro.  emu_log_write() then only records
+ * the format pointer and a copy of its arguments in a lock-free
+ * multi-producer ring.  A logger thread formats the records, prints
+ * them and adds them to the panel log ring.
+ *
+ * Strings passed for %s are copied; tags and formats are kept as
+ * pointers, so they must be string literals or otherwise static (as in
+ * ESP-IDF).  Messages whose arguments do not fit in a record are
+ * formatted by the caller instead.  Before emu_log_start() and after
+ * emu_log_stop() every message is printed directly.
+ *
+ * Every log and UART line also goes to the history store (see Log
+ * history below) stamped with the emulated cycle count and host time.
+ */
+
+#ifdef _MSC_VER
+#include "../flexe/src/msvc_compat.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#ifndef _MSC_VER
+#include <regex.h>
+#endif
+
+#include "esp_log.h"
+
+/* ---- Runtime levels ---- */
+
+#define LOG_MAX_TAGS    64
+#define LOG_TAG_LEN     32
+
+struct log_tag_level {
+    char tag[LOG_TAG_LEN];
+    atomic_int level;
+};
+
+/* Highest level any tag lets through; read unlocked by the macros */
+volatile int emu_log_max_level = ESP_LOG_INFO;
+
+static atomic_int log_default_level = ESP_LOG_INFO;
+static struct log_tag_level log_tags[LOG_MAX_TAGS];
+static atomic_int log_ntags;
+static pthread_mutex_t log_tags_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char log_letters[] = "NEWIDV";
+
+static int tag_level(const char *tag)
+{
+    int n = atomic_load_explicit(&log_ntags, memory_order_acquire);
+    for (int i = 0; i < n; i++)
+        if (strcmp(log_tags[i].tag, tag) == 0)
+            return atomic_load_explicit(&log_tags[i].level, memory_order_relaxed);
+    return atomic_load_explicit(&log_default_level, memory_order_relaxed);
+}
+
+int emu_log_enabled(const char *tag, esp_log_level_t level)
+{
+    return (int)level <= tag_level(tag);
+}
+
+/* "*" sets the default for tags without a level of their own */
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    if (level < ESP_LOG_NONE) level = ESP_LOG_NONE;
+    if (level > ESP_LOG_VERBOSE) level = ESP_LOG_VERBOSE;
+
+    pthread_mutex_lock(&log_tags_mutex);
+    int n = atomic_load_explicit(&log_ntags, memory_order_relaxed);
+    if (strcmp(tag, "*") == 0) {
+        atomic_store(&log_default_level, (int)level);
+    } else {
+        int i;
+        for (i = 0; i < n; i++)
+            if (strcmp(log_tags[i].tag, tag) == 0) break;
+        if (i == n && n < LOG_MAX_TAGS) {
+            snprintf(log_tags[i].tag, LOG_TAG_LEN, "%s", tag);
+            atomic_store(&log_tags[i].level, (int)level);
+            atomic_store_explicit(&log_ntags, ++n, memory_order_release);
+        } else if (i < n) {
+            atomic_store(&log_tags[i].level, (int)level);
+        }
+    }
+
+    int max = atomic_load(&log_default_level);
+    for (int i = 0; i < n; i++) {
+        int l = atomic_load(&log_tags[i].level);
+        if (l > max) max = l;
+    }
+    emu_log_max_level = max;
+    pthread_mutex_unlock(&log_tags_mutex);
+}
+
+esp_log_level_t esp_log_level_get(const char *tag)
+{
+    return (esp_log_level_t)tag_level(tag);
+}
+
+/* none/error/warn/info/debug/verbose, their first letter, or 0-5 */
+static int parse_level(const char *s)
+{
+    static const char *const names[] = {
+        "none", "error", "warn", "info", "debug", "verbose"
+    };
+    if (s[0] >= '0' && s[0] <= '5' && s[1] == '\0') return s[0] - '0';
+    for (int i = 0; i <= ESP_LOG_VERBOSE; i++) {
+        if (strcmp(s, names[i]) == 0) return i;
+        if (s[1] == '\0' && (s[0] == log_letters[i] || s[0] == names[i][0]))
+            return i;
+    }
+    return -1;
+}
+
+/* "[tag=]level[,[tag=]level...]"; -1 (after applying the valid
+ * entries) if any entry is malformed */
+int emu_log_set_levels(const char *spec)
+{
+    int ret = 0;
+    while (*spec) {
+        size_t n = strcspn(spec, ",");
+        char item[LOG_TAG_LEN + 16];
+        snprintf(item, sizeof(item), "%.*s", (int)n, spec);
+        spec += n + (spec[n] == ',');
+
+        char *eq = strchr(item, '=');
+        const char *tag = "*";
+        const char *lvl = item;
+        if (eq) {
+            *eq = '\0';
+            tag = item;
+            lvl = eq + 1;
+        }
+        int level = parse_level(lvl);
+        if (level < 0 || !*tag) {
+            ret = -1;
+            continue;
+        }
+        esp_log_level_set(tag, (esp_log_level_t)level);
+    }
+    return ret;
+}
+
+#define ALIGN8(n)  (((n) + 7) & ~(size_t)7)
+
+/* ---- Log history ----
+ *
+ * An in-memory ring of fixed-size segments, each with its line
+ * offsets, its cycle range and a bloom filter of the byte trigrams in
+ * its text.  Queries walk segments newest first, skip those whose
+ * cycle range ends before "since" or whose filter rules out a literal
+ * grep pattern, and stop once they have enough lines.  With
+ * emu_log_file_path set, lines are also appended to that file, which
+ * is rotated to <path>.1 .. <path>.N at emu_log_file_max bytes.
+ */
+
+#define LOG_MSG_MAX     256     /* formatted message, as before */
+#define LOG_SEG_BYTES   (32 * 1024)
+#define LOG_SEG_LINES   (LOG_SEG_BYTES / 32)
+#define LOG_BLOOM_BITS  (64 * 1024)
+#define LOG_LINE_MAX    1024
+#define LOG_FILE_KEEP   8
+#define LOG_SEARCH_MAX  10000   /* lines per query without tail */
+
+/* History size (--log-history); 0 keeps no history */
+uint64_t emu_log_history_bytes = 16ULL * 1024 * 1024;
+/* History file (--log-file) and its rotation size (--log-rotate) */
+const char *emu_log_file_path = NULL;
+uint64_t emu_log_file_max = 64ULL * 1024 * 1024;
+
+struct log_entry {          /* followed by the text and a NUL, 8-aligned */
+    uint64_t cycle;
+    int64_t  host_ns;
+    uint16_t len;
+    char     src;           /* E/W/I/D/V for ESP_LOG, U for UART */
+};
+
+struct log_hit {
+    const struct log_entry *e;
+    int age;                /* 0 = newest */
+};
+
+struct log_seg {
+    uint8_t  data[LOG_SEG_BYTES];
+    uint32_t used;
+    uint32_t nlines;
+    uint16_t offs[LOG_SEG_LINES];
+    uint64_t min_cycle, max_cycle;
+    uint8_t  bloom[LOG_BLOOM_BITS / 8];
+};
+
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_seg *store_segs;
+static int      store_nsegs;        /* 0 = not allocated yet, -1 = off */
+static int      store_cur;
+static int      store_filled;       /* segments holding lines */
+static FILE    *store_file;
+static uint64_t store_file_size;
+
+static _Atomic(uint64_t (*)(void)) log_cycle_fn;
+
+/* Where emulated cycle counts come from (emu_flexe.c) */
+void emu_log_set_cycle_source(uint64_t (*fn)(void))
+{
+    atomic_store(&log_cycle_fn, fn);
+}
+
+static uint64_t log_cycles(void)
+{
+    uint64_t (*fn)(void) = atomic_load_explicit(&log_cycle_fn, memory_order_relaxed);
+    return fn ? fn() : 0;
+}
+
+static int64_t host_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t trigram_bit(const uint8_t *p)
+{
+    uint32_t h = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (h * 2654435761u) >> (32 - 16);
+}
+
+static void seg_reset(struct log_seg *g)
+{
+    g->used = 0;
+    g->nlines = 0;
+    g->min_cycle = UINT64_MAX;
+    g->max_cycle = 0;
+    memset(g->bloom, 0, sizeof(g->bloom));
+}
+
+/* Caller holds store_mutex */
+static int store_alloc(void)
+{
+    if (store_nsegs) return store_nsegs > 0;
+    int n = (int)(emu_log_history_bytes / LOG_SEG_BYTES);
+    if (emu_log_history_bytes && n < 2) n = 2;
+    store_segs = n ? calloc((size_t)n, sizeof(*store_segs)) : NULL;
+    if (!store_segs) {
+        store_nsegs = -1;
+        return 0;
+    }
+    store_nsegs = n;
+    seg_reset(&store_segs[0]);
+    store_filled = 1;
+    return 1;
+}
+
+static void format_host_time(char *out, size_t cap, int64_t host_ns)
+{
+    time_t t = (time_t)(host_ns / 1000000000LL);
+    struct tm tm;
+#ifdef _MSC_VER
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+    snprintf(out, cap, "%02d:%02d:%02d.%03d", tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (int)(host_ns / 1000000 % 1000));
+}
+
+/* Caller holds store_mutex */
+static void store_file_write(char src, uint64_t cycle, int64_t host_ns, const char *text)
+{
+    if (!store_file) {
+        store_file = fopen(emu_log_file_path, "a");
+        if (!store_file) {
+            fprintf(stderr, "Cannot open log file %s\n", emu_log_file_path);
+            emu_log_file_path = NULL;
+            return;
+        }
+        fseek(store_file, 0, SEEK_END);
+        store_file_size = (uint64_t)ftell(store_file);
+    }
+    char when[16];
+    format_host_time(when, sizeof(when), host_ns);
+    int n = fprintf(store_file, "%llu %s %c %s\n", (unsigned long long)cycle, when, src, text);
+    if (n > 0) store_file_size += (uint64_t)n;
+    if (emu_log_file_max && store_file_size >= emu_log_file_max) {
+        char from[1024], to[1024];
+        fclose(store_file);
+        store_file = NULL;
+        for (int k = LOG_FILE_KEEP - 1; k >= 1; k--) {
+            snprintf(from, sizeof(from), "%s.%d", emu_log_file_path, k);
+            snprintf(to, sizeof(to), "%s.%d", emu_log_file_path, k + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", emu_log_file_path);
+        rename(emu_log_file_path, to);
+    }
+}
+
+static void store_add(char src, uint64_t cycle, int64_t host_ns, const char *text)
+{
+    size_t len = strlen(text);
+    if (len > LOG_LINE_MAX) len = LOG_LINE_MAX;
+
+    pthread_mutex_lock(&store_mutex);
+    if (emu_log_file_path)
+        store_file_write(src, cycle, host_ns, text);
+    if (!store_alloc()) {
+        pthread_mutex_unlock(&store_mutex);
+        return;
+    }
+
+    size_t need = ALIGN8(sizeof(struct log_entry) + len + 1);
+    struct log_seg *g = &store_segs[store_cur];
+    if (g->used + need > LOG_SEG_BYTES || g->nlines == LOG_SEG_LINES) {
+        store_cur = (store_cur + 1) % store_nsegs;
+        if (store_filled < store_nsegs) store_filled++;
+        g = &store_segs[store_cur];
+        seg_reset(g);
+    }
+
+    struct log_entry *e = (struct log_entry *)(g->data + g->used);
+    e->cycle = cycle;
+    e->host_ns = host_ns;
+    e->len = (uint16_t)len;
+    e->src = src;
+    char *t = (char *)(e + 1);
+    memcpy(t, text, len);
+    t[len] = '\0';
+    for (size_t i = 0; i + 2 < len; i++) {
+        uint32_t b = trigram_bit((const uint8_t *)t + i);
+        g->bloom[b >> 3] |= (uint8_t)(1u << (b & 7));
+    }
+    if (cycle < g->min_cycle) g->min_cycle = cycle;
+    if (cycle > g->max_cycle) g->max_cycle = cycle;
+    g->offs[g->nlines++] = (uint16_t)g->used;
+    g->used += (uint32_t)need;
+    pthread_mutex_unlock(&store_mutex);
+}
+
+/* A UART line (emu_flexe.c); cycle is when its terminator was sent */
+void emu_log_uart_line(uint64_t cycle, const char *line)
+{
+    store_add('U', cycle, host_now_ns(), line);
+}
+
+/* 1 unless the segment's trigram filter rules out literal pat */
+static int seg_may_contain(const struct log_seg *g, const char *pat, size_t len)
+{
+    for (size_t i = 0; i + 2 < len; i++) {
+        uint32_t b = trigram_bit((const uint8_t *)pat + i);
+        if (!(g->bloom[b >> 3] & (1u << (b & 7)))) return 0;
+    }
+    return 1;
+}
+
+static int hit_cmp(const void *a, const void *b)
+{
+    const struct log_hit *x = a, *y = b;
+    if (x->e->cycle != y->e->cycle) return x->e->cycle < y->e->cycle ? -1 : 1;
+    return y->age - x->age;
+}
+
+/*
+ * History lines with cycle >= since (0 = all) that match regex (NULL =
+ * all), newest <tail> of them (0 = up to LOG_SEARCH_MAX), formatted as
+ * "LOG <cycle> <hh:mm:ss.mmm> <src> <text>\n" in a malloc'd string.
+ * *nlines gets the count, *more is set if older matches were left out.
+ * NULL for a bad regex or out of memory.
+ */
+char *emu_log_search(uint64_t since, const char *regex, int tail, int *nlines, int *more)
+{
+    int limit = tail > 0 && tail < LOG_SEARCH_MAX ? tail : LOG_SEARCH_MAX;
+    *nlines = 0;
+    *more = 0;
+
+#ifndef _MSC_VER
+    regex_t re;
+    if (regex && regcomp(&re, regex, REG_EXTENDED | REG_NOSUB) != 0)
+        return NULL;
+#endif
+    /* Literal patterns can use the segment filters */
+    int literal = regex && !strpbrk(regex, ".[]()*+?{}|^$\\");
+    size_t rlen = regex ? strlen(regex) : 0;
+
+    struct log_hit *hits = malloc((size_t)limit * sizeof(*hits));
+    if (!hits) {
+#ifndef _MSC_VER
+        if (regex) regfree(&re);
+#endif
+        return NULL;
+    }
+
+    pthread_mutex_lock(&store_mutex);
+    int n = 0;
+    for (int k = 0; k < (store_nsegs > 0 ? store_filled : 0) && !*more; k++) {
+        const struct log_seg *g = &store_segs[(store_cur - k + store_nsegs) % store_nsegs];
+        if (!g->nlines || g->max_cycle < since) continue;
+        if (literal && !seg_may_contain(g, regex, rlen)) continue;
+        for (int i = (int)g->nlines - 1; i >= 0; i--) {
+            const struct log_entry *e = (const struct log_entry *)(g->data + g->offs[i]);
+            if (e->cycle < since) continue;
+            if (regex) {
+                const char *text = (const char *)(e + 1);
+#ifndef _MSC_VER
+                if (regexec(&re, text, 0, NULL, 0) != 0) continue;
+#else
+                if (!strstr(text, regex)) continue;
+#endif
+            }
+            if (n == limit) {
+                *more = 1;
+                break;
+            }
+            hits[n].e = e;
+            hits[n].age = n;
+            n++;
+        }
+    }
+
+    /* Deferred ESP_LOG lines are stored a little late: list by cycle */
+    qsort(hits, (size_t)n, sizeof(*hits), hit_cmp);
+
+    size_t cap = 1, pos = 0;
+    for (int i = 0; i < n; i++)
+        cap += hits[i].e->len + 64;
+    char *out = malloc(cap);
+    if (out) {
+        out[0] = '\0';
+        for (int i = 0; i < n; i++) {
+            const struct log_entry *e = hits[i].e;
+            char when[16];
+            format_host_time(when, sizeof(when), e->host_ns);
+            pos += (size_t)snprintf(out + pos, cap - pos, "LOG %llu %s %c %s\n",
+                                    (unsigned long long)e->cycle, when, e->src,
+                                    (const char *)(e + 1));
+        }
+        *nlines = n;
+    }
+    pthread_mutex_unlock(&store_mutex);
+
+    free(hits);
+#ifndef _MSC_VER
+    if (regex) regfree(&re);
+#endif
+    return out;
+}
+
+/* ---- Panel ring ---- */
+
+static pthread_mutex_t panel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Append one line (truncated to fit) to emu_log_ring */
+void emu_log_panel_add(const char *line)
+{
+    size_t n = strnlen(line, EMU_LOG_COLS - 1);
+    pthread_mutex_lock(&panel_mutex);
+    memcpy(emu_log_ring[emu_log_head], line, n);
+    emu_log_ring[emu_log_head][n] = '\0';
+    emu_log_head = (emu_log_head + 1) % EMU_LOG_LINES;
+    pthread_mutex_unlock(&panel_mutex);
+}
+
+static void log_emit(int level, const char *tag, const char *msg,
+                     uint64_t cycle, int64_t host_ns)
+{
+    char line[LOG_MSG_MAX + 64];
+    printf("[%c][%s] %s\n", log_letters[level], tag, msg);
+    snprintf(line, sizeof(line), "[%s] %s", tag, msg);
+    store_add(log_letters[level], cycle, host_ns, line);
+    snprintf(line, EMU_LOG_COLS, "[%c] %.43s", log_letters[level], msg);
+    emu_log_panel_add(line);
+}
+
+/* ---- Format specs ----
+ *
+ * Arguments are stored as 8-byte aligned items: integers widened to
+ * 64 bits, pointers, doubles, long doubles, and strings inline with
+ * their NUL.  The logger rebuilds a one-conversion format per spec
+ * ('*' widths resolved) and hands it the item with its original type.
+ */
+
+enum { ARG_NONE, ARG_INT, ARG_UINT, ARG_DBL, ARG_LDBL, ARG_PTR, ARG_STR, ARG_BAD };
+
+struct log_spec {
+    const char *end;        /* past the conversion character */
+    char flags[8];
+    int star_width, star_prec;
+    int has_prec;
+    char width[12], prec[12];
+    char len[3];            /* "", "h", "hh", "l", "ll", "j", "z", "t", "L" */
+    char conv;
+    int kind;
+};
+
+/* p points just past a '%' */
+static void parse_spec(const char *p, struct log_spec *sp)
+{
+    memset(sp, 0, sizeof(*sp));
+    int n = 0;
+    while (*p && strchr("-+ #0'", *p) && n < (int)sizeof(sp->flags) - 1)
+        sp->flags[n++] = *p++;
+    if (*p == '*') { sp->star_width = 1; p++; }
+    n = 0;
+    while (*p >= '0' && *p <= '9' && n < (int)sizeof(sp->width) - 1)
+        sp->width[n++] = *p++;
+    if (*p == '.') {
+        sp->has_prec = 1;
+        p++;
+        if (*p == '*') { sp->star_prec = 1; p++; }
+        n = 0;
+        while (*p >= '0' && *p <= '9' && n < (int)sizeof(sp->prec) - 1)
+            sp->prec[n++] = *p++;
+    }
+    n = 0;
+    while (*p && strchr("hljztL", *p) && n < 2)
+        sp->len[n++] = *p++;
+    sp->conv = *p;
+    sp->end = *p ? p + 1 : p;
+
+    switch (sp->conv) {
+    case 'd': case 'i':
+        sp->kind = ARG_INT; break;
+    case 'u': case 'o': case 'x': case 'X':
+        sp->kind = ARG_UINT; break;
+    case 'c':
+        sp->kind = sp->len[0] ? ARG_BAD : ARG_INT; break;
+    case 'f': case 'F': case 'e': case 'E':
+    case 'g': case 'G': case 'a': case 'A':
+        sp->kind = sp->len[0] == 'L' ? ARG_LDBL : ARG_DBL; break;
+    case 'p':
+        sp->kind = ARG_PTR; break;
+    case 's':
+        sp->kind = sp->len[0] ? ARG_BAD : ARG_STR; break;
+    case '%':
+        sp->kind = ARG_NONE; break;
+    default:                /* %n, wide strings, malformed specs */
+        sp->kind = ARG_BAD; break;
+    }
+}
+
+static long long fetch_int(va_list *ap, const char *len)
+{
+    if (len[0] == 'l') return len[1] == 'l' ? va_arg(*ap, long long) : va_arg(*ap, long);
+    if (len[0] == 'j') return va_arg(*ap, intmax_t);
+    if (len[0] == 'z') return (long long)va_arg(*ap, size_t);
+    if (len[0] == 't') return va_arg(*ap, ptrdiff_t);
+    return va_arg(*ap, int);
+}
+
+static unsigned long long fetch_uint(va_list *ap, const char *len)
+{
+    if (len[0] == 'l')
+        return len[1] == 'l' ? va_arg(*ap, unsigned long long) : va_arg(*ap, unsigned long);
+    if (len[0] == 'j') return va_arg(*ap, uintmax_t);
+    if (len[0] == 'z') return va_arg(*ap, size_t);
+    if (len[0] == 't') return (unsigned long long)va_arg(*ap, ptrdiff_t);
+    return va_arg(*ap, unsigned int);
+}
+
+/* Copy the arguments of fmt into buf; -1 if they do not fit or a spec
+ * cannot be deferred */
+static int capture_args(unsigned char *buf, size_t cap, const char *fmt, va_list *ap)
+{
+    size_t used = 0;
+    for (const char *p = fmt; *p; ) {
+        if (*p++ != '%') continue;
+        struct log_spec sp;
+        parse_spec(p, &sp);
+        p = sp.end;
+        if (sp.kind == ARG_BAD) return -1;
+
+        for (int k = 0; k < sp.star_width + sp.star_prec; k++) {
+            if (used + 8 > cap) return -1;
+            long long v = va_arg(*ap, int);
+            memcpy(buf + used, &v, 8);
+            used += 8;
+        }
+
+        switch (sp.kind) {
+        case ARG_INT: {
+            if (used + 8 > cap) return -1;
+            long long v = fetch_int(ap, sp.len);
+            memcpy(buf + used, &v, 8);
+            used += 8;
+            break;
+        }
+        case ARG_UINT: {
+            if (used + 8 > cap) return -1;
+            unsigned long long v = fetch_uint(ap, sp.len);
+            memcpy(buf + used, &v, 8);
+            used += 8;
+            break;
+        }
+        case ARG_DBL: {
+            if (used + 8 > cap) return -1;
+            double v = va_arg(*ap, double);
+            memcpy(buf + used, &v, 8);
+            used += 8;
+            break;
+        }
+        case ARG_LDBL: {
+            size_t sz = ALIGN8(sizeof(long double));
+            if (used + sz > cap) return -1;
+            long double v = va_arg(*ap, long double);
+            memcpy(buf + used, &v, sizeof(v));
+            used += sz;
+            break;
+        }
+        case ARG_PTR: {
+            if (used + 8 > cap) return -1;
+            void *v = va_arg(*ap, void *);
+            memset(buf + used, 0, 8);
+            memcpy(buf + used, &v, sizeof(v));
+            used += 8;
+            break;
+        }
+        case ARG_STR: {
+            const char *s = va_arg(*ap, const char *);
+            if (!s) s = "(null)";
+            /* A precision may bound an unterminated buffer */
+            size_t n = sp.has_prec && !sp.star_prec ? strnlen(s, (size_t)atoi(sp.prec))
+                                                    : strlen(s);
+            if (sp.star_prec) {
+                long long prec;
+                memcpy(&prec, buf + used - 8, 8);
+                n = prec >= 0 ? strnlen(s, (size_t)prec) : strlen(s);
+            }
+            if (used + n + 1 > cap) return -1;
+            memcpy(buf + used, s, n);
+            buf[used + n] = '\0';
+            used += ALIGN8(n + 1);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return (int)used;
+}
+
+/* Format fmt with arguments captured by capture_args() */
+static void format_args(char *out, size_t cap, const char *fmt, const unsigned char *buf)
+{
+    size_t pos = 0;
+    size_t used = 0;
+    out[0] = '\0';
+    for (const char *p = fmt; *p && pos + 1 < cap; ) {
+        if (*p != '%') {
+            const char *q = strchr(p, '%');
+            size_t n = q ? (size_t)(q - p) : strlen(p);
+            if (n > cap - 1 - pos) n = cap - 1 - pos;
+            memcpy(out + pos, p, n);
+            pos += n;
+            out[pos] = '\0';
+            p += n;
+            continue;
+        }
+        struct log_spec sp;
+        parse_spec(p + 1, &sp);
+        p = sp.end;
+        if (sp.kind == ARG_NONE) {
+            out[pos++] = '%';
+            out[pos] = '\0';
+            continue;
+        }
+
+        /* One-conversion format with '*' widths made explicit */
+        char one[64];
+        long long w = 0, pr = 0;
+        if (sp.star_width) { memcpy(&w, buf + used, 8); used += 8; }
+        if (sp.star_prec)  { memcpy(&pr, buf + used, 8); used += 8; }
+        int n = snprintf(one, sizeof(one), "%%%s", sp.flags);
+        if (sp.star_width)
+            n += snprintf(one + n, sizeof(one) - n, "%lld", w);
+        else
+            n += snprintf(one + n, sizeof(one) - n, "%s", sp.width);
+        if (sp.star_prec)
+            n += snprintf(one + n, sizeof(one) - n, ".%lld", pr);
+        else if (sp.has_prec)
+            n += snprintf(one + n, sizeof(one) - n, ".%s", sp.prec);
+        if (sp.kind != ARG_STR)
+            n += snprintf(one + n, sizeof(one) - n, "%s", sp.len);
+        snprintf(one + n, sizeof(one) - n, "%c", sp.conv);
+
+        char *dst = out + pos;
+        size_t room = cap - pos;
+        int r = 0;
+        switch (sp.kind) {
+        case ARG_INT: {
+            long long v;
+            memcpy(&v, buf + used, 8);
+            used += 8;
+            if (sp.len[0] == 'l' && sp.len[1] == 'l') r = snprintf(dst, room, one, v);
+            else if (sp.len[0] == 'l') r = snprintf(dst, room, one, (long)v);
+            else if (sp.len[0] == 'j') r = snprintf(dst, room, one, (intmax_t)v);
+            else if (sp.len[0] == 'z') r = snprintf(dst, room, one, (size_t)v);
+            else if (sp.len[0] == 't') r = snprintf(dst, room, one, (ptrdiff_t)v);
+            else r = snprintf(dst, room, one, (int)v);
+            break;
+        }
+        case ARG_UINT: {
+            unsigned long long v;
+            memcpy(&v, buf + used, 8);
+            used += 8;
+            if (sp.len[0] == 'l' && sp.len[1] == 'l') r = snprintf(dst, room, one, v);
+            else if (sp.len[0] == 'l') r = snprintf(dst, room, one, (unsigned long)v);
+            else if (sp.len[0] == 'j') r = snprintf(dst, room, one, (uintmax_t)v);
+            else if (sp.len[0] == 'z') r = snprintf(dst, room, one, (size_t)v);
+            else if (sp.len[0] == 't') r = snprintf(dst, room, one, (ptrdiff_t)v);
+            else r = snprintf(dst, room, one, (unsigned int)v);
+            break;
+        }
+        case ARG_DBL: {
+            double v;
+            memcpy(&v, buf + used, 8);
+            used += 8;
+            r = snprintf(dst, room, one, v);
+            break;
+        }
+        case ARG_LDBL: {
+            long double v;
+            memcpy(&v, buf + used, sizeof(v));
+            used += ALIGN8(sizeof(long double));
+            r = snprintf(dst, room, one, v);
+            break;
+        }
+        case ARG_PTR: {
+            void *v;
+            memcpy(&v, buf + used, sizeof(v));
+            used += 8;
+            r = snprintf(dst, room, one, v);
+            break;
+        }
+        case ARG_STR: {
+            const char *s = (const char *)buf + used;
+            used += ALIGN8(strlen(s) + 1);
+            r = snprintf(dst, room, one, s);
+            break;
+        }
+        default:
+            break;
+        }
+        if (r > 0) pos += (size_t)r < room ? (size_t)r : room - 1;
+    }
+}
+
+/* ---- Record ring ----
+ *
+ * Bounded multi-producer queue with a sequence number per slot: a
+ * producer claims a slot by advancing log_head with a CAS, fills it
+ * and publishes it by setting seq to its position + 1.  The logger
+ * thread is the only consumer.  Producers count themselves in
+ * log_producers before checking log_running, and emu_log_stop() waits
+ * for that count to reach zero before stopping the logger, so a record
+ * that was queued is always printed.
+ */
+
+#define LOG_RING_SLOTS  1024    /* power of two */
+#define LOG_ARG_BYTES   LOG_MSG_MAX  /* also holds preformatted text */
+
+struct log_rec {
+    atomic_uint seq;
+    uint8_t level;
+    uint8_t preformatted;       /* args holds the message text */
+    uint64_t cycle;
+    int64_t host_ns;
+    const char *tag;
+    const char *fmt;
+    _Alignas(8) unsigned char args[LOG_ARG_BYTES];
+};
+
+static struct log_rec log_ring[LOG_RING_SLOTS];
+static atomic_uint log_head;
+static unsigned    log_tail;        /* logger thread only */
+static atomic_int  log_running;
+static atomic_int  log_producers;   /* emu_log_write calls using the ring */
+static atomic_int  log_quit;
+static pthread_t   log_thread;
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  log_wake_cond  = PTHREAD_COND_INITIALIZER;
+
+static void log_print_rec(struct log_rec *r)
+{
+    char msg[LOG_MSG_MAX];
+    if (r->preformatted)
+        snprintf(msg, sizeof(msg), "%s", (const char *)r->args);
+    else
+        format_args(msg, sizeof(msg), r->fmt, r->args);
+    log_emit(r->level, r->tag, msg, r->cycle, r->host_ns);
+}
+
+/* Print every published record; 1 if any */
+static int log_drain(void)
+{
+    int any = 0;
+    for (;;) {
+        struct log_rec *r = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&r->seq, memory_order_acquire) != log_tail + 1)
+            break;
+        log_print_rec(r);
+        atomic_store_explicit(&r->seq, log_tail + LOG_RING_SLOTS, memory_order_release);
+        log_tail++;
+        any = 1;
+    }
+    return any;
+}
+
+static void *log_thread_func(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        if (log_drain()) {
+            fflush(stdout);
+            continue;
+        }
+        if (atomic_load(&log_quit)) {
+            /* Wait out producers that claimed a slot but not yet filled it */
+            while (log_tail != atomic_load(&log_head)) {
+                if (!log_drain()) sched_yield();
+            }
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 20 * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&log_wake_mutex);
+        pthread_cond_timedwait(&log_wake_cond, &log_wake_mutex, &ts);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+void emu_log_write(esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    atomic_fetch_add(&log_producers, 1);
+    if (!atomic_load(&log_running)) {
+        atomic_fetch_sub(&log_producers, 1);
+        char msg[LOG_MSG_MAX];
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        log_emit(level, tag, msg, log_cycles(), host_now_ns());
+        return;
+    }
+
+    /* Claim a slot; wait for the logger while the ring is full */
+    struct log_rec *r;
+    unsigned pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    for (;;) {
+        r = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        unsigned seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        int dif = (int)(seq - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            pthread_cond_signal(&log_wake_cond);
+            sched_yield();
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    r->level = (uint8_t)level;
+    r->cycle = log_cycles();
+    r->host_ns = host_now_ns();
+    r->tag = tag;
+    r->fmt = fmt;
+    va_list aq;
+    va_copy(aq, ap);
+    r->preformatted = capture_args(r->args, sizeof(r->args), fmt, &aq) < 0;
+    va_end(aq);
+    if (r->preformatted)
+        vsnprintf((char *)r->args, sizeof(r->args), fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+
+    /* The logger polls, so errors are the only messages worth a wakeup */
+    if (level == ESP_LOG_ERROR)
+        pthread_cond_signal(&log_wake_cond);
+    atomic_fetch_sub(&log_producers, 1);
+}
+
+/* Flush deferred messages and go back to printing them directly */
+void emu_log_stop(void)
+{
+    if (!atomic_load(&log_running)) return;
+    atomic_store(&log_running, 0);
+    /* New callers now print directly; let the ones already queueing
+     * finish while the logger still drains a full ring for them */
+    while (atomic_load(&log_producers) > 0) {
+        pthread_cond_signal(&log_wake_cond);
+        sched_yield();
+    }
+    atomic_store(&log_quit, 1);
+    pthread_mutex_lock(&log_wake_mutex);
+    pthread_cond_signal(&log_wake_cond);
+    pthread_mutex_unlock(&log_wake_mutex);
+    pthread_join(log_thread, NULL);
+}
+
+void emu_log_start(void)
+{
+    static int registered;
+    if (atomic_load(&log_running)) return;
+
+    unsigned head = atomic_load(&log_head);
+    for (unsigned i = 0; i < LOG_RING_SLOTS; i++)
+        atomic_store(&log_ring[(head + i) & (LOG_RING_SLOTS - 1)].seq, head + i);
+    log_tail = head;
+    atomic_store(&log_quit, 0);
+    if (pthread_create(&log_thread, NULL, log_thread_func, NULL) != 0) {
+        fprintf(stderr, "Failed to create logger thread\n");
+        return;
+    }
+    atomic_store_explicit(&log_running, 1, memory_order_release);
+    if (!registered) {
+        atexit(emu_log_stop);
+        registered = 1;
+    }
+}
@@ -54,13 +54,32 @@ extern int  emu_touch_log_head;
 /* From emu_sdcard.c */
 extern const char *emu_sdcard_path;
 extern uint64_t emu_sdcard_size_bytes;
-extern int emu_sdcard_enabled;
+extern int emu_sdcard_slots;
+extern int emu_sdcard_mmap;
+extern const char *emu_sdcard_overlay_path;
+extern const char *emu_sdcard_dir;
+extern int emu_sdcard_sync_ms;
+extern uint64_t emu_sdcard_cache_bytes;
 extern int emu_turbo_mode;
 
-/* From esp_log.h (ring buffer) */
+/* From esp_log.h (ring buffer) / emu_log.c */
 extern char emu_log_ring[][48];
 extern int  emu_log_head;
 #define EMU_LOG_LINES 64
+extern int  emu_log_set_levels(const char *spec);
+extern void emu_log_start(void);
+extern uint64_t emu_log_history_bytes;
+extern const char *emu_log_file_path;
+extern uint64_t emu_log_file_max;
+
+/* From emu_flexe.c */
+extern const char *emu_uart_log_path;
+
+/* From emu_uart.c */
+extern int emu_uart_pty;
+extern int emu_uart_pty_start(void);
+extern void emu_uart_pty_stop(void);
+extern void emu_uart_shutdown(void);
 
 /* From esp_chip_info.h */
 int emu_chip_model = 1;  /* CHIP_ESP32 */
@@ -73,6 +92,11 @@ static const char *elf_path = NULL;
 /* Control socket path */
 static const char *control_path = NULL;
 
+/* ESP-IDF NVS partition image, loaded at start and written back on exit */
+static const char *nvs_partition_path = NULL;
+/* NVS partition image loaded at start only */
+static const char *nvs_seed_path = NULL;
+
 /* ---- Board profile ---- */
 const struct board_profile *emu_active_board = NULL;
 
@@ -131,6 +155,10 @@ static pthread_t app_thread;
 static int app_thread_valid = 0;
 static int emu_window_running = 1;  /* main event loop flag */
 
+/* ---- Save state in progress (SD snapshot running) ---- */
+static int save_pending = 0;
+static int save_percent = 0;
+
 /* ---- Menu state ---- */
 enum { MENU_CLOSED = 0, MENU_FILE, MENU_VIEW, MENU_HELP };
 static int menu_open = MENU_CLOSED;
@@ -340,6 +368,8 @@ static void render_panel(uint32_t *buf, int pw, int ph)
                        "  Speed: %.0f IPS", ips_display);
         else
             panel_line(buf, pw, ph, row++, PANEL_DIM, "  Speed: ---");
+    } else if (save_pending) {
+        panel_line(buf, pw, ph, row++, PANEL_YELLOW, "  Saving SD image: %d%%", save_percent);
     } else {
         panel_line(buf, pw, ph, row++, PANEL_DIM, "  (not running)");
     }
@@ -434,8 +464,10 @@ static int dropdown_is_disabled(int item)
 {
     if (menu_open == MENU_FILE) {
         switch (item) {
+        case 0: return save_pending;       /* Load Firmware */
         case 1: return !app_thread_valid;  /* Attach SD Image */
         case 2: return !app_thread_valid;  /* Save State */
+        case 3: return save_pending;       /* Load State */
         case 5: return !app_thread_valid;  /* Restart App */
         }
     }
@@ -620,8 +652,16 @@ static void *app_thread_func(void *arg)
 
 /* From emu_freertos.c */
 extern void emu_freertos_shutdown(void);
+extern void emu_freertos_set_virtual_time(int enable);
+extern void emu_obj_report(void);
 /* From emu_timer.c */
 extern void emu_esp_timer_shutdown(void);
+/* From emu_nvs.c */
+extern void emu_nvs_shutdown(void);
+extern int emu_nvs_import_partition(const char *path);
+extern int emu_nvs_export_partition(const char *path);
+extern void emu_nvs_set_dir(const char *dir);
+extern void emu_nvs_set_memory(int enable);
 
 static void stop_app_thread(void)
 {
@@ -631,7 +671,11 @@ static void stop_app_thread(void)
     app_thread_valid = 0;
     emu_flexe_shutdown();
     emu_freertos_shutdown();
+    emu_uart_shutdown();    /* UART drivers, so Restart App can reinstall */
+    emu_obj_report();       /* whatever the app left behind */
     emu_esp_timer_shutdown();
+    emu_nvs_shutdown();     /* write back uncommitted NVS changes */
+    sdcard_flush();         /* write back cached SD sectors */
 }
 
 static int start_app_thread(void)
@@ -653,7 +697,7 @@ static void apply_board(const struct board_profile *b)
     emu_active_board = &active;
     emu_chip_model = active.chip_model;
     emu_chip_cores = active.cores;
-    emu_sdcard_enabled = (active.sd_slots > 0) ? 1 : 0;
+    emu_sdcard_slots = active.sd_slots;
 
     if (s_window) {
         char title[128];
@@ -724,7 +768,6 @@ static void do_save_state(void)
         path[len - 4] = '\0';
 
     stop_app_thread();
-    sdcard_deinit();  /* flushes and closes SD file */
 
     struct emu_state state = {
         .board = &active,
@@ -735,14 +778,29 @@ static void do_save_state(void)
         .sdcard_size_bytes = emu_sdcard_size_bytes,
     };
 
-    int ret = emu_json_save_state(path, &state, emu_sdcard_path);
-    if (ret != 0)
-        printf("Save state failed\n");
-
+    /* The SD image is copied on a worker thread; the app restarts from
+     * poll_save_state() once the copy is complete */
+    char img_path[520];
+    snprintf(img_path, sizeof(img_path), "%s.img", path);
+    int ret = emu_json_save_state(path, &state);
     free(path);
+    if (ret != 0 || sdcard_snapshot_start(img_path) != 0) {
+        printf("Save state failed\n");
+        start_app_thread();
+        return;
+    }
+    save_pending = 1;
+    save_percent = 0;
+}
 
-    /* Reopen SD card and restart app */
-    sdcard_init();
+/* Called every frame while a save-state snapshot runs */
+static void poll_save_state(void)
+{
+    int ret = sdcard_snapshot_poll(&save_percent);
+    if (ret == 1) return;
+    save_pending = 0;
+    if (ret != 0)
+        printf("Save state failed: cannot copy SD image\n");
     start_app_thread();
 }
 
@@ -778,6 +836,7 @@ static void do_load_state(void)
     strncpy(sdcard_path_buf, img_path, sizeof(sdcard_path_buf) - 1);
     sdcard_path_buf[sizeof(sdcard_path_buf) - 1] = '\0';
     emu_sdcard_path = sdcard_path_buf;
+    emu_sdcard_dir = NULL;
 
     /* Apply firmware paths if provided */
     if (state.firmware_path && state.firmware_path[0])
@@ -819,6 +878,7 @@ static void do_attach_sd(void)
     strncpy(sdcard_path_buf, path, sizeof(sdcard_path_buf) - 1);
     sdcard_path_buf[sizeof(sdcard_path_buf) - 1] = '\0';
     emu_sdcard_path = sdcard_path_buf;
+    emu_sdcard_dir = NULL;
     free(path);
 
     sdcard_init();
@@ -1051,8 +1111,29 @@ static void usage(const char *prog)
         "Emulation:\n"
         "  --sdcard <file>         SD card image path (default: sd.img)\n"
         "  --sdcard-size <size>    SD card size, e.g. 4G (default: 4G)\n"
+        "  --sdcard-overlay <file> Keep the SD image read-only; writes go to <file>\n"
+        "  --sdcard-dir <dir>      Serve a host directory as a FAT32 card\n"
+        "  --sdcard-mmap           Map the SD image into memory for sector I/O\n"
+        "  --sdcard-sync <policy>  fsync SD image: none, close, or every <ms>\n"
+        "  --sdcard-class <class>  SD timing: spi, class2, class4, class10\n"
+        "  --sdcard-cache <size>   SD sector cache size, 0 to disable (default: 4M)\n"
+        "  --sdcard-trace <n>      Trace the last n SD requests (see sdstats)\n"
+        "  --sdcard-pack <raw> <packed>  Compress an SD image and exit\n"
         "  --scale <n>             Display scale factor 1-4 (default: 2)\n"
         "  --control <path>        Unix socket path for scripted control\n"
+        "  --uart-log <file>       Also write firmware UART output to <file>\n"
+        "  --uart-pty              Bridge UART0 TX to a host pty (path printed at start)\n"
+        "  --log-level [tag=]<lvl> Emulator log level: none, error, warn, info,\n"
+        "                          debug, verbose (repeatable)\n"
+        "  --log-history <size>    In-memory UART/log history (default: 16M)\n"
+        "  --log-file <file>       Also append the history to <file>\n"
+        "  --log-rotate <size>     Rotate --log-file at <size> (default: 64M, 0 = never)\n"
+        "  --virtual-time          FreeRTOS delays/timeouts run on a virtual clock\n"
+        "  --nvs-dir <dir>         NVS storage directory (default: ~/.cyd-emulator/nvs)\n"
+        "  --nvs-memory            Keep NVS in memory only, never touch disk\n"
+        "  --nvs-seed <file>       Load an ESP-IDF NVS partition image at start\n"
+        "  --nvs-partition <file>  ESP-IDF NVS partition image, loaded at start\n"
+        "                          and saved back on exit\n"
         "\n"
         "Controls:\n"
         "  Click on display   Tap touchscreen\n"
@@ -1087,6 +1168,7 @@ int main(int argc, char *argv[])
     const char *chip_override = NULL;
     const char *touch_override = NULL;
     int sdcard_slots_override = -1;
+    int virtual_time = 0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
@@ -1099,6 +1181,35 @@ int main(int argc, char *argv[])
             emu_sdcard_path = argv[++i];
         } else if (strcmp(argv[i], "--sdcard-size") == 0 && i + 1 < argc) {
             emu_sdcard_size_bytes = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--sdcard-overlay") == 0 && i + 1 < argc) {
+            emu_sdcard_overlay_path = argv[++i];
+        } else if (strcmp(argv[i], "--sdcard-dir") == 0 && i + 1 < argc) {
+            emu_sdcard_dir = argv[++i];
+        } else if (strcmp(argv[i], "--sdcard-mmap") == 0) {
+            emu_sdcard_mmap = 1;
+        } else if (strcmp(argv[i], "--sdcard-sync") == 0 && i + 1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "none") == 0)
+                emu_sdcard_sync_ms = SDCARD_SYNC_NONE;
+            else if (strcmp(p, "close") == 0)
+                emu_sdcard_sync_ms = SDCARD_SYNC_DEINIT;
+            else if (atoi(p) > 0)
+                emu_sdcard_sync_ms = atoi(p);
+            else {
+                fprintf(stderr, "Bad --sdcard-sync policy: %s\n", p);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--sdcard-cache") == 0 && i + 1 < argc) {
+            emu_sdcard_cache_bytes = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--sdcard-trace") == 0 && i + 1 < argc) {
+            sdcard_trace_enable((uint32_t)atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--sdcard-pack") == 0 && i + 2 < argc) {
+            return sdcard_pack_image(argv[i + 1], argv[i + 2]) == 0 ? 0 : 1;
+        } else if (strcmp(argv[i], "--sdcard-class") == 0 && i + 1 < argc) {
+            if (sdcard_set_speed_class(argv[++i]) != 0) {
+                fprintf(stderr, "Unknown --sdcard-class: %s\n", argv[i]);
+                return 1;
+            }
         } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
             scale = atoi(argv[++i]);
             if (scale < 1) scale = 1;
@@ -1117,6 +1228,31 @@ int main(int argc, char *argv[])
             elf_path = argv[++i];
         } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
             control_path = argv[++i];
+        } else if (strcmp(argv[i], "--uart-log") == 0 && i + 1 < argc) {
+            emu_uart_log_path = argv[++i];
+        } else if (strcmp(argv[i], "--uart-pty") == 0) {
+            emu_uart_pty = 1;
+        } else if (strcmp(argv[i], "--log-history") == 0 && i + 1 < argc) {
+            emu_log_history_bytes = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            emu_log_file_path = argv[++i];
+        } else if (strcmp(argv[i], "--log-rotate") == 0 && i + 1 < argc) {
+            emu_log_file_max = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            if (emu_log_set_levels(argv[++i]) != 0) {
+                fprintf(stderr, "Bad --log-level: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--virtual-time") == 0) {
+            virtual_time = 1;
+        } else if (strcmp(argv[i], "--nvs-dir") == 0 && i + 1 < argc) {
+            emu_nvs_set_dir(argv[++i]);
+        } else if (strcmp(argv[i], "--nvs-memory") == 0) {
+            emu_nvs_set_memory(1);
+        } else if (strcmp(argv[i], "--nvs-seed") == 0 && i + 1 < argc) {
+            nvs_seed_path = argv[++i];
+        } else if (strcmp(argv[i], "--nvs-partition") == 0 && i + 1 < argc) {
+            nvs_partition_path = argv[++i];
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             usage(argv[0]);
             return 0;
@@ -1179,7 +1315,24 @@ int main(int argc, char *argv[])
 
     emu_chip_model = active.chip_model;
     emu_chip_cores = active.cores;
-    emu_sdcard_enabled = (active.sd_slots > 0) ? 1 : 0;
+    emu_sdcard_slots = active.sd_slots;
+
+    if (virtual_time)
+        emu_freertos_set_virtual_time(1);
+
+    /* ESP_LOG output is formatted on the logger thread from here on */
+    emu_log_start();
+
+    if (nvs_seed_path && emu_nvs_import_partition(nvs_seed_path) != 0) {
+        fprintf(stderr, "Failed to load NVS seed: %s\n", nvs_seed_path);
+        return 1;
+    }
+    /* A missing image is created on exit */
+    if (nvs_partition_path && access(nvs_partition_path, F_OK) == 0 &&
+        emu_nvs_import_partition(nvs_partition_path) != 0) {
+        fprintf(stderr, "Failed to load NVS partition: %s\n", nvs_partition_path);
+        return 1;
+    }
 
     /* Load firmware if provided, otherwise start GUI without it */
     int firmware_loaded = 0;
@@ -1207,6 +1360,8 @@ int main(int argc, char *argv[])
     if (elf_path) printf("  ELF:     %s\n", elf_path);
     if (control_path)
         printf("  Control: %s\n", control_path);
+    if (nvs_partition_path)
+        printf("  NVS:     %s\n", nvs_partition_path);
     printf("\n");
 
     /* Initialize SDL */
@@ -1279,6 +1434,9 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Warning: failed to create control socket %s\n", control_path);
     }
 
+    if (emu_uart_pty && emu_uart_pty_start() != 0)
+        fprintf(stderr, "Warning: failed to create UART pty\n");
+
     /* Start the app thread if firmware was loaded */
     if (firmware_loaded) {
         if (start_app_thread() != 0) {
@@ -1472,13 +1630,20 @@ int main(int argc, char *argv[])
         SDL_RenderPresent(s_renderer);
 
         emu_control_poll();
+        if (save_pending)
+            poll_save_state();
 
         SDL_Delay(16);
     }
 
     /* Clean shutdown */
     emu_control_shutdown();
+    while (sdcard_snapshot_poll(NULL) == 1)  /* finish a save in progress */
+        SDL_Delay(16);
     stop_app_thread();
+    emu_uart_pty_stop();
+    if (nvs_partition_path)
+        emu_nvs_export_partition(nvs_partition_path);
 
     free(panel_pixels);
     free(menu_pixels);
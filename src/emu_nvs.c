@@ -1,11 +1,36 @@
 /*
  * emu_nvs.c -- NVS emulation via file-backed key-value store
  *
- * Each namespace gets a binary file in ~/.cyd-emulator/nvs/.
- * Format: sequence of (key_len[1], key[key_len], val_len[4LE], val[val_len])
- * On commit, the entire file is rewritten.
+ * Each namespace gets an append-only record log in ~/.cyd-emulator/nvs/
+ * (or the directory given by emu_nvs_set_dir()).
+ * File: magic "CYDNVSL1", then records of
+ *   type[1] key_len[1] val_len[4LE] key[key_len] val[val_len] crc32[4LE]
+ * where the CRC covers everything before it.  nvs_commit() appends one
+ * record per changed key (or erase) with a single fsync.  Opening
+ * replays the log, stopping at the first torn or corrupt record.
  *
- * Simple and correct, not optimized for large datasets.
+ * Once garbage (superseded records) outweighs live data, or too many
+ * records have piled up since the last checkpoint, a background thread
+ * rewrites the log as one SET record per live key — a checkpoint that
+ * bounds reopen time.  Files in the old whole-file format are read and
+ * converted on first open.
+ *
+ * In memory, keys are found through an open-addressing hash index over
+ * a growable entry array (no fixed key limit), and values live in a
+ * per-namespace arena instead of one allocation each.
+ *
+ * Each namespace is loaded once per run and cached; every nvs_open()
+ * of the same name returns a handle onto the shared copy, guarded by a
+ * reader/writer lock.  Open mode is per handle.  Changes left
+ * uncommitted are written back by the background thread once they are
+ * NVS_WRITEBACK_MS old, and on emulator shutdown.
+ *
+ * Raw ESP-IDF NVS partition images (as flashed to a device) can be
+ * imported into the store and the store exported back as one.
+ *
+ * With emu_nvs_set_memory(1) nothing is read from or written to the
+ * NVS directory: namespaces start empty (or seeded from an imported
+ * image) and commits only mark changes as committed.
  */
 
 #ifdef _MSC_VER
@@ -17,55 +42,150 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
 
 static const char *TAG = "nvs";
 
 /* ---- In-memory key-value entry ---- */
 
 #define NVS_MAX_KEY_LEN   16
-#define NVS_MAX_ENTRIES   128
 
 struct nvs_entry {
     char key[NVS_MAX_KEY_LEN];
-    void *data;
+    uint32_t hash;
+    void *data;           /* value bytes, in the namespace arena */
     size_t size;
+    size_t cap;           /* arena bytes reserved at data */
+    size_t rec_size;      /* bytes of this key's latest record in the log */
+    uint8_t type;         /* nvs_type_t it was set as, 0 = unknown */
+    int dirty;            /* changed since last commit */
+};
+
+/* Value arena: values are bump-allocated from chunks; a value that fits
+ * its old slot is overwritten in place.  Freed slots are only counted,
+ * and the arena is repacked once they outweigh the live values. */
+#define NVS_ARENA_CHUNK   4096
+
+struct nvs_arena_chunk {
+    struct nvs_arena_chunk *next;
+    size_t used, size;
+    uint8_t data[];
 };
 
 struct nvs_namespace {
+    pthread_rwlock_t lock;  /* rd: getters; wr: everything that mutates */
     char name[NVS_MAX_KEY_LEN];
-    nvs_open_mode_t mode;
-    struct nvs_entry entries[NVS_MAX_ENTRIES];
-    int count;
-    int dirty;
     char filepath[512];
+    struct nvs_namespace *cache_next;
+
+    /* Entries (dense, growable) and an open-addressing index over them */
+    struct nvs_entry *entries;
+    int count, cap;
+    int *index;           /* entry index + 1, 0 = empty slot */
+    size_t index_cap;     /* power of two */
+    int dirty;
+    uint64_t dirty_since_ms;  /* when dirty was first set, for write-back */
+    int needs_checkpoint;     /* file was torn or legacy: rewrite on first RW use */
+
+    struct nvs_arena_chunk *arena;
+    size_t arena_live, arena_garbage;
+
+    /* Pending erases, written ahead of the dirty entries on commit */
+    char (*erased)[NVS_MAX_KEY_LEN];
+    int erased_count, erased_cap;
+    int clear_pending;    /* nvs_erase_all since last commit */
+
+    /* Log state */
+    FILE *log;            /* append handle, opened on first commit */
+    size_t log_bytes;     /* current file size */
+    size_t live_bytes;    /* sum of rec_size over entries */
+    int records_since_ckpt;
+
+    int compact_queued;
+    struct nvs_namespace *compact_next;
 };
 
-/* ---- Handle management ---- */
+/* ---- Namespace cache and handle management ---- */
 
 #define MAX_NVS_HANDLES 16
-static struct nvs_namespace *handles[MAX_NVS_HANDLES];
 
-static nvs_handle_t alloc_handle(struct nvs_namespace *ns)
+struct nvs_handle_slot {
+    struct nvs_namespace *ns;
+    nvs_open_mode_t mode;
+};
+
+/* cache_mutex guards the cache list and the handle table.  Cached
+ * namespaces live until exit, so a handle's ns pointer stays valid. */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct nvs_namespace *ns_cache;
+static struct nvs_handle_slot handles[MAX_NVS_HANDLES];
+
+/* Caller holds cache_mutex */
+static nvs_handle_t alloc_handle(struct nvs_namespace *ns, nvs_open_mode_t mode)
 {
     for (int i = 0; i < MAX_NVS_HANDLES; i++) {
-        if (!handles[i]) {
-            handles[i] = ns;
+        if (!handles[i].ns) {
+            handles[i].ns = ns;
+            handles[i].mode = mode;
             return (nvs_handle_t)(i + 1);  /* 1-based */
         }
     }
     return 0;
 }
 
-static struct nvs_namespace *get_ns(nvs_handle_t handle)
+static struct nvs_handle_slot *get_handle(nvs_handle_t handle)
 {
     if (handle == 0 || handle > MAX_NVS_HANDLES) return NULL;
-    return handles[handle - 1];
+    struct nvs_handle_slot *hs = &handles[handle - 1];
+    return hs->ns ? hs : NULL;
+}
+
+static struct nvs_namespace *get_ns(nvs_handle_t handle)
+{
+    struct nvs_handle_slot *hs = get_handle(handle);
+    return hs ? hs->ns : NULL;
 }
 
-/* ---- Directory setup ---- */
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---- Storage root ---- */
+
+/* Both must be set before the first nvs_open() */
+static char nvs_root[400];        /* "" = $HOME/.cyd-emulator/nvs */
+static int nvs_in_memory = 0;
+
+void emu_nvs_set_dir(const char *dir)
+{
+    strncpy(nvs_root, dir, sizeof(nvs_root) - 1);
+    size_t n = strlen(nvs_root);
+    while (n > 1 && (nvs_root[n - 1] == '/' || nvs_root[n - 1] == '\\'))
+        nvs_root[--n] = '\0';
+}
+
+void emu_nvs_set_memory(int enable)
+{
+    nvs_in_memory = enable;
+}
 
 static const char *get_home_dir(void)
 {
@@ -77,8 +197,21 @@ static const char *get_home_dir(void)
     return home;
 }
 
+static void nvs_dir(char *buf, size_t bufsize)
+{
+    if (nvs_root[0])
+        snprintf(buf, bufsize, "%s", nvs_root);
+    else
+        snprintf(buf, bufsize, "%s/.cyd-emulator/nvs", get_home_dir());
+}
+
 static void ensure_nvs_dir(void)
 {
+    if (nvs_in_memory) return;
+    if (nvs_root[0]) {
+        mkdir(nvs_root, 0755);
+        return;
+    }
     const char *home = get_home_dir();
     char dir[512];
     snprintf(dir, sizeof(dir), "%s/.cyd-emulator", home);
@@ -89,116 +222,883 @@ static void ensure_nvs_dir(void)
 
 static void ns_filepath(const char *namespace_name, char *buf, size_t bufsize)
 {
-    const char *home = get_home_dir();
-    snprintf(buf, bufsize, "%s/.cyd-emulator/nvs/%s.nvs", home, namespace_name);
+    char dir[448];
+    nvs_dir(dir, sizeof(dir));
+    snprintf(buf, bufsize, "%s/%s.nvs", dir, namespace_name);
 }
 
-/* ---- File I/O ---- */
+/* ---- Record encoding ---- */
 
-static void ns_load(struct nvs_namespace *ns)
+#define NVS_LOG_MAGIC        "CYDNVSL1"
+#define NVS_LOG_MAGIC_LEN    8
+#define NVS_REC_HDR          6     /* type + key_len + val_len */
+#define NVS_REC_CRC          4
+#define NVS_MAX_VALUE        (1024 * 1024)   /* sanity limit: 1MB */
+
+/* Compact once garbage exceeds both this floor and the live data */
+#define NVS_COMPACT_MIN_GARBAGE  4096
+/* ...or once this many records were appended since the last checkpoint */
+#define NVS_CHECKPOINT_RECORDS   256
+
+/* REC_SET_TYPED carries the nvs_type_t as the first value byte */
+enum { REC_SET = 1, REC_ERASE = 2, REC_CLEAR = 3, REC_SET_TYPED = 4 };
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static size_t rec_size(size_t klen, size_t vlen)
 {
-    FILE *f = fopen(ns->filepath, "rb");
-    if (!f) return;
+    return NVS_REC_HDR + klen + vlen + NVS_REC_CRC;
+}
+
+/* Encode one record at out (which must hold rec_size bytes) */
+static size_t rec_encode(uint8_t *out, int type, const char *key,
+                         const void *val, size_t vlen)
+{
+    size_t klen = key ? strlen(key) : 0;
+    out[0] = (uint8_t)type;
+    out[1] = (uint8_t)klen;
+    put_le32(out + 2, (uint32_t)vlen);
+    if (klen) memcpy(out + NVS_REC_HDR, key, klen);
+    if (vlen) memcpy(out + NVS_REC_HDR + klen, val, vlen);
+    size_t body = NVS_REC_HDR + klen + vlen;
+    put_le32(out + body, esp_rom_crc32_le(0, out, (uint32_t)body));
+    return body + NVS_REC_CRC;
+}
+
+static size_t entry_rec_size(const struct nvs_entry *e)
+{
+    return rec_size(strlen(e->key), e->size + (e->type ? 1 : 0));
+}
+
+/* Encode the SET record for e */
+static size_t entry_encode(uint8_t *out, const struct nvs_entry *e)
+{
+    if (!e->type)
+        return rec_encode(out, REC_SET, e->key, e->data, e->size);
+
+    size_t klen = strlen(e->key);
+    out[0] = REC_SET_TYPED;
+    out[1] = (uint8_t)klen;
+    put_le32(out + 2, (uint32_t)(e->size + 1));
+    memcpy(out + NVS_REC_HDR, e->key, klen);
+    out[NVS_REC_HDR + klen] = e->type;
+    if (e->size) memcpy(out + NVS_REC_HDR + klen + 1, e->data, e->size);
+    size_t body = NVS_REC_HDR + klen + 1 + e->size;
+    put_le32(out + body, esp_rom_crc32_le(0, out, (uint32_t)body));
+    return body + NVS_REC_CRC;
+}
+
+/* Build the checkpoint image: magic + one SET record per live key.
+ * Every key now has a record on disk, so a later erase must be logged
+ * even if the key was never committed. */
+static uint8_t *ns_serialize(struct nvs_namespace *ns, size_t *out_len)
+{
+    size_t len = NVS_LOG_MAGIC_LEN;
+    for (int i = 0; i < ns->count; i++)
+        len += entry_rec_size(&ns->entries[i]);
+
+    uint8_t *buf = malloc(len);
+    if (!buf) return NULL;
+    memcpy(buf, NVS_LOG_MAGIC, NVS_LOG_MAGIC_LEN);
+    size_t off = NVS_LOG_MAGIC_LEN;
+    for (int i = 0; i < ns->count; i++) {
+        struct nvs_entry *e = &ns->entries[i];
+        size_t n = entry_encode(buf + off, e);
+        ns->live_bytes += n - e->rec_size;
+        e->rec_size = n;
+        off += n;
+    }
+    *out_len = len;
+    return buf;
+}
+
+/* ---- Value arena ---- */
+
+static void arena_free_all(struct nvs_namespace *ns)
+{
+    while (ns->arena) {
+        struct nvs_arena_chunk *c = ns->arena;
+        ns->arena = c->next;
+        free(c);
+    }
+    ns->arena_live = ns->arena_garbage = 0;
+}
+
+static void *arena_alloc(struct nvs_namespace *ns, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (size == 0) size = 8;
+    struct nvs_arena_chunk *c = ns->arena;
+    if (!c || c->size - c->used < size) {
+        size_t csize = size > NVS_ARENA_CHUNK ? size : NVS_ARENA_CHUNK;
+        c = malloc(sizeof(*c) + csize);
+        if (!c) return NULL;
+        c->used = 0;
+        c->size = csize;
+        c->next = ns->arena;
+        ns->arena = c;
+    }
+    void *p = c->data + c->used;
+    c->used += size;
+    ns->arena_live += size;
+    return p;
+}
 
+static size_t arena_slot(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    return size ? size : 8;
+}
+
+/* Copy every live value into fresh chunks and drop the old ones */
+static void arena_repack(struct nvs_namespace *ns)
+{
+    struct nvs_arena_chunk *old = ns->arena;
+    ns->arena = NULL;
+    ns->arena_live = ns->arena_garbage = 0;
+
+    for (int i = 0; i < ns->count; i++) {
+        struct nvs_entry *e = &ns->entries[i];
+        void *p = arena_alloc(ns, e->size);
+        if (!p) {
+            /* Out of memory: keep the old chunks alive as well */
+            struct nvs_arena_chunk **tail = &ns->arena;
+            while (*tail) tail = &(*tail)->next;
+            *tail = old;
+            return;
+        }
+        memcpy(p, e->data, e->size);
+        e->data = p;
+        e->cap = arena_slot(e->size);
+    }
+    while (old) {
+        struct nvs_arena_chunk *c = old;
+        old = c->next;
+        free(c);
+    }
+}
+
+/* ---- Key index ---- */
+
+static uint32_t key_hash(const char *key)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    while (*key) {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slot holding key, or the empty slot where it would go */
+static size_t index_slot(struct nvs_namespace *ns, const char *key, uint32_t hash)
+{
+    size_t mask = ns->index_cap - 1;
+    size_t i = hash & mask;
+    while (ns->index[i]) {
+        struct nvs_entry *e = &ns->entries[ns->index[i] - 1];
+        if (e->hash == hash && strcmp(e->key, key) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int index_rebuild(struct nvs_namespace *ns, size_t cap)
+{
+    int *idx = calloc(cap, sizeof(*idx));
+    if (!idx) return -1;
+    free(ns->index);
+    ns->index = idx;
+    ns->index_cap = cap;
+    for (int n = 0; n < ns->count; n++) {
+        size_t i = ns->entries[n].hash & (cap - 1);
+        while (idx[i]) i = (i + 1) & (cap - 1);
+        idx[i] = n + 1;
+    }
+    return 0;
+}
+
+/* Empty a slot, shifting later entries of the probe run back so that
+ * lookups never need tombstones */
+static void index_delete_slot(struct nvs_namespace *ns, size_t hole)
+{
+    size_t mask = ns->index_cap - 1;
+    size_t i = hole;
+    ns->index[hole] = 0;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!ns->index[i]) return;
+        size_t home = ns->entries[ns->index[i] - 1].hash & mask;
+        /* Move it if its home is not within (hole, i] cyclically */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            ns->index[hole] = ns->index[i];
+            ns->index[i] = 0;
+            hole = i;
+        }
+    }
+}
+
+/* ---- In-memory entry updates (shared by replay and the setters) ---- */
+
+static struct nvs_entry *find_entry(struct nvs_namespace *ns, const char *key)
+{
+    if (!ns->count) return NULL;
+    size_t i = index_slot(ns, key, key_hash(key));
+    return ns->index[i] ? &ns->entries[ns->index[i] - 1] : NULL;
+}
+
+static void free_entries(struct nvs_namespace *ns)
+{
     ns->count = 0;
-    while (ns->count < NVS_MAX_ENTRIES) {
-        uint8_t klen;
-        if (fread(&klen, 1, 1, f) != 1) break;
-        if (klen == 0 || klen >= NVS_MAX_KEY_LEN) break;
+    ns->live_bytes = 0;
+    if (ns->index) memset(ns->index, 0, ns->index_cap * sizeof(*ns->index));
+    arena_free_all(ns);
+}
+
+static void remove_entry(struct nvs_namespace *ns, struct nvs_entry *e)
+{
+    int n = (int)(e - ns->entries);
+    ns->live_bytes -= e->rec_size;
+    ns->arena_live -= e->cap;
+    ns->arena_garbage += e->cap;
+    index_delete_slot(ns, index_slot(ns, e->key, e->hash));
+
+    /* Move the last entry into the gap and repoint its index slot */
+    int last = --ns->count;
+    if (n != last) {
+        ns->entries[n] = ns->entries[last];
+        size_t i = index_slot(ns, ns->entries[n].key, ns->entries[n].hash);
+        ns->index[i] = n + 1;
+    }
+}
+
+/* Store a copy of data under key.  Returns NULL when out of memory. */
+static struct nvs_entry *put_entry(struct nvs_namespace *ns, const char *key,
+                                   const void *data, size_t size)
+{
+    char k[NVS_MAX_KEY_LEN];
+    strncpy(k, key, NVS_MAX_KEY_LEN - 1);
+    k[NVS_MAX_KEY_LEN - 1] = '\0';
+    uint32_t hash = key_hash(k);
+
+    /* Keep the index at most 3/4 full */
+    if ((size_t)(ns->count + 1) * 4 > ns->index_cap * 3) {
+        if (index_rebuild(ns, ns->index_cap ? ns->index_cap * 2 : 64) != 0)
+            return NULL;
+    }
+
+    struct nvs_entry *e = NULL;
+    size_t slot = index_slot(ns, k, hash);
+    if (ns->index[slot]) {
+        e = &ns->entries[ns->index[slot] - 1];
+        if (size <= e->cap) {
+            memcpy(e->data, data, size);   /* fits the old slot */
+            e->size = size;
+            return e;
+        }
+    }
+
+    if (ns->arena_garbage > NVS_ARENA_CHUNK && ns->arena_garbage > ns->arena_live)
+        arena_repack(ns);
+    void *p = arena_alloc(ns, size);
+    if (!p) return NULL;
+    memcpy(p, data, size);
+
+    if (!e) {
+        if (ns->count == ns->cap) {
+            int cap = ns->cap ? ns->cap * 2 : 32;
+            struct nvs_entry *ents = realloc(ns->entries, (size_t)cap * sizeof(*ents));
+            if (!ents) {
+                ns->arena_live -= arena_slot(size);
+                ns->arena_garbage += arena_slot(size);
+                return NULL;
+            }
+            ns->entries = ents;
+            ns->cap = cap;
+        }
+        e = &ns->entries[ns->count];
+        memset(e, 0, sizeof(*e));
+        memcpy(e->key, k, sizeof(k));
+        e->hash = hash;
+        ns->index[slot] = ++ns->count;
+    } else {
+        ns->arena_live -= e->cap;
+        ns->arena_garbage += e->cap;
+    }
+    e->data = p;
+    e->size = size;
+    e->cap = arena_slot(size);
+    return e;
+}
+
+/* Remember a logged key erased since the last commit */
+static void erased_add(struct nvs_namespace *ns, const char *key)
+{
+    for (int i = 0; i < ns->erased_count; i++)
+        if (strcmp(ns->erased[i], key) == 0) return;
+
+    if (ns->erased_count == ns->erased_cap) {
+        int cap = ns->erased_cap ? ns->erased_cap * 2 : 16;
+        char (*er)[NVS_MAX_KEY_LEN] = realloc(ns->erased, (size_t)cap * sizeof(*er));
+        if (!er) {
+            /* Fall back to rewriting everything on the next commit */
+            ns->clear_pending = 1;
+            ns->erased_count = 0;
+            for (int i = 0; i < ns->count; i++) ns->entries[i].dirty = 1;
+            return;
+        }
+        ns->erased = er;
+        ns->erased_cap = cap;
+    }
+    strcpy(ns->erased[ns->erased_count++], key);
+}
 
-        struct nvs_entry *e = &ns->entries[ns->count];
-        if (fread(e->key, 1, klen, f) != klen) break;
-        e->key[klen] = '\0';
+/* ---- File I/O ---- */
 
-        uint32_t vlen;
-        if (fread(&vlen, 1, 4, f) != 4) break;
-        if (vlen > 1024 * 1024) break;  /* sanity limit: 1MB */
+static int file_sync(FILE *f)
+{
+    if (fflush(f) != 0) return -1;
+#ifdef _MSC_VER
+    return _commit(_fileno(f));
+#else
+    return fsync(fileno(f));
+#endif
+}
 
-        e->data = malloc(vlen);
-        if (!e->data) break;
-        if (fread(e->data, 1, vlen, f) != vlen) {
-            free(e->data);
-            e->data = NULL;
+static uint8_t *read_file(const char *path, size_t *out_len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = len > 0 ? malloc((size_t)len) : NULL;
+    if (buf && fread(buf, 1, (size_t)len, f) != (size_t)len) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *out_len = buf ? (size_t)len : 0;
+    return buf;
+}
+
+/* Pre-log format: (key_len[1], key, val_len[4], val) repeated */
+static void ns_load_legacy(struct nvs_namespace *ns, const uint8_t *buf, size_t len)
+{
+    size_t off = 0;
+    while (off + 1 <= len) {
+        uint8_t klen = buf[off];
+        if (klen == 0 || klen >= NVS_MAX_KEY_LEN) break;
+        if (off + 1 + klen + 4 > len) break;
+
+        char key[NVS_MAX_KEY_LEN];
+        memcpy(key, buf + off + 1, klen);
+        key[klen] = '\0';
+        uint32_t vlen = get_le32(buf + off + 1 + klen);
+        if (vlen > NVS_MAX_VALUE || off + 5 + klen + vlen > len) break;
+
+        struct nvs_entry *e = put_entry(ns, key, buf + off + 5 + klen, vlen);
+        if (!e) break;
+        ns->live_bytes -= e->rec_size;
+        e->rec_size = rec_size(klen, vlen);
+        ns->live_bytes += e->rec_size;
+        off += 5 + klen + vlen;
+    }
+}
+
+/* Replay log records.  Returns the offset just past the last good one. */
+static size_t ns_replay(struct nvs_namespace *ns, const uint8_t *buf, size_t len)
+{
+    size_t off = NVS_LOG_MAGIC_LEN;
+    ns->records_since_ckpt = 0;
+
+    while (off + NVS_REC_HDR + NVS_REC_CRC <= len) {
+        const uint8_t *r = buf + off;
+        int type = r[0];
+        size_t klen = r[1];
+        size_t vlen = get_le32(r + 2);
+        if (klen >= NVS_MAX_KEY_LEN || vlen > NVS_MAX_VALUE) break;
+        size_t body = NVS_REC_HDR + klen + vlen;
+        if (off + body + NVS_REC_CRC > len) break;   /* torn write */
+        if (get_le32(r + body) != esp_rom_crc32_le(0, r, (uint32_t)body)) break;
+
+        char key[NVS_MAX_KEY_LEN];
+        memcpy(key, r + NVS_REC_HDR, klen);
+        key[klen] = '\0';
+
+        if (type == REC_SET || type == REC_SET_TYPED) {
+            const uint8_t *val = r + NVS_REC_HDR + klen;
+            int typed = type == REC_SET_TYPED;
+            if (typed && vlen == 0) break;
+            struct nvs_entry *e = put_entry(ns, key, val + typed, vlen - typed);
+            if (!e) break;
+            e->type = typed ? val[0] : 0;
+            ns->live_bytes -= e->rec_size;
+            e->rec_size = body + NVS_REC_CRC;
+            ns->live_bytes += e->rec_size;
+        } else if (type == REC_ERASE) {
+            struct nvs_entry *e = find_entry(ns, key);
+            if (e) remove_entry(ns, e);
+        } else if (type == REC_CLEAR) {
+            free_entries(ns);
+        } else {
             break;
         }
-        e->size = vlen;
-        ns->count++;
+        off += body + NVS_REC_CRC;
+        ns->records_since_ckpt++;
     }
+    return off;
+}
 
+/* Replace path with buf via a temp file + rename */
+static int write_file_atomic(const char *path, const uint8_t *buf, size_t len)
+{
+    char tmp[520];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    int ok = fwrite(buf, 1, len, f) == len && file_sync(f) == 0;
     fclose(f);
+#ifdef _WIN32
+    if (ok) remove(path);   /* rename() does not replace on Windows */
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
 }
 
-static void ns_save(struct nvs_namespace *ns)
+/* Synchronous checkpoint of the full in-memory state, which then counts
+ * as committed.  Used at open and to start a log from scratch; in
+ * memory mode it is all a commit does. */
+static int ns_checkpoint(struct nvs_namespace *ns)
 {
-    FILE *f = fopen(ns->filepath, "wb");
-    if (!f) {
-        ESP_LOGE(TAG, "Cannot write %s: %s", ns->filepath, strerror(errno));
-        return;
+    size_t len = 0;
+    if (!nvs_in_memory) {
+        uint8_t *buf = ns_serialize(ns, &len);
+        if (!buf) return -1;
+        if (ns->log) { fclose(ns->log); ns->log = NULL; }
+        int ret = write_file_atomic(ns->filepath, buf, len);
+        free(buf);
+        if (ret != 0) {
+            ESP_LOGE(TAG, "Cannot write %s: %s", ns->filepath, strerror(errno));
+            return -1;
+        }
     }
 
+    ns->log_bytes = len;
+    ns->live_bytes = 0;
     for (int i = 0; i < ns->count; i++) {
         struct nvs_entry *e = &ns->entries[i];
-        uint8_t klen = (uint8_t)strlen(e->key);
-        uint32_t vlen = (uint32_t)e->size;
-        fwrite(&klen, 1, 1, f);
-        fwrite(e->key, 1, klen, f);
-        fwrite(&vlen, 1, 4, f);
-        fwrite(e->data, 1, e->size, f);
+        e->rec_size = entry_rec_size(e);
+        e->dirty = 0;
+        ns->live_bytes += e->rec_size;
     }
-
-    fclose(f);
+    ns->records_since_ckpt = ns->count;
+    ns->erased_count = 0;
+    ns->clear_pending = 0;
     ns->dirty = 0;
+    ns->needs_checkpoint = 0;
+    return 0;
 }
 
-/* ---- Entry lookup ---- */
+static void ns_load(struct nvs_namespace *ns)
+{
+    if (nvs_in_memory) return;
+
+    size_t len;
+    uint8_t *buf = read_file(ns->filepath, &len);
+    if (!buf) return;
+
+    int rewrite = 0;
+    if (len >= NVS_LOG_MAGIC_LEN && memcmp(buf, NVS_LOG_MAGIC, NVS_LOG_MAGIC_LEN) == 0) {
+        size_t good = ns_replay(ns, buf, len);
+        ns->log_bytes = len;
+        if (good < len) {
+            ESP_LOGW(TAG, "%s: dropping %zu bytes of torn/corrupt log tail",
+                     ns->name, len - good);
+            rewrite = 1;
+        }
+    } else {
+        ns_load_legacy(ns, buf, len);
+        rewrite = 1;   /* convert to the log format */
+    }
+    free(buf);
 
-static struct nvs_entry *find_entry(struct nvs_namespace *ns, const char *key)
+    /* Left for the first read-write open, so read-only use never writes */
+    ns->needs_checkpoint = rewrite;
+}
+
+/* ---- Background worker: compaction and write-back ---- */
+
+/* Uncommitted changes older than this are committed by the worker */
+#define NVS_WRITEBACK_MS  1000
+
+/* Clock used for condvar timeouts (MSVC pthreads only support REALTIME) */
+#ifdef _MSC_VER
+#define NVS_COND_CLOCK CLOCK_REALTIME
+#else
+#define NVS_COND_CLOCK CLOCK_MONOTONIC
+#endif
+
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond;        /* set up by worker_ensure_started */
+static int worker_cond_ready = 0;
+static struct nvs_namespace *compact_queue;
+static pthread_t worker_thread;
+static int worker_started = 0;
+static int worker_quit = 0;               /* drain compact_queue, then exit */
+
+static esp_err_t ns_commit_locked(struct nvs_namespace *ns);
+
+/* Rewrite the log without holding ns->lock across the file I/O: snapshot
+ * the live set, write it out, then copy across any records appended
+ * meanwhile and swap the files under the lock. */
+static void ns_compact(struct nvs_namespace *ns)
 {
-    for (int i = 0; i < ns->count; i++) {
-        if (strcmp(ns->entries[i].key, key) == 0)
-            return &ns->entries[i];
+    pthread_rwlock_wrlock(&ns->lock);
+    size_t len, snap_off = ns->log_bytes;
+    uint8_t *buf = ns_serialize(ns, &len);
+    int snap_records = ns->records_since_ckpt;
+    int snap_count = ns->count;
+    pthread_rwlock_unlock(&ns->lock);
+    if (!buf) return;
+
+    char tmp[520];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ns->filepath);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(buf, 1, len, f) == len;
+    free(buf);
+
+    pthread_rwlock_wrlock(&ns->lock);
+    if (ok && ns->log_bytes > snap_off) {
+        /* Records committed while we were writing */
+        size_t old_len;
+        uint8_t *old = read_file(ns->filepath, &old_len);
+        ok = old && old_len >= ns->log_bytes &&
+             fwrite(old + snap_off, 1, ns->log_bytes - snap_off, f) == ns->log_bytes - snap_off;
+        len += ns->log_bytes - snap_off;
+        free(old);
+    }
+    if (ok) ok = file_sync(f) == 0;
+    if (f) fclose(f);
+    if (ok) {
+        if (ns->log) { fclose(ns->log); ns->log = NULL; }
+#ifdef _WIN32
+        remove(ns->filepath);
+#endif
+        ok = rename(tmp, ns->filepath) == 0;
     }
+    if (ok) {
+        ESP_LOGI(TAG, "Compacted '%s': %zu -> %zu bytes",
+                 ns->name, ns->log_bytes, len);
+        ns->log_bytes = len;
+        ns->records_since_ckpt = snap_count + ns->records_since_ckpt - snap_records;
+    } else {
+        remove(tmp);
+        ESP_LOGE(TAG, "Compaction of '%s' failed", ns->name);
+    }
+    pthread_rwlock_unlock(&ns->lock);
+}
+
+/* Commit every namespace whose oldest uncommitted change has aged past
+ * max_age_ms (0 = all dirty namespaces).  Returns the first error. */
+static esp_err_t writeback_dirty(uint64_t max_age_ms)
+{
+    pthread_mutex_lock(&cache_mutex);
+    struct nvs_namespace *head = ns_cache;
+    pthread_mutex_unlock(&cache_mutex);
+
+    esp_err_t err = ESP_OK;
+    uint64_t now = now_ms();
+    for (struct nvs_namespace *ns = head; ns; ns = ns->cache_next) {
+        pthread_rwlock_wrlock(&ns->lock);
+        if (ns->dirty && now - ns->dirty_since_ms >= max_age_ms) {
+            esp_err_t e = ns_commit_locked(ns);
+            if (e != ESP_OK && err == ESP_OK) err = e;
+        }
+        pthread_rwlock_unlock(&ns->lock);
+    }
+    return err;
+}
+
+static void *worker_thread_func(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&worker_mutex);
+    for (;;) {
+        if (!compact_queue && worker_quit) break;
+        if (!compact_queue) {
+            struct timespec ts;
+            clock_gettime(NVS_COND_CLOCK, &ts);
+            ts.tv_nsec += (NVS_WRITEBACK_MS / 2) * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&worker_cond, &worker_mutex, &ts);
+        }
+        struct nvs_namespace *ns = compact_queue;
+        if (ns) compact_queue = ns->compact_next;
+        pthread_mutex_unlock(&worker_mutex);
+
+        if (ns) {
+            ns_compact(ns);
+            pthread_rwlock_wrlock(&ns->lock);
+            ns->compact_queued = 0;
+            pthread_rwlock_unlock(&ns->lock);
+        } else {
+            writeback_dirty(NVS_WRITEBACK_MS);
+        }
+
+        pthread_mutex_lock(&worker_mutex);
+    }
+    pthread_mutex_unlock(&worker_mutex);
     return NULL;
 }
 
-static esp_err_t set_entry(struct nvs_namespace *ns, const char *key,
-                            const void *data, size_t size)
+/* Caller holds worker_mutex.  Returns nonzero if the worker is running. */
+static int worker_ensure_started(void)
 {
-    if (ns->mode == NVS_READONLY) return ESP_FAIL;
+    if (!worker_cond_ready) {
+#ifdef _MSC_VER
+        pthread_cond_init(&worker_cond, NULL);
+#else
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, NVS_COND_CLOCK);
+        pthread_cond_init(&worker_cond, &attr);
+        pthread_condattr_destroy(&attr);
+#endif
+        worker_cond_ready = 1;
+    }
+    if (!worker_started && !worker_quit &&
+        pthread_create(&worker_thread, NULL, worker_thread_func, NULL) == 0)
+        worker_started = 1;
+    return worker_started;
+}
 
-    struct nvs_entry *e = find_entry(ns, key);
-    if (!e) {
-        if (ns->count >= NVS_MAX_ENTRIES) return ESP_FAIL;
-        e = &ns->entries[ns->count++];
-        strncpy(e->key, key, NVS_MAX_KEY_LEN - 1);
-        e->key[NVS_MAX_KEY_LEN - 1] = '\0';
-        e->data = NULL;
-        e->size = 0;
+/* Let the worker finish the queued compactions, then join it */
+static void worker_stop(void)
+{
+    pthread_mutex_lock(&worker_mutex);
+    if (!worker_started) {
+        pthread_mutex_unlock(&worker_mutex);
+        return;
     }
+    worker_quit = 1;
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_mutex);
 
-    void *new_data = malloc(size);
-    if (!new_data) return ESP_FAIL;
-    memcpy(new_data, data, size);
+    pthread_join(worker_thread, NULL);
 
-    free(e->data);
-    e->data = new_data;
-    e->size = size;
+    pthread_mutex_lock(&worker_mutex);
+    worker_started = 0;
+    worker_quit = 0;
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+/* Caller holds ns->lock for writing */
+static void mark_dirty(struct nvs_namespace *ns)
+{
+    if (ns->dirty) return;
     ns->dirty = 1;
+    ns->dirty_since_ms = now_ms();
+    if (nvs_in_memory) return;   /* nothing to write back */
+    pthread_mutex_lock(&worker_mutex);
+    worker_ensure_started();
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+/* Caller holds ns->lock for writing */
+static void maybe_schedule_compaction(struct nvs_namespace *ns)
+{
+    size_t garbage = ns->log_bytes - NVS_LOG_MAGIC_LEN - ns->live_bytes;
+    int due = (garbage > NVS_COMPACT_MIN_GARBAGE && garbage > ns->live_bytes) ||
+              ns->records_since_ckpt >= NVS_CHECKPOINT_RECORDS + ns->count;
+    if (!due || ns->compact_queued) return;
+
+    pthread_mutex_lock(&worker_mutex);
+    if (worker_ensure_started()) {
+        ns->compact_queued = 1;
+        ns->compact_next = compact_queue;
+        compact_queue = ns;
+        pthread_cond_signal(&worker_cond);
+    }
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+/* ---- Commit ---- */
+
+/* Append erases and changed entries as one write + fsync.
+ * Caller holds ns->lock for writing. */
+static esp_err_t ns_commit_locked(struct nvs_namespace *ns)
+{
+    if (!ns->dirty) return ESP_OK;
+
+    if (nvs_in_memory || ns->needs_checkpoint ||
+        (!ns->log && ns->log_bytes < NVS_LOG_MAGIC_LEN)) {
+        /* No log yet: start one holding the whole live set (memory
+         * mode just marks it committed) */
+        return ns_checkpoint(ns) == 0 ? ESP_OK : ESP_FAIL;
+    }
+    if (!ns->log) {
+        ns->log = fopen(ns->filepath, "ab");
+        if (!ns->log) {
+            ESP_LOGE(TAG, "Cannot write %s: %s", ns->filepath, strerror(errno));
+            return ESP_FAIL;
+        }
+    }
+
+    size_t len = 0;
+    if (ns->clear_pending) len += rec_size(0, 0);
+    for (int i = 0; i < ns->erased_count; i++)
+        len += rec_size(strlen(ns->erased[i]), 0);
+    for (int i = 0; i < ns->count; i++) {
+        if (ns->entries[i].dirty)
+            len += entry_rec_size(&ns->entries[i]);
+    }
+
+    uint8_t *buf = malloc(len ? len : 1);
+    if (!buf) return ESP_FAIL;
+
+    size_t off = 0;
+    int records = 0;
+    if (ns->clear_pending) {
+        off += rec_encode(buf + off, REC_CLEAR, NULL, NULL, 0);
+        records++;
+    }
+    for (int i = 0; i < ns->erased_count; i++) {
+        off += rec_encode(buf + off, REC_ERASE, ns->erased[i], NULL, 0);
+        records++;
+    }
+    for (int i = 0; i < ns->count; i++) {
+        struct nvs_entry *e = &ns->entries[i];
+        if (!e->dirty) continue;
+        size_t n = entry_encode(buf + off, e);
+        ns->live_bytes += n - e->rec_size;
+        e->rec_size = n;
+        e->dirty = 0;
+        off += n;
+        records++;
+    }
+
+    int ok = fwrite(buf, 1, len, ns->log) == len && file_sync(ns->log) == 0;
+    free(buf);
+    if (!ok) {
+        ESP_LOGE(TAG, "Cannot write %s: %s", ns->filepath, strerror(errno));
+        return ESP_FAIL;
+    }
+
+    ns->log_bytes += len;
+    ns->records_since_ckpt += records;
+    ns->erased_count = 0;
+    ns->clear_pending = 0;
+    ns->dirty = 0;
+
+    maybe_schedule_compaction(ns);
+    return ESP_OK;
+}
+
+/* ---- Entry access ---- */
+
+static esp_err_t set_entry(struct nvs_handle_slot *hs, const char *key,
+                            const void *data, size_t size, nvs_type_t type)
+{
+    if (hs->mode == NVS_READONLY) return ESP_FAIL;
+    if (size > NVS_MAX_VALUE) return ESP_ERR_NVS_INVALID_LENGTH;
+
+    struct nvs_namespace *ns = hs->ns;
+    pthread_rwlock_wrlock(&ns->lock);
+    struct nvs_entry *e = find_entry(ns, key);
+    if (e && e->type == type && e->size == size &&
+        memcmp(e->data, data, size) == 0) {
+        /* Unchanged value — nothing to append */
+        pthread_rwlock_unlock(&ns->lock);
+        return ESP_OK;
+    }
+    e = put_entry(ns, key, data, size);
+    if (!e) {
+        pthread_rwlock_unlock(&ns->lock);
+        return ESP_FAIL;
+    }
+    e->type = (uint8_t)type;
+    e->dirty = 1;
+    mark_dirty(ns);
+    pthread_rwlock_unlock(&ns->lock);
     return ESP_OK;
 }
 
 static esp_err_t get_entry(struct nvs_namespace *ns, const char *key,
                             void *out, size_t expected_size)
 {
+    esp_err_t err = ESP_OK;
+    pthread_rwlock_rdlock(&ns->lock);
     struct nvs_entry *e = find_entry(ns, key);
-    if (!e) return ESP_ERR_NVS_NOT_FOUND;
-    if (e->size != expected_size) return ESP_FAIL;
-    memcpy(out, e->data, expected_size);
-    return ESP_OK;
+    if (!e) err = ESP_ERR_NVS_NOT_FOUND;
+    else if (e->size != expected_size) err = ESP_FAIL;
+    else memcpy(out, e->data, expected_size);
+    pthread_rwlock_unlock(&ns->lock);
+    return err;
+}
+
+/* Shared by nvs_get_str / nvs_get_blob */
+static esp_err_t get_variable(struct nvs_namespace *ns, const char *key,
+                              void *out_value, size_t *length)
+{
+    esp_err_t err = ESP_OK;
+    pthread_rwlock_rdlock(&ns->lock);
+    struct nvs_entry *e = find_entry(ns, key);
+    if (!e) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (!out_value) {
+        /* If out_value is NULL, return required length */
+        if (length) *length = e->size;
+    } else if (!length || *length < e->size) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(out_value, e->data, e->size);
+        *length = e->size;
+    }
+    pthread_rwlock_unlock(&ns->lock);
+    return err;
 }
 
 /* ---- Public API ---- */
 
+/* Find or load the shared copy of a namespace.  Caller holds cache_mutex. */
+static struct nvs_namespace *ns_lookup(const char *name)
+{
+    for (struct nvs_namespace *ns = ns_cache; ns; ns = ns->cache_next) {
+        if (strncmp(ns->name, name, NVS_MAX_KEY_LEN - 1) == 0)
+            return ns;
+    }
+
+    struct nvs_namespace *ns = calloc(1, sizeof(*ns));
+    if (!ns) return NULL;
+
+    pthread_rwlock_init(&ns->lock, NULL);
+    strncpy(ns->name, name, NVS_MAX_KEY_LEN - 1);
+    ns_filepath(name, ns->filepath, sizeof(ns->filepath));
+    ns_load(ns);
+
+    ns->cache_next = ns_cache;
+    ns_cache = ns;
+    return ns;
+}
+
 esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode,
                     nvs_handle_t *out_handle)
 {
@@ -206,20 +1106,16 @@ esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode,
 
     ensure_nvs_dir();
 
-    struct nvs_namespace *ns = calloc(1, sizeof(*ns));
-    if (!ns) return ESP_FAIL;
+    pthread_mutex_lock(&cache_mutex);
+    struct nvs_namespace *ns = ns_lookup(namespace_name);
+    nvs_handle_t h = ns ? alloc_handle(ns, open_mode) : 0;
+    pthread_mutex_unlock(&cache_mutex);
+    if (h == 0) return ESP_FAIL;
 
-    strncpy(ns->name, namespace_name, NVS_MAX_KEY_LEN - 1);
-    ns->mode = open_mode;
-    ns_filepath(namespace_name, ns->filepath, sizeof(ns->filepath));
-    ns_load(ns);
-
-    nvs_handle_t h = alloc_handle(ns);
-    if (h == 0) {
-        /* Free loaded data */
-        for (int i = 0; i < ns->count; i++) free(ns->entries[i].data);
-        free(ns);
-        return ESP_FAIL;
+    if (open_mode == NVS_READWRITE) {
+        pthread_rwlock_wrlock(&ns->lock);
+        if (ns->needs_checkpoint) ns_checkpoint(ns);
+        pthread_rwlock_unlock(&ns->lock);
     }
 
     *out_handle = h;
@@ -230,57 +1126,77 @@ esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode,
 
 void nvs_close(nvs_handle_t handle)
 {
-    struct nvs_namespace *ns = get_ns(handle);
-    if (!ns) return;
-
-    if (ns->dirty) ns_save(ns);
-
-    for (int i = 0; i < ns->count; i++)
-        free(ns->entries[i].data);
+    struct nvs_handle_slot *hs = get_handle(handle);
+    if (!hs) return;
+
+    struct nvs_namespace *ns = hs->ns;
+    if (hs->mode == NVS_READWRITE) {
+        pthread_rwlock_wrlock(&ns->lock);
+        ns_commit_locked(ns);
+        pthread_rwlock_unlock(&ns->lock);
+    }
 
-    handles[handle - 1] = NULL;
-    free(ns);
+    pthread_mutex_lock(&cache_mutex);
+    hs->ns = NULL;
+    pthread_mutex_unlock(&cache_mutex);
 }
 
 esp_err_t nvs_commit(nvs_handle_t handle)
 {
     struct nvs_namespace *ns = get_ns(handle);
     if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
-    if (ns->dirty) ns_save(ns);
-    return ESP_OK;
+    pthread_rwlock_wrlock(&ns->lock);
+    esp_err_t err = ns_commit_locked(ns);
+    pthread_rwlock_unlock(&ns->lock);
+    return err;
+}
+
+/* Called once the app has stopped: finish queued compactions, stop the
+ * worker, write back everything still pending and drop the handles it
+ * left open.  The cached namespaces survive, so a restarted app sees the
+ * same data without reloading (the worker starts again on demand). */
+void emu_nvs_shutdown(void)
+{
+    worker_stop();
+    writeback_dirty(0);
+
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < MAX_NVS_HANDLES; i++)
+        handles[i].ns = NULL;
+    pthread_mutex_unlock(&cache_mutex);
 }
 
 /* ---- Typed setters ---- */
 
-#define NVS_SET_IMPL(type, suffix) \
+#define NVS_SET_IMPL(type, suffix, nvs_type) \
 esp_err_t nvs_set_##suffix(nvs_handle_t handle, const char *key, type value) { \
-    struct nvs_namespace *ns = get_ns(handle); \
-    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE; \
-    return set_entry(ns, key, &value, sizeof(value)); \
+    struct nvs_handle_slot *hs = get_handle(handle); \
+    if (!hs) return ESP_ERR_NVS_INVALID_HANDLE; \
+    return set_entry(hs, key, &value, sizeof(value), nvs_type); \
 }
 
-NVS_SET_IMPL(int8_t,   i8)
-NVS_SET_IMPL(uint8_t,  u8)
-NVS_SET_IMPL(int16_t,  i16)
-NVS_SET_IMPL(uint16_t, u16)
-NVS_SET_IMPL(int32_t,  i32)
-NVS_SET_IMPL(uint32_t, u32)
-NVS_SET_IMPL(int64_t,  i64)
-NVS_SET_IMPL(uint64_t, u64)
+NVS_SET_IMPL(int8_t,   i8,  NVS_TYPE_I8)
+NVS_SET_IMPL(uint8_t,  u8,  NVS_TYPE_U8)
+NVS_SET_IMPL(int16_t,  i16, NVS_TYPE_I16)
+NVS_SET_IMPL(uint16_t, u16, NVS_TYPE_U16)
+NVS_SET_IMPL(int32_t,  i32, NVS_TYPE_I32)
+NVS_SET_IMPL(uint32_t, u32, NVS_TYPE_U32)
+NVS_SET_IMPL(int64_t,  i64, NVS_TYPE_I64)
+NVS_SET_IMPL(uint64_t, u64, NVS_TYPE_U64)
 
 esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
 {
-    struct nvs_namespace *ns = get_ns(handle);
-    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
-    return set_entry(ns, key, value, strlen(value) + 1);
+    struct nvs_handle_slot *hs = get_handle(handle);
+    if (!hs) return ESP_ERR_NVS_INVALID_HANDLE;
+    return set_entry(hs, key, value, strlen(value) + 1, NVS_TYPE_STR);
 }
 
 esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key,
                         const void *value, size_t length)
 {
-    struct nvs_namespace *ns = get_ns(handle);
-    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
-    return set_entry(ns, key, value, length);
+    struct nvs_handle_slot *hs = get_handle(handle);
+    if (!hs) return ESP_ERR_NVS_INVALID_HANDLE;
+    return set_entry(hs, key, value, length, NVS_TYPE_BLOB);
 }
 
 /* ---- Typed getters ---- */
@@ -306,74 +1222,621 @@ esp_err_t nvs_get_str(nvs_handle_t handle, const char *key,
 {
     struct nvs_namespace *ns = get_ns(handle);
     if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
+    return get_variable(ns, key, out_value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key,
+                        void *out_value, size_t *length)
+{
+    struct nvs_namespace *ns = get_ns(handle);
+    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
+    return get_variable(ns, key, out_value, length);
+}
+
+/* ---- Erase ---- */
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    struct nvs_handle_slot *hs = get_handle(handle);
+    if (!hs) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (hs->mode == NVS_READONLY) return ESP_FAIL;
 
+    struct nvs_namespace *ns = hs->ns;
+    pthread_rwlock_wrlock(&ns->lock);
     struct nvs_entry *e = find_entry(ns, key);
-    if (!e) return ESP_ERR_NVS_NOT_FOUND;
+    if (!e) {
+        pthread_rwlock_unlock(&ns->lock);
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (e->rec_size && !ns->clear_pending)
+        erased_add(ns, e->key);   /* key is in the log — record the erase */
+    remove_entry(ns, e);
+    mark_dirty(ns);
+    pthread_rwlock_unlock(&ns->lock);
+    return ESP_OK;
+}
 
-    /* If out_value is NULL, return required length */
-    if (!out_value) {
-        if (length) *length = e->size;
-        return ESP_OK;
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    struct nvs_handle_slot *hs = get_handle(handle);
+    if (!hs) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (hs->mode == NVS_READONLY) return ESP_FAIL;
+
+    struct nvs_namespace *ns = hs->ns;
+    pthread_rwlock_wrlock(&ns->lock);
+    free_entries(ns);
+    ns->erased_count = 0;
+    ns->clear_pending = 1;
+    mark_dirty(ns);
+    pthread_rwlock_unlock(&ns->lock);
+    return ESP_OK;
+}
+
+/* ---- ESP-IDF partition images ----
+ *
+ * Flash layout of a real NVS partition: 4 KB pages, each a 32-byte
+ * header, a 32-byte entry-state bitmap (2 bits per entry) and 126
+ * 32-byte entries.  An entry is
+ *   nsIndex[1] type[1] span[1] chunkIndex[1] crc32[4] key[16] data[8]
+ * Strings and blob chunks keep size[2] reserved[2] data_crc32[4] in
+ * data, with the payload in the span-1 entries that follow.  A blob is
+ * a run of BLOB_DATA chunks plus a BLOB_IDX entry holding the total
+ * size, chunk count and first chunk index.  Namespace names are U8
+ * entries in nsIndex 0 whose value is the namespace's index.
+ */
+
+#define PART_PAGE_SIZE       4096
+#define PART_ENTRY_SIZE      32
+#define PART_ENTRIES         126
+#define PART_ENTRY_OFF       64      /* header + state bitmap */
+#define PART_MAX_PAYLOAD     ((PART_ENTRIES - 1) * PART_ENTRY_SIZE)
+#define PART_PAGE_ACTIVE     0xFFFFFFFEu
+#define PART_PAGE_FULL       0xFFFFFFFCu
+#define PART_PAGE_FREEING    0xFFFFFFF8u
+#define PART_VERSION         0xFE    /* v2: multi-chunk blobs */
+#define PART_ENTRY_WRITTEN   2
+#define PART_ITEM_BLOB_V1    0x41
+#define PART_ITEM_BLOB_DATA  0x42
+#define PART_ITEM_BLOB_IDX   0x48
+#define PART_CHUNK_ANY       0xFF
+#define PART_MAX_CHUNKS      127
+#define PART_DEFAULT_SIZE    0x6000  /* default "nvs" partition */
+
+static uint32_t get_le16(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+/* IDF seeds its CRCs with 0xFFFFFFFF (ROM semantics), not 0 */
+static uint32_t part_item_crc(const uint8_t *ent)
+{
+    uint32_t crc = esp_rom_crc32_le(0xFFFFFFFF, ent, 4);
+    return esp_rom_crc32_le(crc, ent + 8, PART_ENTRY_SIZE - 8);
+}
+
+static int part_is_varlen(int type)
+{
+    return type == NVS_TYPE_STR || type == PART_ITEM_BLOB_V1 ||
+           type == PART_ITEM_BLOB_DATA;
+}
+
+/* Map a whole file read-only; falls back to reading it on Windows */
+static uint8_t *part_map(const char *path, size_t *len)
+{
+#ifdef _WIN32
+    return read_file(path, len);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    *len = (size_t)st.st_size;
+    return p;
+#endif
+}
+
+static void part_unmap(uint8_t *p, size_t len)
+{
+#ifdef _WIN32
+    (void)len;
+    free(p);
+#else
+    munmap(p, len);
+#endif
+}
+
+struct part_page {
+    uint32_t seq;
+    const uint8_t *base;
+};
+
+struct part_ref {
+    const uint8_t *ent;
+    int order;           /* position in page-sequence order */
+};
+
+static int part_page_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const struct part_page *)a)->seq;
+    uint32_t y = ((const struct part_page *)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/* Blob chunks sort by (nsIndex, key, chunkIndex), newest last */
+static int part_chunk_cmp(const void *a, const void *b)
+{
+    const struct part_ref *x = a, *y = b;
+    if (x->ent[0] != y->ent[0]) return x->ent[0] - y->ent[0];
+    int c = strncmp((const char *)x->ent + 8, (const char *)y->ent + 8, NVS_MAX_KEY_LEN);
+    if (c) return c;
+    if (x->ent[3] != y->ent[3]) return x->ent[3] - y->ent[3];
+    return x->order - y->order;
+}
+
+static const struct part_ref *part_find_chunk(const struct part_ref *chunks, int n,
+                                              const uint8_t *idx, int chunk)
+{
+    const struct part_ref *found = NULL;
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const uint8_t *e = chunks[mid].ent;
+        int c = e[0] - idx[0];
+        if (!c) c = strncmp((const char *)e + 8, (const char *)idx + 8, NVS_MAX_KEY_LEN);
+        if (!c) c = e[3] - chunk;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    /* Last (newest) of the equal run */
+    for (; lo < n; lo++) {
+        const uint8_t *e = chunks[lo].ent;
+        if (e[0] != idx[0] || e[3] != chunk ||
+            strncmp((const char *)e + 8, (const char *)idx + 8, NVS_MAX_KEY_LEN) != 0)
+            break;
+        found = &chunks[lo];
     }
+    return found;
+}
 
-    if (!length || *length < e->size)
-        return ESP_ERR_NVS_INVALID_LENGTH;
+static int part_push(struct part_ref **v, int *n, int *cap, const uint8_t *ent, int order)
+{
+    if (*n == *cap) {
+        int c = *cap ? *cap * 2 : 256;
+        struct part_ref *nv = realloc(*v, (size_t)c * sizeof(*nv));
+        if (!nv) return -1;
+        *v = nv;
+        *cap = c;
+    }
+    (*v)[*n].ent = ent;
+    (*v)[*n].order = order;
+    (*n)++;
+    return 0;
+}
 
-    memcpy(out_value, e->data, e->size);
-    *length = e->size;
-    return ESP_OK;
+/* Store one decoded item.  The first item of each namespace replaces
+ * whatever the emulator held for it, so the image is authoritative. */
+static int part_store(struct nvs_namespace **touched, const char *ns_name,
+                      const char *key, const void *data, size_t size, int type)
+{
+    pthread_mutex_lock(&cache_mutex);
+    struct nvs_namespace *ns = ns_lookup(ns_name);
+    pthread_mutex_unlock(&cache_mutex);
+    if (!ns) return -1;
+
+    pthread_rwlock_wrlock(&ns->lock);
+    int i;
+    for (i = 0; touched[i]; i++)
+        if (touched[i] == ns) break;
+    if (!touched[i]) {
+        touched[i] = ns;
+        free_entries(ns);
+        ns->erased_count = 0;
+        ns->clear_pending = 1;
+    }
+    struct nvs_entry *e = put_entry(ns, key, data, size);
+    if (e) {
+        e->type = (uint8_t)type;
+        e->dirty = 1;
+        mark_dirty(ns);
+    }
+    pthread_rwlock_unlock(&ns->lock);
+    return e ? 0 : -1;
 }
 
-esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key,
-                        void *out_value, size_t *length)
+/* Load a raw NVS partition image into the store, replacing the
+ * namespaces it contains.  Pages are visited in sequence-number order
+ * so a newer copy of a key wins. */
+esp_err_t emu_nvs_import_partition(const char *path)
 {
-    struct nvs_namespace *ns = get_ns(handle);
-    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
+    size_t len;
+    uint8_t *img = part_map(path, &len);
+    if (!img) {
+        ESP_LOGE(TAG, "Cannot read NVS partition %s", path);
+        return ESP_FAIL;
+    }
+    ensure_nvs_dir();
 
-    struct nvs_entry *e = find_entry(ns, key);
-    if (!e) return ESP_ERR_NVS_NOT_FOUND;
+    int npages = (int)(len / PART_PAGE_SIZE), nvalid = 0;
+    struct part_page *pages = calloc(npages ? npages : 1, sizeof(*pages));
+    struct part_ref *items = NULL, *chunks = NULL;
+    int nitems = 0, items_cap = 0, nchunks = 0, chunks_cap = 0;
+    char (*ns_names)[NVS_MAX_KEY_LEN] = calloc(256, NVS_MAX_KEY_LEN);
+    struct nvs_namespace *touched[257] = { 0 };
+    esp_err_t err = ESP_FAIL;
+    int stored = 0, bad = 0;
+    if (!pages || !ns_names) goto out;
+
+    for (int p = 0; p < npages; p++) {
+        const uint8_t *pg = img + (size_t)p * PART_PAGE_SIZE;
+        uint32_t state = get_le32(pg);
+        if (state != PART_PAGE_ACTIVE && state != PART_PAGE_FULL &&
+            state != PART_PAGE_FREEING)
+            continue;
+        if (get_le32(pg + 28) != esp_rom_crc32_le(0xFFFFFFFF, pg + 4, 24)) {
+            bad++;
+            continue;
+        }
+        pages[nvalid].seq = get_le32(pg + 4);
+        pages[nvalid].base = pg;
+        nvalid++;
+    }
+    qsort(pages, nvalid, sizeof(*pages), part_page_cmp);
+
+    /* One pass over the entries: validate, note namespaces, and keep
+     * pointers to the items and blob chunks in sequence order */
+    int order = 0;
+    for (int p = 0; p < nvalid; p++) {
+        const uint8_t *pg = pages[p].base;
+        for (int i = 0; i < PART_ENTRIES; ) {
+            int state = (pg[32 + i / 4] >> ((i % 4) * 2)) & 3;
+            const uint8_t *ent = pg + PART_ENTRY_OFF + i * PART_ENTRY_SIZE;
+            int span = ent[2];
+            if (state != PART_ENTRY_WRITTEN) { i++; continue; }
+            if (span == 0 || i + span > PART_ENTRIES ||
+                get_le32(ent + 4) != part_item_crc(ent)) {
+                bad++;
+                i++;
+                continue;
+            }
+            if (part_is_varlen(ent[1])) {
+                uint32_t size = get_le16(ent + 24);
+                if ((int)(1 + (size + PART_ENTRY_SIZE - 1) / PART_ENTRY_SIZE) != span ||
+                    get_le32(ent + 28) != esp_rom_crc32_le(0xFFFFFFFF, ent + PART_ENTRY_SIZE, size)) {
+                    bad++;
+                    i += span;
+                    continue;
+                }
+            }
+
+            if (ent[0] == 0) {
+                /* Namespace definition: key is the name, value the index */
+                memcpy(ns_names[ent[24]], ent + 8, NVS_MAX_KEY_LEN - 1);
+            } else if (ent[1] == PART_ITEM_BLOB_DATA) {
+                if (part_push(&chunks, &nchunks, &chunks_cap, ent, order++) != 0) goto out;
+            } else {
+                if (part_push(&items, &nitems, &items_cap, ent, order++) != 0) goto out;
+            }
+            i += span;
+        }
+    }
+    qsort(chunks, nchunks, sizeof(*chunks), part_chunk_cmp);
+
+    for (int n = 0; n < nitems; n++) {
+        const uint8_t *ent = items[n].ent;
+        const char *ns_name = ns_names[ent[0]];
+        char key[NVS_MAX_KEY_LEN];
+        memcpy(key, ent + 8, NVS_MAX_KEY_LEN - 1);
+        key[NVS_MAX_KEY_LEN - 1] = '\0';
+        if (!ns_name[0] || !key[0]) { bad++; continue; }
+
+        int type = ent[1];
+        int ret;
+        if (type == PART_ITEM_BLOB_IDX) {
+            uint32_t total = get_le32(ent + 24);
+            int count = ent[28], start = ent[29];
+            uint8_t *blob = total <= NVS_MAX_VALUE ? malloc(total ? total : 1) : NULL;
+            uint32_t got = 0;
+            for (int c = 0; blob && c < count; c++) {
+                const struct part_ref *ch = part_find_chunk(chunks, nchunks, ent, start + c);
+                uint32_t sz = ch ? get_le16(ch->ent + 24) : 0;
+                if (!ch || got + sz > total) { free(blob); blob = NULL; break; }
+                memcpy(blob + got, ch->ent + PART_ENTRY_SIZE, sz);
+                got += sz;
+            }
+            if (!blob || got != total) {
+                ESP_LOGW(TAG, "%s/%s: incomplete blob, skipped", ns_name, key);
+                free(blob);
+                bad++;
+                continue;
+            }
+            ret = part_store(touched, ns_name, key, blob, total, NVS_TYPE_BLOB);
+            free(blob);
+        } else if (part_is_varlen(type)) {
+            ret = part_store(touched, ns_name, key, ent + PART_ENTRY_SIZE,
+                             get_le16(ent + 24),
+                             type == NVS_TYPE_STR ? NVS_TYPE_STR : NVS_TYPE_BLOB);
+        } else {
+            int width = type & 0x0F;
+            if (width != 1 && width != 2 && width != 4 && width != 8) { bad++; continue; }
+            ret = part_store(touched, ns_name, key, ent + 24, width, type);
+        }
+        if (ret != 0) goto out;
+        stored++;
+    }
 
-    if (!out_value) {
-        if (length) *length = e->size;
-        return ESP_OK;
+    err = ESP_OK;
+    for (int i = 0; touched[i]; i++) {
+        pthread_rwlock_wrlock(&touched[i]->lock);
+        if (ns_commit_locked(touched[i]) != ESP_OK) err = ESP_FAIL;
+        pthread_rwlock_unlock(&touched[i]->lock);
     }
+    ESP_LOGI(TAG, "Imported %d keys from %s (%d pages)", stored, path, nvalid);
+    if (bad) ESP_LOGW(TAG, "%s: skipped %d invalid entries/pages", path, bad);
+
+out:
+    if (err != ESP_OK) ESP_LOGE(TAG, "Import of %s failed", path);
+    free(pages);
+    free(items);
+    free(chunks);
+    free(ns_names);
+    part_unmap(img, len);
+    return err;
+}
 
-    if (!length || *length < e->size)
-        return ESP_ERR_NVS_INVALID_LENGTH;
+/* Sequential page writer.  With img == NULL it only counts pages. */
+struct part_writer {
+    uint8_t *img;
+    int npages;
+    int page;            /* current page, -1 before the first */
+    int next;            /* next free entry in it */
+};
 
-    memcpy(out_value, e->data, e->size);
-    *length = e->size;
-    return ESP_OK;
+static int part_new_page(struct part_writer *w)
+{
+    if (w->img && w->page >= 0)
+        put_le32(w->img + (size_t)w->page * PART_PAGE_SIZE, PART_PAGE_FULL);
+    if (w->img && w->page + 1 >= w->npages) return -1;
+    w->page++;
+    w->next = 0;
+    if (w->img) {
+        uint8_t *pg = w->img + (size_t)w->page * PART_PAGE_SIZE;
+        put_le32(pg, PART_PAGE_ACTIVE);
+        put_le32(pg + 4, (uint32_t)w->page);
+        pg[8] = PART_VERSION;
+        put_le32(pg + 28, esp_rom_crc32_le(0xFFFFFFFF, pg + 4, 24));
+    }
+    return 0;
 }
 
-/* ---- Erase ---- */
+/* Write one item of 1 + ceil(len / 32) entries, starting a new page if
+ * it does not fit in this one */
+static int part_emit(struct part_writer *w, int ns_index, int type, int chunk,
+                     const char *key, const uint8_t data[8],
+                     const void *payload, size_t len)
+{
+    int span = 1 + (int)((len + PART_ENTRY_SIZE - 1) / PART_ENTRY_SIZE);
+    if (w->page < 0 || w->next + span > PART_ENTRIES) {
+        if (part_new_page(w) != 0) return -1;
+    }
+    int i = w->next;
+    w->next += span;
+    if (!w->img) return 0;
+
+    uint8_t *pg = w->img + (size_t)w->page * PART_PAGE_SIZE;
+    uint8_t *ent = pg + PART_ENTRY_OFF + i * PART_ENTRY_SIZE;
+    ent[0] = (uint8_t)ns_index;
+    ent[1] = (uint8_t)type;
+    ent[2] = (uint8_t)span;
+    ent[3] = (uint8_t)chunk;
+    memset(ent + 8, 0, NVS_MAX_KEY_LEN);
+    strncpy((char *)ent + 8, key, NVS_MAX_KEY_LEN - 1);
+    memcpy(ent + 24, data, 8);
+    put_le32(ent + 4, part_item_crc(ent));
+    if (len) memcpy(ent + PART_ENTRY_SIZE, payload, len);
+    for (int k = i; k < i + span; k++)
+        pg[32 + k / 4] &= (uint8_t)~(1u << ((k % 4) * 2));   /* 11 -> 10 */
+    return 0;
+}
 
-esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+static int part_emit_varlen(struct part_writer *w, int ns_index, int type, int chunk,
+                            const char *key, const void *payload, size_t len)
 {
-    struct nvs_namespace *ns = get_ns(handle);
-    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
-    if (ns->mode == NVS_READONLY) return ESP_FAIL;
+    uint8_t data[8];
+    data[0] = (uint8_t)len;
+    data[1] = (uint8_t)(len >> 8);
+    data[2] = data[3] = 0xFF;
+    put_le32(data + 4, esp_rom_crc32_le(0xFFFFFFFF, payload, (uint32_t)len));
+    return part_emit(w, ns_index, type, chunk, key, data, payload, len);
+}
 
-    for (int i = 0; i < ns->count; i++) {
-        if (strcmp(ns->entries[i].key, key) == 0) {
-            free(ns->entries[i].data);
-            ns->entries[i] = ns->entries[--ns->count];
-            ns->dirty = 1;
-            return ESP_OK;
+/* Entries written by an older emulator have no type: guess from the
+ * size and contents */
+static int part_guess_type(const struct nvs_entry *e)
+{
+    const uint8_t *d = e->data;
+    switch (e->size) {
+    case 1: return NVS_TYPE_U8;
+    case 2: return NVS_TYPE_U16;
+    case 4: return NVS_TYPE_U32;
+    case 8: return NVS_TYPE_U64;
+    }
+    if (e->size && d[e->size - 1] == '\0' && memchr(d, '\0', e->size) == d + e->size - 1)
+        return NVS_TYPE_STR;
+    return NVS_TYPE_BLOB;
+}
+
+static int part_emit_entry(struct part_writer *w, int ns_index,
+                           const char *ns_name, const struct nvs_entry *e)
+{
+    int type = e->type ? e->type : part_guess_type(e);
+    int width = type & 0x0F;
+
+    if (type != NVS_TYPE_STR && type != NVS_TYPE_BLOB && (size_t)width == e->size) {
+        uint8_t data[8];
+        memset(data, 0xFF, sizeof(data));
+        memcpy(data, e->data, e->size);
+        return part_emit(w, ns_index, type, PART_CHUNK_ANY, e->key, data, NULL, 0);
+    }
+    if (type == NVS_TYPE_STR && e->size <= PART_MAX_PAYLOAD)
+        return part_emit_varlen(w, ns_index, NVS_TYPE_STR, PART_CHUNK_ANY,
+                                e->key, e->data, e->size);
+
+    /* Blob: chunks fill the rest of each page, then the index entry */
+    if (e->size > (size_t)PART_MAX_CHUNKS * PART_MAX_PAYLOAD) {
+        ESP_LOGW(TAG, "%s/%s: %zu bytes is too large for NVS, skipped",
+                 ns_name, e->key, e->size);
+        return 0;
+    }
+    const uint8_t *p = e->data;
+    size_t left = e->size;
+    int chunks = 0;
+    do {
+        if (w->page < 0 || PART_ENTRIES - w->next < 2) {
+            if (part_new_page(w) != 0) return -1;
         }
+        size_t room = (size_t)(PART_ENTRIES - w->next - 1) * PART_ENTRY_SIZE;
+        size_t n = left < room ? left : room;
+        if (part_emit_varlen(w, ns_index, PART_ITEM_BLOB_DATA, chunks, e->key, p, n) != 0)
+            return -1;
+        p += n;
+        left -= n;
+        chunks++;
+    } while (left > 0);
+
+    uint8_t data[8];
+    put_le32(data, (uint32_t)e->size);
+    data[4] = (uint8_t)chunks;
+    data[5] = 0;                 /* chunk start */
+    data[6] = data[7] = 0xFF;
+    return part_emit(w, ns_index, PART_ITEM_BLOB_IDX, PART_CHUNK_ANY, e->key, data, NULL, 0);
+}
+
+static int part_ns_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct nvs_namespace *const *)a)->name,
+                  (*(struct nvs_namespace *const *)b)->name);
+}
+
+/* Lay out every namespace.  Returns the number of pages used, or -1. */
+static int part_layout(struct part_writer *w, struct nvs_namespace **list, int n)
+{
+    int ns_index = 0;
+    for (int i = 0; i < n; i++) {
+        struct nvs_namespace *ns = list[i];
+        pthread_rwlock_rdlock(&ns->lock);
+        int ret = 0;
+        if (ns->count > 0) {
+            uint8_t data[8];
+            memset(data, 0xFF, sizeof(data));
+            data[0] = (uint8_t)++ns_index;
+            ret = part_emit(w, 0, NVS_TYPE_U8, PART_CHUNK_ANY, ns->name, data, NULL, 0);
+            for (int k = 0; ret == 0 && k < ns->count; k++)
+                ret = part_emit_entry(w, ns_index, ns->name, &ns->entries[k]);
+        }
+        pthread_rwlock_unlock(&ns->lock);
+        if (ret != 0) return -1;
     }
-    return ESP_ERR_NVS_NOT_FOUND;
+    return w->page + 1;
 }
 
-esp_err_t nvs_erase_all(nvs_handle_t handle)
+/* Write every namespace (cached or on disk) to path as an NVS partition
+ * image.  An existing image keeps its size unless the data needs more;
+ * one page is always left erased, as IDF requires. */
+esp_err_t emu_nvs_export_partition(const char *path)
 {
-    struct nvs_namespace *ns = get_ns(handle);
-    if (!ns) return ESP_ERR_NVS_INVALID_HANDLE;
-    if (ns->mode == NVS_READONLY) return ESP_FAIL;
+#ifndef _MSC_VER
+    /* Pull in namespaces this run never opened */
+    char dir[448];
+    nvs_dir(dir, sizeof(dir));
+    DIR *d = nvs_in_memory ? NULL : opendir(dir);
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            size_t l = strlen(de->d_name);
+            if (l < 5 || l - 4 >= NVS_MAX_KEY_LEN || strcmp(de->d_name + l - 4, ".nvs") != 0)
+                continue;
+            char name[NVS_MAX_KEY_LEN];
+            memcpy(name, de->d_name, l - 4);
+            name[l - 4] = '\0';
+            pthread_mutex_lock(&cache_mutex);
+            ns_lookup(name);
+            pthread_mutex_unlock(&cache_mutex);
+        }
+        closedir(d);
+    }
+#endif
 
-    for (int i = 0; i < ns->count; i++)
-        free(ns->entries[i].data);
-    ns->count = 0;
-    ns->dirty = 1;
+    pthread_mutex_lock(&cache_mutex);
+    int n = 0;
+    for (struct nvs_namespace *ns = ns_cache; ns; ns = ns->cache_next) n++;
+    struct nvs_namespace **list = malloc((n ? n : 1) * sizeof(*list));
+    if (list) {
+        n = 0;
+        for (struct nvs_namespace *ns = ns_cache; ns; ns = ns->cache_next)
+            list[n++] = ns;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    if (!list) return ESP_FAIL;
+    qsort(list, n, sizeof(*list), part_ns_cmp);
+    if (n > 254) {
+        ESP_LOGW(TAG, "Only the first 254 namespaces fit an NVS partition");
+        n = 254;
+    }
+
+    struct part_writer w = { NULL, 0, -1, 0 };
+    int need = part_layout(&w, list, n) + 1;
+    struct stat st;
+    int existed = stat(path, &st) == 0 && st.st_size > 0;
+    size_t size = existed ? (size_t)st.st_size : PART_DEFAULT_SIZE;
+    size -= size % PART_PAGE_SIZE;
+    if (size < (size_t)need * PART_PAGE_SIZE) {
+        if (existed) ESP_LOGW(TAG, "%s grows to %d pages to fit the data", path, need);
+        size = (size_t)need * PART_PAGE_SIZE;
+    }
+
+    int ok = 0;
+#ifdef _WIN32
+    uint8_t *img = malloc(size);
+#else
+    /* Build the image straight into the mapped output file */
+    char tmp[520];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    uint8_t *img = NULL;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && ftruncate(fd, (off_t)size) == 0) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) img = p;
+    }
+#endif
+    if (img) {
+        memset(img, 0xFF, size);
+        w.img = img;
+        w.npages = (int)(size / PART_PAGE_SIZE);
+        w.page = -1;
+        ok = part_layout(&w, list, n) >= 0;
+#ifdef _WIN32
+        if (ok) ok = write_file_atomic(path, img, size) == 0;
+        free(img);
+#else
+        if (ok) ok = msync(img, size, MS_SYNC) == 0;
+        munmap(img, size);
+#endif
+    }
+#ifndef _WIN32
+    if (fd >= 0) close(fd);
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+#endif
+    free(list);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Cannot write NVS partition %s: %s", path, strerror(errno));
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Exported %d namespaces to %s (%zu KB)", n, path, size / 1024);
     return ESP_OK;
 }
@@ -4,8 +4,41 @@
  * Uses a raw disk image file. Sectors are 512 bytes.
  * Respects board profile sd_slots: if 0, sdcard_init() fails.
  *
- * Hardware speed emulation: throttles I/O to match ESP32 SPI SD card
- * timing (20 MHz SPI3 host) unless turbo mode is enabled.
+ * Everything below is per slot (struct sd_slot): slot 0 is the card
+ * configured by the emu_sdcard_* options.  Slot 1 is never opened yet:
+ * flexe gives the firmware a single card (see sdcard_guest_image_path).
+ *
+ * Sector I/O goes straight to the image with pread/pwrite on a raw fd
+ * (no stdio buffering or shared file position, so callers may run
+ * concurrently).  With emu_sdcard_mmap set the whole image is mapped
+ * instead and sector I/O becomes memcpy.  emu_sdcard_sync_ms selects
+ * when data is forced to disk: never, on deinit, or at most every N ms.
+ *
+ * Overlay mode (emu_sdcard_overlay_path set): the image is only a
+ * read-only base, shareable between instances.  Written sectors go to a
+ * sparse delta file laid out as
+ *   header[4 KB] bitmap[1 bit per sector, 4 KB-aligned] data[card size]
+ * with sector N's data at the same offset in the data area, so a fresh
+ * delta of any card size is just holes.  The delta survives restarts
+ * (while the base is unchanged) and can be discarded or committed into
+ * the base.
+ *
+ * With emu_sdcard_dir set there is no image at all: a FAT32 volume is
+ * generated from a host directory and always overlaid (see Host
+ * directory cards below).
+ *
+ * Images made with sdcard_pack_image() (--sdcard-pack) are recognized
+ * by their header and read chunk by chunk, compressed (see Packed
+ * images below).
+ *
+ * A write-back LRU sector cache with read-ahead sits in front of all of
+ * this (see Sector cache below); its hit rates are kept per region of
+ * the FAT filesystem on the card.
+ *
+ * Hardware speed emulation: unless turbo mode is enabled, transfers are
+ * charged to a per-card-class bandwidth model with a small burst
+ * allowance (see Transfer timing below); the default class matches the
+ * ESP32's 20 MHz SPI3 host.
  */
 
 #ifdef _MSC_VER
@@ -14,119 +47,2766 @@
 
 #include "sdcard.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "miniz.h"
+#include "emu_flexe.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#ifndef _MSC_VER
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>      /* FICLONE */
 #endif
 #include <time.h>
 
 static const char *TAG = "emu_sdcard";
 
-static FILE *sd_file = NULL;
-static uint64_t sd_size = 0;
-
 /* Set by emu_main before sdcard_init is called */
 const char *emu_sdcard_path = NULL;
 uint64_t emu_sdcard_size_bytes = 4ULL * 1024 * 1024 * 1024; /* default 4GB */
-int emu_sdcard_enabled = 1;  /* set from board profile sd_slots */
+int emu_sdcard_slots = 1;    /* set from board profile sd_slots */
+
+/* Sparse copy-on-write delta over a read-only image (--sdcard-overlay) */
+const char *emu_sdcard_overlay_path = NULL;
+
+/* Host directory served as a generated FAT32 card (--sdcard-dir) */
+const char *emu_sdcard_dir = NULL;
+
+/* Map the image instead of pread/pwrite (--sdcard-mmap) */
+int emu_sdcard_mmap = 0;
+
+/* fsync policy (--sdcard-sync): SDCARD_SYNC_NONE, SDCARD_SYNC_DEINIT,
+ * or N > 0 to sync at most every N ms while writing */
+int emu_sdcard_sync_ms = SDCARD_SYNC_NONE;
+
+/* Sector cache size in bytes (--sdcard-cache); 0 disables it */
+uint64_t emu_sdcard_cache_bytes = 4ULL * 1024 * 1024;
 
 /* Hardware speed emulation: 0=throttled (real speed), 1=turbo (instant) */
 int emu_turbo_mode = 0;
 
-/*
- * Throttle I/O to match ESP32 SPI SD card timing.
- * ESP32 SPI3 host at 20 MHz: 400 ns per byte, ~200 µs command overhead.
+/* ---- Slots ----
+ *
+ * Each slot is a separate card: its image, overlay, cache, transfer
+ * queue, trace and statistics live in a struct sd_slot with their own
+ * locks.  The speed class (--sdcard-class) and the other emu_sdcard_*
+ * settings are global.  Only slot 0 is opened, from those settings;
+ * slot 1 stays empty until the firmware has a way to reach a second
+ * card.
+ */
+
+#define CZ_DCACHE      4      /* inflated chunks kept per packed image */
+#define SD_RA_STREAMS  4      /* FAT lookups interleave with file reads */
+
+struct cz_header {
+    char magic[8];
+    uint64_t card_size;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct cz_entry {
+    uint64_t off;
+    uint32_t len;             /* 0: all-zero chunk */
+    uint32_t flags;
+};
+
+struct hd_run {
+    uint32_t first;           /* first cluster */
+    uint32_t nclus;
+    uint64_t size;            /* bytes of data */
+    char *host;               /* host file, or NULL for a directory */
+    uint8_t *dir;             /* directory entries, nclus clusters */
+};
+
+struct ovl_header {
+    char magic[8];
+    uint64_t card_size;
+    uint64_t base_size;      /* base identity: a changed base */
+    int64_t base_mtime;      /* invalidates the delta */
+};
+
+struct sd_layout {
+    uint32_t fat_start, fat_end;     /* all FAT copies */
+    uint32_t root_start, root_end;   /* FAT12/16 fixed root directory */
+    uint32_t data_start;             /* first sector of cluster 2; 0 = no fs */
+    uint32_t clus_shift;             /* log2(sectors per cluster) */
+    uint32_t nclusters;
+    int fat_bits;                    /* 12, 16 or 32 (exFAT: 32) */
+    int exfat;
+    uint8_t *dir_map;                /* 1 bit per cluster: holds a directory */
+};
+
+struct cache_line {
+    uint32_t tag;           /* lba / CACHE_LINE_SECT; UINT32_MAX if unused */
+    uint8_t valid, dirty;   /* per-sector masks */
+    int32_t prev, next;     /* LRU list, most recent first */
+    int32_t hnext;          /* hash chain */
+};
+
+struct sd_trace_rec {
+    uint64_t t_ns;          /* shim clock at request start */
+    uint32_t lba;
+    uint32_t count;
+    uint32_t latency_ns;    /* cycle stall + shim clock */
+    uint32_t host_ns;       /* host time in the request */
+    uint8_t write;
+    uint8_t ok;
+};
+
+struct sd_slot {
+    int id;
+    const char *path;              /* image, or read-only base */
+    const char *overlay_path;      /* delta file, if any */
+    const char *dir;               /* host directory card */
+    int ready;
+    int fd;                        /* image, or read-only base in overlay mode */
+    uint64_t size;
+    uint8_t *map;                  /* whole image when mapped */
+    uint64_t last_sync_ms;
+
+    /* Transfer timing */
+    pthread_mutex_t time_mutex;
+    uint64_t busy_guest_ns;        /* queue end, guest time (CPU thread) */
+    uint64_t busy_shim_ns;         /* queue end, shim clock (other threads) */
+
+    /* Packed images */
+    int cz_active;
+    struct cz_header cz_hdr;
+    struct cz_entry *cz_index;
+    uint64_t cz_end;               /* where the next chunk moved aside goes */
+    pthread_mutex_t cz_mutex;
+    struct {
+        uint32_t chunk;            /* UINT32_MAX: empty */
+        uint8_t *data;
+    } cz_dcache[CZ_DCACHE];
+    uint32_t cz_dcache_next;
+
+    /* Host directory cards */
+    int hd_active;
+    struct hd_run *hd_runs;        /* sorted by first cluster */
+    uint32_t hd_nruns, hd_cap;
+    uint32_t hd_spc, hd_fatsz, hd_data_start, hd_nclus, hd_next;
+    uint32_t hd_clus_bytes;
+    uint64_t hd_stamp;             /* hash of the tree, for the overlay */
+    uint32_t hd_files;
+    uint8_t hd_boot[512], hd_fsinfo[512];
+    pthread_mutex_t hd_mutex;
+    int hd_fd;                     /* last host file read */
+    uint32_t hd_fd_run;
+
+    /* Copy-on-write overlay */
+    int ovl_fd;
+    FILE *ovl_tmp;                 /* anonymous delta (host directory cards) */
+    uint8_t *ovl_bitmap;
+    size_t ovl_bitmap_bytes;
+    uint64_t ovl_data_off;
+    struct ovl_header ovl_hdr;
+    /* Readers share; writers, commit and discard are exclusive */
+    pthread_rwlock_t ovl_lock;
+
+    struct sd_layout layout;
+
+    /* Sector cache */
+    pthread_mutex_t cache_mutex;
+    struct cache_line *cache_lines;
+    uint8_t *cache_data;           /* line i at i * CACHE_LINE_BYTES */
+    int32_t *cache_hash;
+    uint32_t cache_nlines, cache_hash_mask, cache_max_run;
+    uint32_t cache_ra_max;         /* read-ahead window cap, lines */
+    int32_t lru_head, lru_tail;
+    uint8_t *cache_fill_buf;       /* a miss run plus read-ahead */
+    uint8_t *cache_flush_buf;      /* one coalesced write-back run */
+    uint64_t cache_dirty_since_ms; /* 0 when nothing is dirty */
+    struct {
+        uint32_t next_lba;         /* where the stream's last read ended */
+        uint32_t lines;            /* current read-ahead window */
+    } ra_streams[SD_RA_STREAMS];
+    uint32_t ra_victim;
+    sdcard_cache_stats_t cache_stats;
+
+    /* Snapshots */
+    pthread_mutex_t snap_mutex;
+    pthread_t snap_thread;
+    int snap_started;              /* worker not joined yet */
+    int snap_finished;
+    int snap_result;
+    uint64_t snap_done, snap_total;
+    char snap_path[512];
+
+    /* I/O trace */
+    pthread_mutex_t trace_mutex;
+    struct sd_trace_rec *trace_ring;   /* NULL while tracing is off */
+    uint32_t trace_mask;
+    uint64_t trace_total;              /* records ever added */
+};
+
+#define SD_SLOT_INIT(n) {                                   \
+    .id = (n), .fd = -1, .ovl_fd = -1, .hd_fd = -1,         \
+    .lru_head = -1, .lru_tail = -1, .snap_result = -1,      \
+    .time_mutex = PTHREAD_MUTEX_INITIALIZER,                \
+    .cz_mutex = PTHREAD_MUTEX_INITIALIZER,                  \
+    .hd_mutex = PTHREAD_MUTEX_INITIALIZER,                  \
+    .ovl_lock = PTHREAD_RWLOCK_INITIALIZER,                 \
+    .cache_mutex = PTHREAD_MUTEX_INITIALIZER,               \
+    .snap_mutex = PTHREAD_MUTEX_INITIALIZER,                \
+    .trace_mutex = PTHREAD_MUTEX_INITIALIZER,               \
+}
+
+static struct sd_slot sd_slots[SDCARD_MAX_SLOTS] = { SD_SLOT_INIT(0), SD_SLOT_INIT(1) };
+
+static struct sd_slot *slot_get(int slot)
+{
+    return slot >= 0 && slot < SDCARD_MAX_SLOTS ? &sd_slots[slot] : NULL;
+}
+
+/* ---- Transfer timing ----
+ *
+ * Each card class is a bus/card speed model.  A transfer costs command
+ * overhead plus bytes * ns-per-byte of card time, charged against a
+ * token bucket: the card's queued work is tracked per slot as a busy-until
+ * time, and a caller is only held up once more than SD_BURST_NS of work
+ * is outstanding, so short bursts overlap with the caller like DMA.
+ *
+ * The clock depends on the caller.  The flexe CPU thread runs on guest
+ * time (its cycle count) and pays for the excess in cycles, so the host
+ * never sleeps with the whole guest stopped.  Any other thread (shim
+ * tasks, control socket) uses the FreeRTOS shim clock and shim-sleeps,
+ * which blocks only that task.  The two clocks are not comparable, so
+ * each has its own queue.
  */
-static void throttle_io(uint32_t sector_count)
+
+struct sd_speed_class {
+    const char *name;
+    uint32_t cmd_ns;         /* per-command overhead */
+    uint32_t read_ns_byte;
+    uint32_t write_ns_byte;
+};
+
+static const struct sd_speed_class sd_classes[] = {
+    /* ESP32 SPI3 host at 20 MHz: 400 ns per byte, ~200 µs per command */
+    { "spi",     200000, 400, 400 },
+    /* 4-bit SDMMC host at 40 MHz (20 MB/s bus), limited by the card's
+     * minimum sustained write speed */
+    { "class2",  100000,  50, 500 },
+    { "class4",  100000,  50, 250 },
+    { "class10", 100000,  50, 100 },
+};
+
+#define SD_BURST_NS 2000000ULL   /* bucket depth: 2 ms of card time */
+
+static const struct sd_speed_class *sd_class = &sd_classes[0];
+
+int sdcard_set_speed_class(const char *name)
 {
-    if (emu_turbo_mode) return;
-    uint64_t ns = 200000 + (uint64_t)sector_count * 512 * 400;
-    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
-    nanosleep(&ts, NULL);
+    for (size_t i = 0; i < sizeof(sd_classes) / sizeof(sd_classes[0]); i++) {
+        if (strcmp(sd_classes[i].name, name) == 0) {
+            sd_class = &sd_classes[i];
+            return 0;
+        }
+    }
+    return -1;
 }
 
-int sdcard_init(void)
+/* Returns the stall charged to the CPU thread in ns (shim sleeps show
+ * up on the shim clock instead) */
+static uint64_t throttle_io(struct sd_slot *sd, uint32_t sector_count, int write)
 {
-    if (!emu_sdcard_enabled) {
-        ESP_LOGE(TAG, "No SD card slot on this board");
-        return -1;
+    if (emu_turbo_mode) return 0;
+    uint64_t cost = sd_class->cmd_ns + (uint64_t)sector_count * 512 *
+                    (write ? sd_class->write_ns_byte : sd_class->read_ns_byte);
+
+    uint64_t now;
+    int guest = emu_flexe_guest_ns(&now);
+    if (!guest) now = emu_freertos_now_ns();
+    uint64_t *busy = guest ? &sd->busy_guest_ns : &sd->busy_shim_ns;
+
+    pthread_mutex_lock(&sd->time_mutex);
+    if (*busy < now) *busy = now;
+    *busy += cost;
+    uint64_t backlog = *busy - now;
+    pthread_mutex_unlock(&sd->time_mutex);
+
+    if (backlog <= SD_BURST_NS) return 0;
+    if (guest) {
+        emu_flexe_charge_ns(backlog - SD_BURST_NS);
+        return backlog - SD_BURST_NS;
     }
+    emu_freertos_sleep_until_ns(now + backlog - SD_BURST_NS);
+    return 0;
+}
 
-    if (!emu_sdcard_path) {
-        ESP_LOGE(TAG, "No SD card image path set (use --sdcard)");
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+    return mono_ns() / 1000000;
+}
+
+/* ---- Positional I/O ---- */
+
+#ifdef _MSC_VER
+/* No pread/pwrite: seek + read under a lock */
+static pthread_mutex_t sd_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long sd_pio(int fd, void *buf, size_t len, uint64_t off, int write)
+{
+    pthread_mutex_lock(&sd_io_mutex);
+    long long n = -1;
+    if (_lseeki64(fd, (long long)off, SEEK_SET) >= 0)
+        n = write ? _write(fd, buf, (unsigned)len) : _read(fd, buf, (unsigned)len);
+    pthread_mutex_unlock(&sd_io_mutex);
+    return n;
+}
+#define sd_pread(fd, buf, len, off)   sd_pio((fd), (buf), (len), (off), 0)
+#define sd_pwrite(fd, buf, len, off)  sd_pio((fd), (void *)(buf), (len), (off), 1)
+#define sd_fsync(fd)                  _commit(fd)
+#else
+#define sd_pread(fd, buf, len, off)   pread((fd), (buf), (len), (off_t)(off))
+#define sd_pwrite(fd, buf, len, off)  pwrite((fd), (buf), (len), (off_t)(off))
+#define sd_fsync(fd)                  fsync(fd)
+#endif
+
+/* Returns bytes transferred; stops early only at EOF or on error */
+static size_t sd_read_full(int fd, uint8_t *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        long long n = sd_pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static size_t sd_write_full(int fd, const uint8_t *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        long long n = sd_pwrite(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static int sd_open_image(struct sd_slot *sd, int flags)
+{
+#ifdef _MSC_VER
+    return _open(sd->path, flags | _O_BINARY, 0644);
+#else
+    return open(sd->path, flags, 0644);
+#endif
+}
+
+static int is_zero(const uint8_t *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/* ---- Packed images ----
+ *
+ * An image starting with CZ_MAGIC holds the card in 64 KB chunks:
+ *   header[4 KB] index[16 bytes per chunk, 4 KB-aligned] chunk data
+ * An index entry is empty (an all-zero chunk), a deflate stream, or
+ * CZ_RAW (stored uncompressed).  Reads inflate whole chunks into a small
+ * chunk cache; the sector cache above keeps the hot sectors.  The first
+ * write to a compressed chunk moves it, inflated, to a side area at the
+ * end of the file and repoints its index entry; later writes go there in
+ * place.  When the card is closed the file is rebuilt with the modified
+ * chunks compressed again.  sdcard_pack_image() converts a raw image.
+ */
+
+#define CZ_MAGIC      "CYDSDCZ1"
+#define CZ_CHUNK      65536
+#define CZ_HDR_SIZE   4096
+#define CZ_RAW        1       /* entry flag: stored uncompressed */
+#define CZ_HDR_SIDE   1       /* header flag: chunks in the side area */
+
+static uint64_t cz_index_bytes(uint32_t nchunks)
+{
+    return ((uint64_t)nchunks * sizeof(struct cz_entry) + 4095) & ~(uint64_t)4095;
+}
+
+static void cz_close(struct sd_slot *sd)
+{
+    free(sd->cz_index);
+    sd->cz_index = NULL;
+    for (int k = 0; k < CZ_DCACHE; k++) {
+        free(sd->cz_dcache[k].data);
+        sd->cz_dcache[k].data = NULL;
+    }
+    sd->cz_active = 0;
+}
+
+/* 1 if the slot fd is a packed image (size is then the card size from its
+ * header), 0 for a raw image, -1 for a damaged packed one */
+static int cz_open(struct sd_slot *sd)
+{
+    struct cz_header h;
+    if (sd_read_full(sd->fd, (uint8_t *)&h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, CZ_MAGIC, 8) != 0)
+        return 0;
+
+    struct stat st;
+    size_t ibytes = (size_t)h.nchunks * sizeof(struct cz_entry);
+    if (h.chunk_size != CZ_CHUNK || h.card_size == 0 ||
+        h.nchunks != (h.card_size + CZ_CHUNK - 1) / CZ_CHUNK ||
+        fstat(sd->fd, &st) != 0 ||
+        (uint64_t)st.st_size < CZ_HDR_SIZE + cz_index_bytes(h.nchunks)) {
+        ESP_LOGE(TAG, "%s: bad packed image header", sd->path);
+        return -1;
+    }
+    sd->cz_index = malloc(ibytes);
+    int ok = sd->cz_index && sd_read_full(sd->fd, (uint8_t *)sd->cz_index, ibytes, CZ_HDR_SIZE) == ibytes;
+    for (int k = 0; k < CZ_DCACHE && ok; k++) {
+        sd->cz_dcache[k].chunk = UINT32_MAX;
+        ok = (sd->cz_dcache[k].data = malloc(CZ_CHUNK)) != NULL;
+    }
+    if (!ok) {
+        ESP_LOGE(TAG, "%s: cannot load chunk index", sd->path);
+        cz_close(sd);
         return -1;
     }
+    sd->cz_hdr = h;
+    sd->cz_end = ((uint64_t)st.st_size + 4095) & ~(uint64_t)4095;
+    sd->size = h.card_size;
+    sd->cz_active = 1;
+    return 1;
+}
 
-    /* Open or create the image file */
-    sd_file = fopen(emu_sdcard_path, "r+b");
-    if (!sd_file) {
-        sd_file = fopen(emu_sdcard_path, "w+b");
-        if (!sd_file) {
-            ESP_LOGE(TAG, "Cannot open/create %s", emu_sdcard_path);
-            return -1;
+/* Inflated contents of a stored chunk, through the chunk cache.
+ * Caller holds cz_mutex. */
+static const uint8_t *cz_chunk(struct sd_slot *sd, uint32_t i)
+{
+    for (int k = 0; k < CZ_DCACHE; k++)
+        if (sd->cz_dcache[k].chunk == i) return sd->cz_dcache[k].data;
+
+    uint32_t k = sd->cz_dcache_next++ % CZ_DCACHE;
+    uint8_t *out = sd->cz_dcache[k].data;
+    const struct cz_entry *e = &sd->cz_index[i];
+    sd->cz_dcache[k].chunk = UINT32_MAX;
+    if (e->len == 0) {
+        memset(out, 0, CZ_CHUNK);
+    } else if (e->flags & CZ_RAW) {
+        if (sd_read_full(sd->fd, out, CZ_CHUNK, e->off) != CZ_CHUNK) return NULL;
+    } else {
+        uint8_t *z = malloc(e->len);
+        mz_ulong n = CZ_CHUNK;
+        int ok = z && sd_read_full(sd->fd, z, e->len, e->off) == e->len &&
+                 mz_uncompress(out, &n, z, e->len) == MZ_OK && n == CZ_CHUNK;
+        free(z);
+        if (!ok) {
+            ESP_LOGE(TAG, "%s: chunk %u is corrupt", sd->path, (unsigned)i);
+            return NULL;
+        }
+    }
+    sd->cz_dcache[k].chunk = i;
+    return out;
+}
+
+static int cz_read(struct sd_slot *sd, uint64_t off, size_t len, uint8_t *out)
+{
+    int ret = 0;
+    pthread_mutex_lock(&sd->cz_mutex);
+    while (len) {
+        uint32_t i = (uint32_t)(off / CZ_CHUNK);
+        size_t in = (size_t)(off % CZ_CHUNK);
+        size_t n = len < CZ_CHUNK - in ? len : CZ_CHUNK - in;
+        if (i >= sd->cz_hdr.nchunks) {
+            memset(out, 0, n);
+        } else if (sd->cz_index[i].flags & CZ_RAW) {
+            /* Stored as is: read just the sectors asked for */
+            if (sd_read_full(sd->fd, out, n, sd->cz_index[i].off + in) != n) ret = -1;
+        } else {
+            const uint8_t *p = cz_chunk(sd, i);
+            if (p) memcpy(out, p + in, n);
+            else ret = -1;
         }
+        if (ret != 0) break;
+        off += n;
+        out += n;
+        len -= n;
     }
+    pthread_mutex_unlock(&sd->cz_mutex);
+    return ret;
+}
 
-    /* Extend to desired size (sparse file) */
-    if (ftruncate(fileno(sd_file), (off_t)emu_sdcard_size_bytes) != 0) {
-        ESP_LOGE(TAG, "ftruncate failed");
-        fclose(sd_file);
-        sd_file = NULL;
+/* Move chunk i to the side area, inflated.  Caller holds cz_mutex. */
+static int cz_move_aside(struct sd_slot *sd, uint32_t i)
+{
+    const uint8_t *p = cz_chunk(sd, i);
+    struct cz_entry e = { sd->cz_end, CZ_CHUNK, CZ_RAW };
+    if (!p || sd_write_full(sd->fd, p, CZ_CHUNK, e.off) != CZ_CHUNK ||
+        sd_write_full(sd->fd, (const uint8_t *)&e, sizeof(e),
+                      CZ_HDR_SIZE + (uint64_t)i * sizeof(e)) != sizeof(e))
         return -1;
+    sd->cz_index[i] = e;
+    sd->cz_end += CZ_CHUNK;
+    for (int k = 0; k < CZ_DCACHE; k++)
+        if (sd->cz_dcache[k].chunk == i) sd->cz_dcache[k].chunk = UINT32_MAX;
+    if (!(sd->cz_hdr.flags & CZ_HDR_SIDE)) {
+        /* Remembered in the file so a crash still leads to compaction */
+        sd->cz_hdr.flags |= CZ_HDR_SIDE;
+        if (sd_write_full(sd->fd, (const uint8_t *)&sd->cz_hdr, sizeof(sd->cz_hdr), 0) != sizeof(sd->cz_hdr))
+            return -1;
+    }
+    return 0;
+}
+
+static int cz_write(struct sd_slot *sd, uint64_t off, size_t len, const uint8_t *data)
+{
+    int ret = 0;
+    pthread_mutex_lock(&sd->cz_mutex);
+    while (len && ret == 0) {
+        uint32_t i = (uint32_t)(off / CZ_CHUNK);
+        size_t in = (size_t)(off % CZ_CHUNK);
+        size_t n = len < CZ_CHUNK - in ? len : CZ_CHUNK - in;
+        if (i >= sd->cz_hdr.nchunks) {
+            ret = -1;
+            break;
+        }
+        if (!(sd->cz_index[i].flags & CZ_RAW))
+            ret = cz_move_aside(sd, i);
+        if (ret == 0 && sd_write_full(sd->fd, data, n, sd->cz_index[i].off + in) != n)
+            ret = -1;
+        off += n;
+        data += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&sd->cz_mutex);
+    return ret;
+}
+
+/* Fetch chunk i into buf (mz_compressBound(CZ_CHUNK) bytes): either the
+ * CZ_CHUNK plain bytes with *zlen = 0, or an existing deflate stream of
+ * *zlen bytes that can be stored as it is */
+typedef int (*cz_source_fn)(uint32_t i, uint8_t *buf, size_t *zlen, void *ctx);
+
+/* Write a packed image of a card_size card to out */
+static int cz_build(int out, uint64_t card_size, cz_source_fn get, void *ctx)
+{
+    struct cz_header h = { .card_size = card_size, .chunk_size = CZ_CHUNK };
+    memcpy(h.magic, CZ_MAGIC, 8);
+    h.nchunks = (uint32_t)((card_size + CZ_CHUNK - 1) / CZ_CHUNK);
+    mz_ulong bound = mz_compressBound(CZ_CHUNK);
+    struct cz_entry *index = calloc(h.nchunks ? h.nchunks : 1, sizeof(*index));
+    uint8_t *buf = malloc(bound), *zbuf = malloc(bound);
+    uint64_t pos = CZ_HDR_SIZE + cz_index_bytes(h.nchunks);
+    int ret = index && buf && zbuf && ftruncate(out, (off_t)pos) == 0 ? 0 : -1;
+
+    for (uint32_t i = 0; i < h.nchunks && ret == 0; i++) {
+        size_t zlen = 0;
+        if (get(i, buf, &zlen, ctx) != 0) {
+            ret = -1;
+            break;
+        }
+        const uint8_t *p = buf;
+        struct cz_entry *e = &index[i];
+        if (zlen) {
+            e->len = (uint32_t)zlen;
+        } else if (!is_zero(buf, CZ_CHUNK)) {
+            mz_ulong n = bound;
+            if (mz_compress2(zbuf, &n, buf, CZ_CHUNK, MZ_DEFAULT_LEVEL) == MZ_OK && n < CZ_CHUNK) {
+                p = zbuf;
+                e->len = (uint32_t)n;
+            } else {
+                e->len = CZ_CHUNK;
+                e->flags = CZ_RAW;
+            }
+        }
+        if (e->len) {
+            e->off = pos;
+            if (sd_write_full(out, p, e->len, pos) != e->len) ret = -1;
+            pos += e->len;
+        }
     }
+    /* Header last: an interrupted build is not mistaken for an image */
+    size_t ibytes = (size_t)h.nchunks * sizeof(*index);
+    if (ret == 0 &&
+        (sd_write_full(out, (const uint8_t *)index, ibytes, CZ_HDR_SIZE) != ibytes ||
+         sd_fsync(out) != 0 ||
+         sd_write_full(out, (const uint8_t *)&h, sizeof(h), 0) != sizeof(h)))
+        ret = -1;
+    if (ret == 0) ret = sd_fsync(out);
+    free(index);
+    free(buf);
+    free(zbuf);
+    return ret;
+}
 
-    sd_size = emu_sdcard_size_bytes;
-    ESP_LOGI(TAG, "SD card image: %s (%llu MB)",
-             emu_sdcard_path, (unsigned long long)(sd_size / (1024 * 1024)));
+static int cz_source_raw(uint32_t i, uint8_t *buf, size_t *zlen, void *ctx)
+{
+    int fd = *(int *)ctx;
+    size_t n = sd_read_full(fd, buf, CZ_CHUNK, (uint64_t)i * CZ_CHUNK);
+    memset(buf + n, 0, CZ_CHUNK - n);
     return 0;
 }
 
-void sdcard_deinit(void)
+/* Chunks of the open packed image; untouched ones are copied compressed */
+static int cz_source_self(uint32_t i, uint8_t *buf, size_t *zlen, void *ctx)
 {
-    if (sd_file) {
-        fclose(sd_file);
-        sd_file = NULL;
+    struct sd_slot *sd = ctx;
+    pthread_mutex_lock(&sd->cz_mutex);
+    struct cz_entry e = sd->cz_index[i];
+    pthread_mutex_unlock(&sd->cz_mutex);
+    if (e.len && !(e.flags & CZ_RAW)) {
+        *zlen = e.len;
+        return sd_read_full(sd->fd, buf, e.len, e.off) == e.len ? 0 : -1;
     }
+    return cz_read(sd, (uint64_t)i * CZ_CHUNK, CZ_CHUNK, buf);
 }
 
-uint64_t sdcard_size(void)
+/* Rebuild the open image without its side area */
+static int cz_compact(struct sd_slot *sd)
 {
-    return sd_size;
+    char tmp[520];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sd->path);
+#ifdef _MSC_VER
+    int out = _open(tmp, _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+    int out = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+    int ret = out >= 0 ? cz_build(out, sd->cz_hdr.card_size, cz_source_self, sd) : -1;
+    if (out >= 0) close(out);
+    if (ret == 0) {
+        close(sd->fd);       /* Windows cannot replace an open file */
+        sd->fd = -1;
+#ifdef _MSC_VER
+        remove(sd->path);   /* rename() does not replace on Windows */
+#endif
+        ret = rename(tmp, sd->path);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Compacting %s failed: %s", sd->path, strerror(errno));
+        remove(tmp);
+    }
+    return ret;
 }
 
-uint32_t sdcard_sector_size(void)
+int sdcard_pack_image(const char *src, const char *dst)
 {
-    return 512;
+#ifdef _MSC_VER
+    int in = _open(src, _O_RDONLY | _O_BINARY);
+    int out = in >= 0 ? _open(dst, _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, 0644) : -1;
+#else
+    int in = open(src, O_RDONLY);
+    int out = in >= 0 ? open(dst, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+#endif
+    struct stat st;
+    char magic[8];
+    int ret = -1;
+    if (in < 0 || out < 0 || fstat(in, &st) != 0) {
+        ESP_LOGE(TAG, "Cannot open %s: %s", in < 0 ? src : dst, strerror(errno));
+    } else if (sd_read_full(in, (uint8_t *)magic, 8, 0) == 8 && memcmp(magic, CZ_MAGIC, 8) == 0) {
+        ESP_LOGE(TAG, "%s is already packed", src);
+    } else if (st.st_size == 0) {
+        ESP_LOGE(TAG, "%s is empty", src);
+    } else if ((ret = cz_build(out, (uint64_t)st.st_size, cz_source_raw, &in)) != 0) {
+        ESP_LOGE(TAG, "Packing %s failed: %s", src, strerror(errno));
+    } else {
+        struct stat ost;
+        if (fstat(out, &ost) == 0)
+            ESP_LOGI(TAG, "Packed %s (%llu KB) into %s (%llu KB)", src,
+                     (unsigned long long)(st.st_size / 1024), dst,
+                     (unsigned long long)(ost.st_size / 1024));
+    }
+    if (out >= 0) close(out);
+    if (in >= 0) close(in);
+    if (ret != 0 && out >= 0) remove(dst);
+    return ret;
 }
 
-int sdcard_write(uint32_t lba, uint32_t count, const void *data)
+/* ---- Host directory cards ----
+ *
+ * With emu_sdcard_dir set the card is a FAT32 volume generated from a
+ * host directory tree when the card is attached.  Only the metadata is
+ * built: every file and directory gets a contiguous cluster run, so the
+ * FAT is computed per sector from the run list, directory clusters are
+ * kept in memory and file clusters are read from the host file when the
+ * sector is accessed.  The volume is read-only; writes land in the
+ * overlay (a temporary one unless --sdcard-overlay names a file).
+ */
+
+#define HD_RESERVED     32
+#define HD_EOC          0x0FFFFFFFu
+#define HD_MIN_CLUSTERS 65525u      /* FAT32 minimum cluster count */
+
+static void hd_free(struct sd_slot *sd)
 {
-    if (!sd_file) return -1;
-    throttle_io(count);
+    for (uint32_t i = 0; i < sd->hd_nruns; i++) {
+        free(sd->hd_runs[i].host);
+        free(sd->hd_runs[i].dir);
+    }
+    free(sd->hd_runs);
+    sd->hd_runs = NULL;
+    sd->hd_nruns = sd->hd_cap = 0;
+    if (sd->hd_fd >= 0) close(sd->hd_fd);
+    sd->hd_fd = -1;
+    sd->hd_active = 0;
+}
 
-    uint64_t offset = (uint64_t)lba * 512;
-    if (fseeko(sd_file, (off_t)offset, SEEK_SET) != 0)
+static void wr16(uint8_t *p, uint32_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void wr32(uint8_t *p, uint32_t v) { wr16(p, v); wr16(p + 2, v >> 16); }
+
+static uint64_t hd_hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Allocate a run of clusters (at least one); returns its index in
+ * hd_runs */
+static int32_t hd_alloc(struct sd_slot *sd, uint64_t bytes, char *host)
+{
+    uint32_t nclus = (uint32_t)((bytes + sd->hd_clus_bytes - 1) / sd->hd_clus_bytes);
+    if (!nclus) nclus = 1;
+    if ((uint64_t)sd->hd_next + nclus > (uint64_t)sd->hd_nclus + 2) return -1;
+    if (sd->hd_nruns == sd->hd_cap) {
+        uint32_t cap = sd->hd_cap ? sd->hd_cap * 2 : 256;
+        struct hd_run *r = realloc(sd->hd_runs, cap * sizeof(*r));
+        if (!r) return -1;
+        sd->hd_runs = r;
+        sd->hd_cap = cap;
+    }
+    struct hd_run *r = &sd->hd_runs[sd->hd_nruns];
+    memset(r, 0, sizeof(*r));
+    r->first = sd->hd_next;
+    r->nclus = nclus;
+    r->size = bytes;
+    r->host = host;
+    if (!host && !(r->dir = calloc(nclus, sd->hd_clus_bytes))) return -1;
+    sd->hd_next += nclus;
+    return (int32_t)sd->hd_nruns++;
+}
+
+/* Run holding cluster c, or -1 with *next set to the first cluster of
+ * the following run (hd_nclus + 2 if none) */
+static int32_t hd_find(struct sd_slot *sd, uint32_t c, uint32_t *next)
+{
+    uint32_t lo = 0, hi = sd->hd_nruns;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (sd->hd_runs[mid].first + sd->hd_runs[mid].nclus <= c) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < sd->hd_nruns && sd->hd_runs[lo].first <= c) return (int32_t)lo;
+    if (next) *next = lo < sd->hd_nruns ? sd->hd_runs[lo].first : sd->hd_nclus + 2;
+    return -1;
+}
+
+static uint32_t hd_fat_entry(struct sd_slot *sd, uint32_t c)
+{
+    if (c < 2) return c ? HD_EOC : 0x0FFFFFF8u;
+    int32_t i = hd_find(sd, c, NULL);
+    if (i < 0) return 0;
+    return c + 1 < sd->hd_runs[i].first + sd->hd_runs[i].nclus ? c + 1 : HD_EOC;
+}
+
+static void fat_datetime(time_t t, uint16_t *date, uint16_t *tm)
+{
+    struct tm lt;
+#ifdef _MSC_VER
+    localtime_s(&lt, &t);
+#else
+    localtime_r(&t, &lt);
+#endif
+    if (lt.tm_year < 80) {
+        *date = (1 << 5) | 1;         /* 1980-01-01 */
+        *tm = 0;
+        return;
+    }
+    *date = (uint16_t)((lt.tm_year - 80) << 9 | (lt.tm_mon + 1) << 5 | lt.tm_mday);
+    *tm = (uint16_t)(lt.tm_hour << 11 | lt.tm_min << 5 | lt.tm_sec / 2);
+}
+
+static uint8_t sfn_checksum(const uint8_t *sfn)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + sfn[i]);
+    return sum;
+}
+
+static int sfn_char_ok(int c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/* Decode UTF-8 into UCS-2 (other planes become '_'); returns the length
+ * or -1 if over 255 characters */
+static int utf8_to_ucs2(const char *s, uint16_t *out)
+{
+    int n = 0;
+    const uint8_t *p = (const uint8_t *)s;
+    while (*p) {
+        uint32_t c = *p++;
+        int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        if (extra) c &= 0x3F >> extra;
+        while (extra-- && (*p & 0xC0) == 0x80) c = c << 6 | (*p++ & 0x3F);
+        if (n == 255) return -1;
+        out[n++] = c > 0xFFFF ? '_' : (uint16_t)c;
+    }
+    return n;
+}
+
+/* Short name for name in sfn[11].  Returns 1 if name is itself a valid
+ * 8.3 name (no long name entries needed).  taken/ntaken are the short
+ * names already in the directory. */
+static int make_sfn(const char *name, uint8_t *sfn, const uint8_t *taken, uint32_t ntaken)
+{
+    const char *dot = strrchr(name, '.');
+    if (dot == name) dot = NULL;      /* ".hidden" has no extension */
+    size_t blen = dot ? (size_t)(dot - name) : strlen(name);
+    size_t elen = dot ? strlen(dot + 1) : 0;
+
+    int exact = blen >= 1 && blen <= 8 && elen <= 3;
+    for (const char *p = name; *p && exact; p++)
+        if (p != dot && !sfn_char_ok((uint8_t)*p)) exact = 0;
+
+    char base[8], ext[3];
+    size_t nb = 0, ne = 0;
+    for (size_t i = 0; i < blen && nb < 8; i++) {
+        int c = (uint8_t)name[i];
+        if (c == ' ' || c == '.') continue;
+        if (c >= 'a' && c <= 'z') c -= 32;
+        base[nb++] = sfn_char_ok(c) ? (char)c : '_';
+    }
+    for (size_t i = 0; i < elen && ne < 3; i++) {
+        int c = (uint8_t)dot[1 + i];
+        if (c == ' ') continue;
+        if (c >= 'a' && c <= 'z') c -= 32;
+        ext[ne++] = sfn_char_ok(c) ? (char)c : '_';
+    }
+    if (!nb) base[nb++] = '_';
+
+    for (uint32_t tail = 0; ; tail++) {
+        memset(sfn, ' ', 11);
+        if (tail == 0) {
+            if (!exact) continue;
+            memcpy(sfn, base, nb);
+        } else {
+            char t[12];
+            int tl = snprintf(t, sizeof(t), "~%u", (unsigned)tail);
+            size_t keep = nb < (size_t)(8 - tl) ? nb : (size_t)(8 - tl);
+            memcpy(sfn, base, keep);
+            memcpy(sfn + keep, t, (size_t)tl);
+        }
+        memcpy(sfn + 8, ext, ne);
+        if (sfn[0] == 0xE5) sfn[0] = 0x05;
+        uint32_t k = 0;
+        while (k < ntaken && memcmp(taken + k * 11, sfn, 11) != 0) k++;
+        if (k == ntaken) return tail == 0;
+    }
+}
+
+struct hd_entry {
+    char *name;
+    struct stat st;
+};
+
+static int hd_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct hd_entry *)a)->name, ((const struct hd_entry *)b)->name);
+}
+
+static void put_dirent(uint8_t *e, const uint8_t *sfn, uint8_t attr, uint32_t clus,
+                       uint32_t size, time_t mtime)
+{
+    uint16_t d, t;
+    fat_datetime(mtime, &d, &t);
+    memcpy(e, sfn, 11);
+    e[11] = attr;
+    wr16(e + 14, t);
+    wr16(e + 16, d);
+    wr16(e + 18, d);
+    wr16(e + 20, clus >> 16);
+    wr16(e + 22, t);
+    wr16(e + 24, d);
+    wr16(e + 26, clus);
+    wr32(e + 28, size);
+}
+
+/* Lay out directory path and everything below it; *first gets its
+ * first cluster.  parent is the first cluster of the parent directory
+ * (0 for the root and its children). */
+static int hd_scan_dir(struct sd_slot *sd, const char *path, uint32_t parent, int depth, uint32_t *first)
+{
+#ifdef _MSC_VER
+    ESP_LOGE(TAG, "--sdcard-dir is not supported on this platform");
+    return -1;
+#else
+    struct stat dst;
+    DIR *d = stat(path, &dst) == 0 ? opendir(path) : NULL;
+    if (!d) {
+        ESP_LOGE(TAG, "Cannot open directory %s: %s", path, strerror(errno));
         return -1;
+    }
+    struct hd_entry *ents = NULL;
+    uint32_t n = 0, cap = 0;
+    struct dirent *de;
+    int ret = 0;
+    while ((de = readdir(d)) != NULL && ret == 0) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char host[4096];
+        struct stat st;
+        if (snprintf(host, sizeof(host), "%s/%s", path, de->d_name) >= (int)sizeof(host) ||
+            stat(host, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+            continue;
+        if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > 0xFFFFFFFFull) {
+            ESP_LOGW(TAG, "Skipping %s: too large for FAT32", host);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 32;
+            struct hd_entry *p = realloc(ents, cap * sizeof(*p));
+            if (!p) { ret = -1; break; }
+            ents = p;
+        }
+        ents[n].name = strdup(de->d_name);
+        ents[n].st = st;
+        if (!ents[n++].name) ret = -1;
+    }
+    closedir(d);
+    /* Stable order, so the same tree always gives the same volume */
+    if (ret == 0 && n) qsort(ents, n, sizeof(*ents), hd_entry_cmp);
+
+    /* Size the directory: dot entries, long name entries, short entries */
+    uint16_t *ucs = malloc(256 * sizeof(uint16_t));
+    uint8_t *sfns = calloc(n ? n : 1, 11);
+    uint8_t *kind = calloc(n ? n : 1, 1);   /* 0 skipped, 1 long name, 2 plain 8.3 */
+    uint32_t slots = depth ? 2 : 1;         /* . and .., or the volume label */
+    for (uint32_t i = 0; i < n && ret == 0 && ucs && sfns && kind; i++) {
+        int len = utf8_to_ucs2(ents[i].name, ucs);
+        if (len < 0) {
+            ESP_LOGW(TAG, "Name too long, skipping %s/%s", path, ents[i].name);
+            continue;
+        }
+        int plain = make_sfn(ents[i].name, sfns + i * 11, sfns, i);
+        kind[i] = plain ? 2 : 1;
+        slots += 1 + (plain ? 0 : (uint32_t)(len + 12) / 13);
+    }
+    if (!ucs || !sfns || !kind) ret = -1;
+
+    int32_t self = ret == 0 ? hd_alloc(sd, (uint64_t)slots * 32, NULL) : -1;
+    if (self < 0 && ret == 0) {
+        ESP_LOGE(TAG, "%s does not fit on the card", path);
+        ret = -1;
+    }
+    uint32_t dir_first = self >= 0 ? sd->hd_runs[self].first : 0;
+    *first = dir_first;
+
+    /* Children first: entries need their first clusters */
+    uint32_t *clus = calloc(n ? n : 1, sizeof(uint32_t));
+    if (!clus) ret = -1;
+    for (uint32_t i = 0; i < n && ret == 0; i++) {
+        if (!kind[i]) continue;
+        char host[4096];
+        snprintf(host, sizeof(host), "%s/%s", path, ents[i].name);
+        sd->hd_stamp = hd_hash(sd->hd_stamp, host, strlen(host));
+        sd->hd_stamp = hd_hash(sd->hd_stamp, &ents[i].st.st_size, sizeof(ents[i].st.st_size));
+        sd->hd_stamp = hd_hash(sd->hd_stamp, &ents[i].st.st_mtime, sizeof(ents[i].st.st_mtime));
+        if (S_ISDIR(ents[i].st.st_mode)) {
+            if (depth >= 32) {
+                ESP_LOGW(TAG, "Skipping %s: too deep", host);
+                kind[i] = 0;
+                continue;
+            }
+            ret = hd_scan_dir(sd, host, depth ? dir_first : 0, depth + 1, &clus[i]);
+        } else {
+            sd->hd_files++;
+            if (ents[i].st.st_size == 0) continue;     /* no clusters */
+            char *h = strdup(host);
+            int32_t r = h ? hd_alloc(sd, (uint64_t)ents[i].st.st_size, h) : -1;
+            if (r < 0) {
+                free(h);
+                ESP_LOGE(TAG, "%s does not fit on the card", host);
+                ret = -1;
+            } else {
+                clus[i] = sd->hd_runs[r].first;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* hd_runs may have moved while children were added */
+        uint8_t *e = sd->hd_runs[self].dir;
+        if (depth) {
+            uint8_t dot[11];
+            memset(dot, ' ', 11);
+            dot[0] = '.';
+            put_dirent(e, dot, 0x10, dir_first, 0, dst.st_mtime);
+            dot[1] = '.';
+            put_dirent(e + 32, dot, 0x10, parent, 0, dst.st_mtime);
+            e += 64;
+        } else {
+            put_dirent(e, (const uint8_t *)"CYD SD CARD", 0x08, 0, 0, dst.st_mtime);
+            e += 32;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (!kind[i]) continue;
+            int len = kind[i] == 2 ? 0 : utf8_to_ucs2(ents[i].name, ucs);
+            const uint8_t *sfn = sfns + i * 11;
+            uint8_t sum = sfn_checksum(sfn);
+            int nl = (len + 12) / 13;
+            for (int l = nl; l >= 1; l--) {
+                /* Long name pieces, last piece first */
+                static const int pos[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+                memset(e, 0, 32);
+                e[0] = (uint8_t)(l | (l == nl ? 0x40 : 0));
+                e[11] = 0x0F;
+                e[13] = sum;
+                for (int k = 0; k < 13; k++) {
+                    int ci = (l - 1) * 13 + k;
+                    uint16_t c = ci < len ? ucs[ci] : ci == len ? 0 : 0xFFFF;
+                    wr16(e + pos[k], c);
+                }
+                e += 32;
+            }
+            int dir = S_ISDIR(ents[i].st.st_mode);
+            put_dirent(e, sfn, dir ? 0x10 : 0x20, clus[i],
+                       dir ? 0 : (uint32_t)ents[i].st.st_size, ents[i].st.st_mtime);
+            e += 32;
+        }
+    }
 
-    size_t n = fwrite(data, 512, count, sd_file);
-    return (n == count) ? 0 : -1;
+    for (uint32_t i = 0; i < n; i++) free(ents[i].name);
+    free(ents);
+    free(ucs);
+    free(sfns);
+    free(kind);
+    free(clus);
+    return ret;
+#endif
 }
 
-int sdcard_read(uint32_t lba, uint32_t count, void *data)
+/* Lay out a FAT32 volume of sd->size bytes for sd->dir */
+static int hd_build(struct sd_slot *sd)
 {
-    if (!sd_file) return -1;
-    throttle_io(count);
+    uint64_t total = sd->size / 512;
+    if (total > 0xFFFFFFFFull) total = 0xFFFFFFFFull;
+    if (total < 128 * 1024) {
+        ESP_LOGE(TAG, "--sdcard-dir needs a card of at least 64 MB");
+        return -1;
+    }
+    /* Usual cluster size for the card size, made smaller while that
+     * leaves fewer clusters than FAT32 allows (a reader would take the
+     * volume for FAT16) */
+    sd->hd_spc = sd->size < (256ULL << 20) ? 1 : sd->size <= (8ULL << 30) ? 8 :
+             sd->size <= (16ULL << 30) ? 16 : sd->size <= (32ULL << 30) ? 32 : 64;
+    for (;;) {
+        sd->hd_fatsz = (uint32_t)((((total - HD_RESERVED) / sd->hd_spc + 2) * 4 + 511) / 512);
+        sd->hd_data_start = HD_RESERVED + 2 * sd->hd_fatsz;
+        sd->hd_nclus = (uint32_t)((total - sd->hd_data_start) / sd->hd_spc);
+        if (sd->hd_nclus >= HD_MIN_CLUSTERS || sd->hd_spc == 1) break;
+        sd->hd_spc /= 2;
+    }
+    if (sd->hd_nclus < HD_MIN_CLUSTERS) {
+        ESP_LOGE(TAG, "--sdcard-dir: %llu sectors is too small for FAT32",
+                 (unsigned long long)total);
+        return -1;
+    }
+    sd->hd_clus_bytes = sd->hd_spc * 512;
+    if (sd->hd_nclus > 0x0FFFFFF5u) sd->hd_nclus = 0x0FFFFFF5u;
+    sd->hd_next = 2;
+    sd->hd_files = 0;
+    sd->hd_stamp = 0xcbf29ce484222325ULL;
 
-    uint64_t offset = (uint64_t)lba * 512;
-    if (fseeko(sd_file, (off_t)offset, SEEK_SET) != 0) {
-        memset(data, 0, (size_t)count * 512);
+    uint32_t root;
+    if (hd_scan_dir(sd, sd->dir, 0, 0, &root) != 0) {
+        hd_free(sd);
         return -1;
     }
 
-    size_t n = fread(data, 512, count, sd_file);
-    if (n < count)
-        memset((uint8_t *)data + n * 512, 0, (count - n) * 512);
+    uint8_t *b = sd->hd_boot;
+    memset(b, 0, 512);
+    memcpy(b, "\xEB\x58\x90" "MSWIN4.1", 11);
+    wr16(b + 11, 512);
+    b[13] = (uint8_t)sd->hd_spc;
+    wr16(b + 14, HD_RESERVED);
+    b[16] = 2;
+    b[21] = 0xF8;
+    wr16(b + 24, 63);
+    wr16(b + 26, 255);
+    wr32(b + 32, (uint32_t)total);
+    wr32(b + 36, sd->hd_fatsz);
+    wr32(b + 44, root);           /* root directory cluster */
+    wr16(b + 48, 1);              /* FSInfo */
+    wr16(b + 50, 6);              /* backup boot sector */
+    b[64] = 0x80;
+    b[66] = 0x29;
+    wr32(b + 67, (uint32_t)sd->hd_stamp);
+    memcpy(b + 71, "CYD SD CARDFAT32   ", 19);
+    b[510] = 0x55;
+    b[511] = 0xAA;
+
+    b = sd->hd_fsinfo;
+    memset(b, 0, 512);
+    wr32(b, 0x41615252);
+    wr32(b + 484, 0x61417272);
+    wr32(b + 488, sd->hd_nclus + 2 - sd->hd_next);
+    wr32(b + 492, sd->hd_next);
+    wr32(b + 508, 0xAA550000);
+
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < sd->hd_nruns; i++)
+        if (sd->hd_runs[i].host) bytes += sd->hd_runs[i].size;
+    sd->hd_active = 1;
+    ESP_LOGI(TAG, "SD card from %s: %u files, %llu MB, %u of %u clusters used",
+             sd->dir, (unsigned)sd->hd_files, (unsigned long long)(bytes >> 20),
+             (unsigned)(sd->hd_next - 2), (unsigned)sd->hd_nclus);
+    return 0;
+}
+
+/* Read a file run's data; past the host file's end (it may have
+ * shrunk) reads as zeros.  Caller holds hd_mutex. */
+static void hd_read_file(struct sd_slot *sd, uint32_t run, uint64_t off, size_t len, uint8_t *out)
+{
+    size_t n = 0;
+    if (sd->hd_fd < 0 || sd->hd_fd_run != run) {
+        if (sd->hd_fd >= 0) close(sd->hd_fd);
+#ifdef _MSC_VER
+        sd->hd_fd = _open(sd->hd_runs[run].host, _O_RDONLY | _O_BINARY);
+#else
+        sd->hd_fd = open(sd->hd_runs[run].host, O_RDONLY);
+#endif
+        sd->hd_fd_run = run;
+        if (sd->hd_fd < 0)
+            ESP_LOGW(TAG, "Cannot read %s: %s", sd->hd_runs[run].host, strerror(errno));
+    }
+    if (sd->hd_fd >= 0 && off < sd->hd_runs[run].size) {
+        uint64_t avail = sd->hd_runs[run].size - off;
+        n = sd_read_full(sd->hd_fd, out, len < avail ? len : (size_t)avail, off);
+    }
+    memset(out + n, 0, len - n);
+}
+
+static int hd_read(struct sd_slot *sd, uint64_t off, size_t len, uint8_t *out)
+{
+    pthread_mutex_lock(&sd->hd_mutex);
+    while (len) {
+        uint32_t lba = (uint32_t)(off / 512);
+        size_t n = 512;
+        if (lba < sd->hd_data_start) {
+            memset(out, 0, 512);
+            if (lba == 0 || lba == 6)
+                memcpy(out, sd->hd_boot, 512);
+            else if (lba == 1 || lba == 7)
+                memcpy(out, sd->hd_fsinfo, 512);
+            else if (lba >= HD_RESERVED) {
+                uint32_t c = (lba - HD_RESERVED) % sd->hd_fatsz * 128;
+                for (int k = 0; k < 128; k++) wr32(out + k * 4, hd_fat_entry(sd, c + k));
+            }
+        } else {
+            uint32_t rel = lba - sd->hd_data_start;
+            uint32_t c = 2 + rel / sd->hd_spc;
+            uint64_t in = (uint64_t)(rel % sd->hd_spc) * 512 + off % 512;
+            uint32_t next;
+            int32_t r = c < sd->hd_nclus + 2 ? hd_find(sd, c, &next) : -1;
+            if (r < 0) {
+                /* Free space up to the next run */
+                uint64_t gap = c < sd->hd_nclus + 2 ? (uint64_t)(next - c) * sd->hd_clus_bytes - in : len;
+                n = len < gap ? len : (size_t)gap;
+                memset(out, 0, n);
+            } else {
+                const struct hd_run *h = &sd->hd_runs[r];
+                uint64_t at = (uint64_t)(c - h->first) * sd->hd_clus_bytes + in;
+                uint64_t avail = (uint64_t)h->nclus * sd->hd_clus_bytes - at;
+                n = len < avail ? len : (size_t)avail;
+                if (h->dir)
+                    memcpy(out, h->dir + at, n);
+                else
+                    hd_read_file(sd, (uint32_t)r, at, n, out);
+            }
+        }
+        if (n > len) n = len;
+        off += n;
+        out += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&sd->hd_mutex);
     return 0;
 }
+
+/* Read from the card's base: the image file (inflating packed images)
+ * or the host directory volume.  Short at the end of a raw image. */
+static size_t image_read(struct sd_slot *sd, uint8_t *buf, size_t len, uint64_t off)
+{
+    if (sd->hd_active) return hd_read(sd, off, len, buf) == 0 ? len : 0;
+    if (sd->cz_active) return cz_read(sd, off, len, buf) == 0 ? len : 0;
+    if (sd->fd < 0) return 0;
+    return sd_read_full(sd->fd, buf, len, off);
+}
+
+/* ---- Copy-on-write overlay ---- */
+
+#define OVL_MAGIC     "CYDSDOV1"
+#define OVL_HDR_SIZE  4096
+
+#define OVL_BIT(sd, lba)  (((sd)->ovl_bitmap[(lba) >> 3] >> ((lba) & 7)) & 1)
+
+static void ovl_stat_base(struct sd_slot *sd)
+{
+    struct stat st;
+    sd->ovl_hdr.base_size = 0;
+    sd->ovl_hdr.base_mtime = 0;
+    if (sd->hd_active) {
+        sd->ovl_hdr.base_size = sd->size;
+        sd->ovl_hdr.base_mtime = (int64_t)sd->hd_stamp;
+    } else if (sd->fd >= 0 && fstat(sd->fd, &st) == 0) {
+        sd->ovl_hdr.base_size = (uint64_t)st.st_size;
+        sd->ovl_hdr.base_mtime = (int64_t)st.st_mtime;
+    }
+}
+
+/* Empty the delta: truncating drops all data blocks */
+static int ovl_reset(struct sd_slot *sd)
+{
+    memset(sd->ovl_bitmap, 0, sd->ovl_bitmap_bytes);
+    memcpy(sd->ovl_hdr.magic, OVL_MAGIC, 8);
+    sd->ovl_hdr.card_size = sd->size;
+    uint8_t hdr[OVL_HDR_SIZE] = { 0 };
+    memcpy(hdr, &sd->ovl_hdr, sizeof(sd->ovl_hdr));
+    if (ftruncate(sd->ovl_fd, 0) != 0 ||
+        ftruncate(sd->ovl_fd, (off_t)(sd->ovl_data_off + sd->size)) != 0 ||
+        sd_write_full(sd->ovl_fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return -1;
+    return 0;
+}
+
+static int ovl_open(struct sd_slot *sd)
+{
+    const char *name = sd->overlay_path ? sd->overlay_path : "(temporary)";
+    if (!sd->hd_active) {
+        sd->fd = sd_open_image(sd, O_RDONLY);
+        if (sd->fd < 0)
+            ESP_LOGW(TAG, "Overlay base %s missing, starting blank", sd->path);
+        else if (cz_open(sd) < 0)
+            return -1;
+    }
+    ovl_stat_base(sd);
+
+    uint64_t sectors = sd->size / 512;
+    sd->ovl_bitmap_bytes = (size_t)((sectors + 7) / 8);
+    sd->ovl_data_off = (OVL_HDR_SIZE + sd->ovl_bitmap_bytes + 4095) & ~(uint64_t)4095;
+    sd->ovl_bitmap = malloc(sd->ovl_bitmap_bytes ? sd->ovl_bitmap_bytes : 1);
+    if (!sd->overlay_path) {
+        /* Deleted when closed */
+        sd->ovl_tmp = tmpfile();
+        sd->ovl_fd = sd->ovl_tmp ? fileno(sd->ovl_tmp) : -1;
+    } else {
+#ifdef _MSC_VER
+        sd->ovl_fd = _open(sd->overlay_path, _O_RDWR | _O_CREAT | _O_BINARY, 0644);
+#else
+        sd->ovl_fd = open(sd->overlay_path, O_RDWR | O_CREAT, 0644);
+#endif
+    }
+    if (!sd->ovl_bitmap || sd->ovl_fd < 0) {
+        ESP_LOGE(TAG, "Cannot open/create overlay %s", name);
+        return -1;
+    }
+
+    /* Reuse an existing delta only if it was made over this same base */
+    struct ovl_header old = { 0 };
+    int reuse = sd_read_full(sd->ovl_fd, (uint8_t *)&old, sizeof(old), 0) == sizeof(old) &&
+                memcmp(old.magic, OVL_MAGIC, 8) == 0 &&
+                old.card_size == sd->size &&
+                old.base_size == sd->ovl_hdr.base_size &&
+                old.base_mtime == sd->ovl_hdr.base_mtime &&
+                sd_read_full(sd->ovl_fd, sd->ovl_bitmap, sd->ovl_bitmap_bytes, OVL_HDR_SIZE) == sd->ovl_bitmap_bytes;
+    if (!reuse) {
+        if (old.magic[0] && memcmp(old.magic, OVL_MAGIC, 8) == 0)
+            ESP_LOGW(TAG, "Overlay %s does not match its base, discarding it",
+                     name);
+        if (ovl_reset(sd) != 0) {
+            ESP_LOGE(TAG, "Cannot initialize overlay %s", name);
+            return -1;
+        }
+        return 0;
+    }
+
+    uint64_t dirty = 0;
+    for (size_t i = 0; i < sd->ovl_bitmap_bytes; i++)
+        for (uint8_t b = sd->ovl_bitmap[i]; b; b &= b - 1) dirty++;
+    ESP_LOGI(TAG, "Overlay %s: %llu modified sectors", name,
+             (unsigned long long)dirty);
+    return 0;
+}
+
+static void ovl_close(struct sd_slot *sd)
+{
+    if (sd->ovl_tmp) fclose(sd->ovl_tmp);
+    else if (sd->ovl_fd >= 0) close(sd->ovl_fd);
+    sd->ovl_tmp = NULL;
+    sd->ovl_fd = -1;
+    free(sd->ovl_bitmap);
+    sd->ovl_bitmap = NULL;
+}
+
+static int ovl_write(struct sd_slot *sd, uint32_t lba, uint32_t count, const void *data)
+{
+    size_t len = (size_t)count * 512;
+    pthread_rwlock_wrlock(&sd->ovl_lock);
+    int ret = -1;
+    if (sd_write_full(sd->ovl_fd, data, len, sd->ovl_data_off + (uint64_t)lba * 512) == len) {
+        /* Data first, then the bitmap bytes that cover it */
+        for (uint32_t s = lba; s < lba + count; s++)
+            sd->ovl_bitmap[s >> 3] |= (uint8_t)(1u << (s & 7));
+        size_t first = lba >> 3, last = (lba + count - 1) >> 3;
+        size_t n = last - first + 1;
+        if (sd_write_full(sd->ovl_fd, sd->ovl_bitmap + first, n, OVL_HDR_SIZE + first) == n)
+            ret = 0;
+    }
+    pthread_rwlock_unlock(&sd->ovl_lock);
+    return ret;
+}
+
+/* Read runs of sectors from the delta or the base */
+static void ovl_read(struct sd_slot *sd, uint32_t lba, uint32_t count, uint8_t *out)
+{
+    pthread_rwlock_rdlock(&sd->ovl_lock);
+    uint32_t i = 0;
+    while (i < count) {
+        int in_delta = OVL_BIT(sd, lba + i);
+        uint32_t j = i + 1;
+        while (j < count && OVL_BIT(sd, lba + j) == in_delta) j++;
+
+        uint64_t off = (uint64_t)(lba + i) * 512;
+        size_t len = (size_t)(j - i) * 512, n = 0;
+        if (in_delta)
+            n = sd_read_full(sd->ovl_fd, out + (size_t)i * 512, len, sd->ovl_data_off + off);
+        else
+            n = image_read(sd, out + (size_t)i * 512, len, off);
+        if (n < len)
+            memset(out + (size_t)i * 512 + n, 0, len - n);
+        i = j;
+    }
+    pthread_rwlock_unlock(&sd->ovl_lock);
+}
+
+/* ---- Backing I/O ----
+ *
+ * Uncached sector access to whatever holds the card: the overlay, a
+ * packed image, the mapping or the image fd.  Reads past the end of the data come back
+ * zeroed.
+ */
+
+static int backing_read(struct sd_slot *sd, uint32_t lba, uint32_t count, uint8_t *out)
+{
+    uint64_t offset = (uint64_t)lba * 512;
+    size_t len = (size_t)count * 512;
+
+    if (sd->ovl_fd >= 0) {
+        ovl_read(sd, lba, count, out);
+        return 0;
+    }
+    if (sd->cz_active)
+        return cz_read(sd, offset, len, out);
+    if (sd->map) {
+        memcpy(out, sd->map + offset, len);
+        return 0;
+    }
+    size_t n = sd_read_full(sd->fd, out, len, offset);
+    if (n < len)
+        memset(out + n, 0, len - n);
+    return 0;
+}
+
+static int backing_write(struct sd_slot *sd, uint32_t lba, uint32_t count, const uint8_t *data)
+{
+    uint64_t offset = (uint64_t)lba * 512;
+    size_t len = (size_t)count * 512;
+
+    if (sd->ovl_fd >= 0)
+        return ovl_write(sd, lba, count, data);
+    if (sd->cz_active)
+        return cz_write(sd, offset, len, data);
+    if (sd->map) {
+        memcpy(sd->map + offset, data, len);
+        return 0;
+    }
+    return sd_write_full(sd->fd, data, len, offset) == len ? 0 : -1;
+}
+
+/* ---- Region map ----
+ *
+ * For the cache statistics every sector is classed as boot (MBR, boot
+ * and reserved sectors), fat, dir or data.  The FAT12/16/32 or exFAT
+ * layout and the set of directory clusters are read once when the card
+ * is opened; directories created later count as data.
+ */
+
+#define LAYOUT_MAX_DIR_CLUSTERS 65536
+
+static uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return (uint32_t)rd16(p) | (uint32_t)rd16(p + 2) << 16; }
+
+static int sector_region(struct sd_slot *sd, uint32_t lba)
+{
+    if (!sd->layout.data_start) return SDCARD_REGION_DATA;
+    if (lba < sd->layout.fat_start) return SDCARD_REGION_BOOT;
+    if (lba < sd->layout.fat_end) return SDCARD_REGION_FAT;
+    if (lba < sd->layout.data_start)
+        return lba >= sd->layout.root_start && lba < sd->layout.root_end ?
+               SDCARD_REGION_DIR : SDCARD_REGION_BOOT;
+    uint32_t c = (lba - sd->layout.data_start) >> sd->layout.clus_shift;
+    if (c < sd->layout.nclusters && (sd->layout.dir_map[c >> 3] >> (c & 7)) & 1)
+        return SDCARD_REGION_DIR;
+    return SDCARD_REGION_DATA;
+}
+
+/* Next cluster in a FAT chain, 0 at the end or on a bad entry */
+static uint32_t layout_fat_next(struct sd_slot *sd, uint32_t c, uint8_t *buf, uint32_t *buf_lba)
+{
+    uint64_t off = sd->layout.fat_bits == 12 ? c + c / 2 : (uint64_t)c * (sd->layout.fat_bits / 8);
+    uint32_t lba = sd->layout.fat_start + (uint32_t)(off / 512);
+    if (lba >= sd->layout.fat_end) return 0;
+    if (*buf_lba != lba) {
+        backing_read(sd, lba, 2, buf);   /* two, for FAT12 entries across a boundary */
+        *buf_lba = lba;
+    }
+    const uint8_t *p = buf + off % 512;
+    uint32_t v, eoc;
+    if (sd->layout.fat_bits == 12) {
+        v = rd16(p);
+        v = (c & 1) ? v >> 4 : v & 0xFFF;
+        eoc = 0xFF8;
+    } else if (sd->layout.fat_bits == 16) {
+        v = rd16(p);
+        eoc = 0xFFF8;
+    } else {
+        v = sd->layout.exfat ? rd32(p) : rd32(p) & 0x0FFFFFFF;
+        eoc = sd->layout.exfat ? 0xFFFFFFF7 : 0x0FFFFFF8;
+    }
+    return v >= 2 && v < eoc && v - 2 < sd->layout.nclusters ? v : 0;
+}
+
+struct dir_ref {
+    uint32_t cluster;
+    uint32_t contig;     /* exFAT NoFatChain: length in clusters, else 0 */
+};
+
+/* Mark every directory reachable from the root in dir_map */
+static void layout_walk_dirs(struct sd_slot *sd, uint32_t root_cluster)
+{
+    uint32_t spc = 1u << sd->layout.clus_shift;
+    uint8_t *sec = malloc(512), *fat_buf = malloc(1024);
+    struct dir_ref *stack = NULL;
+    size_t depth = 0, cap = 0;
+    uint32_t fat_lba = UINT32_MAX, visited = 0;
+    uint32_t root_sectors = sd->layout.root_end - sd->layout.root_start;
+
+    if (!sec || !fat_buf) goto out;
+
+    /* FAT12/16: the root is a fixed region, walked as pseudo-cluster 0 */
+    int root_pending = root_sectors > 0;
+    if (!root_pending && root_cluster >= 2) {
+        stack = malloc(16 * sizeof(*stack));
+        if (!stack) goto out;
+        cap = 16;
+        stack[depth++] = (struct dir_ref){ root_cluster, 0 };
+    }
+
+    while (root_pending || depth > 0) {
+        struct dir_ref d = { 0, 0 };
+        if (!root_pending) d = stack[--depth];
+        uint32_t c = d.cluster, n = 0;
+        int pending_dir = 0, done = 0;
+        /* After the end marker the rest of the chain is only marked */
+        while (visited < LAYOUT_MAX_DIR_CLUSTERS) {
+            uint32_t first, count;
+            if (root_pending) {
+                first = sd->layout.root_start;
+                count = root_sectors;
+            } else {
+                if (c < 2 || c - 2 >= sd->layout.nclusters) break;
+                uint32_t idx = c - 2;
+                if ((sd->layout.dir_map[idx >> 3] >> (idx & 7)) & 1) break;  /* loop */
+                sd->layout.dir_map[idx >> 3] |= (uint8_t)(1u << (idx & 7));
+                visited++;
+                first = sd->layout.data_start + (idx << sd->layout.clus_shift);
+                count = spc;
+            }
+            for (uint32_t s = 0; s < count && !done; s++) {
+                backing_read(sd, first + s, 1, sec);
+                for (int e = 0; e < 512; e += 32) {
+                    const uint8_t *ent = sec + e;
+                    uint32_t child = 0, contig = 0;
+                    if (ent[0] == 0x00) { done = 1; break; }
+                    if (sd->layout.exfat) {
+                        if (ent[0] == 0x85) {
+                            pending_dir = (rd16(ent + 4) & 0x10) != 0;
+                        } else if (ent[0] == 0xC0 && pending_dir) {
+                            child = rd32(ent + 20);
+                            if (ent[1] & 0x02) {
+                                uint64_t cb = (uint64_t)spc * 512;
+                                uint64_t len = (uint64_t)rd32(ent + 24) |
+                                               (uint64_t)rd32(ent + 28) << 32;
+                                contig = (uint32_t)((len + cb - 1) / cb);
+                                if (!contig) child = 0;
+                            }
+                            pending_dir = 0;
+                        }
+                    } else if (ent[0] != 0xE5 && ent[0] != '.' && ent[11] != 0x0F &&
+                               (ent[11] & 0x10)) {
+                        child = (uint32_t)rd16(ent + 26) |
+                                (sd->layout.fat_bits == 32 ? (uint32_t)rd16(ent + 20) << 16 : 0);
+                    }
+                    if (child < 2) continue;
+                    if (depth == cap) {
+                        size_t ncap = cap ? cap * 2 : 16;
+                        struct dir_ref *ns = realloc(stack, ncap * sizeof(*stack));
+                        if (!ns) continue;
+                        stack = ns;
+                        cap = ncap;
+                    }
+                    stack[depth++] = (struct dir_ref){ child, contig };
+                }
+            }
+            if (root_pending) break;
+            if (d.contig)
+                c = ++n < d.contig ? c + 1 : 0;
+            else
+                c = layout_fat_next(sd, c, fat_buf, &fat_lba);
+        }
+        root_pending = 0;
+    }
+out:
+    free(stack);
+    free(fat_buf);
+    free(sec);
+}
+
+/* Find the filesystem (at sector 0 or in the first MBR partition) */
+static void layout_scan(struct sd_slot *sd)
+{
+    uint8_t bs[512];
+    free(sd->layout.dir_map);
+    memset(&sd->layout, 0, sizeof(sd->layout));
+
+    uint32_t part = 0;
+    backing_read(sd, 0, 1, bs);
+    if (memcmp(bs + 3, "EXFAT   ", 8) != 0 && memcmp(bs + 54, "FAT", 3) != 0 &&
+        memcmp(bs + 82, "FAT32", 5) != 0) {
+        if (bs[510] != 0x55 || bs[511] != 0xAA) return;
+        part = rd32(bs + 446 + 8);
+        if (!part || (uint64_t)part * 512 >= sd->size) return;
+        backing_read(sd, part, 1, bs);
+    }
+
+    uint32_t root_cluster = 0;
+    if (memcmp(bs + 3, "EXFAT   ", 8) == 0) {
+        if (bs[108] != 9 || bs[109] > 16) return;   /* 512-byte sectors only */
+        sd->layout.exfat = 1;
+        sd->layout.fat_bits = 32;
+        sd->layout.fat_start = part + rd32(bs + 80);
+        sd->layout.fat_end = sd->layout.fat_start + rd32(bs + 84) * (bs[110] ? bs[110] : 1);
+        sd->layout.data_start = part + rd32(bs + 88);
+        sd->layout.nclusters = rd32(bs + 92);
+        sd->layout.clus_shift = bs[109];
+        root_cluster = rd32(bs + 96);
+    } else {
+        uint32_t spc = bs[13], fatsz = rd16(bs + 22), total = rd16(bs + 19);
+        if (rd16(bs + 11) != 512 || !spc || (spc & (spc - 1)) || !bs[16]) return;
+        if (!fatsz) fatsz = rd32(bs + 36);
+        if (!total) total = rd32(bs + 32);
+        while ((1u << sd->layout.clus_shift) < spc) sd->layout.clus_shift++;
+        sd->layout.fat_start = part + rd16(bs + 14);
+        sd->layout.fat_end = sd->layout.fat_start + bs[16] * fatsz;
+        sd->layout.root_start = sd->layout.fat_end;
+        sd->layout.root_end = sd->layout.root_start + (rd16(bs + 17) * 32 + 511) / 512;
+        sd->layout.data_start = sd->layout.root_end;
+        if (total <= sd->layout.data_start - part) {
+            sd->layout.data_start = 0;
+            return;
+        }
+        sd->layout.nclusters = (total - (sd->layout.data_start - part)) >> sd->layout.clus_shift;
+        /* FAT32 has no 16-bit FAT size (small FAT32 volumes exist) */
+        sd->layout.fat_bits = !rd16(bs + 22) ? 32 : sd->layout.nclusters < 4085 ? 12 : 16;
+        if (sd->layout.fat_bits == 32) {
+            sd->layout.root_end = sd->layout.root_start;
+            root_cluster = rd32(bs + 44);
+        }
+    }
+
+    sd->layout.dir_map = calloc(sd->layout.nclusters / 8 + 1, 1);
+    if (!sd->layout.dir_map) {
+        sd->layout.data_start = 0;
+        return;
+    }
+    layout_walk_dirs(sd, root_cluster);
+}
+
+/* ---- Sector cache ----
+ *
+ * LRU cache of 4 KB lines (8 aligned sectors) in front of the backing
+ * store, so the FAT and directory sectors firmware keeps re-reading stay
+ * in memory.  Per-sector valid/dirty masks let writes land without a
+ * read-fill.  Writes are held back and go out as runs of contiguous dirty
+ * sectors, merged across neighbouring lines: when a dirty line is
+ * evicted, on sync, once the oldest dirty line is SD_CACHE_FLUSH_MS old,
+ * and on deinit.  A read starting where one of the last few reads ended
+ * is sequential; a sequential miss also fetches a read-ahead window that
+ * doubles up to SD_RA_MAX_LINES, or a quarter of the cache if that is
+ * smaller, so one fill never takes more than half the lines.  Requests
+ * larger than a quarter of the cache bypass it.  Not used with --sdcard-mmap.
+ */
+
+#define CACHE_LINE_SECT     8
+#define CACHE_LINE_BYTES    (CACHE_LINE_SECT * 512)
+#define CACHE_MIN_LINES     16
+#define CACHE_NONE          (-1)
+#define SD_RA_MIN_LINES     4
+#define SD_RA_MAX_LINES     32
+#define SD_FLUSH_MAX_LINES  64
+#define SD_CACHE_FLUSH_MS   1000
+
+#define LINE_DATA(sd, i)  ((sd)->cache_data + (size_t)(i) * CACHE_LINE_BYTES)
+#define HASH_TAG(sd, t)   (((t) * 2654435761u) & (sd)->cache_hash_mask)
+
+/* Sectors of line <tag> that fall inside [lba, end) */
+static uint8_t line_mask(uint32_t tag, uint32_t lba, uint32_t end)
+{
+    uint32_t s0 = tag * CACHE_LINE_SECT, s1 = s0 + CACHE_LINE_SECT;
+    if (lba > s0) s0 = lba;
+    if (end < s1) s1 = end;
+    return (uint8_t)(((1u << (s1 - s0)) - 1) << (s0 % CACHE_LINE_SECT));
+}
+
+static int32_t cache_lookup(struct sd_slot *sd, uint32_t tag)
+{
+    for (int32_t i = sd->cache_hash[HASH_TAG(sd, tag)]; i != CACHE_NONE; i = sd->cache_lines[i].hnext)
+        if (sd->cache_lines[i].tag == tag) return i;
+    return CACHE_NONE;
+}
+
+static void lru_unlink(struct sd_slot *sd, int32_t i)
+{
+    struct cache_line *ln = &sd->cache_lines[i];
+    if (ln->prev != CACHE_NONE) sd->cache_lines[ln->prev].next = ln->next;
+    else sd->lru_head = ln->next;
+    if (ln->next != CACHE_NONE) sd->cache_lines[ln->next].prev = ln->prev;
+    else sd->lru_tail = ln->prev;
+}
+
+static void lru_push_front(struct sd_slot *sd, int32_t i)
+{
+    sd->cache_lines[i].prev = CACHE_NONE;
+    sd->cache_lines[i].next = sd->lru_head;
+    if (sd->lru_head != CACHE_NONE) sd->cache_lines[sd->lru_head].prev = i;
+    sd->lru_head = i;
+    if (sd->lru_tail == CACHE_NONE) sd->lru_tail = i;
+}
+
+static void cache_touch(struct sd_slot *sd, int32_t i)
+{
+    if (sd->lru_head == i) return;
+    lru_unlink(sd, i);
+    lru_push_front(sd, i);
+}
+
+static void hash_remove(struct sd_slot *sd, int32_t i)
+{
+    for (int32_t *pp = &sd->cache_hash[HASH_TAG(sd, sd->cache_lines[i].tag)]; *pp != CACHE_NONE;
+         pp = &sd->cache_lines[*pp].hnext) {
+        if (*pp == i) {
+            *pp = sd->cache_lines[i].hnext;
+            break;
+        }
+    }
+}
+
+/* Write one run of dirty sectors staged in cache_flush_buf */
+static int cache_write_out(struct sd_slot *sd, uint32_t lba, uint32_t count)
+{
+    sd->cache_stats.writeback_runs++;
+    sd->cache_stats.writeback_sectors += count;
+    if (backing_write(sd, lba, count, sd->cache_flush_buf) == 0) return 0;
+    ESP_LOGE(TAG, "Write-back of %u sectors at %u failed: %s",
+             count, lba, strerror(errno));
+    return -1;
+}
+
+/* Flush line i together with dirty neighbours that continue its runs */
+static int cache_flush_run(struct sd_slot *sd, int32_t i)
+{
+    uint32_t lo = sd->cache_lines[i].tag, hi = lo;
+    int32_t j, k;
+
+    for (j = i; hi - lo + 1 < SD_FLUSH_MAX_LINES && lo > 0 && (sd->cache_lines[j].dirty & 0x01) &&
+                (k = cache_lookup(sd, lo - 1)) != CACHE_NONE && (sd->cache_lines[k].dirty & 0x80); j = k)
+        lo--;
+    for (j = i; hi - lo + 1 < SD_FLUSH_MAX_LINES && (sd->cache_lines[j].dirty & 0x80) &&
+                (k = cache_lookup(sd, hi + 1)) != CACHE_NONE && (sd->cache_lines[k].dirty & 0x01); j = k)
+        hi++;
+
+    int ret = 0;
+    uint32_t run_lba = 0, run_len = 0;
+    for (uint32_t tag = lo; tag <= hi; tag++) {
+        k = tag == sd->cache_lines[i].tag ? i : cache_lookup(sd, tag);
+        struct cache_line *ln = &sd->cache_lines[k];
+        for (uint32_t s = 0; s < CACHE_LINE_SECT; s++) {
+            if (ln->dirty & (1u << s)) {
+                if (!run_len) run_lba = tag * CACHE_LINE_SECT + s;
+                memcpy(sd->cache_flush_buf + (size_t)run_len * 512, LINE_DATA(sd, k) + s * 512, 512);
+                run_len++;
+            } else if (run_len) {
+                ret |= cache_write_out(sd, run_lba, run_len);
+                run_len = 0;
+            }
+        }
+        ln->dirty = 0;
+    }
+    if (run_len) ret |= cache_write_out(sd, run_lba, run_len);
+    return ret;
+}
+
+static int cache_flush_all(struct sd_slot *sd)
+{
+    int ret = 0;
+    for (uint32_t i = 0; i < sd->cache_nlines; i++)
+        if (sd->cache_lines[i].dirty) ret |= cache_flush_run(sd, (int32_t)i);
+    sd->cache_dirty_since_ms = 0;
+    return ret;
+}
+
+/* Drop every line, dirty or not */
+static void cache_invalidate_all(struct sd_slot *sd)
+{
+    for (uint32_t i = 0; i <= sd->cache_hash_mask; i++) sd->cache_hash[i] = CACHE_NONE;
+    sd->lru_head = sd->lru_tail = CACHE_NONE;
+    for (uint32_t i = 0; i < sd->cache_nlines; i++) {
+        sd->cache_lines[i].tag = UINT32_MAX;
+        sd->cache_lines[i].valid = sd->cache_lines[i].dirty = 0;
+        sd->cache_lines[i].hnext = CACHE_NONE;
+        lru_push_front(sd, (int32_t)i);
+    }
+    sd->cache_dirty_since_ms = 0;
+    for (int k = 0; k < SD_RA_STREAMS; k++) sd->ra_streams[k].next_lba = UINT32_MAX;
+}
+
+/* Recycle the least recently used line for <tag> */
+static int32_t cache_alloc(struct sd_slot *sd, uint32_t tag)
+{
+    int32_t i = sd->lru_tail;
+    struct cache_line *ln = &sd->cache_lines[i];
+    if (ln->dirty) cache_flush_run(sd, i);
+    if (ln->tag != UINT32_MAX) hash_remove(sd, i);
+    ln->tag = tag;
+    ln->valid = ln->dirty = 0;
+    ln->hnext = sd->cache_hash[HASH_TAG(sd, tag)];
+    sd->cache_hash[HASH_TAG(sd, tag)] = i;
+    cache_touch(sd, i);
+    return i;
+}
+
+/* Read lines [t0, t1) into cache_fill_buf and install them.  Sectors
+ * already cached win over the image, since they may be dirty. */
+static int cache_fill(struct sd_slot *sd, uint32_t t0, uint32_t t1)
+{
+    uint32_t s0 = t0 * CACHE_LINE_SECT, s1 = t1 * CACHE_LINE_SECT;
+    uint32_t sectors = (uint32_t)(sd->size / 512);
+    if (s1 > sectors) s1 = sectors;
+    if (backing_read(sd, s0, s1 - s0, sd->cache_fill_buf) != 0) return -1;
+    memset(sd->cache_fill_buf + (size_t)(s1 - s0) * 512, 0,
+           (size_t)(t1 * CACHE_LINE_SECT - s1) * 512);
+
+    /* Merge cached sectors first: installing may evict lines of this run */
+    for (uint32_t t = t0; t < t1; t++) {
+        int32_t i = cache_lookup(sd, t);
+        if (i == CACHE_NONE) continue;
+        uint8_t *buf = sd->cache_fill_buf + (size_t)(t - t0) * CACHE_LINE_BYTES;
+        for (uint32_t s = 0; s < CACHE_LINE_SECT; s++)
+            if (sd->cache_lines[i].valid & (1u << s))
+                memcpy(buf + s * 512, LINE_DATA(sd, i) + s * 512, 512);
+    }
+    for (uint32_t t = t0; t < t1; t++) {
+        int32_t i = cache_lookup(sd, t);
+        if (i == CACHE_NONE) i = cache_alloc(sd, t);
+        else cache_touch(sd, i);
+        uint8_t *buf = sd->cache_fill_buf + (size_t)(t - t0) * CACHE_LINE_BYTES;
+        for (uint32_t s = 0; s < CACHE_LINE_SECT; s++) {
+            uint8_t bit = (uint8_t)(1u << s);
+            if ((sd->cache_lines[i].valid & bit) || t * CACHE_LINE_SECT + s >= sectors) continue;
+            memcpy(LINE_DATA(sd, i) + s * 512, buf + s * 512, 512);
+            sd->cache_lines[i].valid |= bit;
+        }
+    }
+    return 0;
+}
+
+static void count_sectors(struct sd_slot *sd, uint64_t *counter, uint32_t lba, uint32_t count)
+{
+    for (uint32_t s = lba; s < lba + count; s++)
+        counter[sector_region(sd, s)]++;
+}
+
+static int cache_read(struct sd_slot *sd, uint32_t lba, uint32_t count, uint8_t *out)
+{
+    uint32_t end = lba + count;
+    uint32_t first = lba / CACHE_LINE_SECT, last = (end - 1) / CACHE_LINE_SECT;
+    uint32_t card_lines = (uint32_t)((sd->size / 512 + CACHE_LINE_SECT - 1) / CACHE_LINE_SECT);
+    int k, seq = 0;
+    for (k = 0; k < SD_RA_STREAMS && !seq; k++)
+        seq = sd->ra_streams[k].next_lba == lba;
+    if (seq) {
+        k--;
+    } else {
+        k = (int)(sd->ra_victim++ % SD_RA_STREAMS);
+        sd->ra_streams[k].lines = 0;
+    }
+    sd->ra_streams[k].next_lba = end;
+
+    if (last - first + 1 > sd->cache_nlines / 4) {
+        for (uint32_t t = first; t <= last; t++) {
+            int32_t i = cache_lookup(sd, t);
+            if (i != CACHE_NONE && sd->cache_lines[i].dirty) cache_flush_run(sd, i);
+        }
+        count_sectors(sd, sd->cache_stats.misses, lba, count);
+        return backing_read(sd, lba, count, out);
+    }
+
+    for (uint32_t t = first; t <= last; ) {
+        int32_t i = cache_lookup(sd, t);
+        uint8_t need = line_mask(t, lba, end);
+        if (i != CACHE_NONE && (sd->cache_lines[i].valid & need) == need) {
+            uint32_t s0 = t * CACHE_LINE_SECT > lba ? t * CACHE_LINE_SECT : lba;
+            uint32_t s1 = (t + 1) * CACHE_LINE_SECT < end ? (t + 1) * CACHE_LINE_SECT : end;
+            memcpy(out + (size_t)(s0 - lba) * 512,
+                   LINE_DATA(sd, i) + (s0 % CACHE_LINE_SECT) * 512, (size_t)(s1 - s0) * 512);
+            count_sectors(sd, sd->cache_stats.hits, s0, s1 - s0);
+            cache_touch(sd, i);
+            t++;
+            continue;
+        }
+
+        /* Miss: fetch the following uncached lines in the same read */
+        uint32_t run_end = t + 1;
+        while (run_end <= last) {
+            int32_t j = cache_lookup(sd, run_end);
+            uint8_t m = line_mask(run_end, lba, end);
+            if (j != CACHE_NONE && (sd->cache_lines[j].valid & m) == m) break;
+            run_end++;
+        }
+        uint32_t fill_end = run_end;
+        if (seq && run_end > last) {
+            uint32_t *win = &sd->ra_streams[k].lines;
+            *win = *win ? *win * 2 : SD_RA_MIN_LINES;
+            if (*win > sd->cache_ra_max) *win = sd->cache_ra_max;
+            while (fill_end < run_end + *win && fill_end < card_lines &&
+                   cache_lookup(sd, fill_end) == CACHE_NONE)
+                fill_end++;
+        }
+        if (cache_fill(sd, t, fill_end) != 0) return -1;
+
+        uint32_t s0 = t * CACHE_LINE_SECT > lba ? t * CACHE_LINE_SECT : lba;
+        uint32_t s1 = run_end * CACHE_LINE_SECT < end ? run_end * CACHE_LINE_SECT : end;
+        memcpy(out + (size_t)(s0 - lba) * 512,
+               sd->cache_fill_buf + (size_t)(s0 - t * CACHE_LINE_SECT) * 512,
+               (size_t)(s1 - s0) * 512);
+        count_sectors(sd, sd->cache_stats.misses, s0, s1 - s0);
+        sd->cache_stats.readahead += (uint64_t)(fill_end - run_end) * CACHE_LINE_SECT;
+        t = run_end;
+    }
+    return 0;
+}
+
+static int cache_write(struct sd_slot *sd, uint32_t lba, uint32_t count, const uint8_t *data)
+{
+    uint32_t end = lba + count;
+    uint32_t first = lba / CACHE_LINE_SECT, last = (end - 1) / CACHE_LINE_SECT;
+    int bypass = last - first + 1 > sd->cache_nlines / 4;
+
+    /* Large writes go straight out; cached copies are refreshed and
+     * their overwritten sectors are clean again */
+    if (bypass && backing_write(sd, lba, count, data) != 0) return -1;
+
+    for (uint32_t t = first; t <= last; t++) {
+        int32_t i = cache_lookup(sd, t);
+        if (i == CACHE_NONE) {
+            if (bypass) continue;
+            i = cache_alloc(sd, t);
+        } else {
+            cache_touch(sd, i);
+        }
+        uint8_t m = line_mask(t, lba, end);
+        for (uint32_t s = 0; s < CACHE_LINE_SECT; s++) {
+            if (!(m & (1u << s))) continue;
+            memcpy(LINE_DATA(sd, i) + s * 512,
+                   data + (size_t)(t * CACHE_LINE_SECT + s - lba) * 512, 512);
+        }
+        sd->cache_lines[i].valid |= m;
+        if (bypass) sd->cache_lines[i].dirty &= (uint8_t)~m;
+        else sd->cache_lines[i].dirty |= m;
+    }
+    if (!bypass && !sd->cache_dirty_since_ms) sd->cache_dirty_since_ms = now_ms();
+    return 0;
+}
+
+/* Flush if the oldest dirty line has waited long enough */
+static void cache_age_check(struct sd_slot *sd)
+{
+    if (sd->cache_dirty_since_ms && now_ms() - sd->cache_dirty_since_ms >= SD_CACHE_FLUSH_MS)
+        cache_flush_all(sd);
+}
+
+static void cache_free(struct sd_slot *sd)
+{
+    free(sd->cache_lines);
+    free(sd->cache_data);
+    free(sd->cache_hash);
+    free(sd->cache_fill_buf);
+    free(sd->cache_flush_buf);
+    sd->cache_lines = NULL;
+    sd->cache_data = sd->cache_fill_buf = sd->cache_flush_buf = NULL;
+    sd->cache_hash = NULL;
+    sd->cache_nlines = 0;
+}
+
+static int cache_init(struct sd_slot *sd)
+{
+    uint64_t nlines = emu_sdcard_cache_bytes / CACHE_LINE_BYTES;
+    if (!nlines || sd->map) return 0;
+    if (nlines < CACHE_MIN_LINES) nlines = CACHE_MIN_LINES;
+    if (nlines > (1u << 24)) nlines = 1u << 24;
+
+    uint32_t hsize = 1;
+    while (hsize < nlines) hsize <<= 1;
+    sd->cache_nlines = (uint32_t)nlines;
+    sd->cache_hash_mask = hsize - 1;
+    sd->cache_ra_max = sd->cache_nlines / 4 < SD_RA_MAX_LINES ? sd->cache_nlines / 4 : SD_RA_MAX_LINES;
+    sd->cache_max_run = sd->cache_nlines / 4 + sd->cache_ra_max;
+    sd->cache_lines = malloc(sd->cache_nlines * sizeof(*sd->cache_lines));
+    sd->cache_data = malloc((size_t)sd->cache_nlines * CACHE_LINE_BYTES);
+    sd->cache_hash = malloc(hsize * sizeof(*sd->cache_hash));
+    sd->cache_fill_buf = malloc((size_t)sd->cache_max_run * CACHE_LINE_BYTES);
+    sd->cache_flush_buf = malloc((size_t)SD_FLUSH_MAX_LINES * CACHE_LINE_BYTES);
+    if (!sd->cache_lines || !sd->cache_data || !sd->cache_hash || !sd->cache_fill_buf || !sd->cache_flush_buf) {
+        cache_free(sd);
+        ESP_LOGW(TAG, "No memory for a %llu KB sector cache, running uncached",
+                 (unsigned long long)(emu_sdcard_cache_bytes / 1024));
+        return -1;
+    }
+    cache_invalidate_all(sd);
+    return 0;
+}
+
+int sdcard_get_cache_stats(int slot, sdcard_cache_stats_t *out)
+{
+    struct sd_slot *sd = slot_get(slot);
+    if (!sd) return -1;
+    pthread_mutex_lock(&sd->cache_mutex);
+    *out = sd->cache_stats;
+    pthread_mutex_unlock(&sd->cache_mutex);
+    return 0;
+}
+
+const char *sdcard_region_name(int region)
+{
+    static const char *names[SDCARD_REGION_COUNT] = { "boot", "fat", "dir", "data" };
+    return region >= 0 && region < SDCARD_REGION_COUNT ? names[region] : "?";
+}
+
+static void cache_log_stats(struct sd_slot *sd)
+{
+    uint64_t hits = 0, total = 0;
+    char detail[160];
+    int len = 0;
+    for (int r = 0; r < SDCARD_REGION_COUNT; r++) {
+        uint64_t h = sd->cache_stats.hits[r], n = h + sd->cache_stats.misses[r];
+        hits += h;
+        total += n;
+        if (n && len < (int)sizeof(detail))
+            len += snprintf(detail + len, sizeof(detail) - len, "%s%s %.1f%%",
+                            len ? ", " : "", sdcard_region_name(r), 100.0 * h / n);
+    }
+    if (!total) return;
+    ESP_LOGI(TAG, "Sector cache: %.1f%% hits of %llu sectors read (%s), "
+             "%llu read ahead, %llu sectors written back in %llu runs",
+             100.0 * hits / total, (unsigned long long)total, detail,
+             (unsigned long long)sd->cache_stats.readahead,
+             (unsigned long long)sd->cache_stats.writeback_sectors,
+             (unsigned long long)sd->cache_stats.writeback_runs);
+}
+
+int sdcard_overlay_discard(void)
+{
+    struct sd_slot *sd = &sd_slots[0];
+    if (!sd->ready || sd->ovl_fd < 0) return -1;
+    pthread_mutex_lock(&sd->cache_mutex);
+    if (sd->cache_nlines) cache_invalidate_all(sd);
+    pthread_rwlock_wrlock(&sd->ovl_lock);
+    int ret = ovl_reset(sd);
+    pthread_rwlock_unlock(&sd->ovl_lock);
+    pthread_mutex_unlock(&sd->cache_mutex);
+    ESP_LOGI(TAG, "Overlay %s discarded",
+             sd->overlay_path ? sd->overlay_path : "(temporary)");
+    return ret;
+}
+
+/* Write every modified sector into the image at path (created or
+ * extended to the card size as needed).  Caller holds ovl_lock. */
+static int ovl_copy_to(struct sd_slot *sd, const char *path, uint64_t *copied)
+{
+#ifdef _MSC_VER
+    int fd = _open(path, _O_RDWR | _O_CREAT | _O_BINARY, 0644);
+#else
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+#endif
+    uint8_t *buf = malloc(256 * 512);
+    struct stat st;
+    int ret = -1;
+    *copied = 0;
+    if (fd >= 0 && buf && fstat(fd, &st) == 0 &&
+        ((uint64_t)st.st_size >= sd->size || ftruncate(fd, (off_t)sd->size) == 0)) {
+        ret = 0;
+        uint64_t sectors = sd->size / 512;
+        for (uint64_t s = 0; s < sectors && ret == 0; ) {
+            if (!sd->ovl_bitmap[s >> 3]) { s = (s | 7) + 1; continue; }
+            if (!OVL_BIT(sd, s)) { s++; continue; }
+            uint64_t e = s + 1;
+            while (e < sectors && e - s < 256 && OVL_BIT(sd, e)) e++;
+            size_t len = (size_t)(e - s) * 512;
+            if (sd_read_full(sd->ovl_fd, buf, len, sd->ovl_data_off + s * 512) != len ||
+                sd_write_full(fd, buf, len, s * 512) != len)
+                ret = -1;
+            *copied += e - s;
+            s = e;
+        }
+        if (ret == 0) ret = sd_fsync(fd);
+    }
+    free(buf);
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+/* Copy every modified sector into the base, then start a fresh delta */
+int sdcard_overlay_commit(void)
+{
+    struct sd_slot *sd = &sd_slots[0];
+    if (!sd->ready || sd->ovl_fd < 0) return -1;
+    if (sd->cz_active || sd->hd_active) {
+        ESP_LOGE(TAG, "Cannot commit an overlay into %s %s",
+                 sd->hd_active ? "host directory" : "packed image",
+                 sd->hd_active ? sd->dir : sd->path);
+        return -1;
+    }
+    pthread_mutex_lock(&sd->cache_mutex);
+    if (sd->cache_nlines) cache_flush_all(sd);
+    pthread_rwlock_wrlock(&sd->ovl_lock);
+
+    uint64_t copied;
+    int ret = ovl_copy_to(sd, sd->path, &copied);
+    if (ret == 0) {
+        /* The base changed: reopen it read-only and restart the delta */
+        if (sd->fd >= 0) close(sd->fd);
+        sd->fd = sd_open_image(sd, O_RDONLY);
+        ovl_stat_base(sd);
+        ret = ovl_reset(sd);
+    }
+    pthread_rwlock_unlock(&sd->ovl_lock);
+    pthread_mutex_unlock(&sd->cache_mutex);
+
+    if (ret == 0)
+        ESP_LOGI(TAG, "Overlay committed: %llu sectors written to %s",
+                 (unsigned long long)copied, sd->path);
+    else
+        ESP_LOGE(TAG, "Overlay commit to %s failed: %s", sd->path, strerror(errno));
+    return ret;
+}
+
+/* Apply the delta to a copy of the base (used by save-state) */
+int sdcard_overlay_apply(const char *path)
+{
+    struct sd_slot *sd = &sd_slots[0];
+    if (!sd->ready || sd->ovl_fd < 0) return -1;
+    pthread_mutex_lock(&sd->cache_mutex);
+    if (sd->cache_nlines) cache_flush_all(sd);
+    pthread_rwlock_rdlock(&sd->ovl_lock);
+    uint64_t copied;
+    int ret = ovl_copy_to(sd, path, &copied);
+    pthread_rwlock_unlock(&sd->ovl_lock);
+    pthread_mutex_unlock(&sd->cache_mutex);
+    if (ret != 0)
+        ESP_LOGE(TAG, "Applying overlay to %s failed: %s", path, strerror(errno));
+    return ret;
+}
+
+static int sd_sync(struct sd_slot *sd)
+{
+    pthread_mutex_lock(&sd->cache_mutex);
+    if (sd->cache_nlines) cache_flush_all(sd);
+    pthread_mutex_unlock(&sd->cache_mutex);
+    sd->last_sync_ms = now_ms();
+    if (sd->ovl_fd >= 0) return sd_fsync(sd->ovl_fd);
+#ifndef _MSC_VER
+    if (sd->map) return msync(sd->map, (size_t)sd->size, MS_SYNC);
+#endif
+    return sd_fsync(sd->fd);
+}
+
+/* ---- Snapshots ----
+ *
+ * sdcard_snapshot_start() copies the card into a new image on a worker
+ * thread, fastest method first: a reflink (FICLONE) sharing extents with
+ * the source, copy_file_range over the data extents found with
+ * SEEK_DATA/SEEK_HOLE, or chunked pread/pwrite that leaves all-zero
+ * chunks as holes.  In overlay mode the base is copied and the delta
+ * applied on top (a packed or host directory base is written out raw
+ * first).
+ */
+
+#define SNAP_CHUNK (4 * 1024 * 1024)
+
+static void snap_progress(struct sd_slot *sd, uint64_t done)
+{
+    pthread_mutex_lock(&sd->snap_mutex);
+    uint64_t step = sd->snap_total / 10;
+    if (step && done / step > sd->snap_done / step && done < sd->snap_total)
+        ESP_LOGI(TAG, "Snapshot %s: %d%%", sd->snap_path, (int)(done * 100 / sd->snap_total));
+    sd->snap_done = done;
+    pthread_mutex_unlock(&sd->snap_mutex);
+}
+
+/* Copy in (may be -1: blank card) to out, sized max(source, card) */
+static int snap_copy(struct sd_slot *sd, int in, int out)
+{
+    struct stat st;
+    uint64_t src_size = 0;
+    if (in >= 0 && fstat(in, &st) == 0) src_size = (uint64_t)st.st_size;
+    uint64_t size = src_size > sd->size || sd->cz_active ? src_size : sd->size;
+    pthread_mutex_lock(&sd->snap_mutex);
+    sd->snap_total = size;
+    pthread_mutex_unlock(&sd->snap_mutex);
+
+#ifdef FICLONE
+    if (in >= 0 && ioctl(out, FICLONE, in) == 0) {
+        ESP_LOGI(TAG, "Snapshot %s: reflinked", sd->snap_path);
+        return size > src_size ? ftruncate(out, (off_t)size) : 0;
+    }
+#endif
+    if (ftruncate(out, (off_t)size) != 0) return -1;
+
+    uint8_t *buf = NULL;
+    int ret = 0;
+    uint64_t off = 0;
+#ifdef __linux__
+    int use_cfr = 1;
+#endif
+    while (off < src_size && ret == 0) {
+        uint64_t pos = off, end = src_size;
+#ifdef SEEK_DATA
+        off_t d = lseek(in, (off_t)off, SEEK_DATA);
+        if (d < 0 && errno == ENXIO) break;        /* only holes left */
+        if (d >= 0) {
+            off_t h = lseek(in, d, SEEK_HOLE);
+            pos = (uint64_t)d;
+            if (h > d) end = (uint64_t)h;
+        }
+#endif
+        while (pos < end) {
+            size_t len = end - pos < SNAP_CHUNK ? (size_t)(end - pos) : SNAP_CHUNK;
+            long long n = -1;
+#ifdef __linux__
+            if (use_cfr) {
+                loff_t in_off = (loff_t)pos, out_off = (loff_t)pos;
+                n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+                if (n <= 0) use_cfr = 0;   /* unsupported here: plain copy */
+            }
+#endif
+            if (n <= 0) {
+                if (!buf && !(buf = malloc(SNAP_CHUNK))) {
+                    ret = -1;
+                    break;
+                }
+                if (sd_read_full(in, buf, len, pos) != len ||
+                    (!is_zero(buf, len) && sd_write_full(out, buf, len, pos) != len)) {
+                    ret = -1;
+                    break;
+                }
+                n = (long long)len;
+            }
+            pos += (uint64_t)n;
+            snap_progress(sd, pos);
+        }
+        off = end;
+    }
+    free(buf);
+    if (ret == 0) ret = sd_fsync(out);
+    return ret;
+}
+
+/* Write the base as a raw image, so the delta can be applied on top */
+static int snap_export(struct sd_slot *sd, int out)
+{
+    pthread_mutex_lock(&sd->snap_mutex);
+    sd->snap_total = sd->size;
+    pthread_mutex_unlock(&sd->snap_mutex);
+    uint8_t *buf = malloc(CZ_CHUNK);
+    int ret = buf && ftruncate(out, (off_t)sd->size) == 0 ? 0 : -1;
+    for (uint64_t off = 0; off < sd->size && ret == 0; off += CZ_CHUNK) {
+        size_t len = sd->size - off < CZ_CHUNK ? (size_t)(sd->size - off) : CZ_CHUNK;
+        if (image_read(sd, buf, len, off) != len ||
+            (!is_zero(buf, len) && sd_write_full(out, buf, len, off) != len))
+            ret = -1;
+        snap_progress(sd, off + len);
+    }
+    free(buf);
+    if (ret == 0) ret = sd_fsync(out);
+    return ret;
+}
+
+static void *snap_worker(void *arg)
+{
+    struct sd_slot *sd = arg;
+    /* A separate descriptor: SEEK_DATA moves the file offset */
+    int in = sd->path && !sd->hd_active ? sd_open_image(sd, O_RDONLY) : -1;
+#ifdef _MSC_VER
+    int out = _open(sd->snap_path, _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+    int out = open(sd->snap_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+    int ret = -1;
+    if (out >= 0 && (sd->cz_active || sd->hd_active) && sd->ovl_fd >= 0)
+        ret = snap_export(sd, out);
+    else if (out >= 0 && (in >= 0 || sd->ovl_fd >= 0))
+        ret = snap_copy(sd, in, out);
+    if (out >= 0) close(out);
+    if (in >= 0) close(in);
+
+    if (ret == 0 && sd->ovl_fd >= 0) {
+        uint64_t copied;
+        pthread_rwlock_rdlock(&sd->ovl_lock);
+        ret = ovl_copy_to(sd, sd->snap_path, &copied);
+        pthread_rwlock_unlock(&sd->ovl_lock);
+    }
+    if (ret != 0)
+        ESP_LOGE(TAG, "Snapshot %s failed: %s", sd->snap_path, strerror(errno));
+    else
+        ESP_LOGI(TAG, "Snapshot %s done", sd->snap_path);
+
+    pthread_mutex_lock(&sd->snap_mutex);
+    sd->snap_result = ret;
+    sd->snap_finished = 1;
+    pthread_mutex_unlock(&sd->snap_mutex);
+    return NULL;
+}
+
+int sdcard_snapshot_start(const char *path)
+{
+    struct sd_slot *sd = &sd_slots[0];
+    if (sd->snap_started || !sd->path) return -1;
+
+    /* The worker reads the files directly: push out cached writes */
+    pthread_mutex_lock(&sd->cache_mutex);
+    if (sd->cache_nlines) cache_flush_all(sd);
+    pthread_mutex_unlock(&sd->cache_mutex);
+
+    snprintf(sd->snap_path, sizeof(sd->snap_path), "%s", path);
+    sd->snap_done = 0;
+    sd->snap_total = sd->size;
+    sd->snap_finished = 0;
+    sd->snap_result = -1;
+    if (pthread_create(&sd->snap_thread, NULL, snap_worker, sd) != 0) {
+        ESP_LOGE(TAG, "Cannot start snapshot thread");
+        return -1;
+    }
+    sd->snap_started = 1;
+    return 0;
+}
+
+int sdcard_snapshot_poll(int *percent)
+{
+    struct sd_slot *sd = &sd_slots[0];
+    if (!sd->snap_started) return sd->snap_result;
+    pthread_mutex_lock(&sd->snap_mutex);
+    int finished = sd->snap_finished;
+    if (percent)
+        *percent = sd->snap_total ? (int)(sd->snap_done * 100 / sd->snap_total) : 0;
+    pthread_mutex_unlock(&sd->snap_mutex);
+    if (!finished) return 1;
+    pthread_join(sd->snap_thread, NULL);
+    sd->snap_started = 0;
+    return sd->snap_result;
+}
+
+/* ---- I/O trace ----
+ *
+ * While tracing is on, every sdcard_read/sdcard_write is appended to a
+ * ring of fixed-size binary records: start time on the shim clock,
+ * latency (stall charged as CPU cycles plus shim-clock time in the
+ * request, which includes any shim sleep),
+ * host time spent, LBA, count, direction and result.  Off, the cost is one
+ * pointer test per request.  sdcard_trace_stats() summarizes the ring;
+ * sdcard_trace_export_csv() dumps it.
+ */
+
+static uint32_t clamp_u32(uint64_t v)
+{
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+static void trace_add(struct sd_slot *sd, uint32_t lba, uint32_t count, int write,
+                      int ret, uint64_t t0, uint64_t host0, uint64_t card_ns)
+{
+    uint64_t t1 = emu_freertos_now_ns(), host1 = mono_ns();
+    pthread_mutex_lock(&sd->trace_mutex);
+    if (sd->trace_ring) {
+        struct sd_trace_rec *r = &sd->trace_ring[sd->trace_total++ & sd->trace_mask];
+        r->t_ns = t0;
+        r->lba = lba;
+        r->count = count;
+        r->latency_ns = clamp_u32(card_ns + (t1 - t0));
+        r->host_ns = clamp_u32(host1 - host0);
+        r->write = (uint8_t)write;
+        r->ok = ret == 0;
+    }
+    pthread_mutex_unlock(&sd->trace_mutex);
+}
+
+int sdcard_trace_enable(uint32_t entries)
+{
+    uint32_t n = 1;
+    if (entries > (1u << 24)) entries = 1u << 24;
+    while (n < entries) n <<= 1;
+    for (int i = 0; i < SDCARD_MAX_SLOTS; i++) {
+        struct sd_slot *sd = &sd_slots[i];
+        struct sd_trace_rec *ring = NULL;
+        if (entries && !(ring = calloc(n, sizeof(*ring)))) return -1;
+        pthread_mutex_lock(&sd->trace_mutex);
+        struct sd_trace_rec *old = sd->trace_ring;
+        sd->trace_ring = ring;
+        sd->trace_mask = n - 1;
+        sd->trace_total = 0;
+        pthread_mutex_unlock(&sd->trace_mutex);
+        free(old);
+    }
+    if (entries)
+        ESP_LOGI(TAG, "SD trace on (%u entries per slot)", n);
+    return 0;
+}
+
+/* Copy the ring out in order, oldest first; returns the record count */
+static uint32_t trace_copy(struct sd_slot *sd, struct sd_trace_rec **out, uint64_t *dropped)
+{
+    *out = NULL;
+    *dropped = 0;
+    pthread_mutex_lock(&sd->trace_mutex);
+    uint32_t n = 0;
+    if (sd->trace_ring) {
+        uint64_t size = (uint64_t)sd->trace_mask + 1;
+        n = (uint32_t)(sd->trace_total < size ? sd->trace_total : size);
+        *dropped = sd->trace_total - n;
+        *out = malloc((n ? n : 1) * sizeof(**out));
+        for (uint32_t i = 0; *out && i < n; i++)
+            (*out)[i] = sd->trace_ring[(sd->trace_total - n + i) & sd->trace_mask];
+    }
+    pthread_mutex_unlock(&sd->trace_mutex);
+    return *out ? n : 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int sdcard_trace_stats(int slot, sdcard_trace_stats_t *st)
+{
+    struct sd_slot *sd = slot_get(slot);
+    memset(st, 0, sizeof(*st));
+    if (!sd || !sd->trace_ring) return -1;
+    struct sd_trace_rec *recs;
+    uint32_t n = trace_copy(sd, &recs, &st->dropped);
+    if (!recs) return -1;
+
+    uint64_t first = UINT64_MAX, last = 0;
+    uint32_t ends[SD_RA_STREAMS] = { 0 };   /* as for read-ahead: last few */
+    for (uint32_t i = 0; i < n; i++) {
+        const struct sd_trace_rec *r = &recs[i];
+        st->ops++;
+        if (r->write) {
+            st->writes++;
+            st->write_sectors += r->count;
+        } else {
+            st->reads++;
+            st->read_sectors += r->count;
+        }
+        if (!r->ok) st->errors++;
+        for (int k = 0; k < SD_RA_STREAMS && i > 0; k++) {
+            if (ends[k] == r->lba) {
+                st->sequential++;
+                break;
+            }
+        }
+        ends[i % SD_RA_STREAMS] = r->lba + r->count;
+        st->latency_ns_sum += r->latency_ns;
+        if (r->latency_ns > st->latency_ns_max) st->latency_ns_max = r->latency_ns;
+        if (r->t_ns < first) first = r->t_ns;
+        if (r->t_ns + r->latency_ns > last) last = r->t_ns + r->latency_ns;
+    }
+    st->span_ns = n ? last - first : 0;
+
+    /* Hot LBAs: sort the start LBAs and keep the longest runs */
+    uint32_t *lbas = malloc((n ? n : 1) * sizeof(*lbas));
+    if (lbas) {
+        for (uint32_t i = 0; i < n; i++) lbas[i] = recs[i].lba;
+        qsort(lbas, n, sizeof(*lbas), cmp_u32);
+        for (uint32_t i = 0; i < n; ) {
+            uint32_t j = i + 1;
+            while (j < n && lbas[j] == lbas[i]) j++;
+            uint32_t hits = j - i;
+            if (st->nhot < SDCARD_TRACE_HOT || hits > st->hot[st->nhot - 1].hits) {
+                /* Insert keeping the list sorted by hits, most first */
+                int k = st->nhot < SDCARD_TRACE_HOT ? st->nhot++ : SDCARD_TRACE_HOT - 1;
+                while (k > 0 && st->hot[k - 1].hits < hits) {
+                    st->hot[k] = st->hot[k - 1];
+                    k--;
+                }
+                st->hot[k].lba = lbas[i];
+                st->hot[k].hits = hits;
+                st->hot[k].region = sector_region(sd, lbas[i]);
+            }
+            i = j;
+        }
+        free(lbas);
+    }
+    free(recs);
+    return 0;
+}
+
+int sdcard_trace_export_csv(int slot, const char *path)
+{
+    struct sd_slot *sd = slot_get(slot);
+    if (!sd) return -1;
+    struct sd_trace_rec *recs;
+    uint64_t dropped;
+    uint32_t n = trace_copy(sd, &recs, &dropped);
+    if (!recs) return -1;
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        free(recs);
+        return -1;
+    }
+    fprintf(f, "t_ns,op,lba,count,latency_ns,host_ns,ok,region\n");
+    for (uint32_t i = 0; i < n; i++) {
+        const struct sd_trace_rec *r = &recs[i];
+        fprintf(f, "%llu,%c,%u,%u,%u,%u,%d,%s\n", (unsigned long long)r->t_ns,
+                r->write ? 'W' : 'R', r->lba, r->count, r->latency_ns, r->host_ns,
+                r->ok, sdcard_region_name(sector_region(sd, r->lba)));
+    }
+    free(recs);
+    int ret = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0) ret = -1;
+    if (ret == 0)
+        ESP_LOGI(TAG, "SD trace: %u records written to %s", n, path);
+    return ret;
+}
+
+/* ---- API ---- */
+
+/* Common tail of sdcard_init once the image is open */
+static void sd_attach(struct sd_slot *sd)
+{
+    layout_scan(sd);
+    memset(&sd->cache_stats, 0, sizeof(sd->cache_stats));
+    cache_init(sd);
+    sd->ready = 1;
+}
+
+static int slot_init(struct sd_slot *sd)
+{
+    sd->size = emu_sdcard_size_bytes;
+    sd->last_sync_ms = now_ms();
+
+    if (sd->dir) {
+        /* Always overlaid: the generated volume is read-only */
+        if (hd_build(sd) != 0 || ovl_open(sd) != 0) {
+            ovl_close(sd);
+            hd_free(sd);
+            return -1;
+        }
+        if (emu_sdcard_mmap)
+            ESP_LOGW(TAG, "--sdcard-mmap is ignored with --sdcard-dir");
+        sd_attach(sd);
+        ESP_LOGI(TAG, "SD card %d: %s + overlay %s (%llu MB)", sd->id, sd->dir,
+                 sd->overlay_path ? sd->overlay_path : "(temporary)",
+                 (unsigned long long)(sd->size / (1024 * 1024)));
+        return 0;
+    }
+
+    if (!sd->path) {
+        ESP_LOGE(TAG, "No SD card image path set (use --sdcard)");
+        return -1;
+    }
+
+    if (sd->overlay_path) {
+        if (ovl_open(sd) != 0) {
+            ovl_close(sd);
+            cz_close(sd);
+            if (sd->fd >= 0) close(sd->fd);
+            sd->fd = -1;
+            return -1;
+        }
+        if (emu_sdcard_mmap)
+            ESP_LOGW(TAG, "--sdcard-mmap is ignored in overlay mode");
+        sd_attach(sd);
+        ESP_LOGI(TAG, "SD card %d: %s + overlay %s (%llu MB)",
+                 sd->id, sd->path, sd->overlay_path,
+                 (unsigned long long)(sd->size / (1024 * 1024)));
+        return 0;
+    }
+
+    /* Open or create the image file */
+    sd->fd = sd_open_image(sd, O_RDWR | O_CREAT);
+    if (sd->fd < 0) {
+        ESP_LOGE(TAG, "Cannot open/create %s", sd->path);
+        return -1;
+    }
+
+    /* A packed image brings its own size; extend a raw one to the
+     * desired size (sparse file) */
+    int packed = cz_open(sd);
+    if (packed < 0 || (!packed && ftruncate(sd->fd, (off_t)emu_sdcard_size_bytes) != 0)) {
+        if (!packed) ESP_LOGE(TAG, "ftruncate failed");
+        close(sd->fd);
+        sd->fd = -1;
+        return -1;
+    }
+    if (packed && emu_sdcard_mmap)
+        ESP_LOGW(TAG, "--sdcard-mmap is ignored for packed images");
+
+#ifndef _MSC_VER
+    if (emu_sdcard_mmap && !packed) {
+        void *p = mmap(NULL, (size_t)sd->size, PROT_READ | PROT_WRITE, MAP_SHARED, sd->fd, 0);
+        if (p == MAP_FAILED)
+            ESP_LOGW(TAG, "mmap of %s failed (%s), using pread/pwrite",
+                     sd->path, strerror(errno));
+        else
+            sd->map = p;
+    }
+#endif
+
+    sd_attach(sd);
+    ESP_LOGI(TAG, "SD card %d: %s (%llu MB%s)",
+             sd->id, sd->path, (unsigned long long)(sd->size / (1024 * 1024)),
+             sd->map ? ", mapped" : packed ? ", packed" : "");
+    return 0;
+}
+
+/* The image flexe can be handed for the firmware's card, or NULL when
+ * slot 0 has no plain image at emu_sdcard_path: in overlay mode that
+ * file is the read-only base, --sdcard-dir has no image at all, and a
+ * packed image is not a FAT volume. */
+const char *sdcard_guest_image_path(void)
+{
+    if (emu_sdcard_slots < 1 || !emu_sdcard_path) return NULL;
+    if (emu_sdcard_overlay_path || emu_sdcard_dir) return NULL;
+    int fd = open(emu_sdcard_path, O_RDONLY);
+    if (fd >= 0) {
+        char magic[8];
+        int packed = sd_read_full(fd, (uint8_t *)magic, 8, 0) == 8 &&
+                     memcmp(magic, CZ_MAGIC, 8) == 0;
+        close(fd);
+        if (packed) return NULL;
+    }
+    return emu_sdcard_path;
+}
+
+int sdcard_init(void)
+{
+    if (emu_sdcard_slots < 1) {
+        ESP_LOGE(TAG, "No SD card slot on this board");
+        return -1;
+    }
+
+    struct sd_slot *sd = &sd_slots[0];
+    sd->path = emu_sdcard_path;
+    sd->overlay_path = emu_sdcard_overlay_path;
+    sd->dir = emu_sdcard_dir;
+    return slot_init(sd);
+}
+
+static void slot_deinit(struct sd_slot *sd)
+{
+    if (!sd->ready) return;
+    if (sd->snap_started) {    /* the worker uses the overlay */
+        pthread_join(sd->snap_thread, NULL);
+        sd->snap_started = 0;
+    }
+    sd->ready = 0;
+
+    pthread_mutex_lock(&sd->cache_mutex);
+    if (sd->cache_nlines) {
+        cache_flush_all(sd);
+        cache_log_stats(sd);
+        cache_free(sd);
+    }
+    pthread_mutex_unlock(&sd->cache_mutex);
+    free(sd->layout.dir_map);
+    memset(&sd->layout, 0, sizeof(sd->layout));
+    if (emu_sdcard_sync_ms != SDCARD_SYNC_NONE && sd_sync(sd) != 0)
+        ESP_LOGW(TAG, "Sync of %s failed: %s", sd->path, strerror(errno));
+#ifndef _MSC_VER
+    if (sd->map) {
+        munmap(sd->map, (size_t)sd->size);
+        sd->map = NULL;
+    }
+#endif
+    if (sd->cz_active) {
+        if ((sd->cz_hdr.flags & CZ_HDR_SIDE) && sd->ovl_fd < 0 && cz_compact(sd) == 0)
+            ESP_LOGI(TAG, "Compacted %s", sd->path);
+        cz_close(sd);
+    }
+    hd_free(sd);
+    ovl_close(sd);
+    if (sd->fd >= 0) close(sd->fd);
+    sd->fd = -1;
+}
+
+void sdcard_deinit(void)
+{
+    for (int i = 0; i < SDCARD_MAX_SLOTS; i++)
+        slot_deinit(&sd_slots[i]);
+}
+
+uint64_t sdcard_slot_size(int slot)
+{
+    struct sd_slot *sd = slot_get(slot);
+    return sd && sd->ready ? sd->size : 0;
+}
+
+uint64_t sdcard_size(void)
+{
+    return sdcard_slot_size(0);
+}
+
+uint32_t sdcard_sector_size(void)
+{
+    return 512;
+}
+
+/* Write back cached sectors (e.g. before the app is stopped) */
+void sdcard_flush(void)
+{
+    for (int i = 0; i < SDCARD_MAX_SLOTS; i++) {
+        struct sd_slot *sd = &sd_slots[i];
+        if (!sd->ready) continue;
+        pthread_mutex_lock(&sd->cache_mutex);
+        if (sd->cache_nlines) cache_flush_all(sd);
+        pthread_mutex_unlock(&sd->cache_mutex);
+    }
+}
+
+/* *card_ns: stall charged to the CPU thread for the request */
+static int sd_write(struct sd_slot *sd, uint32_t lba, uint32_t count, const void *data,
+                    uint64_t *card_ns)
+{
+    if (!sd->ready) return -1;
+    *card_ns = throttle_io(sd, count, 1);
+
+    uint64_t offset = (uint64_t)lba * 512;
+    size_t len = (size_t)count * 512;
+    if (offset + len > sd->size) return -1;
+    if (count == 0) return 0;
+
+    int ret;
+    if (sd->cache_nlines) {
+        pthread_mutex_lock(&sd->cache_mutex);
+        ret = cache_write(sd, lba, count, data);
+        cache_age_check(sd);
+        pthread_mutex_unlock(&sd->cache_mutex);
+    } else {
+        ret = backing_write(sd, lba, count, data);
+    }
+    if (ret != 0) return -1;
+
+    if (emu_sdcard_sync_ms > 0 &&
+        now_ms() - sd->last_sync_ms >= (uint64_t)emu_sdcard_sync_ms)
+        sd_sync(sd);
+    return 0;
+}
+
+static int sd_read(struct sd_slot *sd, uint32_t lba, uint32_t count, void *data,
+                   uint64_t *card_ns)
+{
+    if (!sd->ready) return -1;
+    *card_ns = throttle_io(sd, count, 0);
+
+    uint64_t offset = (uint64_t)lba * 512;
+    size_t len = (size_t)count * 512;
+    if (offset + len > sd->size) {
+        memset(data, 0, len);
+        return -1;
+    }
+    if (count == 0) return 0;
+
+    int ret;
+    if (sd->cache_nlines) {
+        pthread_mutex_lock(&sd->cache_mutex);
+        ret = cache_read(sd, lba, count, data);
+        cache_age_check(sd);
+        pthread_mutex_unlock(&sd->cache_mutex);
+    } else {
+        ret = backing_read(sd, lba, count, data);
+    }
+    return ret;
+}
+
+int sdcard_slot_write(int slot, uint32_t lba, uint32_t count, const void *data)
+{
+    struct sd_slot *sd = slot_get(slot);
+    if (!sd) return -1;
+    uint64_t card_ns = 0;
+    if (!sd->trace_ring) return sd_write(sd, lba, count, data, &card_ns);
+    uint64_t t0 = emu_freertos_now_ns(), host0 = mono_ns();
+    int ret = sd_write(sd, lba, count, data, &card_ns);
+    trace_add(sd, lba, count, 1, ret, t0, host0, card_ns);
+    return ret;
+}
+
+int sdcard_slot_read(int slot, uint32_t lba, uint32_t count, void *data)
+{
+    struct sd_slot *sd = slot_get(slot);
+    if (!sd) return -1;
+    uint64_t card_ns = 0;
+    if (!sd->trace_ring) return sd_read(sd, lba, count, data, &card_ns);
+    uint64_t t0 = emu_freertos_now_ns(), host0 = mono_ns();
+    int ret = sd_read(sd, lba, count, data, &card_ns);
+    trace_add(sd, lba, count, 0, ret, t0, host0, card_ns);
+    return ret;
+}
+
+int sdcard_write(uint32_t lba, uint32_t count, const void *data)
+{
+    return sdcard_slot_write(0, lba, count, data);
+}
+
+int sdcard_read(uint32_t lba, uint32_t count, void *data)
+{
+    return sdcard_slot_read(0, lba, count, data);
+}
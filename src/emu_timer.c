@@ -1,47 +1,50 @@
 /*
  * emu_timer.c -- esp_timer API emulation
  *
- * Dedicated timer thread manages a list of timers with microsecond
- * fire times.  Callbacks run in the timer thread context.
- * Uses CLOCK_MONOTONIC for timing.
+ * Dedicated timer thread manages a min-heap of armed timers keyed by
+ * their microsecond fire time.  Each timer remembers its heap slot, so
+ * start/stop/delete are O(log n) and there is no fixed timer limit.
+ * Callbacks run in the timer thread context.
+ * Runs on the FreeRTOS shim clock, so under --virtual-time the timer
+ * thread's next deadline is one of the points the clock jumps to.
  */
 
 #ifdef _MSC_VER
 #include "../flexe/src/msvc_compat.h"
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-#include <time.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "esp_timer.h"
 #include "esp_log.h"
+#include "freertos/task.h"   /* object registry */
 
 extern volatile int emu_app_running;
 
+/* emu_freertos.c: shim-clock waits for service threads */
+extern int emu_freertos_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg);
+extern void emu_freertos_cond_init(pthread_cond_t *cond);
+extern void emu_freertos_cond_signal(pthread_cond_t *cond);
+extern int emu_freertos_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                                        uint64_t deadline_ns);
+
 static const char *TAG = "esp_timer";
 
 /* ---- Time helpers ---- */
 
 static int64_t now_us(void)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (int64_t)ts.tv_sec * 1000000LL + (int64_t)ts.tv_nsec / 1000;
+    return (int64_t)(emu_freertos_now_ns() / 1000);
 }
 
-static int64_t boot_time_us = 0;
-static int boot_time_init = 0;
-
 int64_t esp_timer_get_time(void)
 {
-    if (!boot_time_init) {
-        boot_time_us = now_us();
-        boot_time_init = 1;
-    }
-    return now_us() - boot_time_us;
+    return now_us();
 }
 
 /* ---- Timer structure ---- */
@@ -50,90 +53,170 @@ struct esp_timer {
     esp_timer_cb_t callback;
     void *arg;
     const char *name;
-    int active;
+    int heap_idx;          /* slot in timer_heap, -1 when not armed */
     int periodic;
     uint64_t period_us;
-    int64_t fire_time_us;  /* absolute time (CLOCK_MONOTONIC based) */
+    int64_t fire_time_us;  /* absolute time on the shim clock */
+    uint32_t times_triggered;
+    int64_t max_late_us;
+    struct esp_timer *all_prev, *all_next;   /* every created timer */
+    struct emu_obj_node obj;
 };
 
-/* ---- Timer list ---- */
-
-#define MAX_ESP_TIMERS 32
+/* ---- Timer heap ---- */
 
-static struct esp_timer *timer_list[MAX_ESP_TIMERS];
-static int timer_count = 0;
+static struct esp_timer **timer_heap;
+static int heap_len = 0;
+static int heap_cap = 0;
+static struct esp_timer *all_timers;     /* for dump and shutdown */
 static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t timer_cond;
+static int timer_cond_ready = 0;
 static pthread_t timer_thread;
 static int timer_thread_running = 0;
 
+static void heap_set(int i, struct esp_timer *t)
+{
+    timer_heap[i] = t;
+    t->heap_idx = i;
+}
+
+static void heap_sift_up(int i)
+{
+    struct esp_timer *t = timer_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timer_heap[parent]->fire_time_us <= t->fire_time_us) break;
+        heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void heap_sift_down(int i)
+{
+    struct esp_timer *t = timer_heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap_len) break;
+        if (child + 1 < heap_len &&
+            timer_heap[child + 1]->fire_time_us < timer_heap[child]->fire_time_us)
+            child++;
+        if (t->fire_time_us <= timer_heap[child]->fire_time_us) break;
+        heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    heap_set(i, t);
+}
+
+/* Arm (or re-arm) a timer at its current fire_time_us */
+static int heap_insert(struct esp_timer *t)
+{
+    if (t->heap_idx >= 0) {
+        heap_sift_up(t->heap_idx);
+        heap_sift_down(t->heap_idx);
+        return 0;
+    }
+    if (heap_len == heap_cap) {
+        int cap = heap_cap ? heap_cap * 2 : 16;
+        struct esp_timer **h = realloc(timer_heap, (size_t)cap * sizeof(*h));
+        if (!h) return -1;
+        timer_heap = h;
+        heap_cap = cap;
+    }
+    heap_set(heap_len++, t);
+    heap_sift_up(t->heap_idx);
+    return 0;
+}
+
+static void heap_remove(struct esp_timer *t)
+{
+    int i = t->heap_idx;
+    if (i < 0) return;
+    t->heap_idx = -1;
+    struct esp_timer *last = timer_heap[--heap_len];
+    if (i == heap_len) return;
+    heap_set(i, last);
+    heap_sift_up(i);
+    heap_sift_down(last->heap_idx);
+}
+
+/* ---- Dispatch lateness histogram ---- */
+
+/* Upper bounds (us) of each bucket; the last bucket is open-ended */
+static const int64_t late_bounds[] = { 10, 50, 100, 250, 500, 1000, 2000, 5000, 10000 };
+#define LATE_BUCKETS ((int)(sizeof(late_bounds) / sizeof(late_bounds[0])) + 1)
+
+static uint64_t late_hist[LATE_BUCKETS];
+static uint64_t late_count = 0;
+static int64_t late_sum_us = 0;
+static int64_t late_max_us = 0;
+
+static void record_lateness(struct esp_timer *t, int64_t late)
+{
+    if (late < 0) late = 0;
+    int b = 0;
+    while (b < LATE_BUCKETS - 1 && late >= late_bounds[b]) b++;
+    late_hist[b]++;
+    late_count++;
+    late_sum_us += late;
+    if (late > late_max_us) late_max_us = late;
+    if (late > t->max_late_us) t->max_late_us = late;
+}
+
 /* ---- Timer thread ---- */
 
+static void timer_unlock_cleanup(void *arg)
+{
+    (void)arg;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+/* Caller holds timer_mutex; UINT64_MAX waits for a signal only */
+static void timer_wait_until(uint64_t deadline_ns)
+{
+    pthread_cleanup_push(timer_unlock_cleanup, NULL);
+    emu_freertos_cond_wait_until(&timer_cond, &timer_mutex, deadline_ns);
+    pthread_cleanup_pop(0);
+}
+
 static void *timer_thread_func(void *arg)
 {
     (void)arg;
     pthread_mutex_lock(&timer_mutex);
 
     while (timer_thread_running && emu_app_running) {
-        /* Find earliest active timer */
-        int64_t earliest = INT64_MAX;
-        int earliest_idx = -1;
-
-        for (int i = 0; i < timer_count; i++) {
-            if (timer_list[i] && timer_list[i]->active) {
-                if (timer_list[i]->fire_time_us < earliest) {
-                    earliest = timer_list[i]->fire_time_us;
-                    earliest_idx = i;
-                }
-            }
-        }
-
-        if (earliest_idx < 0) {
-            /* No active timers — wait for signal or 100ms check */
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += 100000000;  /* 100ms */
-            if (ts.tv_nsec >= 1000000000) {
-                ts.tv_sec++;
-                ts.tv_nsec -= 1000000000;
-            }
-            pthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
+        if (heap_len == 0) {
+            /* Nothing armed — sleep until a timer starts or shutdown */
+            timer_wait_until(UINT64_MAX);
             continue;
         }
 
+        struct esp_timer *t = timer_heap[0];
         int64_t now = now_us();
-        if (earliest > now) {
-            /* Sleep until fire time, but cap at 100ms for shutdown checks */
-            int64_t wait_us = earliest - now;
-            if (wait_us > 100000) wait_us = 100000;
-
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += (long)(wait_us * 1000);
-            while (ts.tv_nsec >= 1000000000) {
-                ts.tv_sec++;
-                ts.tv_nsec -= 1000000000;
-            }
-            pthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
+        if (t->fire_time_us > now) {
+            timer_wait_until((uint64_t)t->fire_time_us * 1000);
             continue;
         }
 
-        /* Fire the timer */
-        struct esp_timer *t = timer_list[earliest_idx];
-        if (!t || !t->active) continue;
-
+        /* Fire the earliest timer */
         esp_timer_cb_t cb = t->callback;
         void *cb_arg = t->arg;
 
+        record_lateness(t, now - t->fire_time_us);
+        t->times_triggered++;
+
         if (t->periodic) {
             t->fire_time_us += (int64_t)t->period_us;
+            heap_sift_down(0);
         } else {
-            t->active = 0;
+            heap_remove(t);
         }
 
         /* Unlock while calling callback to avoid deadlock */
         pthread_mutex_unlock(&timer_mutex);
         cb(cb_arg);
+        emu_yield_from_isr(pdTRUE);   /* wakeups deferred by FromISR calls */
         pthread_mutex_lock(&timer_mutex);
     }
 
@@ -141,11 +224,44 @@ static void *timer_thread_func(void *arg)
     return NULL;
 }
 
+/* Caller holds timer_mutex */
+static void ensure_timer_cond(void)
+{
+    if (timer_cond_ready) return;
+    emu_freertos_cond_init(&timer_cond);
+    timer_cond_ready = 1;
+}
+
 static void ensure_timer_thread(void)
 {
     if (timer_thread_running) return;
     timer_thread_running = 1;
-    pthread_create(&timer_thread, NULL, timer_thread_func, NULL);
+    if (emu_freertos_thread_create(&timer_thread, timer_thread_func, NULL) != 0) {
+        timer_thread_running = 0;
+        ESP_LOGE(TAG, "Failed to start timer thread");
+    }
+}
+
+static esp_err_t timer_arm(esp_timer_handle_t timer, int periodic,
+                           uint64_t period_us, uint64_t timeout_us)
+{
+    if (!timer) return ESP_FAIL;
+
+    ensure_timer_thread();
+
+    pthread_mutex_lock(&timer_mutex);
+    timer->periodic = periodic;
+    timer->period_us = period_us;
+    timer->fire_time_us = now_us() + (int64_t)timeout_us;
+    if (heap_insert(timer) != 0) {
+        pthread_mutex_unlock(&timer_mutex);
+        ESP_LOGE(TAG, "Out of memory arming timer %s", timer->name);
+        return ESP_FAIL;
+    }
+    emu_freertos_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_mutex);
+
+    return ESP_OK;
 }
 
 /* ---- Public API ---- */
@@ -162,54 +278,29 @@ esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
     t->callback = create_args->callback;
     t->arg = create_args->arg;
     t->name = create_args->name ? create_args->name : "unnamed";
-    t->active = 0;
+    t->heap_idx = -1;
 
     pthread_mutex_lock(&timer_mutex);
-    if (timer_count >= MAX_ESP_TIMERS) {
-        pthread_mutex_unlock(&timer_mutex);
-        free(t);
-        ESP_LOGE(TAG, "Too many esp_timers (max %d)", MAX_ESP_TIMERS);
-        return ESP_FAIL;
-    }
-    timer_list[timer_count++] = t;
+    ensure_timer_cond();
+    t->all_next = all_timers;
+    if (all_timers) all_timers->all_prev = t;
+    all_timers = t;
     pthread_mutex_unlock(&timer_mutex);
 
+    emu_obj_register(&t->obj, EMU_OBJ_ESP_TIMER, EMU_CALLER());
+
     *out_handle = t;
     return ESP_OK;
 }
 
 esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
 {
-    if (!timer) return ESP_FAIL;
-
-    ensure_timer_thread();
-
-    pthread_mutex_lock(&timer_mutex);
-    timer->periodic = 0;
-    timer->period_us = 0;
-    timer->fire_time_us = now_us() + (int64_t)timeout_us;
-    timer->active = 1;
-    pthread_cond_signal(&timer_cond);
-    pthread_mutex_unlock(&timer_mutex);
-
-    return ESP_OK;
+    return timer_arm(timer, 0, 0, timeout_us);
 }
 
 esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
 {
-    if (!timer) return ESP_FAIL;
-
-    ensure_timer_thread();
-
-    pthread_mutex_lock(&timer_mutex);
-    timer->periodic = 1;
-    timer->period_us = period_us;
-    timer->fire_time_us = now_us() + (int64_t)period_us;
-    timer->active = 1;
-    pthread_cond_signal(&timer_cond);
-    pthread_mutex_unlock(&timer_mutex);
-
-    return ESP_OK;
+    return timer_arm(timer, 1, period_us, period_us);
 }
 
 esp_err_t esp_timer_stop(esp_timer_handle_t timer)
@@ -217,28 +308,31 @@ esp_err_t esp_timer_stop(esp_timer_handle_t timer)
     if (!timer) return ESP_FAIL;
 
     pthread_mutex_lock(&timer_mutex);
-    timer->active = 0;
-    pthread_cond_signal(&timer_cond);
+    heap_remove(timer);
+    emu_freertos_cond_signal(&timer_cond);
     pthread_mutex_unlock(&timer_mutex);
 
     return ESP_OK;
 }
 
+static void unlink_timer(struct esp_timer *t)
+{
+    if (t->all_prev) t->all_prev->all_next = t->all_next;
+    else all_timers = t->all_next;
+    if (t->all_next) t->all_next->all_prev = t->all_prev;
+}
+
 esp_err_t esp_timer_delete(esp_timer_handle_t timer)
 {
     if (!timer) return ESP_FAIL;
 
     pthread_mutex_lock(&timer_mutex);
-    timer->active = 0;
-    for (int i = 0; i < timer_count; i++) {
-        if (timer_list[i] == timer) {
-            timer_list[i] = timer_list[--timer_count];
-            break;
-        }
-    }
-    pthread_cond_signal(&timer_cond);
+    heap_remove(timer);
+    unlink_timer(timer);
+    emu_freertos_cond_signal(&timer_cond);
     pthread_mutex_unlock(&timer_mutex);
 
+    emu_obj_unregister(&timer->obj);
     free(timer);
     return ESP_OK;
 }
@@ -247,27 +341,63 @@ bool esp_timer_is_active(esp_timer_handle_t timer)
 {
     if (!timer) return false;
     pthread_mutex_lock(&timer_mutex);
-    bool active = timer->active;
+    bool active = timer->heap_idx >= 0;
     pthread_mutex_unlock(&timer_mutex);
     return active;
 }
 
-/* Called by emu_main on shutdown */
-void emu_esp_timer_shutdown(void)
+esp_err_t esp_timer_dump(FILE *stream)
 {
-    if (!timer_thread_running) return;
+    if (!stream) return ESP_FAIL;
 
     pthread_mutex_lock(&timer_mutex);
-    timer_thread_running = 0;
-    pthread_cond_signal(&timer_cond);
+    int64_t now = now_us();
+
+    fprintf(stream, "Timer stats:\n");
+    fprintf(stream, "%-20s  %12s  %12s  %10s  %12s\n",
+            "Name", "Period", "Alarm", "Triggered", "Max late");
+    for (struct esp_timer *t = all_timers; t; t = t->all_next) {
+        long long alarm = t->heap_idx >= 0 ? (long long)(t->fire_time_us - now) : 0;
+        fprintf(stream, "%-20s  %12llu  %12lld  %10u  %12lld\n",
+                t->name, (unsigned long long)(t->periodic ? t->period_us : 0),
+                alarm, t->times_triggered, (long long)t->max_late_us);
+    }
+
+    fprintf(stream, "Dispatch lateness (%llu callbacks, avg %lld us, max %lld us):\n",
+            (unsigned long long)late_count,
+            late_count ? (long long)(late_sum_us / (int64_t)late_count) : 0LL,
+            (long long)late_max_us);
+    for (int b = 0; b < LATE_BUCKETS; b++) {
+        if (b < LATE_BUCKETS - 1)
+            fprintf(stream, "  < %6lld us  %llu\n",
+                    (long long)late_bounds[b], (unsigned long long)late_hist[b]);
+        else
+            fprintf(stream, "  >=%6lld us  %llu\n",
+                    (long long)late_bounds[b - 1], (unsigned long long)late_hist[b]);
+    }
     pthread_mutex_unlock(&timer_mutex);
 
-    pthread_join(timer_thread, NULL);
+    return ESP_OK;
+}
+
+/* Called by emu_main on shutdown */
+void emu_esp_timer_shutdown(void)
+{
+    if (timer_thread_running) {
+        pthread_mutex_lock(&timer_mutex);
+        timer_thread_running = 0;
+        emu_freertos_cond_signal(&timer_cond);
+        pthread_mutex_unlock(&timer_mutex);
+
+        pthread_join(timer_thread, NULL);
+    }
 
     /* Free remaining timers */
-    for (int i = 0; i < timer_count; i++) {
-        free(timer_list[i]);
-        timer_list[i] = NULL;
+    while (all_timers) {
+        struct esp_timer *t = all_timers;
+        all_timers = t->all_next;
+        emu_obj_unregister(&t->obj);
+        free(t);
     }
-    timer_count = 0;
+    heap_len = 0;
 }
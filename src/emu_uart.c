@@ -0,0 +1,724 @@
+/*
+ * emu_uart.c -- UART driver shim with an RX line model
+ *
+ * Bytes injected with emu_uart_inject() wait in a per-port input queue and cross the wire one frame at a time at the
+ * configured baud rate, on the FreeRTOS shim clock.  They land in a
+ * 128-byte RX FIFO; the "interrupt" moves the FIFO into the driver's
+ * ring buffer when it reaches the full threshold, or when the line has
+ * been idle for the RX timeout, and then wakes uart_read_bytes() and
+ * posts a UART_DATA event, as the ESP-IDF driver does.
+ *
+ * The line is lossless: while the FIFO and ring are both full the
+ * sender is held off (as with RTS flow control) and UART_BUFFER_FULL is
+ * posted once.  In turbo mode frames take no time and the timeout
+ * fires at once, so bulk uploads run at full emulator speed.
+ *
+ * The interrupt side runs in one "uart_rx" task, started by the first
+ * uart_driver_install().  TX goes straight to stdout.  When the app
+ * stops, emu_uart_shutdown() deletes the drivers so the next run can
+ * install them again.
+ *
+ * Only code calling this host driver shim reads RX.  Firmware run by
+ * flexe has its own UART model with no RX hook yet, so the emulator
+ * has no control command or option for sending it input until that
+ * hook exists.
+ *
+ * --uart-pty mirrors UART0 TX to a host pseudo-terminal: a thread polls
+ * the pty master without blocking and passes firmware TX out, flow
+ * controlled end to end; TX is dropped while no client has the pty open.
+ * With no firmware RX hook the pty is TX-only: what the client writes
+ * is read and discarded, so it never blocks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+static const char *TAG = "emu_uart";
+
+extern int emu_turbo_mode;
+
+#define UART_DEFAULT_BAUD        115200
+#define UART_FULL_THRESH_DEFAULT 120
+#define UART_TOUT_THRESH_DEFAULT 10    /* symbols */
+
+struct uart_port {
+    /* Host side: bytes not yet on the wire */
+    uint8_t *in;
+    size_t in_len, in_off, in_cap;
+
+    /* Line and FIFO */
+    uint32_t baud;
+    uint32_t frame_half_bits;     /* start + data + parity + stop, x2 */
+    uint64_t wire_ns;             /* end of the last frame (or line idle since) */
+    uint64_t last_rx_ns;          /* when the newest FIFO byte arrived */
+    uint8_t fifo[UART_FIFO_LEN];
+    int fifo_len;
+    int full_thresh;
+    int tout_sym;                 /* 0 = RX timeout disabled */
+
+    /* Driver */
+    int installed;
+    int no_reader_warned;         /* input queued with no driver installed */
+    uint8_t *ring;
+    size_t ring_size, ring_head, ring_len;
+    int ring_full_posted;
+    SemaphoreHandle_t rx_sem;
+    QueueHandle_t events;
+};
+
+static struct uart_port uart_ports[UART_NUM_MAX];
+static pthread_mutex_t uart_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SemaphoreHandle_t uart_kick;
+static int uart_task_running;
+
+static struct uart_port *port_get(uart_port_t port)
+{
+    if (port < 0 || port >= UART_NUM_MAX) return NULL;
+    return &uart_ports[port];
+}
+
+static void kick_task(void)
+{
+    if (uart_kick) xSemaphoreGive(uart_kick);
+}
+
+/* ---- Line timing ---- */
+
+static void port_defaults(struct uart_port *p)
+{
+    if (p->baud) return;
+    p->baud = UART_DEFAULT_BAUD;
+    p->frame_half_bits = 20;      /* 8N1 */
+    p->full_thresh = UART_FULL_THRESH_DEFAULT;
+    p->tout_sym = UART_TOUT_THRESH_DEFAULT;
+}
+
+static uint64_t frame_ns(const struct uart_port *p)
+{
+    if (emu_turbo_mode) return 0;
+    return (uint64_t)p->frame_half_bits * 500000000ULL / p->baud;
+}
+
+static uint64_t tout_ns(const struct uart_port *p)
+{
+    if (emu_turbo_mode) return 0;
+    return (uint64_t)p->tout_sym * frame_ns(p);
+}
+
+/* ---- RX interrupt ---- */
+
+static void post_event(struct uart_port *p, uart_event_type_t type,
+                       size_t size, int timeout)
+{
+    if (!p->events) return;
+    uart_event_t ev = { type, size, timeout };
+    xQueueSend(p->events, &ev, 0);   /* dropped when full, like the ISR */
+}
+
+/* Move the FIFO into the ring buffer.  Returns bytes moved. */
+static size_t rx_isr(struct uart_port *p, int timeout)
+{
+    size_t room = p->ring_size - p->ring_len;
+    size_t n = (size_t)p->fifo_len < room ? (size_t)p->fifo_len : room;
+    if (n == 0) {
+        if (p->fifo_len && !p->ring_full_posted) {
+            p->ring_full_posted = 1;
+            post_event(p, UART_BUFFER_FULL, 0, 0);
+        }
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++)
+        p->ring[(p->ring_head + p->ring_len + i) % p->ring_size] = p->fifo[i];
+    p->ring_len += n;
+    p->fifo_len -= (int)n;
+    memmove(p->fifo, p->fifo + n, (size_t)p->fifo_len);
+    xSemaphoreGive(p->rx_sem);
+    post_event(p, UART_DATA, n, timeout);
+    return n;
+}
+
+/* Run the line and FIFO up to <now>; returns when next to look again
+ * (UINT64_MAX: nothing to do until injected data or a reader kicks us) */
+static uint64_t port_service(struct uart_port *p, uint64_t now)
+{
+    uint64_t fns = frame_ns(p);
+
+    while (p->in_off < p->in_len) {
+        uint64_t done = p->wire_ns + fns;
+        if (done > now) break;
+        if (p->fifo_len == UART_FIFO_LEN) {
+            p->wire_ns = now;     /* sender held off */
+            break;
+        }
+        p->fifo[p->fifo_len++] = p->in[p->in_off++];
+        p->wire_ns = done;
+        p->last_rx_ns = done;
+        if (p->fifo_len >= p->full_thresh)
+            rx_isr(p, 0);
+    }
+    if (p->in_off == p->in_len)
+        p->in_off = p->in_len = 0;
+
+    if (p->fifo_len && p->tout_sym && now >= p->last_rx_ns + tout_ns(p))
+        rx_isr(p, 1);
+
+    uint64_t next = UINT64_MAX;
+    if (p->ring_len == p->ring_size && p->fifo_len)
+        return next;              /* blocked until a read frees room */
+    if (p->in_off < p->in_len)
+        next = p->wire_ns + fns;
+    if (p->fifo_len && p->tout_sym) {
+        uint64_t t = p->last_rx_ns + tout_ns(p);
+        if (t < next) next = t;
+    }
+    return next;
+}
+
+static void uart_task_exit(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&uart_mutex);
+    uart_task_running = 0;
+    pthread_mutex_unlock(&uart_mutex);
+}
+
+static void uart_rx_task(void *arg)
+{
+    (void)arg;
+    pthread_cleanup_push(uart_task_exit, NULL);
+    while (emu_app_running) {
+        pthread_mutex_lock(&uart_mutex);
+        uint64_t now = emu_freertos_now_ns();
+        uint64_t next = UINT64_MAX;
+        for (int i = 0; i < UART_NUM_MAX; i++) {
+            if (!uart_ports[i].installed) continue;
+            uint64_t t = port_service(&uart_ports[i], now);
+            if (t < next) next = t;
+        }
+        pthread_mutex_unlock(&uart_mutex);
+
+        /* Whole ticks wait on the kick semaphore so injected data and
+         * reads cut the wait short; sub-tick gaps sleep on the clock */
+        if (next == UINT64_MAX) {
+            xSemaphoreTake(uart_kick, portMAX_DELAY);
+        } else if (next > now) {
+            uint64_t wait = next - now;
+            if (wait >= 1000000ULL)
+                xSemaphoreTake(uart_kick, (TickType_t)(wait / 1000000ULL));
+            else if (xSemaphoreTake(uart_kick, 0) != pdTRUE)
+                emu_freertos_sleep_until_ns(next);
+        }
+    }
+    pthread_cleanup_pop(1);
+}
+
+/* Caller holds uart_mutex */
+static void start_task_locked(void)
+{
+    if (uart_task_running) return;
+    if (!uart_kick) uart_kick = xSemaphoreCreateBinary();
+    if (xTaskCreate(uart_rx_task, "uart_rx", 4096, NULL, 12, NULL) == pdPASS)
+        uart_task_running = 1;
+}
+
+/* ---- Driver ---- */
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size,
+                              int queue_size, QueueHandle_t *uart_queue,
+                              int intr_alloc_flags)
+{
+    (void)tx_buffer_size;
+    (void)intr_alloc_flags;
+    struct uart_port *p = port_get(port);
+    if (!p || rx_buffer_size <= UART_FIFO_LEN) return ESP_FAIL;
+
+    pthread_mutex_lock(&uart_mutex);
+    if (p->installed) {
+        pthread_mutex_unlock(&uart_mutex);
+        ESP_LOGE(TAG, "UART%d driver already installed", port);
+        return ESP_FAIL;
+    }
+    p->ring = malloc((size_t)rx_buffer_size);
+    if (!p->ring) {
+        pthread_mutex_unlock(&uart_mutex);
+        return ESP_FAIL;
+    }
+    port_defaults(p);
+    p->ring_size = (size_t)rx_buffer_size;
+    p->ring_head = p->ring_len = 0;
+    p->ring_full_posted = 0;
+    p->fifo_len = 0;
+    p->rx_sem = xSemaphoreCreateBinary();
+    p->events = NULL;
+    if (queue_size > 0 && uart_queue) {
+        p->events = xQueueCreate((UBaseType_t)queue_size, sizeof(uart_event_t));
+        *uart_queue = p->events;
+    }
+    uint64_t now = emu_freertos_now_ns();
+    if (p->wire_ns < now) p->wire_ns = now;
+    p->installed = 1;
+    p->no_reader_warned = 0;
+    start_task_locked();
+    pthread_mutex_unlock(&uart_mutex);
+
+    kick_task();
+    ESP_LOGI(TAG, "UART%d driver installed (rx buffer %d, %u baud)",
+             port, rx_buffer_size, p->baud);
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t port)
+{
+    struct uart_port *p = port_get(port);
+    if (!p) return ESP_FAIL;
+
+    pthread_mutex_lock(&uart_mutex);
+    if (!p->installed) {
+        pthread_mutex_unlock(&uart_mutex);
+        return ESP_FAIL;
+    }
+    p->installed = 0;
+    free(p->ring);
+    p->ring = NULL;
+    p->ring_size = p->ring_len = 0;
+    p->fifo_len = 0;
+    vSemaphoreDelete(p->rx_sem);
+    p->rx_sem = NULL;
+    if (p->events) vQueueDelete(p->events);
+    p->events = NULL;
+    pthread_mutex_unlock(&uart_mutex);
+    return ESP_OK;
+}
+
+int uart_is_driver_installed(uart_port_t port)
+{
+    struct uart_port *p = port_get(port);
+    return p && p->installed;
+}
+
+/* App stopped and the shim has joined its tasks (uart_rx included):
+ * drop the drivers and the kick semaphore so the next run starts from
+ * scratch.  Input not yet on the wire stays queued. */
+void emu_uart_shutdown(void)
+{
+    for (int i = 0; i < UART_NUM_MAX; i++)
+        if (uart_ports[i].installed) uart_driver_delete(i);
+
+    pthread_mutex_lock(&uart_mutex);
+    SemaphoreHandle_t kick = uart_kick;
+    uart_kick = NULL;
+    uart_task_running = 0;
+    pthread_mutex_unlock(&uart_mutex);
+    if (kick) vSemaphoreDelete(kick);
+}
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *cfg)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || !cfg || cfg->baud_rate <= 0) return ESP_FAIL;
+
+    /* start bit, 5..8 data bits, optional parity, 1/1.5/2 stop bits */
+    uint32_t half = 2 + 2 * (5 + (uint32_t)cfg->data_bits);
+    if (cfg->parity != UART_PARITY_DISABLE) half += 2;
+    half += cfg->stop_bits == UART_STOP_BITS_2 ? 4 :
+            cfg->stop_bits == UART_STOP_BITS_1_5 ? 3 : 2;
+
+    pthread_mutex_lock(&uart_mutex);
+    port_defaults(p);
+    p->baud = (uint32_t)cfg->baud_rate;
+    p->frame_half_bits = half;
+    pthread_mutex_unlock(&uart_mutex);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baudrate)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || baudrate == 0) return ESP_FAIL;
+    pthread_mutex_lock(&uart_mutex);
+    port_defaults(p);
+    p->baud = baudrate;
+    pthread_mutex_unlock(&uart_mutex);
+    return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t port, uint32_t *baudrate)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || !baudrate) return ESP_FAIL;
+    pthread_mutex_lock(&uart_mutex);
+    port_defaults(p);
+    *baudrate = p->baud;
+    pthread_mutex_unlock(&uart_mutex);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts)
+{
+    (void)tx; (void)rx; (void)rts; (void)cts;
+    return port_get(port) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t port, int threshold)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || threshold < 1 || threshold >= UART_FIFO_LEN) return ESP_FAIL;
+    pthread_mutex_lock(&uart_mutex);
+    port_defaults(p);
+    p->full_thresh = threshold;
+    pthread_mutex_unlock(&uart_mutex);
+    kick_task();
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t port, uint8_t tout_thresh)
+{
+    struct uart_port *p = port_get(port);
+    if (!p) return ESP_FAIL;
+    pthread_mutex_lock(&uart_mutex);
+    port_defaults(p);
+    p->tout_sym = tout_thresh;
+    pthread_mutex_unlock(&uart_mutex);
+    kick_task();
+    return ESP_OK;
+}
+
+/* Copy out of the ring; wakes the RX task if it was held off.
+ * Caller holds uart_mutex. */
+static size_t ring_pop(struct uart_port *p, uint8_t *dst, size_t len)
+{
+    size_t n = len < p->ring_len ? len : p->ring_len;
+    int was_full = p->ring_len == p->ring_size;
+    for (size_t i = 0; i < n; i++)
+        dst[i] = p->ring[(p->ring_head + i) % p->ring_size];
+    p->ring_head = (p->ring_head + n) % p->ring_size;
+    p->ring_len -= n;
+    if (n && was_full) {
+        p->ring_full_posted = 0;
+        kick_task();
+    }
+    return n;
+}
+
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || !p->installed) return -1;
+
+    uint8_t *dst = (uint8_t *)buf;
+    size_t got = 0;
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        pthread_mutex_lock(&uart_mutex);
+        if (!p->installed) {
+            pthread_mutex_unlock(&uart_mutex);
+            return -1;
+        }
+        got += ring_pop(p, dst + got, length - got);
+        SemaphoreHandle_t sem = p->rx_sem;
+        pthread_mutex_unlock(&uart_mutex);
+
+        if (got == length) break;
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (ticks_to_wait != portMAX_DELAY && waited >= ticks_to_wait) break;
+        xSemaphoreTake(sem, ticks_to_wait == portMAX_DELAY ?
+                       portMAX_DELAY : ticks_to_wait - waited);
+    }
+    return (int)got;
+}
+
+int uart_write_bytes(uart_port_t port, const void *src, size_t size)
+{
+    if (!port_get(port) || !src) return -1;
+    fwrite(src, 1, size, stdout);
+    fflush(stdout);
+    if (port == UART_NUM_0) emu_uart_pty_write(src, size);
+    return (int)size;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || !size) return ESP_FAIL;
+    pthread_mutex_lock(&uart_mutex);
+    *size = p->ring_len;
+    pthread_mutex_unlock(&uart_mutex);
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || !p->installed) return ESP_FAIL;
+    pthread_mutex_lock(&uart_mutex);
+    int was_full = p->ring_len == p->ring_size;
+    p->ring_head = p->ring_len = 0;
+    p->fifo_len = 0;
+    p->ring_full_posted = 0;
+    if (was_full) kick_task();
+    pthread_mutex_unlock(&uart_mutex);
+    return ESP_OK;
+}
+
+esp_err_t uart_flush(uart_port_t port)
+{
+    return uart_flush_input(port);
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks_to_wait)
+{
+    (void)ticks_to_wait;
+    return port_get(port) ? ESP_OK : ESP_FAIL;
+}
+
+/* ---- Host injection ---- */
+
+int emu_uart_inject(uart_port_t port, const void *data, size_t len)
+{
+    struct uart_port *p = port_get(port);
+    if (!p || (!data && len)) return -1;
+    if (len == 0) return 0;
+
+    pthread_mutex_lock(&uart_mutex);
+    port_defaults(p);
+    if (p->in_off == p->in_len) {
+        /* Line was idle: the first frame starts now */
+        uint64_t now = emu_freertos_now_ns();
+        p->in_off = p->in_len = 0;
+        if (p->wire_ns < now) p->wire_ns = now;
+    } else if (p->in_off > p->in_cap / 2) {
+        memmove(p->in, p->in + p->in_off, p->in_len - p->in_off);
+        p->in_len -= p->in_off;
+        p->in_off = 0;
+    }
+    if (p->in_len + len > p->in_cap) {
+        size_t cap = p->in_cap ? p->in_cap : 4096;
+        while (cap < p->in_len + len) cap *= 2;
+        uint8_t *in = realloc(p->in, cap);
+        if (!in) {
+            pthread_mutex_unlock(&uart_mutex);
+            return -1;
+        }
+        p->in = in;
+        p->in_cap = cap;
+    }
+    memcpy(p->in + p->in_len, data, len);
+    p->in_len += len;
+    int warn = !p->installed && !p->no_reader_warned;
+    if (warn) p->no_reader_warned = 1;
+    pthread_mutex_unlock(&uart_mutex);
+
+    if (warn)
+        ESP_LOGW(TAG, "UART%d: no driver installed to read RX; input stays queued "
+                 "(firmware under flexe has no UART RX path yet)", port);
+    kick_task();
+    return (int)len;
+}
+
+/* ---- Host pty bridge ---- */
+
+#define PTY_TX_SIZE       (64 * 1024)
+
+/* Mirror UART0 TX to a host pty (--uart-pty) */
+int emu_uart_pty = 0;
+
+#ifndef _MSC_VER
+
+static int pty_master = -1;
+static int pty_wake[2] = { -1, -1 };
+static char pty_name[128];
+static pthread_t pty_thread;
+static int pty_thread_valid;
+static volatile int pty_quit;
+
+/* TX bytes waiting for the pty; writers wait on pty_space when full */
+static pthread_mutex_t pty_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pty_space = PTHREAD_COND_INITIALIZER;
+static uint8_t pty_tx[PTY_TX_SIZE];
+static size_t pty_tx_len;
+static int pty_connected;
+
+static void pty_set_connected(int connected)
+{
+    pthread_mutex_lock(&pty_mutex);
+    if (connected != pty_connected) {
+        pty_connected = connected;
+        if (!connected) pty_tx_len = 0;   /* nobody is listening */
+        pthread_cond_broadcast(&pty_space);
+        ESP_LOGI(TAG, "UART0 pty %s", connected ? "opened" : "closed");
+    }
+    pthread_mutex_unlock(&pty_mutex);
+}
+
+static void *pty_thread_func(void *arg)
+{
+    (void)arg;
+    uint8_t buf[4096];
+    int rx_warned = 0;
+    while (!pty_quit) {
+        pthread_mutex_lock(&pty_mutex);
+        int tx_pending = pty_tx_len > 0;
+        pthread_mutex_unlock(&pty_mutex);
+
+        struct pollfd fds[2] = {
+            { pty_wake[0], POLLIN, 0 },
+            { pty_master, POLLIN, 0 },
+        };
+        if (tx_pending) fds[1].events |= POLLOUT;
+        if (poll(fds, 2, 50) < 0 && errno != EINTR) break;
+
+        if (fds[0].revents & POLLIN)
+            while (read(pty_wake[0], buf, sizeof(buf)) > 0) {}
+
+        /* No client has the slave open: wait without spinning */
+        if (fds[1].revents & POLLHUP) {
+            pty_set_connected(0);
+            poll(fds, 1, 50);
+            continue;
+        }
+        pty_set_connected(1);
+
+        if (fds[1].revents & POLLIN) {
+            ssize_t n = read(pty_master, buf, sizeof(buf));
+            if (n > 0 && !rx_warned) {
+                ESP_LOGW(TAG, "UART0 pty is TX-only; input is discarded "
+                         "(flexe has no UART RX hook)");
+                rx_warned = 1;
+            }
+        }
+        if (fds[1].revents & POLLOUT) {
+            pthread_mutex_lock(&pty_mutex);
+            ssize_t n = write(pty_master, pty_tx, pty_tx_len);
+            if (n > 0) {
+                pty_tx_len -= (size_t)n;
+                memmove(pty_tx, pty_tx + n, pty_tx_len);
+                pthread_cond_broadcast(&pty_space);
+            }
+            pthread_mutex_unlock(&pty_mutex);
+        }
+    }
+    return NULL;
+}
+
+int emu_uart_pty_start(void)
+{
+    if (pty_master >= 0) return 0;
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || !ptsname(fd)) {
+        ESP_LOGE(TAG, "Cannot create UART pty: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    snprintf(pty_name, sizeof(pty_name), "%s", ptsname(fd));
+
+    /* Raw 8-bit line: no echo, no CR/LF translation */
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* The master only reports POLLHUP once a slave has come and gone;
+     * open and close it so "no client yet" looks the same */
+    int slave = open(pty_name, O_RDWR | O_NOCTTY);
+    if (slave >= 0) close(slave);
+
+    if (pipe(pty_wake) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(pty_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(pty_wake[1], F_SETFL, O_NONBLOCK);
+
+    pty_master = fd;
+    pty_quit = 0;
+    if (pthread_create(&pty_thread, NULL, pty_thread_func, NULL) != 0) {
+        emu_uart_pty_stop();
+        return -1;
+    }
+    pty_thread_valid = 1;
+    printf("UART0 pty: %s (TX only)\n", pty_name);
+    fflush(stdout);
+    return 0;
+}
+
+void emu_uart_pty_stop(void)
+{
+    if (pty_thread_valid) {
+        pty_quit = 1;
+        if (write(pty_wake[1], "q", 1) < 0) {}
+        pthread_join(pty_thread, NULL);
+        pty_thread_valid = 0;
+    }
+    pty_set_connected(0);
+    if (pty_master >= 0) close(pty_master);
+    for (int i = 0; i < 2; i++)
+        if (pty_wake[i] >= 0) close(pty_wake[i]);
+    pty_master = pty_wake[0] = pty_wake[1] = -1;
+}
+
+/* Queue firmware TX for the pty.  Waits while the client is connected
+ * but not reading (the sender is held off, as with CTS). */
+void emu_uart_pty_write(const void *data, size_t len)
+{
+    if (pty_master < 0) return;
+    const uint8_t *src = (const uint8_t *)data;
+
+    pthread_mutex_lock(&pty_mutex);
+    int was_empty = pty_tx_len == 0;
+    while (len > 0 && pty_connected && !pty_quit) {
+        size_t room = PTY_TX_SIZE - pty_tx_len;
+        if (room == 0) {
+            if (!emu_app_running) break;
+            if (was_empty && write(pty_wake[1], "w", 1) < 0) {}
+            was_empty = 0;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100 * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&pty_space, &pty_mutex, &ts);
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(pty_tx + pty_tx_len, src, n);
+        pty_tx_len += n;
+        src += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&pty_mutex);
+    if (was_empty && write(pty_wake[1], "w", 1) < 0) {}
+}
+
+#else /* _MSC_VER */
+
+int emu_uart_pty_start(void)
+{
+    ESP_LOGE(TAG, "--uart-pty is not supported on Windows");
+    return -1;
+}
+
+void emu_uart_pty_stop(void) {}
+void emu_uart_pty_write(const void *data, size_t len) { (void)data; (void)len; }
+
+#endif